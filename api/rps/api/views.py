@@ -2,6 +2,7 @@
 
 from flask import Blueprint, current_app, jsonify, request
 from datetime import datetime
+from pymongo import UpdateOne
 
 from ..extensions import mongo
 from ..utils import dt2ts
@@ -48,16 +49,19 @@ def proxy(tag, proto):
     else:
         return jsonify(status="BAD", error="Invalid proto %s" %proto)    
 
-    filter = {}
+    query = {}
     source = request.args.get("source", None)
     if source is not None:
-        filter["source"] = source
+        query["source"] = source
         
 
+    # rps-check fetches disabled upstreams too, to be able to revive them
+    with_disabled = request.args.get("all", None) == "1"
+
     records = []
     now = datetime.now().replace(tzinfo=None)
 
-    for r in collection.find(filter, {"_id":0}):
+    for r in collection.find(query, {"_id":0}):
         if not r.has_key("insert_date"):
             continue
 
@@ -83,12 +87,50 @@ def proxy(tag, proto):
                 records.append(r)
                 continue                
 
-        if not r.get("enable", 0):
+        if not r.get("enable", 0) and not with_disabled:
             continue
     
         records.append(r)
     return jsonify(records)
 
+@api.route("/<tag>/check/<any('socks5', 'http', 'http_tunnel'):proto>/", methods=["POST"])
+def check(tag, proto):
+    if proto == "socks5":
+        collection = mongo.db.socks5
+    elif proto ==  "http":
+        collection = mongo.db.http
+    elif proto == "http_tunnel":
+        collection = mongo.db.http_tunnel
+    else:
+        return jsonify(status="BAD", error="Invalid proto %s" %proto)
+
+    results = request.get_json()
+    if not isinstance(results, list):
+        return jsonify(status="BAD", error="Invalid check results")
+
+    now = datetime.now()
+    requests = []
+
+    for r in results:
+        query = {"host": r.get("host", None), "port": r.get("port", None)}
+        fields = {
+            "enable": int(r.get("enable", 0)),
+            "check": {
+                "tag": tag,
+                "ts": now,
+                "connect": r.get("connect", None),
+                "handshake": r.get("handshake", None),
+                "rtt": r.get("rtt", None),
+                "error": r.get("error", None),
+            },
+        }
+        requests.append(UpdateOne(query, {"$set":fields}))
+
+    if requests:
+        collection.bulk_write(requests, ordered=False)
+
+    return jsonify(status="ok", count=len(requests))
+
 @api.route("/<tag>/stats/<any('socks5', 'http', 'http_tunnel'):proto>/", methods=["GET", "POST"])
 def stats(tag, proto):
     collection = mongo.db.u_stats
@@ -107,6 +149,12 @@ def stats(tag, proto):
             "insert_date": form.get("insert_date", None),
             "expire_date": form.get("expire_date", None),
             "source": form.get("source", None),
+            "breaker": form.get("breaker", None),
+            "sessions": form.get("sessions", None),
+            "active": form.get("active", None),
+            "bytes_up": form.get("bytes_up", None),
+            "bytes_down": form.get("bytes_down", None),
+            "elapsed": form.get("elapsed", None),
             "last_commit":datetime.now(),
         }
 
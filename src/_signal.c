@@ -1,6 +1,7 @@
 #include "_signal.h"
 #include "core.h"
 #include "log.h"
+#include "rps.h"
 
 #include <signal.h>
 
@@ -16,7 +17,7 @@ static struct _signal signals[] = {
     { SIGFPE,  "SIGFPE",  (int)SA_RESETHAND, signal_handler },
     { SIGILL,  "SIGILL",  (int)SA_RESETHAND, signal_handler },
     { SIGPIPE, "SIGPIPE", 0,                 SIG_IGN },
-    { SIGHUP,  "SIGHUP",  0,                 SIG_IGN },
+    { SIGHUP,  "SIGHUP",  0,                 signal_handler },
     { 0,        NULL,     0,                 NULL }
 };
 
@@ -64,10 +65,19 @@ signal_handler(int signo) {
     done = false;
 
     switch (signo) {
+    case SIGHUP:
+        actionstr = ", restarting";
+        action = rps_restart;
+        break;
+
     case SIGUSR1:
+        actionstr = ", dumping upstreams";
+        action = rps_dump;
         break;
 
     case SIGUSR2:
+        actionstr = ", reloading users";
+        action = rps_reload;
         break;
 
     case SIGTTIN:
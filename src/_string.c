@@ -27,14 +27,21 @@ string_free(rps_str_t *str) {
 
 int
 string_duplicate(rps_str_t *dst, const char *src, size_t len) {
+    size_t n;
+
     ASSERT(dst->data == NULL && dst->len == 0);
     ASSERT(src != NULL && len != 0 );
     
-    dst->data = (uint8_t *)strndup(src, len);
+    /* like strndup, but released by rps_free */
+    dst->data = (uint8_t *)rps_alloc(len + 1);
     if (dst->data == NULL) {
         return RPS_ENOMEM;
     }
 
+    n = strnlen(src, len);
+    memcpy(dst->data, src, n);
+    dst->data[n] = '\0';
+
     dst->len = len;
     //dst->data[len] = '\0';
     
@@ -6,6 +6,7 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
 
 typedef struct rps_string {
     size_t      len;
@@ -33,6 +34,11 @@ string_empty(rps_str_t *str) {
     return str->len == 0 ? true : false;
 }
 
+static inline bool
+string_equal(const rps_str_t *s1, const rps_str_t *s2) {
+    return s1->len == s2->len && (s1->len == 0 || memcmp(s1->data, s2->data, s1->len) == 0);
+}
+
 rps_str_t *string_new();
 void string_free(rps_str_t *str);
 int string_duplicate(rps_str_t *dst, const char *src, size_t len);
@@ -0,0 +1,210 @@
+#include "core.h"
+#include "accesslog.h"
+#include "util.h"
+#include "log.h"
+
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+/* Decoder depends on the record layout, keep it fixed. */
+typedef char accesslog_record_size_check[(sizeof(struct accesslog_record) == 128) ? 1 : -1];
+typedef char accesslog_header_size_check[(sizeof(struct accesslog_header) == 64) ? 1 : -1];
+
+
+void
+accesslog_null(struct accesslog *alog) {
+    alog->fd = -1;
+    alog->header = NULL;
+    alog->size = 0;
+    alog->seq = 0;
+    alog->retry = 0;
+    alog->port = 0;
+    alog->proto = UNSET;
+    alog->path = NULL;
+}
+
+static rps_status_t
+accesslog_open(struct accesslog *alog) {
+    int fd;
+    void *p;
+    time_t now;
+    struct tm tm;
+    struct timeval tv;
+    char datetime[32];
+    char fname[ACCESSLOG_PATH_MAX_LENGTH];
+    struct accesslog_header *header;
+    int i, err;
+
+    gettimeofday(&tv, NULL);
+    now = tv.tv_sec;
+    localtime_r(&now, &tm);
+    strftime(datetime, sizeof(datetime), "%Y%m%d%H%M%S", &tm);
+
+    /* 
+     * Never reuse a name, the process replaced by a hot restart may still 
+     * write a segment opened in the same second with the same seq.
+     */
+    for (i = 0; i < ACCESSLOG_OPEN_TRIES; i++) {
+        snprintf(fname, sizeof(fname), "%s/%s-%d-%s-%u%s", alog->path,
+                rps_proto_str(alog->proto), alog->port, datetime, alog->seq, ACCESSLOG_SUFFIX);
+
+        fd = open(fname, O_RDWR | O_CREAT | O_EXCL, 0644);
+        if (fd >= 0 || errno != EEXIST) {
+            break;
+        }
+        alog->seq++;
+    }
+
+    if (fd < 0) {
+        log_error("open access log '%s' failed: %s", fname, strerror(errno));
+        return RPS_ERROR;
+    }
+
+    /* 
+     * Reserve the blocks, a sparse segment would raise SIGBUS on a record
+     * store once the disk is full.
+     */
+    err = posix_fallocate(fd, 0, (off_t)alog->size);
+    if (err != 0) {
+        log_error("reserve %zu bytes for access log '%s' failed: %s", 
+                alog->size, fname, strerror(err));
+        goto error;
+    }
+
+    p = mmap(NULL, alog->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+        log_error("mmap access log '%s' failed: %s", fname, strerror(errno));
+        goto error;
+    }
+
+    header = (struct accesslog_header *)p;
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, ACCESSLOG_MAGIC, sizeof(ACCESSLOG_MAGIC));
+    header->version = ACCESSLOG_VERSION;
+    header->record_size = sizeof(struct accesslog_record);
+    header->capacity = (alog->size - sizeof(*header)) / sizeof(struct accesslog_record);
+    header->count = 0;
+    header->created = (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+    header->port = alog->port;
+    header->proto = alog->proto;
+
+    alog->fd = fd;
+    alog->header = header;
+    alog->seq++;
+
+    log_debug("open access log '%s', capacity %u records", fname, header->capacity);
+
+    return RPS_OK;
+
+error:
+    /* created above, nobody else writes it */
+    unlink(fname);
+    close(fd);
+    return RPS_ERROR;
+}
+
+static void
+accesslog_close(struct accesslog *alog) {
+    off_t used;
+
+    if (alog->header == NULL) {
+        return;
+    }
+
+    used = sizeof(struct accesslog_header) +
+        (off_t)alog->header->count * sizeof(struct accesslog_record);
+
+    munmap(alog->header, alog->size);
+    alog->header = NULL;
+
+    /* Give back the unused tail of segment */
+    if (ftruncate(alog->fd, used) < 0) {
+        log_warn("truncate access log failed: %s", strerror(errno));
+    }
+
+    close(alog->fd);
+    alog->fd = -1;
+}
+
+rps_status_t
+accesslog_init(struct accesslog *alog, struct config_accesslog *cfg,
+        rps_proto_t proto, uint16_t port) {
+
+    accesslog_null(alog);
+
+    if (string_empty(&cfg->path)) {
+        return RPS_OK;
+    }
+
+    alog->path = (char *)cfg->path.data;
+    alog->proto = (uint8_t)proto;
+    alog->port = port;
+    alog->size = (size_t)cfg->segment * 1024 * 1024;
+
+    if (alog->size < sizeof(struct accesslog_header) + sizeof(struct accesslog_record)) {
+        log_error("access log segment size %u MB is too small", cfg->segment);
+        return RPS_ERROR;
+    }
+
+    return accesslog_open(alog);
+}
+
+void
+accesslog_deinit(struct accesslog *alog) {
+    accesslog_close(alog);
+    accesslog_null(alog);
+}
+
+void
+accesslog_write(struct accesslog *alog, struct accesslog_record *rec) {
+    struct accesslog_header *header;
+    struct accesslog_record *slot;
+
+    header = alog->header;
+
+    if (header == NULL || header->count >= header->capacity) {
+        accesslog_close(alog);
+
+        if (rps_now() < alog->retry) {
+            return;
+        }
+
+        if (accesslog_open(alog) != RPS_OK) {
+            alog->retry = rps_now() + ACCESSLOG_RETRY_INTERVAL;
+            log_error("rotate access log failed, records dropped for %d s", 
+                    ACCESSLOG_RETRY_INTERVAL);
+            return;
+        }
+        header = alog->header;
+    }
+
+    slot = (struct accesslog_record *)(header + 1) + header->count;
+    memcpy(slot, rec, sizeof(*rec));
+
+    /* Count be bumped after record copied, reader never see partial record */
+    header->count++;
+}
+
+void
+accesslog_addr(rps_addr_t *addr, uint8_t *family, uint8_t *dst, uint16_t *port) {
+    switch (addr->family) {
+    case AF_INET:
+        *family = 4;
+        memcpy(dst, &addr->addr.in.sin_addr, 4);
+        *port = ntohs(addr->addr.in.sin_port);
+        break;
+    case AF_INET6:
+        *family = 6;
+        memcpy(dst, &addr->addr.in6.sin6_addr, 16);
+        *port = ntohs(addr->addr.in6.sin6_port);
+        break;
+    default:
+        *family = 0;
+        *port = 0;
+        break;
+    }
+}
@@ -0,0 +1,96 @@
+#ifndef _RPS_ACCESSLOG_H
+#define _RPS_ACCESSLOG_H
+
+#include "core.h"
+#include "config.h"
+
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Binary access log, one fixed-size record per finished session.
+ *
+ * Records are appended into a memory-mapped segment file, a segment is
+ * rotated when it is full. Each server thread owns its writer, so no lock
+ * is required on the hot path and writing a record is a single memcpy.
+ *
+ *  +--------+--------+--------+-----+--------+
+ *  | header | record | record | ... | record |
+ *  +--------+--------+--------+-----+--------+
+ */
+
+#define ACCESSLOG_MAGIC             "RPSALOG"
+#define ACCESSLOG_VERSION           1
+#define ACCESSLOG_SUFFIX            ".alog"
+#define ACCESSLOG_PATH_MAX_LENGTH   1024
+#define ACCESSLOG_OPEN_TRIES        1024    /* names taken in the same second */
+#define ACCESSLOG_RETRY_INTERVAL    10      /* s between opens after a failed one */
+
+/* Record flags */
+#define ACCESSLOG_F_ESTABLISHED     (1 << 0)
+#define ACCESSLOG_F_SUCCESS         (1 << 1)
+
+struct accesslog_header {
+    char        magic[8];
+    uint32_t    version;
+    uint32_t    record_size;
+    uint32_t    capacity;       /* max records in segment */
+    uint32_t    count;          /* records committed */
+    uint64_t    created;        /* microseconds since epoch */
+    uint16_t    port;           /* listen port */
+    uint8_t     proto;          /* listen protocol */
+    uint8_t     reserved[29];
+};
+
+/*
+ * Phase offsets are microseconds since the session has been accepted,
+ * 0 means the phase never be reached.
+ * Address are stored in network byte order, ipv4 use the first 4 bytes.
+ */
+struct accesslog_record {
+    uint64_t    start;          /* accept time, microseconds since epoch */
+    uint64_t    duration;       /* microseconds from accept to session free */
+    uint64_t    nup;            /* bytes client -> remote */
+    uint64_t    ndown;          /* bytes remote -> client */
+    uint32_t    request;        /* request parsed */
+    uint32_t    connect;        /* upstream connected */
+    uint32_t    establish;      /* upstream handshake finished */
+    uint32_t    remote_hash;    /* murmur3 of remote host */
+    uint8_t     client[16];
+    uint8_t     upstream[16];
+    uint16_t    client_port;
+    uint16_t    remote_port;
+    uint16_t    upstream_port;
+    uint16_t    retry;
+    uint16_t    reconn;
+    int16_t     reply_code;     /* rps_reply_code_t */
+    uint8_t     client_family;  /* 4, 6 or 0 */
+    uint8_t     upstream_family;
+    uint8_t     proto;          /* client side protocol */
+    uint8_t     upstream_proto;
+    uint8_t     flags;
+    uint8_t     reserved[31];
+};
+
+struct accesslog {
+    int                     fd;
+    struct accesslog_header *header;    /* mapped segment */
+    size_t                  size;       /* mapped length */
+    uint32_t                seq;
+    time_t                  retry;      /* no open before, records dropped */
+    uint16_t                port;
+    uint8_t                 proto;
+    char                    *path;
+};
+
+#define accesslog_enabled(_l)   ((_l)->path != NULL)
+
+void accesslog_null(struct accesslog *alog);
+rps_status_t accesslog_init(struct accesslog *alog, struct config_accesslog *cfg,
+        rps_proto_t proto, uint16_t port);
+void accesslog_deinit(struct accesslog *alog);
+void accesslog_write(struct accesslog *alog, struct accesslog_record *rec);
+
+void accesslog_addr(rps_addr_t *addr, uint8_t *family, uint8_t *dst, uint16_t *port);
+
+#endif
@@ -0,0 +1,229 @@
+#include "core.h"
+#include "admission.h"
+#include "util.h"
+#include "log.h"
+
+static void
+admission_on_check(uv_check_t *handle) {
+    struct admission *a;
+    uint64_t now, hrnow, delay;
+
+    a = (struct admission *)handle->data;
+
+    /* loop time was updated when poll returned, the rest is spent on io callbacks */
+    now = uv_now(a->loop);
+    hrnow = uv_hrtime() / 1000000;
+    delay = hrnow > now ? hrnow - now : 0;
+
+    if (delay < a->delay_min) {
+        a->delay_min = delay;
+    }
+
+    if (now < a->interval_end) {
+        return;
+    }
+
+    if (!a->shedding && a->delay_min > a->shed_target) {
+        a->shedding = 1;
+        log_warn("loop delay %d ms above %d ms for %d ms, shedding new sessions, %d live",
+                (int)a->delay_min, a->shed_target, a->shed_interval, a->nsess);
+    } else if (a->shedding && a->delay_min <= a->shed_target) {
+        a->shedding = 0;
+        log_notice("loop delay %d ms, stop shedding, %llu sessions shed",
+                (int)a->delay_min, (unsigned long long)a->verdicts[admit_shed]);
+    }
+
+    a->delay_min = UINT64_MAX;
+    a->interval_end = now + a->shed_interval;
+}
+
+rps_status_t
+admission_init(struct admission *a, uv_loop_t *loop, struct config_server *cfg) {
+    int i;
+
+    a->loop = loop;
+    a->max_sessions = cfg->max_sessions;
+    a->max_client_sessions = cfg->max_client_sessions;
+    a->accept_rate = cfg->accept_rate;
+    a->shed_target = cfg->shed_target;
+    a->shed_interval = cfg->shed_interval > 0 ? cfg->shed_interval : SERVER_DEFAULT_SHED_INTERVAL;
+
+    a->nsess = 0;
+    a->nrejecting = 0;
+
+    if (hashmap_init(&a->clients, ADMISSION_CLIENT_BUCKETS, HASHMAP_DEFAULT_COLLISIONS)
+            != RPS_OK) {
+        return RPS_ENOMEM;
+    }
+
+    a->tokens = a->accept_rate;
+    a->refill = uv_now(loop);
+
+    a->delay_min = UINT64_MAX;
+    a->interval_end = uv_now(loop) + a->shed_interval;
+    a->shedding = 0;
+
+    for (i = 0; i < admit_max; i++) {
+        a->verdicts[i] = 0;
+    }
+
+    if (a->shed_target > 0) {
+        uv_check_init(loop, &a->check);
+        a->check.data = a;
+        uv_check_start(&a->check, admission_on_check);
+        /* must not keep the loop alive alone */
+        uv_unref((uv_handle_t *)&a->check);
+    }
+
+    return RPS_OK;
+}
+
+void
+admission_deinit(struct admission *a) {
+    if (a->shed_target > 0) {
+        uv_check_stop(&a->check);
+        uv_close((uv_handle_t *)&a->check, NULL);
+    }
+
+    hashmap_deinit(&a->clients);
+}
+
+static void *
+admission_client_key(rps_addr_t *client, size_t *len) {
+    switch (client->family) {
+    case AF_INET:
+        *len = sizeof(client->addr.in.sin_addr);
+        return &client->addr.in.sin_addr;
+    case AF_INET6:
+        *len = sizeof(client->addr.in6.sin6_addr);
+        return &client->addr.in6.sin6_addr;
+    default:
+        *len = 0;
+        return NULL;
+    }
+}
+
+static void
+admission_refill(struct admission *a) {
+    uint64_t now;
+
+    now = uv_now(a->loop);
+    if (now <= a->refill) {
+        return;
+    }
+
+    a->tokens += (double)(now - a->refill) * a->accept_rate / 1000;
+    if (a->tokens > a->accept_rate) {
+        /* burst up to one second of accepts */
+        a->tokens = a->accept_rate;
+    }
+    a->refill = now;
+}
+
+static admission_verdict_t
+admission_verdict(struct admission *a, uint32_t *nclient) {
+    if (a->shedding) {
+        return admit_shed;
+    }
+
+    if (a->max_sessions > 0 && a->nsess >= a->max_sessions) {
+        return admit_sessions;
+    }
+
+    if (a->max_client_sessions > 0 && nclient != NULL &&
+            *nclient >= a->max_client_sessions) {
+        return admit_client;
+    }
+
+    if (a->accept_rate > 0) {
+        admission_refill(a);
+        if (a->tokens < 1) {
+            return admit_rate;
+        }
+    }
+
+    return admit_ok;
+}
+
+/*
+ * Decide on a new connection. Admitted sessions and rejected ones waiting
+ * for their reply are counted, either must be released by admission_leave.
+ * admit_drop means the connection should be closed without reply.
+ */
+admission_verdict_t
+admission_enter(struct admission *a, rps_addr_t *client) {
+    admission_verdict_t verdict;
+    uint32_t *nclient, one;
+    size_t len, vlen;
+    void *key;
+
+    nclient = NULL;
+    key = NULL;
+    len = 0;
+
+    if (a->max_client_sessions > 0) {
+        key = admission_client_key(client, &len);
+        if (key != NULL) {
+            nclient = hashmap_get(&a->clients, key, len, &vlen);
+        }
+    }
+
+    verdict = admission_verdict(a, nclient);
+
+    if (verdict == admit_ok) {
+        a->nsess++;
+
+        if (a->accept_rate > 0) {
+            a->tokens -= 1;
+        }
+
+        if (nclient != NULL) {
+            (*nclient)++;
+        } else if (key != NULL) {
+            one = 1;
+            hashmap_set(&a->clients, key, len, &one, sizeof(one));
+        }
+    } else if (a->nrejecting >= ADMISSION_MAX_REJECTING) {
+        verdict = admit_drop;
+    } else {
+        a->nrejecting++;
+    }
+
+    a->verdicts[verdict]++;
+
+    return verdict;
+}
+
+void
+admission_leave(struct admission *a, rps_addr_t *client, bool admitted) {
+    uint32_t *nclient;
+    size_t len, vlen;
+    void *key;
+
+    if (!admitted) {
+        ASSERT(a->nrejecting > 0);
+        a->nrejecting--;
+        return;
+    }
+
+    ASSERT(a->nsess > 0);
+    a->nsess--;
+
+    if (a->max_client_sessions == 0) {
+        return;
+    }
+
+    key = admission_client_key(client, &len);
+    if (key == NULL) {
+        return;
+    }
+
+    nclient = hashmap_get(&a->clients, key, len, &vlen);
+    if (nclient == NULL) {
+        return;
+    }
+
+    if (--(*nclient) == 0) {
+        hashmap_remove(&a->clients, key, len);
+    }
+}
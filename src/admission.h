@@ -0,0 +1,88 @@
+#ifndef _RPS_ADMISSION_H
+#define _RPS_ADMISSION_H
+
+#include "core.h"
+#include "config.h"
+#include "hashmap.h"
+
+#include <uv.h>
+
+#include <stdint.h>
+
+/*
+ * Admission control of a listener, consulted once per accepted connection.
+ *
+ * Sessions are limited per listener and per client address, accepts are
+ * limited by a token bucket. Overload is detected CoDel-style on the delay
+ * of the event loop: an event waits until the loop finished the batch in
+ * hand, so the time spent on a batch is the queueing delay of the next one.
+ * Once the minimum delay of a whole interval stays above target, new
+ * sessions are shed until an interval sees it below target again.
+ *
+ * Rejected sessions skip client auth and get a protocol reply right after
+ * the request (socks5 0x01, http 503), they never reach an upstream.
+ */
+
+#define ADMISSION_MAX_REJECTING     1024    /* rejected sessions waiting for reply */
+#define ADMISSION_REJECT_TIMEOUT    5000    /* ms, handshake timeout of rejected */
+#define ADMISSION_CLIENT_BUCKETS    1024
+
+#define ADMISSION_VERDICT_MAP(V)                \
+    V(0, admit_ok, "ok")                        \
+    V(1, admit_sessions, "sessions")            \
+    V(2, admit_client, "client sessions")       \
+    V(3, admit_rate, "accept rate")             \
+    V(4, admit_shed, "overload")                \
+    V(5, admit_drop, "too many rejecting")      \
+
+typedef enum {
+#define ADMISSION_VERDICT_GEN(code, name, _) name = code,
+    ADMISSION_VERDICT_MAP(ADMISSION_VERDICT_GEN)
+#undef ADMISSION_VERDICT_GEN
+    admit_max
+} admission_verdict_t;
+
+static inline const char *
+admission_verdict_str(admission_verdict_t verdict) {
+#define ADMISSION_VERDICT_GEN(_, name, str) case name: return str;
+    switch (verdict) {
+        ADMISSION_VERDICT_MAP(ADMISSION_VERDICT_GEN)
+        default: ;
+    }
+#undef ADMISSION_VERDICT_GEN
+    return "unknown";
+}
+
+struct admission {
+    uv_loop_t           *loop;
+
+    uint32_t            max_sessions;
+    uint32_t            max_client_sessions;
+    uint32_t            accept_rate;
+    uint32_t            shed_target;    /* ms */
+    uint32_t            shed_interval;  /* ms */
+
+    uint32_t            nsess;          /* admitted live sessions */
+    uint32_t            nrejecting;     /* rejected sessions waiting for reply */
+
+    rps_hashmap_t       clients;        /* client address -> admitted sessions */
+
+    /* token bucket of accept rate */
+    double              tokens;
+    uint64_t            refill;         /* loop time of last refill, ms */
+
+    /* loop delay, measured after io callbacks of each iteration */
+    uv_check_t          check;
+    uint64_t            delay_min;      /* ms, minimum of current interval */
+    uint64_t            interval_end;
+    unsigned            shedding:1;
+
+    uint64_t            verdicts[admit_max];
+};
+
+rps_status_t admission_init(struct admission *a, uv_loop_t *loop, struct config_server *cfg);
+void admission_deinit(struct admission *a);
+admission_verdict_t admission_enter(struct admission *a, rps_addr_t *client);
+void admission_leave(struct admission *a, rps_addr_t *client, bool admitted);
+
+#endif
@@ -0,0 +1,133 @@
+#include "bufpool.h"
+#include "util.h"
+
+void
+bufpool_init(struct bufpool *p) {
+    size_t sizes[BUFPOOL_CLASSES] = BUFPOOL_CLASS_SIZES;
+    uint32_t max_free[BUFPOOL_CLASSES] = BUFPOOL_MAX_FREE;
+    int i;
+
+    for (i = 0; i < BUFPOOL_CLASSES; i++) {
+        p->classes[i].size = sizes[i];
+        p->classes[i].free = NULL;
+        p->classes[i].nfree = 0;
+        p->classes[i].max_free = max_free[i];
+        p->classes[i].nused = 0;
+    }
+}
+
+void
+bufpool_deinit(struct bufpool *p) {
+    struct bufpool_class *bc;
+    struct bufchunk *c;
+    int i;
+
+    for (i = 0; i < BUFPOOL_CLASSES; i++) {
+        bc = &p->classes[i];
+        while (bc->free != NULL) {
+            c = bc->free;
+            bc->free = (struct bufchunk *)c->req.data;
+            rps_free(c);
+        }
+        bc->nfree = 0;
+    }
+}
+
+static struct bufchunk *
+bufchunk_alloc(struct bufpool *p, uint8_t cls, size_t size) {
+    struct bufchunk *c;
+
+    c = (struct bufchunk *)rps_alloc_tag(sizeof(struct bufchunk) + size, mem_buffer);
+    if (c == NULL) {
+        return NULL;
+    }
+
+    c->pool = p;
+    c->cls = cls;
+    c->size = size;
+
+    return c;
+}
+
+struct bufchunk *
+bufchunk_get(struct bufpool *p, uint8_t cls) {
+    struct bufpool_class *bc;
+    struct bufchunk *c;
+
+    ASSERT(cls < BUFPOOL_CLASSES);
+
+    bc = &p->classes[cls];
+
+    if (bc->free != NULL) {
+        c = bc->free;
+        bc->free = (struct bufchunk *)c->req.data;
+        bc->nfree--;
+    } else {
+        c = bufchunk_alloc(p, cls, bc->size);
+        if (c == NULL) {
+            return NULL;
+        }
+    }
+
+    bc->nused++;
+
+    c->refcount = 1;
+    c->len = 0;
+    c->wlen = 0;
+    c->req.data = NULL;
+
+    return c;
+}
+
+/* smallest class holding size, or a chunk of exactly size */
+struct bufchunk *
+bufchunk_get_size(struct bufpool *p, size_t size) {
+    struct bufchunk *c;
+    uint8_t cls;
+
+    for (cls = 0; cls < BUFPOOL_CLASSES; cls++) {
+        if (p->classes[cls].size >= size) {
+            return bufchunk_get(p, cls);
+        }
+    }
+
+    c = bufchunk_alloc(p, BUFPOOL_OVERSIZE, size);
+    if (c == NULL) {
+        return NULL;
+    }
+
+    c->refcount = 1;
+    c->len = 0;
+    c->wlen = 0;
+    c->req.data = NULL;
+
+    return c;
+}
+
+void
+bufchunk_unref(struct bufchunk *c) {
+    struct bufpool_class *bc;
+
+    ASSERT(c->refcount > 0);
+
+    if (--c->refcount > 0) {
+        return;
+    }
+
+    if (c->cls == BUFPOOL_OVERSIZE) {
+        rps_free(c);
+        return;
+    }
+
+    bc = &c->pool->classes[c->cls];
+    bc->nused--;
+
+    if (bc->nfree >= bc->max_free) {
+        rps_free(c);
+        return;
+    }
+
+    c->req.data = bc->free;
+    bc->free = c;
+    bc->nfree++;
+}
@@ -0,0 +1,71 @@
+/*
+ * Size-class pools of buffer chunks, one per event loop.
+ *
+ * Handshakes read into a chunk of READ_BUF_SIZE borrowed from the pool and
+ * kept until the session is established. After that every read lands in
+ * a chunk of the size class of its context, the chunk is then handed to
+ * the endpoint as a write of its own and goes back to the pool when the
+ * write completes, relayed data is never copied. Reads that keep filling
+ * the chunk step up a size class, small ones step down.
+ *
+ * Chunks are reference counted, the holder of a reference may queue it
+ * for write or keep it, whoever drops the last one returns it. Writes
+ * larger than the biggest class get a chunk of their own size which is
+ * freed instead of pooled.
+ */
+
+#ifndef _RPS_BUFPOOL_H
+#define _RPS_BUFPOOL_H
+
+#include <uv.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define BUFPOOL_CLASSES         5
+#define BUFPOOL_CLASS_SIZES     { 2048, 8192, 32768, 65536, 262144 }
+#define BUFPOOL_MAX_FREE        { 1024, 256, 128, 64, 16 }  /* idle chunks kept per class */
+#define BUFPOOL_OVERSIZE        BUFPOOL_CLASSES             /* class of unpooled chunks */
+
+#define BUFPOOL_GROW_READS      2   /* full reads in a row to step up */
+#define BUFPOOL_SHRINK_READS    8   /* reads under a quarter in a row to step down */
+
+struct bufpool;
+
+struct bufchunk {
+    uv_write_t      req;        /* write of this chunk, data is the writing context */
+    struct bufpool  *pool;
+    uint32_t        refcount;
+    uint8_t         cls;
+    size_t          size;       /* capacity of data */
+    size_t          len;        /* bytes filled */
+    size_t          wlen;       /* bytes of the write, parts not in data included */
+    char            data[];
+};
+
+struct bufpool_class {
+    size_t              size;
+    struct bufchunk     *free;  /* linked through req.data */
+    uint32_t            nfree;
+    uint32_t            max_free;
+    uint32_t            nused;
+};
+
+struct bufpool {
+    struct bufpool_class    classes[BUFPOOL_CLASSES];
+};
+
+void bufpool_init(struct bufpool *p);
+void bufpool_deinit(struct bufpool *p);
+
+struct bufchunk *bufchunk_get(struct bufpool *p, uint8_t cls);
+struct bufchunk *bufchunk_get_size(struct bufpool *p, size_t size);
+void bufchunk_unref(struct bufchunk *c);
+
+static inline struct bufchunk *
+bufchunk_ref(struct bufchunk *c) {
+    c->refcount++;
+    return c;
+}
+
+#endif
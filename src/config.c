@@ -14,6 +14,7 @@
 
 
 #define CONFIG_SERVERS_NUM  3
+#define CONFIG_USERS_NUM    8
 #define CONFIG_DEFAULT_ARGS  3
 
 #define CONFIG_ROOT_PATH    1
@@ -87,6 +88,12 @@ config_server_init(struct config_server *server) {
     server->port = 0;
     string_init(&server->username);
     string_init(&server->password);
+    server->max_sessions = 0;
+    server->max_client_sessions = 0;
+    server->accept_rate = 0;
+    server->shed_target = SERVER_DEFAULT_SHED_TARGET;
+    server->shed_interval = SERVER_DEFAULT_SHED_INTERVAL;
+    server->io_uring = 0;
 }
 
 static void
@@ -107,6 +114,12 @@ config_servers_init(struct config_servers *servers) {
 
     servers->rtimeout = 0;
     servers->ftimeout = 0;
+    servers->handshake_timeout = 0;
+    servers->establish_timeout = 0;
+    servers->connect_timeout = 0;
+    servers->upstream_timeout = 0;
+    servers->lifetime = 0;
+    servers->drain = SERVERS_DEFAULT_DRAIN * 1000;
 
     return RPS_OK;
 }
@@ -119,6 +132,30 @@ config_servers_deinit(struct config_servers *servers) {
     array_destroy(servers->ss);
 }
 
+void
+config_user_init(struct config_user *user) {
+    string_init(&user->username);
+    string_init(&user->password);
+    user->bandwidth = 0;
+    user->rate = 0;
+    string_init(&user->source);
+}
+
+void
+config_user_deinit(struct config_user *user) {
+    string_deinit(&user->username);
+    string_deinit(&user->password);
+    string_deinit(&user->source);
+}
+
+static void
+config_users_deinit(rps_array_t *users) {
+    while (array_n(users)) {
+        config_user_deinit((struct config_user *)array_pop(users));
+    }
+    array_destroy(users);
+}
+
 static void
 config_upstream_init(struct config_upstream *upstream) {
     string_init(&upstream->proto);
@@ -137,10 +174,17 @@ config_upstreams_init(struct config_upstreams *upstreams) {
     upstreams->maxretry = UPSTREAM_DEFAULT_MAXRETRY;
     string_init(&upstreams->schedule);
     upstreams->hybrid = UPSTREAM_DEFAULT_BYBRID;
+    upstreams->pipeline = UPSTREAM_DEFAULT_PIPELINE;
     upstreams->mr1m = UPSTREAM_DEFAULT_MR1M;
     upstreams->mr1h = UPSTREAM_DEFAULT_MR1H;
     upstreams->mr1d = UPSTREAM_DEFAULT_MR1D;
     upstreams->max_fail_rate = UPSTREAM_DEFAULT_MAX_FIAL_RATE;
+    string_init(&upstreams->snapshot);
+    upstreams->snapshot_interval = UPSTREAM_DEFAULT_SNAPSHOT_INTERVAL * 1000;
+    upstreams->breaker_failures = UPSTREAM_DEFAULT_BREAKER_FAILURES;
+    upstreams->breaker_backoff = UPSTREAM_DEFAULT_BREAKER_BACKOFF;
+    upstreams->breaker_max_backoff = UPSTREAM_DEFAULT_BREAKER_MAX_BACKOFF;
+    upstreams->breaker_probes = UPSTREAM_DEFAULT_BREAKER_PROBES;
 
 #ifdef SOCKS4_PROXY_SUPPORT
     upstreams->pools = array_create(2, sizeof(struct config_upstream));
@@ -150,6 +194,7 @@ config_upstreams_init(struct config_upstreams *upstreams) {
 
     if (upstreams->pools == NULL) {
         string_deinit(&upstreams->schedule);
+        string_deinit(&upstreams->snapshot);
         return RPS_ENOMEM;
     }
 
@@ -159,6 +204,7 @@ config_upstreams_init(struct config_upstreams *upstreams) {
 static void
 config_upstreams_deinit(struct config_upstreams *upstreams) {
     string_deinit(&upstreams->schedule);
+    string_deinit(&upstreams->snapshot);
     while (array_n(upstreams->pools)) {
         config_upstream_deinit((struct config_upstream *)array_pop(upstreams->pools));
     }
@@ -194,6 +240,17 @@ config_log_deinit(struct config_log *log) {
     string_deinit(&log->level);
 }
 
+static void
+config_accesslog_init(struct config_accesslog *accesslog) {
+    string_init(&accesslog->path);
+    accesslog->segment = ACCESSLOG_DEFAULT_SEGMENT_SIZE;
+}
+
+static void
+config_accesslog_deinit(struct config_accesslog *accesslog) {
+    string_deinit(&accesslog->path);
+}
+
 static int
 config_parse_bool(rps_str_t *str) {
     if (rps_strcmp(str, "true") == 0 ) {
@@ -209,6 +266,7 @@ static rps_status_t
 config_handler_map(struct config *cfg, rps_str_t *key, rps_str_t *val, rps_str_t *section) {
     rps_status_t status;
     struct config_server *server;
+    struct config_user *user;
     struct config_upstream *upstream;
     int _bool;
 
@@ -219,6 +277,10 @@ config_handler_map(struct config *cfg, rps_str_t *key, rps_str_t *val, rps_str_t
             status = string_copy(&cfg->title, val);          
         } else if (rps_strcmp(key, "pidfile") == 0) {
             status = string_copy(&cfg->pidfile, val);
+        } else if (rps_strcmp(key, "users_file") == 0) {
+            if (!string_empty(val)) {
+                status = string_copy(&cfg->users_file, val);
+            }
         } else if (rps_strcmp(key, "daemon") == 0) {
             _bool = config_parse_bool(val);
             if (_bool < 0) {
@@ -235,6 +297,18 @@ config_handler_map(struct config *cfg, rps_str_t *key, rps_str_t *val, rps_str_t
             cfg->servers.rtimeout = (atoi((char *)val->data)) * 1000;
         } else if (rps_strcmp(key, "ftimeout") == 0){
             cfg->servers.ftimeout = (atoi((char *)val->data)) * 1000;
+        } else if (rps_strcmp(key, "handshake_timeout") == 0){
+            cfg->servers.handshake_timeout = (atoi((char *)val->data)) * 1000;
+        } else if (rps_strcmp(key, "establish_timeout") == 0){
+            cfg->servers.establish_timeout = (atoi((char *)val->data)) * 1000;
+        } else if (rps_strcmp(key, "connect_timeout") == 0){
+            cfg->servers.connect_timeout = (atoi((char *)val->data)) * 1000;
+        } else if (rps_strcmp(key, "upstream_timeout") == 0){
+            cfg->servers.upstream_timeout = (atoi((char *)val->data)) * 1000;
+        } else if (rps_strcmp(key, "lifetime") == 0){
+            cfg->servers.lifetime = (atoi((char *)val->data)) * 1000;
+        } else if (rps_strcmp(key, "drain") == 0){
+            cfg->servers.drain = (atoi((char *)val->data)) * 1000;
         } else {
             status = RPS_ERROR;
         }
@@ -250,6 +324,40 @@ config_handler_map(struct config *cfg, rps_str_t *key, rps_str_t *val, rps_str_t
             status = string_copy(&server->username, val);
         } else if (rps_strcmp(key, "password") == 0) {
             status = string_copy(&server->password, val);
+        } else if (rps_strcmp(key, "max_sessions") == 0) {
+            server->max_sessions = atoi((char *)val->data);
+        } else if (rps_strcmp(key, "max_client_sessions") == 0) {
+            server->max_client_sessions = atoi((char *)val->data);
+        } else if (rps_strcmp(key, "accept_rate") == 0) {
+            server->accept_rate = atoi((char *)val->data);
+        } else if (rps_strcmp(key, "shed_target") == 0) {
+            server->shed_target = atoi((char *)val->data);
+        } else if (rps_strcmp(key, "shed_interval") == 0) {
+            server->shed_interval = atoi((char *)val->data);
+        } else if (rps_strcmp(key, "io_uring") == 0) {
+            _bool = config_parse_bool(val);
+            if (_bool < 0) {
+                status  = RPS_ERROR;
+            } else {
+                server->io_uring = (unsigned)_bool;
+            }
+        } else {
+            status = RPS_ERROR;
+        }
+    } else if (rps_strcmp(section, "users") == 0) {
+        user = (struct config_user *)array_head(cfg->users);
+        if (rps_strcmp(key, "username") == 0) {
+            status = string_copy(&user->username, val);
+        } else if (rps_strcmp(key, "password") == 0) {
+            status = string_copy(&user->password, val);
+        } else if (rps_strcmp(key, "bandwidth") == 0) {
+            user->bandwidth = atoi((char *)val->data);
+        } else if (rps_strcmp(key, "rate") == 0) {
+            user->rate = atoi((char *)val->data);
+        } else if (rps_strcmp(key, "source") == 0) {
+            if (!string_empty(val)) {
+                status = string_copy(&user->source, val);
+            }
         } else {
             status = RPS_ERROR;
         }
@@ -267,6 +375,13 @@ config_handler_map(struct config *cfg, rps_str_t *key, rps_str_t *val, rps_str_t
             } else {
                 cfg->upstreams.hybrid = (unsigned)_bool;
             }
+        } else if (rps_strcmp(key, "pipeline") == 0) {
+            _bool = config_parse_bool(val);
+            if (_bool < 0) {
+                status  = RPS_ERROR;
+            } else {
+                cfg->upstreams.pipeline = (unsigned)_bool;
+            }
         } else if (rps_strcmp(key, "maxreconn") == 0) { 
             cfg->upstreams.maxreconn = atoi((char *)val->data);
         } else if (rps_strcmp(key, "maxretry") == 0) { 
@@ -279,6 +394,20 @@ config_handler_map(struct config *cfg, rps_str_t *key, rps_str_t *val, rps_str_t
             cfg->upstreams.mr1d = atoi((char *)val->data);
         } else if (rps_strcmp(key, "max_fail_rate") == 0) { 
             cfg->upstreams.max_fail_rate = atof((char *)val->data);
+        } else if (rps_strcmp(key, "snapshot") == 0) { 
+            if (!string_empty(val)) {
+                status = string_copy(&cfg->upstreams.snapshot, val);
+            }
+        } else if (rps_strcmp(key, "snapshot_interval") == 0) { 
+            cfg->upstreams.snapshot_interval = (atoi((char *)val->data)) * 1000;
+        } else if (rps_strcmp(key, "breaker_failures") == 0) { 
+            cfg->upstreams.breaker_failures = atoi((char *)val->data);
+        } else if (rps_strcmp(key, "breaker_backoff") == 0) { 
+            cfg->upstreams.breaker_backoff = atoi((char *)val->data);
+        } else if (rps_strcmp(key, "breaker_max_backoff") == 0) { 
+            cfg->upstreams.breaker_max_backoff = atoi((char *)val->data);
+        } else if (rps_strcmp(key, "breaker_probes") == 0) { 
+            cfg->upstreams.breaker_probes = atoi((char *)val->data);
         } else {
             status = RPS_ERROR;
         }
@@ -317,6 +446,16 @@ config_handler_map(struct config *cfg, rps_str_t *key, rps_str_t *val, rps_str_t
         } else {
             status = RPS_ERROR;
         }
+    } else if (rps_strcmp(section, "accesslog") == 0) {
+        if (rps_strcmp(key, "path") == 0) {
+            if (!string_empty(val)) {
+                status = string_copy(&cfg->accesslog.path, val);
+            }
+        } else if (rps_strcmp(key, "segment") == 0) {
+            cfg->accesslog.segment = atoi((char *)val->data);
+        } else {
+            status = RPS_ERROR;
+        }
     } else {
         status = RPS_ERROR;
     }
@@ -362,9 +501,17 @@ config_load(char *filename, struct config *cfg) {
         goto error;
     }
 
+    cfg->users = array_create(CONFIG_USERS_NUM, sizeof(struct config_user));
+    if (cfg->users == NULL) {
+        array_destroy(cfg->args);
+        config_servers_deinit(&cfg->servers);
+        goto error;
+    }
+
     if (config_upstreams_init(&cfg->upstreams) != RPS_OK) {
         array_destroy(cfg->args);
         config_servers_deinit(&cfg->servers);
+        config_users_deinit(cfg->users);
         goto error;
     }
 
@@ -372,6 +519,8 @@ config_load(char *filename, struct config *cfg) {
 
     config_log_init(&cfg->log);
 
+    config_accesslog_init(&cfg->accesslog);
+
     cfg->fname = filename;
     cfg->fd = fd;
     cfg->depth = 0;
@@ -379,6 +528,7 @@ config_load(char *filename, struct config *cfg) {
     cfg->daemon= 0;
     string_init(&cfg->title);
     string_init(&cfg->pidfile);
+    string_init(&cfg->users_file);
     return RPS_OK;
 
 error:
@@ -459,6 +609,7 @@ config_parse_core(struct config *cfg, rps_str_t *section) {
     rps_status_t status;
     rps_str_t *node;
     struct config_server *server;
+    struct config_user *user;
     struct config_upstream *upstream;
     bool done, leaf;
 
@@ -504,6 +655,16 @@ config_parse_core(struct config *cfg, rps_str_t *section) {
                 config_server_init(server);
             }
 
+            if (rps_strcmp(section, "users") == 0 ) {
+                /* new user block */
+                user = (struct config_user *)array_push(cfg->users);
+                if (user == NULL) {
+                    status = RPS_ENOMEM;
+                    break;
+                }
+                config_user_init(user);
+            }
+
             if (rps_strcmp(section, "pools") == 0 ) {
                 /* new pool block */
                 upstream = (struct config_upstream *)array_push(cfg->upstreams.pools);
@@ -651,6 +812,23 @@ config_dump_server(void *data) {
     log_debug("\t   port: %d", server->port);
     log_debug("\t   username: %s", server->username.data);
     log_debug("\t   password: %s", server->password.data);
+    log_debug("\t   max_sessions: %d", server->max_sessions);
+    log_debug("\t   max_client_sessions: %d", server->max_client_sessions);
+    log_debug("\t   accept_rate: %d", server->accept_rate);
+    log_debug("\t   shed_target: %d", server->shed_target);
+    log_debug("\t   shed_interval: %d", server->shed_interval);
+    log_debug("\t   io_uring: %d", server->io_uring);
+    log_debug("");
+}
+
+static void
+config_dump_user(void *data) {
+    struct config_user *user = data;
+
+    log_debug("\t - username: %s", user->username.data);
+    log_debug("\t   bandwidth: %d", user->bandwidth);
+    log_debug("\t   rate: %d", user->rate);
+    log_debug("\t   source: %s", string_empty(&user->source) ? "" : (char *)user->source.data);
     log_debug("");
 }
 
@@ -671,20 +849,37 @@ config_dump(struct config *cfg) {
     log_debug("[servers]");
     log_debug("\t rtimeout: %d", cfg->servers.rtimeout);
     log_debug("\t ftimeout: %d", cfg->servers.ftimeout);
+    log_debug("\t handshake_timeout: %d", cfg->servers.handshake_timeout);
+    log_debug("\t establish_timeout: %d", cfg->servers.establish_timeout);
+    log_debug("\t connect_timeout: %d", cfg->servers.connect_timeout);
+    log_debug("\t upstream_timeout: %d", cfg->servers.upstream_timeout);
+    log_debug("\t lifetime: %d", cfg->servers.lifetime);
+    log_debug("\t drain: %d", cfg->servers.drain);
     log_debug("");
     array_foreach(cfg->servers.ss, config_dump_server);
 
+    log_debug("users_file: %s", string_empty(&cfg->users_file) ? "" : (char *)cfg->users_file.data);
+    log_debug("[users]");
+    array_foreach(cfg->users, config_dump_user);
+
     log_debug("[upstreams]");
     log_debug("\t schedule: %s", cfg->upstreams.schedule.data);
     log_debug("\t refresh: %d", cfg->upstreams.refresh/1000);
     log_debug("\t stats: %d", cfg->upstreams.stats/1000);
     log_debug("\t hybrid: %d", cfg->upstreams.hybrid);
+    log_debug("\t pipeline: %d", cfg->upstreams.pipeline);
     log_debug("\t maxreconn: %d", cfg->upstreams.maxreconn);
     log_debug("\t maxretry: %d", cfg->upstreams.maxretry);
     log_debug("\t mr1m: %d", cfg->upstreams.mr1m);
     log_debug("\t mr1h: %d", cfg->upstreams.mr1h);
     log_debug("\t mr1d: %d", cfg->upstreams.mr1d);
     log_debug("\t max_fail_rate: %.2f", cfg->upstreams.max_fail_rate);
+    log_debug("\t snapshot: %s", cfg->upstreams.snapshot.data);
+    log_debug("\t snapshot_interval: %d", cfg->upstreams.snapshot_interval/1000);
+    log_debug("\t breaker_failures: %d", cfg->upstreams.breaker_failures);
+    log_debug("\t breaker_backoff: %d", cfg->upstreams.breaker_backoff);
+    log_debug("\t breaker_max_backoff: %d", cfg->upstreams.breaker_max_backoff);
+    log_debug("\t breaker_probes: %d", cfg->upstreams.breaker_probes);
     log_debug("");
     array_foreach(cfg->upstreams.pools, config_dump_upstream);
 
@@ -700,15 +895,24 @@ config_dump(struct config *cfg) {
     log_debug("[log]");
     log_debug("\t file: %s", cfg->log.file.data);
     log_debug("\t level: %s", cfg->log.level.data);
-   
+    log_debug("");
+
+    log_debug("[accesslog]");
+    log_debug("\t path: %s", cfg->accesslog.path.data);
+    log_debug("\t segment: %d", cfg->accesslog.segment);
 }
 
 int
 config_init(char *filename, struct config *cfg) {
     rps_status_t status;
+    rps_mem_tag_t scope;
     
+    /* strings and arrays of the config are charged to it */
+    scope = memstat_scope(mem_config);
+
     status = config_load(filename, cfg);
     if (status != RPS_OK) {
+        memstat_scope(scope);
         return status;
     }
 
@@ -718,11 +922,13 @@ config_init(char *filename, struct config *cfg) {
         fclose(cfg->fd);
         cfg->fd = NULL;
         config_deinit(cfg);
+        memstat_scope(scope);
         return status;
     }
 
     fclose(cfg->fd);
     cfg->fd = NULL;
+    memstat_scope(scope);
     
     return RPS_OK;
 }
@@ -732,6 +938,7 @@ config_deinit(struct config *cfg) {
 
     string_deinit(&cfg->title);
     string_deinit(&cfg->pidfile);
+    string_deinit(&cfg->users_file);
 
     while (array_n(cfg->args)) {
         rps_str_t *arg = config_pop_scalar(cfg);
@@ -741,9 +948,13 @@ config_deinit(struct config *cfg) {
 
     config_servers_deinit(&cfg->servers);
 
+    config_users_deinit(cfg->users);
+
     config_upstreams_deinit(&cfg->upstreams);
 
     config_api_deinit(&cfg->api);
 
     config_log_deinit(&cfg->log);
+
+    config_accesslog_deinit(&cfg->accesslog);
 }
@@ -12,17 +12,36 @@
 #define UPSTREAM_DEFAULT_REFRESH    60
 #define UPSTREAM_DEFAULT_STATS      600
 #define UPSTREAM_DEFAULT_BYBRID     0
+#define UPSTREAM_DEFAULT_PIPELINE   0
 #define UPSTREAM_DEFAULT_MAXRECONN   3
 #define UPSTREAM_DEFAULT_MAXRETRY   3
 #define UPSTREAM_DEFAULT_MR1M   0
 #define UPSTREAM_DEFAULT_MR1H   0
 #define UPSTREAM_DEFAULT_MR1D   0
 #define UPSTREAM_DEFAULT_MAX_FIAL_RATE  0.0
+#define UPSTREAM_DEFAULT_SNAPSHOT_INTERVAL  60
+#define UPSTREAM_DEFAULT_BREAKER_FAILURES   5
+#define UPSTREAM_DEFAULT_BREAKER_BACKOFF    5
+#define UPSTREAM_DEFAULT_BREAKER_MAX_BACKOFF    300
+#define UPSTREAM_DEFAULT_BREAKER_PROBES     1
+
+#define ACCESSLOG_DEFAULT_SEGMENT_SIZE  64
+
+#define SERVERS_DEFAULT_DRAIN   300
+#define SERVER_DEFAULT_SHED_TARGET      20      /* ms */
+#define SERVER_DEFAULT_SHED_INTERVAL    200     /* ms */
 
 struct config_servers {
     rps_array_t     *ss;
-    uint32_t        rtimeout;
-    uint32_t        ftimeout;
+    uint32_t        rtimeout;   /* client idle */
+    uint32_t        ftimeout;   /* upstream idle */
+    /* absolute deadlines of handshake phases, 0 falls back to the idle ones */
+    uint32_t        handshake_timeout;  /* client handshake */
+    uint32_t        establish_timeout;  /* all upstream attempts */
+    uint32_t        connect_timeout;    /* upstream connect, each attempt */
+    uint32_t        upstream_timeout;   /* upstream handshake, each attempt */
+    uint32_t        lifetime;   /* of established sessions, 0 is unlimited */
+    uint32_t        drain;  /* max time to drain sessions on restart */
 };
 
 struct config_server {
@@ -31,6 +50,21 @@ struct config_server {
     uint16_t        port;
     rps_str_t       username;
     rps_str_t       password;
+    uint32_t        max_sessions;           /* per listener, 0 is unlimited */
+    uint32_t        max_client_sessions;    /* per client address, 0 is unlimited */
+    uint32_t        accept_rate;            /* new sessions per second, 0 is unlimited */
+    uint32_t        shed_target;            /* ms of loop delay, 0 disables shedding */
+    uint32_t        shed_interval;          /* ms */
+    unsigned        io_uring:1;             /* relay established tunnels with io_uring */
+};
+
+/* account of listeners with credentials, limits of 0 are unlimited */
+struct config_user {
+    rps_str_t       username;
+    rps_str_t       password;
+    uint32_t        bandwidth;  /* bytes per second, both directions */
+    uint32_t        rate;       /* new sessions per second */
+    rps_str_t       source;     /* upstream source of sessions not asking for one */
 };
 
 struct config_upstream {
@@ -42,12 +76,19 @@ struct config_upstreams {
     uint32_t        stats;
     rps_str_t       schedule;
     unsigned        hybrid:1;
+    unsigned        pipeline:1;
     uint32_t        maxreconn;
     uint32_t        maxretry;
     uint32_t        mr1m;
     uint32_t        mr1h;
     uint32_t        mr1d;
     float           max_fail_rate;
+    rps_str_t       snapshot;           /* pool snapshot path, empty to disable */
+    uint32_t        snapshot_interval;
+    uint32_t        breaker_failures;   /* consecutive failures to open, 0 to disable */
+    uint32_t        breaker_backoff;    /* seconds */
+    uint32_t        breaker_max_backoff;
+    uint32_t        breaker_probes;     /* sessions let through when half-open */
     rps_array_t     *pools;
 };
 
@@ -64,6 +105,11 @@ struct config_log {
     rps_str_t       level;
 };
 
+struct config_accesslog {
+    rps_str_t       path;
+    uint32_t        segment; /* segment size in MB */
+};
+
 
 struct config {
     char                    *fname;
@@ -72,9 +118,12 @@ struct config {
     FILE                    *fd;
     unsigned                daemon:1;
     struct config_servers   servers;
+    rps_array_t             *users;
+    rps_str_t               users_file;
     struct config_upstreams upstreams;
     struct config_api       api;
     struct config_log       log;
+    struct config_accesslog accesslog;
     rps_array_t             *args;
     uint32_t                depth;
     unsigned                seq:1;
@@ -86,6 +135,8 @@ struct config {
 
 int config_init(char *config_file, struct config *cfg);
 void config_deinit(struct config *cfg);
+void config_user_init(struct config_user *user);
+void config_user_deinit(struct config_user *user);
 void config_dump(struct config *cfg);
 
 #endif
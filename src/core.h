@@ -4,6 +4,7 @@
 
 #include <uv.h>
 #include <string.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <sys/time.h>
 
@@ -13,8 +14,9 @@
 #define RPS_EUPSTREAM   -3
 #define RPS_EQUEUE   -4
 
-#define READ_BUF_SIZE 2048 //2k
-#define WRITE_BUF_SIZE 65536 //64k
+#define READ_BUF_SIZE 2048 //2k, handshake reads
+#define WRITE_BACKLOG_HIGH  262144  /* pause the reader above this many queued bytes */
+#define WRITE_BACKLOG_LOW   65536   /* resume it at or below */
 #define WRITE_UV_BUF_SIZE   20
 
 #define UNDEFINED_REPLY_CODE -1
@@ -78,9 +80,43 @@ typedef enum {
     rps_rep_bad_request,
     rps_rep_unreachable,
     rps_rep_proxy_unavailable,
+    rps_rep_overload,         //rejected by admission control
     rps_rep_undefined,
 } rps_reply_code_t;
 
+/*
+ * Deadlines of context phases. Idle deadlines are rearmed by every read and
+ * write of an established context. The others are absolute, armed once as
+ * the phase begins: a client trickling bytes cannot keep a handshake alive.
+ * Lifetime caps an established session, it names idle expiries past it.
+ */
+#define CTX_PHASE_MAP(V)                                \
+    V(p_handshake, "client handshake")                  \
+    V(p_establish, "establishment")                     \
+    V(p_connect, "upstream connect")                    \
+    V(p_upstream, "upstream handshake")                 \
+    V(p_request_idle, "client idle")                    \
+    V(p_forward_idle, "upstream idle")                  \
+    V(p_lifetime, "lifetime")                           \
+
+typedef enum {
+#define CTX_PHASE_GEN(name, _) name,
+    CTX_PHASE_MAP(CTX_PHASE_GEN)
+#undef CTX_PHASE_GEN
+    p_max
+} ctx_phase_t;
+
+static inline const char *
+ctx_phase_str(ctx_phase_t phase) {
+#define CTX_PHASE_GEN(name, str) case name: return str;
+    switch (phase) {
+        CTX_PHASE_MAP(CTX_PHASE_GEN)
+        default: ;
+    }
+#undef CTX_PHASE_GEN
+    return "unknown";
+}
+
 typedef struct context rps_ctx_t;
 typedef struct session rps_sess_t;
 
@@ -89,6 +125,7 @@ typedef struct session rps_sess_t;
 #include "log.h"
 #include "array.h"
 #include "hashmap.h"
+#include "wheel.h"
 #include "server.h"
 #include "upstream.h"
 
@@ -132,8 +169,53 @@ typedef enum {
 
 typedef void (*rps_next_t)(struct context *);
 
+struct bufchunk;
+
+/*
+ * Relaying a chunk touches the hot head of the context only, it must fit
+ * in CONTEXT_HOT_SIZE bytes (two cache lines). The libuv handle follows,
+ * fields of handshakes, logs and error paths come last.
+ *
+ * Handshake reads go to a chunk of READ_BUF_SIZE borrowed from the pool of
+ * the server on first read and given back once the session is established,
+ * an established context holds no read buffer between reads.
+ */
+#define CONTEXT_HOT_SIZE    128
+
 struct context {
     struct session      *sess;
+    rps_next_t          do_next;
+
+    ctx_state_t         state;
+    ctx_flag_t          flag;
+    ctx_stream_t        stream;
+
+    /* rbuf points into rchunk of size class rclass, see bufpool.h */
+    char                *rbuf;
+    size_t              rsize;
+    ssize_t             nread;
+    struct bufchunk     *rchunk;
+
+    /* Every write is a chunk with its own request, queued by libuv 
+     * and released on completion.
+     */
+    size_t              wqueued;    /* bytes of writes in flight */
+
+    uint8_t             rclass;     /* size class of next read */
+    uint8_t             rfull;      /* reads in a row filling the buffer */
+    uint8_t             rsmall;     /* reads in a row under a quarter of it */
+    uint8_t             rstat;
+    uint8_t             wstat;
+    uint8_t             phase;      /* ctx_phase_t the timer is armed for */
+
+    uint8_t             connecting:1;
+    uint8_t             connected:1;
+    uint8_t             established:1;
+    uint8_t             pipelined:1;    /* handshake messages sent in one write */
+    uint8_t             blocked:1;      /* read paused until endpoint drained its backlog */
+
+    /* deadline of phase, scheduled on the timing wheel of server loop */
+    struct wheel_node   timer;
 
     union {
         uv_handle_t     handle;
@@ -141,38 +223,16 @@ struct context {
         uv_tcp_t        tcp;
     } handle;
 
-    rps_next_t          do_next;
+    /* cold */
 
-    uint32_t            timeout;
+    /* read paused by user bandwidth limit until the node expires */
+    struct wheel_node   throttle;
 
-    uv_timer_t          timer;
-    uv_write_t          write_req;
     uv_connect_t        connect_req;
     uv_shutdown_t       shutdown_req;
 
     rps_proto_t         proto;
 
-    char                rbuf[READ_BUF_SIZE];
-    ssize_t             nread;
-
-    char                *wbuf;
-    ssize_t             nwrite;
-
-    /* The memory pointed to by the buffers must remain valid until the write callback gets called.
-     * So we use a buffer for write buffer ensure the wbuf is safe 
-     * and won't be overwritten before write callback called.
-     */
-    char                *wbuf2;
-    ssize_t             nwrite2;
-
-    rps_addr_t          peer;
-    char                peername[MAX_INET_ADDRSTRLEN];
-
-    ctx_flag_t          flag;
-    ctx_stream_t        stream;
-    ctx_state_t         state;
-
-
     /* HTTP proxy and HTTP tunnel proxy need this pointer to transmit request params 
      * from client to upstream (method, url, headers, e.g.) 
      */
@@ -184,23 +244,16 @@ struct context {
      */
     int                 reply_code;
 
-    int                 last_status;
     uint16_t            reconn;
     uint16_t            retry;
 
-    /* closing count, free context memory while counter value be 2
-     * 2 means both timer and connect have been closed.
-     * */
-    uint8_t             c_count;
-
-    uint8_t             rstat;
-    uint8_t             wstat;
-
-    uint8_t             connecting:1;
-    uint8_t             connected:1;
-    uint8_t             established:1;
+    /* client or upstream, always a numeric address */
+    rps_addr_t          peer;
+    char                peername[PEER_ADDRSTRLEN];
 };
 
+STATIC_ASSERT(offsetof(struct context, handle) <= CONTEXT_HOT_SIZE, context_hot_size);
+
 struct session {
     struct server   *server;
 
@@ -209,10 +262,36 @@ struct session {
 
     struct upstream *upstream;
 
+    struct user     *user;  /* authenticated account, NULL if none */
+
+    /* relayed by io_uring instead of libuv, see uring.h */
+    struct uring_tunnel *uring;
+
+    /* bytes relayed */
+    uint64_t        nup;    /* client -> remote */
+    uint64_t        ndown;  /* remote -> client */
+
+    /* monotonic time of accept in nanoseconds, phases are offsets in microseconds */
+    uint64_t        hrstart;
+    uint32_t        t_request;
+    uint32_t        t_connect;
+    uint32_t        t_establish;
+
+    unsigned        success:1;
+    unsigned        admitted:1;     /* counted by admission control */
+    unsigned        rejected:1;     /* answered with overload, never forwarded */
+    unsigned        accounted:1;    /* counted as active session of user */
+
+    /* loop time in ms an established session is closed at, 0 if unlimited */
+    uint64_t        deadline;
+
     struct timeval  start;
     struct timeval  end; 
 
     rps_addr_t remote;
+
+    /* upstream source asked for in the username, empty for any */
+    char            source[UPSTREAM_SOURCE_MAX_LENGTH];
 };
 
 #endif
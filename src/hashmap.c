@@ -1,3 +1,5 @@
+#define RPS_MEM_TAG mem_hashmap
+
 #include "hashmap.h"
 #include "core.h"
 #include "murmur3/murmur3.h"
@@ -0,0 +1,190 @@
+#include "memstat.h"
+
+#ifdef RPS_MEMSTAT
+
+#include "util.h"
+#include "log.h"
+
+#include <uv.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+struct memstat_thread {
+    struct memstat_counter  counters[mem_max];
+    rps_mem_tag_t           scope;
+    struct memstat_thread   *next;
+};
+
+/* every thread ever counted, pushed lock-free and never freed */
+static struct memstat_thread *memstat_threads;
+
+static __thread struct memstat_thread *memstat_self;
+
+/* last dump, used by the dumping thread only */
+static uint64_t memstat_dumped[mem_max];
+static uint64_t memstat_dump_time;
+
+static struct memstat_thread *
+memstat_thread(void) {
+    struct memstat_thread *t;
+
+    if (memstat_self != NULL) {
+        return memstat_self;
+    }
+
+    /* not through rps_alloc, it would count itself */
+    t = (struct memstat_thread *)calloc(1, sizeof(*t));
+    if (t == NULL) {
+        abort();
+    }
+    t->scope = mem_other;
+
+    do {
+        t->next = memstat_threads;
+    } while (!__sync_bool_compare_and_swap(&memstat_threads, t->next, t));
+
+    memstat_self = t;
+
+    return t;
+}
+
+static void
+memstat_count(struct memstat_header *h, size_t size, rps_mem_tag_t tag) {
+    struct memstat_thread *t;
+    struct memstat_counter *c;
+
+    t = memstat_thread();
+    if (tag >= mem_max) {
+        tag = t->scope;
+    }
+
+    h->magic = MEMSTAT_MAGIC;
+    h->tag = tag;
+    h->size = size;
+
+    c = &t->counters[tag];
+    c->live += size;
+    c->nalloc++;
+    c->allocated += size;
+}
+
+static void
+memstat_uncount(struct memstat_header *h) {
+    struct memstat_counter *c;
+
+    ASSERT(h->magic == MEMSTAT_MAGIC);
+
+    c = &memstat_thread()->counters[h->tag];
+    c->live -= h->size;
+    c->nfree++;
+}
+
+void *
+memstat_alloc(size_t size, rps_mem_tag_t tag) {
+    struct memstat_header *h;
+
+    h = (struct memstat_header *)malloc(sizeof(*h) + size);
+    if (h == NULL) {
+        return NULL;
+    }
+
+    memstat_count(h, size, tag);
+
+    return h + 1;
+}
+
+void *
+memstat_realloc(void *ptr, size_t size, rps_mem_tag_t tag) {
+    struct memstat_header *h, *nh;
+
+    if (ptr == NULL) {
+        return memstat_alloc(size, tag);
+    }
+
+    h = (struct memstat_header *)ptr - 1;
+    ASSERT(h->magic == MEMSTAT_MAGIC);
+
+    nh = (struct memstat_header *)realloc(h, sizeof(*nh) + size);
+    if (nh == NULL) {
+        /* old block is untouched */
+        return NULL;
+    }
+
+    /* a resized block stays with its owner */
+    tag = nh->tag;
+    memstat_uncount(nh);
+    memstat_count(nh, size, tag);
+
+    return nh + 1;
+}
+
+void
+memstat_free(void *ptr) {
+    struct memstat_header *h;
+
+    h = (struct memstat_header *)ptr - 1;
+    memstat_uncount(h);
+    h->magic = 0;
+
+    free(h);
+}
+
+rps_mem_tag_t
+memstat_scope(rps_mem_tag_t tag) {
+    struct memstat_thread *t;
+    rps_mem_tag_t prev;
+
+    t = memstat_thread();
+    prev = t->scope;
+    if (tag < mem_max) {
+        t->scope = tag;
+    }
+
+    return prev;
+}
+
+/* Counters of other threads are read without locking, totals may lag a little. */
+void
+memstat_dump(void) {
+    struct memstat_thread *t;
+    struct memstat_counter total[mem_max], sum;
+    uint64_t now;
+    double elapsed;
+    int i;
+
+    memset(total, 0, sizeof(total));
+    memset(&sum, 0, sizeof(sum));
+
+    for (t = memstat_threads; t != NULL; t = t->next) {
+        for (i = 0; i < mem_max; i++) {
+            total[i].live += t->counters[i].live;
+            total[i].nalloc += t->counters[i].nalloc;
+            total[i].nfree += t->counters[i].nfree;
+            total[i].allocated += t->counters[i].allocated;
+        }
+    }
+
+    now = uv_hrtime();
+    elapsed = memstat_dump_time ? (double)(now - memstat_dump_time) / 1e9 : 0;
+
+    for (i = 0; i < mem_max; i++) {
+        log_notice("memory %-16s live: %lld bytes, allocs: %llu, frees: %llu, %.1f allocs/s",
+                memstat_tag_str(i), (long long)total[i].live,
+                (unsigned long long)total[i].nalloc, (unsigned long long)total[i].nfree,
+                elapsed > 0 ? (total[i].nalloc - memstat_dumped[i]) / elapsed : 0);
+
+        memstat_dumped[i] = total[i].nalloc;
+        sum.live += total[i].live;
+        sum.nalloc += total[i].nalloc;
+        sum.allocated += total[i].allocated;
+    }
+
+    log_notice("memory total live: %lld bytes, allocs: %llu, allocated: %llu bytes",
+            (long long)sum.live, (unsigned long long)sum.nalloc,
+            (unsigned long long)sum.allocated);
+
+    memstat_dump_time = now;
+}
+
+#endif
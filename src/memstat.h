@@ -0,0 +1,94 @@
+#ifndef _RPS_MEMSTAT_H
+#define _RPS_MEMSTAT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Memory accounting of rps_alloc, built in with -DRPS_MEMSTAT (make memstat).
+ *
+ * Each allocation is tagged with the subsystem owning it. A file sets its
+ * default tag by defining RPS_MEM_TAG before any include, rps_alloc_tag
+ * overrides it per call. Files without a tag (arrays, strings, queues)
+ * charge the scope tag of the calling thread, so config strings land in
+ * config and upstream strings in upstream.
+ *
+ * Blocks carry a small header with tag and size. Counters live in thread
+ * local storage, each thread writes only its own, the dump sums them.
+ * A block freed by another thread than the one allocated it makes the
+ * per-thread counters drift, the sums stay right.
+ *
+ * Without RPS_MEMSTAT nothing of this is compiled, the allocator is the
+ * plain malloc wrapper.
+ */
+
+#define MEMSTAT_TAG_MAP(V)                      \
+    V(0, mem_other, "other")                    \
+    V(1, mem_session, "session")                \
+    V(2, mem_context, "context")                \
+    V(3, mem_buffer, "buffer")                  \
+    V(4, mem_upstream, "upstream")              \
+    V(5, mem_hashmap, "hashmap")                \
+    V(6, mem_http, "http parser")               \
+    V(7, mem_s5, "socks5 handshake")            \
+    V(8, mem_config, "config")                  \
+    V(9, mem_user, "user")                      \
+
+typedef enum {
+#define MEMSTAT_TAG_GEN(code, name, _) name = code,
+    MEMSTAT_TAG_MAP(MEMSTAT_TAG_GEN)
+#undef MEMSTAT_TAG_GEN
+    mem_max,
+    mem_scope = mem_max     /* charge the scope tag of the thread */
+} rps_mem_tag_t;
+
+static inline const char *
+memstat_tag_str(rps_mem_tag_t tag) {
+#define MEMSTAT_TAG_GEN(_, name, str) case name: return str;
+    switch (tag) {
+        MEMSTAT_TAG_MAP(MEMSTAT_TAG_GEN)
+        default: ;
+    }
+#undef MEMSTAT_TAG_GEN
+    return "unknown";
+}
+
+#ifdef RPS_MEMSTAT
+
+#define MEMSTAT_MAGIC   0x6d656d73  /* "mems" */
+
+/* keeps the user pointer aligned like malloc does */
+struct memstat_header {
+    uint32_t    magic;
+    uint32_t    tag;
+    uint64_t    size;
+};
+
+struct memstat_counter {
+    int64_t     live;       /* bytes */
+    uint64_t    nalloc;
+    uint64_t    nfree;
+    uint64_t    allocated;  /* bytes, ever */
+};
+
+void *memstat_alloc(size_t size, rps_mem_tag_t tag);
+void *memstat_realloc(void *ptr, size_t size, rps_mem_tag_t tag);
+void memstat_free(void *ptr);
+
+rps_mem_tag_t memstat_scope(rps_mem_tag_t tag);
+void memstat_dump(void);
+
+#else
+
+static inline rps_mem_tag_t
+memstat_scope(rps_mem_tag_t tag) {
+    return tag;
+}
+
+static inline void
+memstat_dump(void) {
+}
+
+#endif
+
+#endif
@@ -1,8 +1,9 @@
+#define RPS_MEM_TAG mem_http
+
 #include "http.h"
 #include "core.h"
 #include "util.h"
 #include "b64/cdecode.h"
-#include "b64/cencode.h"
 
 
 #include <uv.h>
@@ -1064,13 +1065,15 @@ http_response_parse(struct http_response *resp, uint8_t *data, size_t size) {
 
 int
 http_basic_auth(struct context *ctx, rps_str_t *param) {
-    char *uname, *passwd;
-    char plain[256];
+    char plain[HTTP_BASIC_AUTH_MAX_LENGTH];
+    char *delimiter;
     int length;
-    struct server *s;
     base64_decodestate bstate;
 
-    length = 0;
+    /* 4 base64 chars decode to 3 bytes */
+    if (param->len > sizeof(plain) / 3 * 4) {
+        return false;
+    }
 
     base64_init_decodestate(&bstate);
 
@@ -1080,50 +1083,14 @@ http_basic_auth(struct context *ctx, rps_str_t *param) {
         return false;
     }
 
-    plain[length] = '\0';
-
-    char *delimiter = ":";
-
-    uname = strtok(plain, delimiter);
-    passwd = strtok(NULL, delimiter);
-
-    if (uname == NULL || passwd == NULL) {
+    /* userid ends at the first colon, the password may hold more */
+    delimiter = memchr(plain, ':', length);
+    if (delimiter == NULL || delimiter == plain || delimiter == plain + length - 1) {
         return false;
     }
 
-    s = ctx->sess->server;
-    
-    if (rps_strcmp(&s->cfg->username, uname) == 0 && 
-        rps_strcmp(&s->cfg->password, passwd) == 0) {
-        return true;
-    }
-    
-
-    return false;
-}
-
-int 
-http_basic_auth_gen(const char *uname, const char *passwd, char *output) {
-    base64_encodestate bstate;   
-    int length;
-    char input[HTTP_HEADER_MAX_VALUE_LENGTH];
-
-    snprintf(input, HTTP_HEADER_MAX_VALUE_LENGTH, "%s:%s", uname, passwd);
-    
-
-    length = 0;
-    base64_init_encodestate(&bstate);
-
-    length = snprintf(output, HTTP_HEADER_MAX_VALUE_LENGTH, "Basic ");
-    length += base64_encode_block(input, strlen(input), &output[length], &bstate);
-    length += base64_encode_blockend(&output[length], &bstate);
-
-    ASSERT (length > 1);
-
-    /* base64_encode_blockend append \n at the last of outoput, we need remove the \n */
-    output[length - 1] = '\0';
-
-    return length - 1;
+    return server_auth(ctx->sess, plain, (size_t)(delimiter - plain), 
+            delimiter + 1, (size_t)(plain + length - delimiter - 1));
 }
 
 static int
@@ -1184,8 +1151,9 @@ http_response_message(char *message, struct http_response *resp) {
     return len;
 }
 
+/* request line and headers, without the blank line ending them */
 int 
-http_request_message(char *message, struct http_request *req) {
+http_request_head(char *message, struct http_request *req) {
     int len;
     int size;
     uint32_t i;
@@ -1214,12 +1182,6 @@ http_request_message(char *message, struct http_request *req) {
         }
     }
 
-    len += snprintf(message + len, size - len, "\r\n");
-
-    if (!string_empty(&req->body)) {
-        len += snprintf(message + len, size - len, "%s", req->body.data);
-    }
-
 #ifdef RPS_DEBUG_OPEN
     http_request_dump(req, http_send);
 #endif
@@ -1228,6 +1190,42 @@ http_request_message(char *message, struct http_request *req) {
 
 }
 
+/* 
+ * Forward req to the upstream of the session in one write, credentials 
+ * go as the header line serialized when the upstream entered its pool.
+ */
+rps_status_t
+http_request_write(struct context *ctx, struct http_request *req) {
+    struct upstream *u;
+    char message[HTTP_MESSAGE_MAX_LENGTH];
+    uv_buf_t bufs[4];
+    unsigned int n;
+    uint32_t inplace;
+    int len;
+
+    u = ctx->sess->upstream;
+
+    len = http_request_head(message, req);
+
+    ASSERT(len > 0);
+
+    /* head and body are copied, auth line and blank line sent in place */
+    n = 0;
+    inplace = 0;
+    bufs[n++] = uv_buf_init(message, len);
+    if (!string_empty(&u->auth)) {
+        inplace |= 1u << n;
+        bufs[n++] = uv_buf_init((char *)u->auth.data, u->auth.len);
+    }
+    inplace |= 1u << n;
+    bufs[n++] = uv_buf_init((char *)CRLF, CRLF_LEN);
+    if (!string_empty(&req->body)) {
+        bufs[n++] = uv_buf_init((char *)req->body.data, req->body.len);
+    }
+
+    return server_writev(ctx, bufs, n, inplace);
+}
+
 
 int
 http_request_verify(struct context *ctx) {
@@ -1238,6 +1236,7 @@ http_request_verify(struct context *ctx) {
     struct server *s;
     rps_addr_t  *remote;
     rps_status_t status;
+    uint32_t gen;
     int result;
 
     data = (uint8_t *)ctx->rbuf;
@@ -1263,9 +1262,10 @@ http_request_verify(struct context *ctx) {
     s = ctx->sess->server;
     req = ctx->req;
     
-    if (string_empty(&s->cfg->username) || string_empty(&s->cfg->password)) {
+    if (!server_auth_required(s) || ctx->sess->rejected) {
         /* rps server didn't assign username or password 
-         * jump to upstream handshake phase directly. */
+         * jump to upstream handshake phase directly. 
+         * Rejected sessions get the overload reply there, credentials unchecked. */
         result = http_verify_success;
         goto next;
     }
@@ -1285,6 +1285,14 @@ http_request_verify(struct context *ctx) {
         goto next;
     }
 
+    /* same header value accepted before, no decoding */
+    if (server_auth_cached(ctx->sess, credentials, credentials_size)) {
+        result = http_verify_success;
+        goto next;
+    }
+
+    gen = users_gen(s->users);
+
    
     http_request_auth_init(&auth);
     status = http_request_auth_parse(&auth, credentials, credentials_size);
@@ -1303,6 +1311,7 @@ http_request_verify(struct context *ctx) {
 
     if (http_basic_auth(ctx, &auth.param)) {
         result = http_verify_success;
+        server_auth_cache(ctx->sess, gen, credentials, credentials_size);
     } else {
         result = http_verify_fail;
     };
@@ -1389,10 +1398,7 @@ http_response_verify(struct context *ctx) {
 rps_status_t
 http_send_request(struct context *ctx) {
     struct http_request *req;
-    struct upstream *u;
     size_t i;
-    char message[HTTP_MESSAGE_MAX_LENGTH];
-    int len;
 
     req = ctx->sess->request->req;
 
@@ -1403,19 +1409,6 @@ http_send_request(struct context *ctx) {
                 strlen(BYPASS_PROXY_HEADER[i]));
     } 
 
-    u = ctx->sess->upstream;
-    
-    if (!string_empty(&u->uname)) {
-        /* autentication required */
-        const char key[] = "Proxy-Authorization";
-        char val[HTTP_HEADER_MAX_VALUE_LENGTH];   
-        int vlen;
-        
-        vlen = http_basic_auth_gen((const char *)u->uname.data, 
-                (const char *)u->passwd.data, val);
-        hashmap_set(&req->headers, (void *)key, strlen(key), (void *)val, vlen);
-    }
-        
 #ifdef HTTP_PROXY_CONNECTION
     /* set proxy-connection header*/
     const char key2[] = "Porxy-Connection";
@@ -1436,12 +1429,7 @@ http_send_request(struct context *ctx) {
             (void *)val4, strlen(val4));    
     }
     
-    len = http_request_message(message, req);
-
-    ASSERT(len > 0);
-
-    return server_write(ctx, message, len);
-
+    return http_request_write(ctx, req);
 }
 
 rps_status_t
@@ -1515,9 +1503,9 @@ http_send_response(struct context *ctx, uint16_t code) {
         if (ctx->sess->upstream == NULL) {
             break;
         }
-        rps_unresolve_addr(&ctx->sess->upstream->server, host);
+        rps_inaddr_name(&ctx->sess->upstream->server, host);
         snprintf(addr, MAX_INET_ADDRSTRLEN, "%s:%d", host, 
-                rps_unresolve_port(&ctx->sess->upstream->server));
+                rps_inaddr_port(&ctx->sess->upstream->server));
 
         hashmap_set(&resp.headers, (void *)key4, strlen(key4), 
                 (void *)addr, strlen(addr));
@@ -12,6 +12,8 @@
 #define HTTP_HEADER_MAX_VALUE_LENGTH   2048
 
 #define HTTP_BODY_MAX_LENGTH    2048
+
+#define HTTP_BASIC_AUTH_MAX_LENGTH  768     /* decoded user-id:password */
 // 1M is big enough in our approach
 #define HTTP_MESSAGE_MAX_LENGTH    1024 * 1024
 
@@ -93,6 +95,8 @@ http_reply_code_reverse(int code) {
     #define HTTP_REPLY_CODE_GEN(c1, c2) case c2: return c1;
     switch(code) {
         HTTP_REPLY_CODE_MAP(HTTP_REPLY_CODE_GEN)
+        /* shares 503 with proxy unavailable, one way only */
+        case rps_rep_overload: return http_proxy_unavailable;
         default: ;
     }
     #undef HTTP_REPLY_CODE_GEN
@@ -192,19 +196,19 @@ rps_status_t http_request_auth_parse(struct http_request_auth *auth,
 rps_status_t http_response_parse(struct http_response *resp, uint8_t *data, size_t size);
 
 int http_basic_auth(struct context *ctx, rps_str_t *param);
-int http_basic_auth_gen(const char *uname, const char *passwd, char *output);
 
 #ifdef RPS_DEBUG_OPEN
 void http_request_dump(struct http_request *req, uint8_t rs);
 void http_response_dump(struct http_response *resp, uint8_t rs);
 #endif
 
-int http_request_message(char *message, struct http_request *req);
+int http_request_head(char *message, struct http_request *req);
 int http_response_message(char *message, struct http_response *resp);
 
 int http_request_verify(struct context *ctx);
 int http_response_verify(struct context *ctx);
 rps_status_t http_send_response(struct context *ctx, uint16_t code);
 rps_status_t http_send_request(struct context *ctx);
+rps_status_t http_request_write(struct context *ctx, struct http_request *req);
 
 #endif
@@ -5,10 +5,8 @@
 static rps_status_t
 http_tunnel_send_request(struct context *ctx) {
     struct http_request *req, nreq;
-    struct upstream *u;
+    rps_status_t status;
     size_t i;
-    char message[HTTP_MESSAGE_MAX_LENGTH];
-    int len;
 
     req = ctx->sess->request->req;
 
@@ -36,19 +34,6 @@ http_tunnel_send_request(struct context *ctx) {
     hashmap_set(&nreq.headers, (void *)key1, strlen(key1), (void *)val1, v1len);
 #endif
 
-    u = ctx->sess->upstream;
-    
-    if (!string_empty(&u->uname)) {
-        /* autentication required */
-        const char key2[] = "Proxy-Authorization";
-        char val2[HTTP_HEADER_MAX_VALUE_LENGTH];   
-        int vlen2;
-        
-        vlen2 = http_basic_auth_gen((const char *)u->uname.data, 
-                (const char *)u->passwd.data, val2);
-        hashmap_set(&nreq.headers, (void *)key2, strlen(key2), (void *)val2, vlen2);
-    }
-        
 #ifdef HTTP_PROXY_CONNECTION
     /* set proxy-connection header*/
     const char key3[] = "Porxy-Connection";
@@ -63,13 +48,11 @@ http_tunnel_send_request(struct context *ctx) {
 #endif
     
     
-    len = http_request_message(message, &nreq);
-
-    ASSERT(len > 0);
+    status = http_request_write(ctx, &nreq);
 
     http_request_deinit(&nreq);
 
-    return server_write(ctx, message, len);
+    return status;
 }
 
 static void
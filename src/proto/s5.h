@@ -154,6 +154,8 @@ s5_reply_code_reverse(int code) {
     #define S5_REPLY_CODE_GEN(c1, c2) case c2: return c1;
     switch(code) {
         S5_REPLY_CODE_MAP(S5_REPLY_CODE_GEN)
+        /* general failure, one way only */
+        case rps_rep_overload: return s5_rep_socks_fail;
         default: ;
     }
     #undef S5_REPLY_CODE_GEN
@@ -298,6 +300,18 @@ typedef enum {
     s5_cmd_udp_assoc   = 0x03
 } s5_cmd;
 
+/*
+ * Client handshake bytes kept between reads, a partial message or the 
+ * data following the request. Longest handshake is 257 + 513 + 262 bytes.
+ */
+struct s5_handshake {
+    uint8_t     buf[2 * READ_BUF_SIZE];
+    size_t      len;
+};
+
+/* method(3) + auth(513) + request(262) */
+#define S5_PIPELINE_MAX_LENGTH  778
+
 void s5_server_do_next(struct context *ctx);
 void s5_client_do_next(struct context *ctx);
 
@@ -1,3 +1,5 @@
+#define RPS_MEM_TAG mem_s5
+
 #include "s5.h"
 #include "core.h"
 #include "upstream.h"
@@ -5,26 +7,109 @@
 #include <stdio.h>
 
 
+/* method selection, auth request of an upstream is its u->auth */
+static const uint8_t s5_methods_none[] = {SOCKS5_VERSION, 1, s5_auth_none};
+static const uint8_t s5_methods_any[] = {SOCKS5_VERSION, 2, s5_auth_none, s5_auth_passwd};
+static const uint8_t s5_methods_passwd[] = {SOCKS5_VERSION, 1, s5_auth_passwd};
+
+static int
+s5_request_message(rps_addr_t *remote, uint8_t *req) {
+    int len, alen;
+    uint16_t port;
+
+    len = 0;
+    
+    req[len++] = SOCKS5_VERSION;
+    req[len++] = s5_cmd_tcp_connect; //cmd
+    req[len++] = 0x00; //rsv
+    
+    switch (remote->family) {
+        case AF_INET:
+            req[len++] = s5_atyp_ipv4;
+            memcpy(&req[len], &remote->addr.in.sin_addr, 4);
+            len += 4;
+            memcpy(&req[len], &remote->addr.in.sin_port, 2);
+            break;
+        case AF_INET6:
+            req[len++] = s5_atyp_ipv6;
+            memcpy(&req[len], &remote->addr.in6.sin6_addr, 16);
+            len += 16;
+            memcpy(&req[len], &remote->addr.in6.sin6_port, 2);
+            break;
+        case AF_DOMAIN:
+            req[len++] = s5_atyp_domain;
+            alen = strlen(remote->addr.name.host);
+            req[len++] = alen;
+            memcpy(&req[len], (const char *)remote->addr.name.host, alen);
+            len += alen;
+            port = htons(remote->addr.name.port);
+            memcpy(&req[len], &port, 2);
+            break;
+        default:
+            NOT_REACHED();
+    }
+
+    len += 2; //port length = 2
+
+    return len;
+}
+
+/*
+ * Pipelined handshake, method selection, auth and request go out in one 
+ * write and the replies are parsed as they stream back. Only the method
+ * we are going to use is offered.
+ */
+static void
+s5_do_pipeline(struct context *ctx) {
+    uint8_t req[S5_PIPELINE_MAX_LENGTH];
+    struct session  *sess;
+    struct upstream *u;
+    uv_buf_t bufs[3];
+
+    sess = ctx->sess;
+    u = sess->upstream;
+
+    if (string_empty(&u->auth)) {
+        bufs[0] = uv_buf_init((char *)s5_methods_none, sizeof(s5_methods_none));
+    } else {
+        bufs[0] = uv_buf_init((char *)s5_methods_passwd, sizeof(s5_methods_passwd));
+    }
+    bufs[1] = uv_buf_init((char *)u->auth.data, u->auth.len);
+    bufs[2] = uv_buf_init((char *)req, s5_request_message(&sess->remote, req));
+
+    /* method and auth messages sent in place, request copied */
+    if (server_writev(ctx, bufs, 3, (1u << 0) | (1u << 1)) != RPS_OK) {
+        ctx->state = c_retry;
+        server_do_next(ctx);
+        return;
+    }
 
+    ctx->pipelined = 1;
+    ctx->state = c_handshake_resp;
+}
 
 static void
 s5_do_handshake(struct context *ctx) {
     rps_status_t status;
     struct session  *sess;
-    struct s5_method_request req;
 
     sess = ctx->sess;
 
-    req.ver = SOCKS5_VERSION;
-    if (string_empty(&sess->upstream->uname)) {
-        req.nmethods = 1;
-        req.methods[0] = 0x00;
-        status = server_write(ctx, &req, 3);
+    /* drop bytes left by previous upstream */
+    if (ctx->req != NULL) {
+        ((struct s5_handshake *)ctx->req)->len = 0;
+    }
+    ctx->pipelined = 0;
+
+    if (sess->server->upstreams->pipeline && upstream_pipeline_allowed(sess->upstream)) {
+        s5_do_pipeline(ctx);
+        return;
+    }
+
+    if (string_empty(&sess->upstream->auth)) {
+        status = server_write(ctx, s5_methods_none, sizeof(s5_methods_none));
     } else {
-        req.nmethods = 2;
-        req.methods[0] = 0x00;
-        req.methods[1] = 0x02;
-        status = server_write(ctx, &req, 4);
+        status = server_write(ctx, s5_methods_any, sizeof(s5_methods_any));
     }
 
     if (status != RPS_OK) {
@@ -37,81 +122,61 @@ s5_do_handshake(struct context *ctx) {
     return;
 }
 
-static void
-s5_do_handshake_resp(struct context *ctx) {
-    uint8_t    *data;
-    size_t     size;
-    ctx_state_t new_state;
-    struct s5_method_response *resp;
-    
-    data = (uint8_t *)ctx->rbuf;
-    size = (size_t)ctx->nread;
+/* 
+ * Response handlers consume one complete message from data and set *used,
+ * s5_need_more_data leaves the data untouched until more bytes arrive.
+ */
 
-    if (size != 2) {
-        log_debug("s5 upstream '%s' handshake error: junk", ctx->peername);
-        goto retry;
+static s5_err_t
+s5_do_handshake_resp(struct context *ctx, uint8_t *data, size_t size, size_t *used) {
+    uint8_t method;
+
+    if (size < 2) {
+        return s5_need_more_data;
     }
 
-    resp = (struct s5_method_response *)data;
-    if (resp->ver != SOCKS5_VERSION) {
+    if (data[0] != SOCKS5_VERSION) {
         log_debug("s5 upstream '%s' handshake error: bad protocol version.", ctx->peername);
-        goto retry;
+        return s5_bad_version;
     }
 
-    switch (resp->method) {
+    *used = 2;
+    method = data[1];
+
+    switch (method) {
         case s5_auth_none:
-            new_state = c_requests;
+            ctx->state = ctx->pipelined ? c_reply : c_requests;
             break;
         case s5_auth_passwd:
-            new_state = c_auth_req;
+            ctx->state = ctx->pipelined ? c_auth_resp : c_auth_req;
             break;
         case s5_auth_gssapi:
         case s5_auth_unacceptable:
         default:
-            new_state = c_retry;
             log_debug("s5 upstream '%s' handshake error: unacceptable authentication.", ctx->peername);
-            goto retry;
+            return s5_auth_error;
+    }
+
+    if (ctx->pipelined && method != (string_empty(&ctx->sess->upstream->auth) ? 
+                s5_auth_none : s5_auth_passwd)) {
+        log_debug("s5 upstream '%s' handshake error: unexpected method %d.", ctx->peername, method);
+        return s5_auth_error;
     }
 
 #ifdef RPS_DEBUG_OPEN
     log_verb("s5 upstream '%s' handshake finish.", ctx->peername);
 #endif
 
-    ctx->state = new_state;
-    server_do_next(ctx);
-    return;
-
-retry:
-    ctx->state = c_retry;
-    server_do_next(ctx);
+    return s5_ok;
 }
 
 static void
 s5_do_auth(struct context *ctx) {
-    //struct s5_auth_request req;
-    uint8_t req[512];
     struct upstream *u;
-    int len;
 
-    len = 0;
     u = ctx->sess->upstream;
 
-    req[len++] = SOCKS5_AUTH_PASSWD_VERSION;
-    req[len++] = u->uname.len;
-
-    if (!string_empty(&u->uname)) {
-        memcpy(&req[len], u->uname.data, u->uname.len);
-        len += u->uname.len;
-    }
-
-    req[len++] = u->passwd.len;
-
-    if (!string_empty(&u->passwd)) {
-        memcpy(&req[len], u->passwd.data, u->passwd.len);
-        len += u->passwd.len;
-    } 
-
-    if (server_write(ctx, req, len) != RPS_OK) {
+    if (string_empty(&u->auth) || server_write(ctx, u->auth.data, u->auth.len) != RPS_OK) {
         ctx->state = c_retry;
         server_do_next(ctx);
     } else {
@@ -119,90 +184,41 @@ s5_do_auth(struct context *ctx) {
     }
 }
 
-static void
-s5_do_auth_resp(struct context *ctx) {
-    uint8_t    *data;
-    size_t     size;
-    struct s5_auth_response *resp;
-
-    data = (uint8_t *)ctx->rbuf;
-    size = (size_t)ctx->nread;
-
-    if (size != 2) {
-        log_debug("s5 upstream '%s' auth error: junk", ctx->peername);
-        goto retry;
+static s5_err_t
+s5_do_auth_resp(struct context *ctx, uint8_t *data, size_t size, size_t *used) {
+    if (size < 2) {
+        return s5_need_more_data;
     }
 
-    resp = (struct s5_auth_response *)data;
-
-    if (resp->ver != SOCKS5_AUTH_PASSWD_VERSION){
-        log_debug("s5 upstream '%s' auth error: invalid auth version : %d", ctx->peername, resp->ver);
-        goto retry;
+    if (data[0] != SOCKS5_AUTH_PASSWD_VERSION){
+        log_debug("s5 upstream '%s' auth error: invalid auth version : %d", ctx->peername, data[0]);
+        return s5_bad_version;
     }
 
-    if (resp->status != s5_auth_allow) {
+    *used = 2;
+
+    if (data[1] != s5_auth_allow) {
         log_debug("s5 upstream '%s' auth error: auth denied", ctx->peername);
-        goto retry;
+        /* upstream did understand us, not a pipelining issue */
+        ctx->pipelined = 0;
+        return s5_auth_error;
     }
 
 #ifdef RPS_DEBUG_OPEN
     log_verb("s5 upstream '%s' auth allow.", ctx->peername);
 #endif
 
-    ctx->state = c_requests;
-    server_do_next(ctx);
-    return;
-
-retry:
-    ctx->state = c_retry;
-    server_do_next(ctx);
+    ctx->state = ctx->pipelined ? c_reply : c_requests;
+    return s5_ok;
 }
 
 
 static void
 s5_do_request(struct context *ctx) {
-    //struct s5_request *req;
     uint8_t req[512];
-    struct session  *sess;
-    rps_addr_t *remote;
-    int len, alen;
-
-    len = 0;
-    sess = ctx->sess;
-    remote = &sess->remote;
-    
-    req[len++] = SOCKS5_VERSION;
-    req[len++] = s5_cmd_tcp_connect; //cmd
-    req[len++] = 0x00; //rsv
-    
-    switch (remote->family) {
-        case AF_INET:
-            req[len++] = s5_atyp_ipv4;
-            memcpy(&req[len], &remote->addr.in.sin_addr, 4);
-            len += 4;
-            memcpy(&req[len], &remote->addr.in.sin_port, 2);
-            break;
-        case AF_INET6:
-            req[len++] = s5_atyp_ipv6;
-            memcpy(&req[len], &remote->addr.in.sin_addr, 16);
-            len += 16;
-            memcpy(&req[len], &remote->addr.in6.sin6_port, 2);
-            break;
-        case AF_DOMAIN:
-            req[len++] = s5_atyp_domain;
-            alen = strlen(remote->addr.name.host);
-            req[len++] = alen;
-            memcpy(&req[len], (const char *)remote->addr.name.host, alen);
-            len += alen;
-            uint16_t port;
-            port = htons(remote->addr.name.port);
-            memcpy(&req[len], &port, 2);
-            break;
-        default:
-            NOT_REACHED();
-    }
+    int len;
 
-    len += 2; //port length = 2
+    len = s5_request_message(&ctx->sess->remote, req);
 
     if (server_write(ctx, req, len) != RPS_OK) {
         ctx->state = c_retry;
@@ -213,40 +229,191 @@ s5_do_request(struct context *ctx) {
 }
 
 
-static void
-s5_do_reply(struct context *ctx) {
-    uint8_t    *data;
-    struct s5_in4_response *resp;
+static s5_err_t
+s5_do_reply(struct context *ctx, uint8_t *data, size_t size, size_t *used) {
+    size_t len;
+    uint8_t rep;
     char remoteip[MAX_INET_ADDRSTRLEN];
 
-    data = (uint8_t *)ctx->rbuf;
+    /* ver(1) + rep(1) + rsv(1) + atyp(1) + baddr(alen) + bport(2) */
+    if (size < 1) {
+        return s5_need_more_data;
+    }
 
-    resp = (struct s5_in4_response *)data; 
-    if (resp->ver != SOCKS5_VERSION) {
+    if (data[0] != SOCKS5_VERSION) {
         log_debug("s5 upstream '%s' reply error: bad protocol version.", ctx->peername);
-        goto retry;
+        return s5_bad_version;
+    }
+
+    if (size < 5) {
+        return s5_need_more_data;
+    }
+
+    switch (data[3]) {
+        case s5_atyp_ipv4:
+            len = 6 + 4;
+            break;
+        case s5_atyp_ipv6:
+            len = 6 + 16;
+            break;
+        case s5_atyp_domain:
+            len = 6 + 1 + data[4];
+            break;
+        default:
+            log_debug("s5 upstream '%s' reply error: bad address type.", ctx->peername);
+            return s5_bad_atyp;
     }
 
+    if (size < len) {
+        return s5_need_more_data;
+    }
+
+    *used = len;
+    rep = data[1];
+
+    /* complete reply, pipelining worked whatever the result */
+    ctx->pipelined = 0;
+
     rps_unresolve_addr(&ctx->sess->remote, remoteip);
 
     /* save reply status and will be sent to request client */
-    ctx->reply_code = s5_reply_code_lookup(resp->rep);
+    ctx->reply_code = s5_reply_code_lookup(rep);
 
-    if (resp->rep != s5_rep_success) {
+    if (rep != s5_rep_success) {
         log_debug("s5 upstream %s reply error, connect remote %s failed : %s", 
-                ctx->peername, remoteip, s5_strrep(resp->rep));
-        goto retry;
+                ctx->peername, remoteip, s5_strrep(rep));
+        return s5_bad_cmd;
+    }
+
+#ifdef RPS_DEBUG_OPEN
+    log_verb("s5 upstream %s connect remote %s success.", ctx->peername, remoteip);
+#endif
+    ctx->established = 1;
+    ctx->state = c_establish;
+
+    return s5_ok;
+}
+
+/* relay the bytes remote sent along with the reply */
+static void
+s5_flush_early_data(struct context *ctx) {
+    struct s5_handshake *hs;
+    struct session *sess;
+
+    hs = (struct s5_handshake *)ctx->req;
+    sess = ctx->sess;
+
+    if (hs == NULL) {
+        return;
+    }
+
+    if (hs->len > 0 && ctx->state == c_established && 
+            sess->request != NULL && sess->request->state == c_established) {
+        if (server_write(sess->request, hs->buf, hs->len) == RPS_OK) {
+            server_account(sess, 0, hs->len);
+        }
+    }
+
+    rps_free(hs);
+    ctx->req = NULL;
+}
+
+/*
+ * Consume every complete response in the read buffer, the responses of a 
+ * pipelined handshake may arrive coalesced or fragmented. A partial 
+ * response is kept for the next read.
+ */
+static void
+s5_do_parse(struct context *ctx) {
+    struct s5_handshake *hs;
+    uint8_t *data;
+    size_t size, pos, used;
+    s5_err_t err;
+
+    hs = (struct s5_handshake *)ctx->req;
+
+    if (hs == NULL) {
+        data = (uint8_t *)ctx->rbuf;
+        size = (size_t)ctx->nread;
     } else {
-    #ifdef RPS_DEBUG_OPEN
-        log_verb("s5 upstream %s connect remote %s success.", ctx->peername, remoteip);
-    #endif
-        ctx->established = 1;
-        ctx->state = c_establish;
+        if (hs->len + (size_t)ctx->nread > sizeof(hs->buf)) {
+            log_debug("s5 upstream '%s' handshake error: junk", ctx->peername);
+            goto retry;
+        }
+        memcpy(&hs->buf[hs->len], ctx->rbuf, ctx->nread);
+        hs->len += ctx->nread;
+        data = hs->buf;
+        size = hs->len;
+    }
+
+    pos = 0;
+    err = s5_ok;
+
+    while (err == s5_ok) {
+        used = 0;
+
+        switch (ctx->state) {
+            case c_handshake_resp:
+                err = s5_do_handshake_resp(ctx, data + pos, size - pos, &used);
+                break;
+            case c_auth_resp:
+                err = s5_do_auth_resp(ctx, data + pos, size - pos, &used);
+                break;
+            case c_reply:
+                err = s5_do_reply(ctx, data + pos, size - pos, &used);
+                break;
+            default:
+                /* next message to send, or established */
+                err = s5_need_more_data;
+                continue;
+        }
+
+        pos += used;
+    }
+
+    if (err != s5_need_more_data) {
+        /* 
+         * Replies of a pipelined handshake misparsed or out of order, the 
+         * upstream mishandles pipelining. Timeouts, resets and refusals are
+         * no sign of it.
+         */
+        if (ctx->pipelined && (err == s5_bad_version || err == s5_bad_atyp)) {
+            upstream_pipeline_failed(ctx->sess->upstream);
+            log_debug("upstream %s:%d fallback to lock-step handshake for %d s", 
+                    ctx->peername, rps_unresolve_port(&ctx->peer), UPSTREAM_NOPIPELINE_BACKOFF);
+        }
+        goto retry;
+    }
+
+    if (pos < size) {
+        if (hs == NULL) {
+            hs = (struct s5_handshake *)rps_alloc(sizeof(struct s5_handshake));
+            if (hs == NULL) {
+                goto retry;
+            }
+            ctx->req = hs;
+        }
+        memmove(hs->buf, data + pos, size - pos);
+        hs->len = size - pos;
+    } else if (hs != NULL) {
+        hs->len = 0;
+    }
+
+    switch (ctx->state) {
+        case c_auth_req:
+        case c_requests:
+            server_do_next(ctx);
+            break;
+        case c_establish:
+            server_do_next(ctx);
+            s5_flush_early_data(ctx);
+            break;
+        default:
+            break;
     }
 
-    server_do_next(ctx);
     return;
-    
+
 retry:
     ctx->state = c_retry;
     server_do_next(ctx);
@@ -260,20 +427,16 @@ s5_client_do_next(struct context *ctx) {
         case c_handshake_req:
             s5_do_handshake(ctx);
             break;
-        case c_handshake_resp:
-            s5_do_handshake_resp(ctx);
-            break;
         case c_auth_req:
             s5_do_auth(ctx);
             break;
-        case c_auth_resp:
-            s5_do_auth_resp(ctx);
-            break;
         case c_requests:
             s5_do_request(ctx);
             break;
+        case c_handshake_resp:
+        case c_auth_resp:
         case c_reply:
-            s5_do_reply(ctx);
+            s5_do_parse(ctx);
             break;
         case c_closing:
             break;
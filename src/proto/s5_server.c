@@ -1,3 +1,4 @@
+#define RPS_MEM_TAG mem_s5
 
 #include "s5.h"
 #include "core.h"
@@ -9,15 +10,13 @@
 #include <uv.h>
 
 static uint8_t
-s5_select_auth(struct s5_method_request *req) {
+s5_select_auth(const uint8_t *methods, uint8_t nmethods) {
     int i;
-    uint8_t method;
 
     /* Select no authentication required if rps server didn't set user and password */
 
-    for (i=0; i<req->nmethods; i++) {
-        method = req->methods[i];
-        if (method == s5_auth_none) {
+    for (i=0; i<nmethods; i++) {
+        if (methods[i] == s5_auth_none) {
             return s5_auth_none;
         }
     }
@@ -25,44 +24,53 @@ s5_select_auth(struct s5_method_request *req) {
     return s5_auth_unacceptable;
 }
 
-static void
-s5_do_handshake(struct context *ctx, uint8_t *data, size_t size) {
+/* 
+ * Handshake handlers consume one complete message from data and set *used,
+ * s5_need_more_data leaves the data untouched until more bytes arrive.
+ */
+
+static s5_err_t
+s5_do_handshake(struct context *ctx, uint8_t *data, size_t size, size_t *used) {
     ctx_state_t new_state;
     struct server *s;
-    struct s5_method_request *req;
     struct s5_method_response resp;
-    rps_status_t status;
+    uint8_t nmethods;
 
-    req = (struct s5_method_request *)data;
-    if (req->ver != SOCKS5_VERSION) {
+    /* ver(1) + nmethods(1) + methods(nmethods) */
+    if (size < 1) {
+        return s5_need_more_data;
+    }
+
+    if (data[0] != SOCKS5_VERSION) {
         log_error("s5 client handshake error: bad protocol version.");
-        goto kill;
+        return s5_bad_version;
     }
 
-    /* ver(1) + nmethods(1) + methods(nmethods) */
-    if (size != (size_t)(2 + req->nmethods)) {
-        log_error("s5 client handshake error: junk");
-        goto kill;
+    if (size < 2 || size < (size_t)(2 + data[1])) {
+        return s5_need_more_data;
     }
 
+    nmethods = data[1];
+    *used = 2 + nmethods;
+
     memset(&resp, 0, sizeof(struct s5_method_response));
 
-    resp.ver = req->ver;
+    resp.ver = SOCKS5_VERSION;
 
     s = ctx->sess->server;
     
-    if (string_empty(&s->cfg->username) || string_empty(&s->cfg->password)) {
+    if (!server_auth_required(s) || ctx->sess->rejected) {
         /* If rps didn't assign username and password, 
-         * select auth method dependent on client request 
+         * select auth method dependent on client request.
+         * Rejected sessions skip auth, the overload reply follows the request.
          * */
-        resp.method = s5_select_auth(req);
+        resp.method = s5_select_auth(&data[2], nmethods);
     } else {
         resp.method = s5_auth_passwd;
     }
 
-    status = server_write(ctx, &resp, sizeof(resp));
-    if (status != RPS_OK) {
-        goto kill;
+    if (server_write(ctx, &resp, sizeof(resp)) != RPS_OK) {
+        return s5_auth_error;
     }
 
     switch (resp.method) {
@@ -86,54 +94,52 @@ s5_do_handshake(struct context *ctx, uint8_t *data, size_t size) {
 #endif
     
     ctx->state = new_state;
-    return;
-
-kill:
-    ctx->state=c_kill;
-    server_do_next(ctx);
-    return;
+    return s5_ok;
 }
 
-static void
-s5_do_auth(struct context *ctx, uint8_t *data, size_t size) {
+static s5_err_t
+s5_do_auth(struct context *ctx, uint8_t *data, size_t size, size_t *used) {
     ctx_state_t new_state;
-    struct server *s;
-    struct s5_auth_request *req;
     struct s5_auth_response resp;
-    rps_status_t status;
+    const char *uname, *passwd;
+    uint8_t ulen, plen;
 
-    req = (struct s5_auth_request *)data;
-    if (req->ver != SOCKS5_AUTH_PASSWD_VERSION) {
+    /* ver(1) + ulen(1) + uname(ulen) + plen(1) + passwd(plen) */
+    if (size < 1) {
+        return s5_need_more_data;
+    }
+
+    if (data[0] != SOCKS5_AUTH_PASSWD_VERSION) {
         log_error("s5 client handshake error: bad password auth version.");
-        goto kill;
+        return s5_bad_version;
     } 
 
-    /* Reset the req struct memory layout */
-    req->plen = req->uname[req->ulen];
-    req->uname[req->ulen] = '\0';
-    memcpy(req->passwd, &req->uname[req->ulen+1], req->plen);
-    req->passwd[req->plen] = '\0';
+    if (size < 2 || size < (size_t)(3 + data[1])) {
+        return s5_need_more_data;
+    }
+
+    ulen = data[1];
+    plen = data[2 + ulen];
 
-    /* ver(1) + ulen(1) + uname(ulen) + plen(1) + passwd(plen) */
-    if ((size_t)(3 + req->ulen + req->plen) != size) {
-        log_error("s5 client auth error: junk");
-        goto kill;
+    if (size < (size_t)(3 + ulen + plen)) {
+        return s5_need_more_data;
     }
 
-    if ((strlen((const char *)req->uname) != req->ulen) || 
-        (strlen((const char *)req->passwd) != req->plen)) {
+    *used = 3 + ulen + plen;
+
+    /* checked in place, credentials are not copied */
+    uname = (const char *)&data[2];
+    passwd = (const char *)&data[3 + ulen];
+
+    if (memchr(uname, '\0', ulen) != NULL || memchr(passwd, '\0', plen) != NULL) {
         log_error("s5 client auth error: invalid auth packet");
-        goto kill;
-        
+        return s5_auth_error;
     }
 
-    s = ctx->sess->server;
-
     memset(&resp, 0, sizeof(struct s5_auth_response));
 
     resp.ver = SOCKS5_AUTH_PASSWD_VERSION;
-    if (rps_strcmp(&s->cfg->username, req->uname) == 0 && 
-        rps_strcmp(&s->cfg->password, req->passwd) == 0) {
+    if (server_auth(ctx->sess, uname, ulen, passwd, plen)) {
         resp.status = s5_auth_allow;
         new_state = c_requests;
     } else {
@@ -141,9 +147,8 @@ s5_do_auth(struct context *ctx, uint8_t *data, size_t size) {
         new_state = c_kill;
     }
 
-    status = server_write(ctx, &resp, sizeof(resp));
-    if (status != RPS_OK) {
-        goto kill;
+    if (server_write(ctx, &resp, sizeof(resp)) != RPS_OK) {
+        return s5_auth_error;
     }
 
     if (resp.status ==  s5_auth_allow) {
@@ -153,94 +158,210 @@ s5_do_auth(struct context *ctx, uint8_t *data, size_t size) {
     }
 
     ctx->state = new_state;
-    return;
-
-kill:
-    ctx->state=c_kill;
-    server_do_next(ctx);
-    return;
+    return s5_ok;
 }
 
-static void
-s5_do_request(struct context *ctx, uint8_t *data, size_t size) {
-    uint8_t alen;
-    struct s5_request *req;
+static s5_err_t
+s5_do_request(struct context *ctx, uint8_t *data, size_t size, size_t *used) {
+    size_t alen;
+    uint8_t port[2];
+    uint16_t dport;
     struct s5_in4_response resp;
     char remoteip[MAX_INET_ADDRSTRLEN];
-    int err;
     rps_addr_t  *remote;
 
-    req = (struct s5_request *)data;
-    if (req->ver != SOCKS5_VERSION) {
+    /* ver(1) + cmd(1) + rsv(1) + atyp(1) + daddr(alen) + dport(2) */
+    if (size < 1) {
+        return s5_need_more_data;
+    }
+
+    if (data[0] != SOCKS5_VERSION) {
         log_error("s5 client request error: bad protocol version.");
-        goto kill;
+        return s5_bad_version;
+    }
+
+    if (size < 5) {
+        return s5_need_more_data;
     }
 
     s5_in4_response_init(&resp);
 
-    if (req->cmd != s5_cmd_tcp_connect) {
+    if (data[1] != s5_cmd_tcp_connect) {
         /* Command not supported */
         resp.rep = 0x07;
         server_write(ctx, &resp, sizeof(struct s5_in4_response));
         log_error("s5 client request error: only support tcp connect verify.");
-        goto kill;
+        return s5_bad_cmd;
     }
 
-    remote = &ctx->sess->remote;
-    
-    switch (req->atyp) {
+    switch (data[3]) {
         case s5_atyp_ipv4:
             alen = 4;
-            memcpy(req->dport, &req->daddr[alen], 2);
-            rps_addr_in4(remote, req->daddr, alen, req->dport);
             break;
-
         case s5_atyp_ipv6:
             alen = 16;
-            memcpy(req->dport, &req->daddr[alen], 2);
-            rps_addr_in6(remote, req->daddr, alen, req->dport);
             break;
-
         case s5_atyp_domain:
             /* First byte is hostname length */
-            alen = req->daddr[0]; 
-            /* Last 2 byte is dport */
-            uint16_t port;
-            memcpy(&port, &req->daddr[alen+1], 2);  
-            rps_addr_name(remote, &req->daddr[1], alen, ntohs(port));
+            alen = 1 + data[4];
             break;
-
         default:
             /* Address type not supported */
             resp.rep = 0x08;
             server_write(ctx, &resp, sizeof(struct s5_in4_response));
-            goto kill;
+            return s5_bad_atyp;
     }
 
-    /*
-     * ver(1) + cmd(1) + rsv(1) + atyp(1) +daddr(alen) + dport(2) 
-     * In some case of atyp_domain, alen didn't calculate the last '\0' 
-     * suffix with hostname, in order fix this pattern, so we need size -1.
-     */
-    if ((size_t)(6 + alen) != size && (size_t)(6 + alen) != (size-1)) {
-        log_error("s5 client request error: junk");
-        goto kill;
+    if (size < 6 + alen) {
+        return s5_need_more_data;
     }
 
-    err = rps_unresolve_addr(remote, remoteip);
-    if (err < 0) {
-        goto kill;
+    *used = 6 + alen;
+
+    remote = &ctx->sess->remote;
+    memcpy(port, &data[4 + alen], 2);
+
+    switch (data[3]) {
+        case s5_atyp_ipv4:
+            rps_addr_in4(remote, &data[4], alen, port);
+            break;
+        case s5_atyp_ipv6:
+            rps_addr_in6(remote, &data[4], alen, port);
+            break;
+        case s5_atyp_domain:
+            memcpy(&dport, port, 2);
+            rps_addr_name(remote, &data[5], alen - 1, ntohs(dport));
+            /* 
+             * Some clients append a '\0' to hostname which isn't counted in
+             * its length, skip it if nothing else follows.
+             */
+            if (size == *used + 1 && data[*used] == '\0') {
+                *used += 1;
+            }
+            break;
+    }
+
+    if (rps_unresolve_addr(remote, remoteip) < 0) {
+        return s5_bad_atyp;
     }
     log_debug("Remote %s:%d", remoteip, rps_unresolve_port(remote));
 
     ctx->state = c_exchange;
-    server_do_next(ctx);
+    return s5_ok;
+}
+
+/*
+ * Consume every complete handshake message in the read buffer, optimistic
+ * clients send greeting, auth and request back to back. A partial message
+ * is kept for the next read, so are bytes following the request which are
+ * relayed once the tunnel is established.
+ */
+static void
+s5_do_parse(struct context *ctx) {
+    struct s5_handshake *hs;
+    uint8_t *data;
+    size_t size, pos, used;
+    s5_err_t err;
+
+    hs = (struct s5_handshake *)ctx->req;
+
+    if (hs == NULL) {
+        data = (uint8_t *)ctx->rbuf;
+        size = (size_t)ctx->nread;
+    } else {
+        if (hs->len + (size_t)ctx->nread > sizeof(hs->buf)) {
+            log_error("s5 client handshake error: message too long");
+            goto kill;
+        }
+        memcpy(&hs->buf[hs->len], ctx->rbuf, ctx->nread);
+        hs->len += ctx->nread;
+        data = hs->buf;
+        size = hs->len;
+    }
+
+    pos = 0;
+    err = s5_ok;
+
+    while (err == s5_ok) {
+        used = 0;
+
+        switch (ctx->state) {
+            case c_handshake_req:
+                err = s5_do_handshake(ctx, data + pos, size - pos, &used);
+                break;
+            case c_auth_req:
+                err = s5_do_auth(ctx, data + pos, size - pos, &used);
+                break;
+            case c_requests:
+                err = s5_do_request(ctx, data + pos, size - pos, &used);
+                break;
+            default:
+                /* request done or rejected, the rest is early data */
+                err = s5_need_more_data;
+                continue;
+        }
+
+        pos += used;
+    }
+
+    if (err != s5_need_more_data) {
+        goto kill;
+    }
+
+    if (ctx->state == c_kill) {
+        /* rejected, wait for client closing */
+        return;
+    }
+
+    if (pos < size) {
+        if (hs == NULL) {
+            hs = (struct s5_handshake *)rps_alloc(sizeof(struct s5_handshake));
+            if (hs == NULL) {
+                goto kill;
+            }
+            ctx->req = hs;
+        }
+        memmove(hs->buf, data + pos, size - pos);
+        hs->len = size - pos;
+    } else if (hs != NULL) {
+        hs->len = 0;
+    }
+
+    if (ctx->state == c_exchange) {
+        server_do_next(ctx);
+    }
+
     return;
 
 kill:
-    ctx->state=c_kill;
+    ctx->state = c_kill;
     server_do_next(ctx);
-    return;
+}
+
+/* relay bytes the client sent along with the request */
+static rps_status_t
+s5_flush_early_data(struct context *ctx) {
+    struct s5_handshake *hs;
+    struct session *sess;
+    rps_status_t status;
+
+    hs = (struct s5_handshake *)ctx->req;
+    if (hs == NULL) {
+        return RPS_OK;
+    }
+
+    sess = ctx->sess;
+    status = RPS_OK;
+
+    if (hs->len > 0 && sess->forward != NULL) {
+        status = server_write(sess->forward, hs->buf, hs->len);
+        server_account(sess, hs->len, 0);
+    }
+
+    rps_free(hs);
+    ctx->req = NULL;
+
+    return status;
 }
 
 static void
@@ -274,7 +395,7 @@ s5_do_reply(struct context *ctx, uint8_t *data, size_t size) {
     if (ctx->sess->upstream == NULL) {
         remote = &ctx->sess->remote;
     } else {
-        remote = &ctx->sess->upstream->server;       
+        remote = &ctx->sess->forward->peer;     /* address of the upstream */
     }
 #else
     remote = &ctx->sess->remote;
@@ -326,6 +447,11 @@ s5_do_reply(struct context *ctx, uint8_t *data, size_t size) {
     } else {
         ctx->established = 1;
         ctx->state = c_established;
+        if (s5_flush_early_data(ctx) != RPS_OK) {
+            ctx->state = c_kill;
+            server_do_next(ctx);
+            return;
+        }
     }
 
 #ifdef RPS_DEBUG_OPEN
@@ -343,13 +469,9 @@ s5_server_do_next(struct context *ctx) {
 
     switch (ctx->state) {
         case c_handshake_req:
-            s5_do_handshake(ctx, data, size);
-            break;
         case c_auth_req:
-            s5_do_auth(ctx, data, size);
-            break;
         case c_requests:
-            s5_do_request(ctx, data, size);
+            s5_do_parse(ctx);
             break;
         case c_reply:
             s5_do_reply(ctx, data, size);
@@ -6,6 +6,7 @@
 #include "server.h"
 #include "upstream.h"
 #include "_signal.h"
+#include "snapshot.h"
 
 #include <uv.h>
 
@@ -13,6 +14,11 @@
 #include <stdlib.h>
 #include <getopt.h>
 
+extern char **environ;
+
+/* signal handler only reaches the application by this */
+static struct application *rps_app = NULL;
+
 
 static struct option long_options[] = {
     { "help",        no_argument,        NULL,   'h' },
@@ -65,6 +71,21 @@ rps_init(struct application *app) {
     app->daemon = 0;
     app->verbose = 0;
 
+    app->argv = NULL;
+    app->ready_fd = -1;
+    app->nhandles = 0;
+    app->upgrading = 0;
+    app->upgraded = 0;
+    app->ncrontab = 0;
+
+    /* resolve now, binary may be replaced and cwd changed by daemonize */
+    if (realpath("/proc/self/exe", app->exe) == NULL) {
+        app->exe[0] = '\0';
+    }
+    if (getcwd(app->cwd, PATH_MAX) == NULL) {
+        app->cwd[0] = '\0';
+    }
+
     rps_init_random();
     
     log_init(app->log_level, app->log_filename);
@@ -246,8 +267,8 @@ rps_server_load(struct application *app) {
             goto error;
         }
         
-        status = server_init(s, cfg, &app->upstreams, 
-                app->cfg.servers.rtimeout, app->cfg.servers.ftimeout);
+        status = server_init(s, i, cfg, &app->upstreams, &app->users, &app->cfg.accesslog,
+                &app->cfg.servers);
         if (status != RPS_OK) {
             goto error;
         }
@@ -265,44 +286,56 @@ error:
     return RPS_ERROR;
 }
 
+static void
+rps_crontab_on_stop(uv_async_t *handle) {
+    struct crontab *c;
+
+    c = (struct crontab *)handle->data;
+
+    uv_close((uv_handle_t *)&c->timer, NULL);
+    uv_close((uv_handle_t *)&c->stop, NULL);
+}
+
+static void
+rps_crontab_run(struct crontab *c) {
+    uv_run(&c->loop, UV_RUN_DEFAULT);
+    uv_loop_close(&c->loop);
+}
+
 static void
 rps_add_crontab(struct application *app, uv_timer_cb callback, uint64_t repeat) {
-    uv_loop_t *loop;
-    uv_timer_t *timer;
+    struct crontab *c;
 
-    loop = rps_alloc(sizeof(uv_loop_t));
+    ASSERT(app->ncrontab < RPS_MAX_CRONTAB);
 
-    ASSERT(loop != NULL);
-    
-    uv_loop_init(loop);
+    c = &app->crontabs[app->ncrontab++];
 
-    timer = (uv_timer_t *)rps_alloc(sizeof(*timer));
-    
-    timer->data = &app->upstreams;
+    uv_loop_init(&c->loop);
 
-    uv_timer_init(loop, timer);
-    uv_timer_start(timer, callback, 0, repeat);
+    uv_timer_init(&c->loop, &c->timer);
+    c->timer.data = &app->upstreams;
+    uv_timer_start(&c->timer, callback, 0, repeat);
 
-    uv_run(loop, UV_RUN_DEFAULT);
+    uv_async_init(&c->loop, &c->stop, rps_crontab_on_stop);
+    c->stop.data = c;
 
-    uv_loop_close(loop);
-    uv_loop_delete(loop);
-    rps_free(loop);
-    rps_free(timer);
+    uv_thread_create(&c->tid, (uv_thread_cb)rps_crontab_run, c);
 }
 
+/* Stop periodic jobs, a job running is waited for. */
 static void
-rps_upstreams_refresh(struct application *app) {
-    rps_add_crontab(app, 
-            (uv_timer_cb)upstreams_refresh, 
-            app->cfg.upstreams.refresh);
-}
+rps_stop_crontabs(struct application *app) {
+    uint32_t i;
 
-static void
-rps_upstreams_stats(struct application *app) {
-    rps_add_crontab(app, 
-            (uv_timer_cb)upstreams_stats, 
-            app->cfg.upstreams.stats);
+    for (i = 0; i < app->ncrontab; i++) {
+        uv_async_send(&app->crontabs[i].stop);
+    }
+
+    for (i = 0; i < app->ncrontab; i++) {
+        uv_thread_join(&app->crontabs[i].tid);
+    }
+
+    app->ncrontab = 0;
 }
 
 static void
@@ -313,6 +346,7 @@ rps_teardown(struct application *app) {
     array_deinit(&app->servers);
 
 	upstreams_deinit(&app->upstreams);
+    users_deinit(&app->users);
     config_deinit(&app->cfg);
 	log_deinit();
 }
@@ -354,7 +388,8 @@ rps_remove_pidfile(struct application *app) {
 static rps_status_t
 rps_pre_run(struct application *app) {
     
-    if (app->daemon) {
+    /* inherited process is detached already if the old one was */
+    if (app->daemon && getenv(RPS_ENV_LISTEN_FDS) == NULL) {
         rps_daemonize();
     }
 
@@ -369,46 +404,489 @@ rps_pre_run(struct application *app) {
     return RPS_OK;
 }
 
+/* 
+ * Take over what the old process handed over on restart, 
+ * must be called before servers start.
+ */
 static void
-rps_run(struct application *app) {
+rps_inherit(struct application *app) {
+    char *env, *p, *end;
+    int fd;
     uint32_t i, n;
     struct server *s;
+
+    env = getenv(RPS_ENV_SNAPSHOT_FD);
+    if (env != NULL) {
+        fd = atoi(env);
+        if (snapshot_read(&app->upstreams, fd) != RPS_OK) {
+            log_warn("restore upstreams from inherited snapshot failed");
+        }
+        close(fd);
+    }
+
+    env = getenv(RPS_ENV_LISTEN_FDS);
+    if (env != NULL) {
+        n = array_n(&app->servers);
+        for (p = env; *p != '\0'; p = end) {
+            fd = (int)strtol(p, &end, 10);
+            if (end == p) {
+                break;
+            }
+            if (*end == ',') {
+                end++;
+            }
+
+            for (i = 0; i < n; i++) {
+                s = (struct server *)array_get(&app->servers, i);
+                if (s->fd < 0 && server_inherit(s, fd) == RPS_OK) {
+                    fcntl(fd, F_SETFD, FD_CLOEXEC);
+                    break;
+                }
+            }
+
+            if (i == n) {
+                /* listener removed from configuration */
+                log_notice("close inherited listener fd %d", fd);
+                close(fd);
+            }
+        }
+    }
+
+    env = getenv(RPS_ENV_READY_FD);
+    if (env != NULL) {
+        app->ready_fd = atoi(env);
+        fcntl(app->ready_fd, F_SETFD, FD_CLOEXEC);
+    }
+
+    unsetenv(RPS_ENV_SNAPSHOT_FD);
+    unsetenv(RPS_ENV_LISTEN_FDS);
+    unsetenv(RPS_ENV_READY_FD);
+}
+
+/* tell the old process we are serving, it stops accepting then */
+static void
+rps_notify_ready(struct application *app) {
+    uint32_t i;
+
+    if (app->ready_fd < 0) {
+        return;
+    }
+
+    for (i = 0; i < array_n(&app->servers); i++) {
+        uv_sem_wait(&app->listening);
+    }
+
+    if (write(app->ready_fd, "1", 1) < 0) {
+        log_error("notify old process failed: %s", strerror(errno));
+    }
+
+    close(app->ready_fd);
+    app->ready_fd = -1;
+}
+
+void
+rps_restart(void) {
+    /* async-signal-safe */
+    if (rps_app != NULL) {
+        uv_async_send(&rps_app->restart);
+    }
+}
+
+void
+rps_dump(void) {
+    /* async-signal-safe */
+    if (rps_app != NULL) {
+        uv_async_send(&rps_app->dump);
+    }
+}
+
+static void
+rps_on_dump(uv_async_t *handle) {
+    struct application *app;
+    struct server *s;
+    struct user *u;
+    struct traffic_slot t;
+    uint32_t i;
+    int j, len;
+    char expired[256];
+
+    app = (struct application *)handle->data;
+
+    upstreams_dump(&app->upstreams);
+    memstat_dump();
+
+    /* counters are written by server threads, totals may lag a little */
+    for (i = 0; i < array_n(&app->servers); i++) {
+        s = (struct server *)array_get(&app->servers, i);
+        log_notice("%s server %d sessions: %llu, active: %lld, up: %llu bytes, down: %llu bytes",
+                rps_proto_str(s->proto), rps_unresolve_port(&s->listen), 
+                (unsigned long long)s->traffic.sessions, (long long)s->traffic.active,
+                (unsigned long long)s->traffic.nup, (unsigned long long)s->traffic.ndown);
+
+        len = 0;
+        for (j = 0; j < p_max && len < (int)sizeof(expired); j++) {
+            len += snprintf(expired + len, sizeof(expired) - len, "%s%s: %llu", 
+                    j > 0 ? ", " : "", ctx_phase_str(j), (unsigned long long)s->expired[j]);
+        }
+        log_notice("%s server %d timeouts %s", rps_proto_str(s->proto), 
+                rps_unresolve_port(&s->listen), expired);
+    }
+
+    /* reloads run on this loop too, the table does not change under us */
+    for (i = 0; i < app->users.n; i++) {
+        u = app->users.users[i];
+        traffic_sum(u->traffic, &t);
+        log_notice("user %s%s sessions: %llu, active: %lld, up: %llu bytes, down: %llu bytes",
+                u->uname.data, u->disabled ? " (disabled)" : "", 
+                (unsigned long long)t.sessions, (long long)t.active,
+                (unsigned long long)t.nup, (unsigned long long)t.ndown);
+    }
+}
+
+void
+rps_reload(void) {
+    /* async-signal-safe */
+    if (rps_app != NULL) {
+        uv_async_send(&rps_app->reload);
+    }
+}
+
+static void
+rps_on_reload(uv_async_t *handle) {
+    struct application *app;
+
+    app = (struct application *)handle->data;
+
+    users_reload(&app->users);
+}
+
+static void
+rps_on_child_close(uv_handle_t *handle) {
+    struct application *app;
+
+    app = (struct application *)handle->data;
+
+    app->nhandles--;
+    if (app->nhandles == 0 && !app->upgraded) {
+        /* restart aborted, ready for another try */
+        app->upgrading = 0;
+    }
+}
+
+static void
+rps_on_child_exit(uv_process_t *process, int64_t exit_status, int term_signal) {
+    struct application *app;
+
+    app = (struct application *)process->data;
+
+    if (!app->upgraded) {
+        log_error("new process %d exited before ready (status: %d, signal: %d), restart aborted", 
+                process->pid, (int)exit_status, term_signal);
+    }
+
+    if (!uv_is_closing((uv_handle_t *)process)) {
+        uv_close((uv_handle_t *)process, rps_on_child_close);
+    }
+}
+
+static void
+rps_on_child_alloc(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
+    static char slot[8];
+
+    UNUSED(handle);
+    UNUSED(suggested_size);
+
+    buf->base = slot;
+    buf->len = sizeof(slot);
+}
+
+static void
+rps_on_child_ready(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf) {
+    struct application *app;
+    struct server *s;
+    uint32_t i;
+
+    UNUSED(buf);
+
+    app = (struct application *)stream->data;
+
+    if (nread == 0) {
+        return;
+    }
+
+    if (nread < 0) {
+        uv_close((uv_handle_t *)stream, rps_on_child_close);
+        return;
+    }
+
+    app->upgraded = 1;
+
+    log_notice("new process %d is ready, process %d stop serving", app->child.pid, app->pid);
+
+    uv_close((uv_handle_t *)stream, rps_on_child_close);
+    if (!uv_is_closing((uv_handle_t *)&app->child)) {
+        uv_close((uv_handle_t *)&app->child, rps_on_child_close);
+    }
+    uv_close((uv_handle_t *)&app->restart, NULL);
+    uv_close((uv_handle_t *)&app->dump, NULL);
+    uv_close((uv_handle_t *)&app->reload, NULL);
+
+    /* the new process refreshes, posts stats and writes snapshots from now on */
+    rps_stop_crontabs(app);
+
+    for (i = 0; i < array_n(&app->servers); i++) {
+        s = (struct server *)array_get(&app->servers, i);
+        server_drain(s, app->cfg.servers.drain);
+    }
+}
+
+static char **
+rps_child_env(char *listen_fds, char *snapshot_fd, char *ready_fd) {
+    char **env, **e;
+    size_t n;
+
+    for (n = 0, e = environ; *e != NULL; e++, n++);
+
+    env = rps_alloc((n + 4) * sizeof(char *));
+    if (env == NULL) {
+        return NULL;
+    }
+
+    for (n = 0, e = environ; *e != NULL; e++) {
+        if (strncmp(*e, "RPS_", 4) == 0 && (
+                strncmp(*e, RPS_ENV_LISTEN_FDS "=", sizeof(RPS_ENV_LISTEN_FDS)) == 0 ||
+                strncmp(*e, RPS_ENV_SNAPSHOT_FD "=", sizeof(RPS_ENV_SNAPSHOT_FD)) == 0 ||
+                strncmp(*e, RPS_ENV_READY_FD "=", sizeof(RPS_ENV_READY_FD)) == 0)) {
+            continue;
+        }
+        env[n++] = *e;
+    }
+
+    env[n++] = listen_fds;
+    env[n++] = snapshot_fd;
+    env[n++] = ready_fd;
+    env[n] = NULL;
+
+    return env;
+}
+
+/*
+ * Start the new process with the same arguments: the binary on disk and the 
+ * configuration file are reloaded. Child fds are laid out as
+ * stdin, stdout, stderr, listeners..., snapshot, ready pipe.
+ */
+static rps_status_t
+rps_spawn(struct application *app) {
+    char listen_fds[RPS_ENV_MAX_LENGTH];
+    char snapshot_fd[RPS_ENV_MAX_LENGTH];
+    char ready_fd[RPS_ENV_MAX_LENGTH];
+    char path[] = RPS_SNAPSHOT_TEMPLATE;
+    uv_stdio_container_t *stdio;
+    uv_process_options_t options;
+    char **env;
+    struct server *s;
+    uint32_t i, n, nstdio;
+    int fd, len, err;
+    uv_os_fd_t lfd;
+    rps_status_t status;
+
+    if (app->exe[0] == '\0') {
+        log_error("restart failed, executable path unknown");
+        return RPS_ERROR;
+    }
+
+    n = array_n(&app->servers);
+    nstdio = 3 + n + 2;
+
+    stdio = rps_alloc(nstdio * sizeof(*stdio));
+    if (stdio == NULL) {
+        return RPS_ENOMEM;
+    }
+
+    env = NULL;
+    fd = -1;
+    status = RPS_ERROR;
+
+    for (i = 0; i < 3; i++) {
+        stdio[i].flags = UV_INHERIT_FD;
+        stdio[i].data.fd = i;
+    }
+
+    len = snprintf(listen_fds, sizeof(listen_fds), "%s=", RPS_ENV_LISTEN_FDS);
+    for (i = 0; i < n; i++) {
+        s = (struct server *)array_get(&app->servers, i);
+        if (uv_fileno((uv_handle_t *)&s->us, &lfd) != 0) {
+            log_error("restart failed, %s proxy on port %d is not listening", 
+                    s->cfg->proto.data, s->cfg->port);
+            goto done;
+        }
+        stdio[3 + i].flags = UV_INHERIT_FD;
+        stdio[3 + i].data.fd = lfd;
+        len += snprintf(listen_fds + len, sizeof(listen_fds) - len, 
+                i == 0 ? "%d" : ",%d", 3 + i);
+    }
+
+    fd = mkstemp(path);
+    if (fd < 0) {
+        log_error("create snapshot %s failed: %s", path, strerror(errno));
+        goto done;
+    }
+    unlink(path);
+
+    if (snapshot_write(&app->upstreams, fd) != RPS_OK) {
+        goto done;
+    }
+    stdio[3 + n].flags = UV_INHERIT_FD;
+    stdio[3 + n].data.fd = fd;
+    snprintf(snapshot_fd, sizeof(snapshot_fd), "%s=%d", RPS_ENV_SNAPSHOT_FD, 3 + n);
+
+    uv_pipe_init(&app->loop, &app->ready, 0);
+    app->ready.data = app;
+    stdio[4 + n].flags = UV_CREATE_PIPE | UV_WRITABLE_PIPE;
+    stdio[4 + n].data.stream = (uv_stream_t *)&app->ready;
+    snprintf(ready_fd, sizeof(ready_fd), "%s=%d", RPS_ENV_READY_FD, 4 + n);
+
+    env = rps_child_env(listen_fds, snapshot_fd, ready_fd);
+    if (env == NULL) {
+        uv_close((uv_handle_t *)&app->ready, NULL);
+        goto done;
+    }
+
+    memset(&options, 0, sizeof(options));
+    options.exit_cb = rps_on_child_exit;
+    options.file = app->exe;
+    options.args = app->argv;
+    options.env = env;
+    options.cwd = app->cwd[0] != '\0' ? app->cwd : NULL;
+    options.stdio_count = nstdio;
+    options.stdio = stdio;
+
+    app->child.data = app;
+
+    err = uv_spawn(&app->loop, &app->child, &options);
+    if (err) {
+        UV_SHOW_ERROR(err, "spawn new process");
+        uv_close((uv_handle_t *)&app->ready, NULL);
+        goto done;
+    }
+
+    app->nhandles = 2;
+    uv_read_start((uv_stream_t *)&app->ready, rps_on_child_alloc, rps_on_child_ready);
+
+    log_notice("spawn new process %d (%s)", app->child.pid, app->exe);
+
+    status = RPS_OK;
+
+done:
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (env != NULL) {
+        rps_free(env);
+    }
+    rps_free(stdio);
+
+    return status;
+}
+
+static void
+rps_on_restart(uv_async_t *handle) {
+    struct application *app;
+
+    app = (struct application *)handle->data;
+
+    if (app->upgrading) {
+        log_warn("restart is in progress");
+        return;
+    }
+
+    if (rps_spawn(app) != RPS_OK) {
+        log_error("restart failed, keep serving");
+        return;
+    }
+
+    app->upgrading = 1;
+}
+
+static void
+rps_run(struct application *app) {
+    uint32_t i;
+    struct server *s;
     rps_status_t status;
     uv_thread_t *tid;
     rps_array_t threads;
 
-    upstreams_init(&app->upstreams, &app->cfg.api, &app->cfg.upstreams);
+    upstreams_init(&app->upstreams, &app->cfg.api, &app->cfg.upstreams, 
+            array_n(app->cfg.servers.ss));
+
+    status = users_init(&app->users, app->cfg.users, &app->cfg.users_file, 
+            array_n(app->cfg.servers.ss));
+    if (status != RPS_OK) {
+        return;
+    }
 
     status = rps_server_load(app);
     if (status != RPS_OK) {
         return;
     }
 
-    n = array_n(&app->servers) + 1; // Add 1 upstream auto-refresh thread
-    
-    status = array_init(&threads, n , sizeof(uv_thread_t));   
+    rps_inherit(app);
+
+    /* warm start, serve at once and reconcile with api in background */
+    if (!app->upstreams.once && !string_empty(&app->upstreams.snapshot)) {
+        snapshot_load(&app->upstreams, (char *)app->upstreams.snapshot.data);
+    }
+
+    uv_loop_init(&app->loop);
+    uv_async_init(&app->loop, &app->restart, rps_on_restart);
+    app->restart.data = app;
+    uv_async_init(&app->loop, &app->dump, rps_on_dump);
+    app->dump.data = app;
+    uv_async_init(&app->loop, &app->reload, rps_on_reload);
+    app->reload.data = app;
+    uv_sem_init(&app->listening, 0);
+    rps_app = app;
+
+    status = array_init(&threads, array_n(&app->servers), sizeof(uv_thread_t));   
     if (status != RPS_OK) {
         return;
     }
 
-    tid = (uv_thread_t *)array_push(&threads);
-    uv_thread_create(tid, (uv_thread_cb)rps_upstreams_refresh, app);
-    
-    tid = (uv_thread_t *)array_push(&threads);
-    uv_thread_create(tid, (uv_thread_cb)rps_upstreams_stats, app);
+    rps_add_crontab(app, (uv_timer_cb)upstreams_refresh, app->cfg.upstreams.refresh);
+    rps_add_crontab(app, (uv_timer_cb)upstreams_stats, app->cfg.upstreams.stats);
+    rps_add_crontab(app, (uv_timer_cb)upstreams_expire, UPSTREAM_EXPIRE_INTERVAL);
+
+    if (!string_empty(&app->upstreams.snapshot)) {
+        rps_add_crontab(app, (uv_timer_cb)snapshot_persist, 
+                app->cfg.upstreams.snapshot_interval);
+    }
     
     for (i = 0; i < array_n(&app->servers); i++) {
         tid = (uv_thread_t *)array_push(&threads);
         s = (struct server *)array_get(&app->servers, i);
+        if (app->ready_fd >= 0) {
+            s->listening = &app->listening;
+        }
         uv_thread_create(tid, (uv_thread_cb)server_run, s);
     }
 
+    rps_notify_ready(app);
+
+    /* serve restart requests, return once replaced by a new process */
+    uv_run(&app->loop, UV_RUN_DEFAULT);
+
     while(array_n(&threads)) {
         uv_thread_join((uv_thread_t *)array_pop(&threads));
     }   
-
     array_deinit(&threads);
 
+    rps_stop_crontabs(app);
+
+    if (app->upgraded) {
+        log_notice("process %d exit, replaced by %d", app->pid, app->child.pid);
+        return;
+    }
+
     rps_teardown(app);
 }
 
@@ -425,6 +903,7 @@ main(int argc, char **argv) {
     rps_status_t status;
 
     rps_init(&app);
+    app.argv = argv;
 
     status = rps_get_options(argc, argv, &app);
     if (status != RPS_OK) {
@@ -457,6 +936,11 @@ main(int argc, char **argv) {
 
     rps_run(&app);
 
+    if (app.upgraded) {
+        /* pidfile belongs to the new process now */
+        exit(0);
+    }
+
     rps_post_run(&app);
 
     exit(1);
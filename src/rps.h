@@ -4,7 +4,11 @@
 #include "core.h"
 #include "array.h"
 #include "config.h"
+#include "users.h"
 
+#include <uv.h>
+
+#include <limits.h>
 #include <sys/types.h>
 
 #define RPS_VERSION "0.1.2"
@@ -19,12 +23,36 @@
 #define RPS_DEFAULT_PID_FILE        NULL
 #define RPS_PID_MAX_LENGTH          16
 
+/* 
+ * Hot restart, the new process is handed over by the old one: 
+ * listening sockets, an upstream snapshot and a pipe to report readiness.
+ */
+#define RPS_ENV_LISTEN_FDS          "RPS_LISTEN_FDS"
+#define RPS_ENV_SNAPSHOT_FD         "RPS_SNAPSHOT_FD"
+#define RPS_ENV_READY_FD            "RPS_READY_FD"
+#define RPS_SNAPSHOT_TEMPLATE       "/tmp/rps-snapshot-XXXXXX"
+#define RPS_ENV_MAX_LENGTH          256
+
+#define RPS_MAX_CRONTAB             4
+
+/* periodic upstream job, a loop and a thread of its own */
+struct crontab {
+    uv_thread_t             tid;
+    uv_loop_t               loop;
+    uv_timer_t              timer;
+    uv_async_t              stop;
+};
 
 struct application {
     rps_array_t             servers;
 
     struct upstreams        upstreams;
 
+    struct users            users;
+
+    struct crontab          crontabs[RPS_MAX_CRONTAB];
+    uint32_t                ncrontab;
+
     int                     log_level;
     char                    *log_filename;
     pid_t                   pid;
@@ -33,8 +61,28 @@ struct application {
     struct config           cfg;
     unsigned                daemon:1;
     unsigned                verbose:1;
+
+    /* hot restart */
+    char                    **argv;
+    char                    exe[PATH_MAX];
+    char                    cwd[PATH_MAX];
+    uv_loop_t               loop;
+    uv_async_t              restart;
+    uv_async_t              dump;       /* dump upstream states */
+    uv_async_t              reload;     /* read users file again */
+    uv_process_t            child;
+    uv_pipe_t               ready;      /* readiness of child */
+    uint32_t                nhandles;   /* child handles not closed yet */
+    int                     ready_fd;   /* readiness to parent, -1 if none */
+    uv_sem_t                listening;
+    unsigned                upgrading:1;
+    unsigned                upgraded:1;
 };
 
+void rps_restart(void);
+void rps_dump(void);
+void rps_reload(void);
+
 
 
 #endif
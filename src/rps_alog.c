@@ -0,0 +1,220 @@
+/*
+ * rps-alog: decode binary access log segments into csv or json lines.
+ *
+ * Usage: rps-alog [-f csv|json] segment.alog [segment.alog ...]
+ */
+#include "core.h"
+#include "accesslog.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+enum alog_format {
+    alog_csv,
+    alog_json,
+};
+
+static void
+alog_show_usage() {
+    fprintf(stderr,
+        "Usage: rps-alog [-f csv|json] segment.alog [segment.alog ...]\n"
+        "Options:\n"
+        "   -h, --help           :this help\n"
+        "   -f, --format=S       :output format, csv or json (default: csv)\n");
+    exit(1);
+}
+
+static void
+alog_addr(uint8_t family, uint8_t *addr, char *dst, size_t size) {
+    switch (family) {
+    case 4:
+        inet_ntop(AF_INET, addr, dst, size);
+        break;
+    case 6:
+        inet_ntop(AF_INET6, addr, dst, size);
+        break;
+    default:
+        dst[0] = '\0';
+        break;
+    }
+}
+
+static void
+alog_time(uint64_t us, char *dst, size_t size) {
+    time_t sec;
+    struct tm tm;
+    char datetime[32];
+
+    sec = (time_t)(us / 1000000);
+    gmtime_r(&sec, &tm);
+    strftime(datetime, sizeof(datetime), "%Y-%m-%dT%H:%M:%S", &tm);
+    snprintf(dst, size, "%s.%06uZ", datetime, (unsigned)(us % 1000000));
+}
+
+static void
+alog_csv_header() {
+    printf("start,duration,proto,client,client_port,remote_hash,remote_port,"
+            "upstream_proto,upstream,upstream_port,request,connect,establish,"
+            "retry,reconn,reply_code,established,success,bytes_up,bytes_down\n");
+}
+
+static void
+alog_print(struct accesslog_record *rec, enum alog_format format) {
+    char start[64];
+    char client[INET6_ADDRSTRLEN];
+    char upstream[INET6_ADDRSTRLEN];
+    int established, success;
+
+    alog_time(rec->start, start, sizeof(start));
+    alog_addr(rec->client_family, rec->client, client, sizeof(client));
+    alog_addr(rec->upstream_family, rec->upstream, upstream, sizeof(upstream));
+
+    established = (rec->flags & ACCESSLOG_F_ESTABLISHED) ? 1 : 0;
+    success = (rec->flags & ACCESSLOG_F_SUCCESS) ? 1 : 0;
+
+    if (format == alog_csv) {
+        printf("%s,%llu,%s,%s,%u,%08x,%u,%s,%s,%u,%u,%u,%u,%u,%u,%d,%d,%d,%llu,%llu\n",
+                start, (unsigned long long)rec->duration, rps_proto_str(rec->proto),
+                client, rec->client_port, rec->remote_hash, rec->remote_port,
+                rps_proto_str(rec->upstream_proto), upstream, rec->upstream_port,
+                rec->request, rec->connect, rec->establish,
+                rec->retry, rec->reconn, rec->reply_code, established, success,
+                (unsigned long long)rec->nup, (unsigned long long)rec->ndown);
+    } else {
+        printf("{\"start\": \"%s\", \"duration\": %llu, \"proto\": \"%s\", "
+                "\"client\": \"%s\", \"client_port\": %u, "
+                "\"remote_hash\": \"%08x\", \"remote_port\": %u, "
+                "\"upstream_proto\": \"%s\", \"upstream\": \"%s\", \"upstream_port\": %u, "
+                "\"request\": %u, \"connect\": %u, \"establish\": %u, "
+                "\"retry\": %u, \"reconn\": %u, \"reply_code\": %d, "
+                "\"established\": %s, \"success\": %s, "
+                "\"bytes_up\": %llu, \"bytes_down\": %llu}\n",
+                start, (unsigned long long)rec->duration, rps_proto_str(rec->proto),
+                client, rec->client_port, rec->remote_hash, rec->remote_port,
+                rps_proto_str(rec->upstream_proto), upstream, rec->upstream_port,
+                rec->request, rec->connect, rec->establish,
+                rec->retry, rec->reconn, rec->reply_code,
+                established ? "true" : "false", success ? "true" : "false",
+                (unsigned long long)rec->nup, (unsigned long long)rec->ndown);
+    }
+}
+
+static int
+alog_decode(const char *fname, enum alog_format format) {
+    int fd;
+    void *p;
+    struct stat st;
+    uint32_t i, count;
+    struct accesslog_header *header;
+    struct accesslog_record *rec;
+
+    fd = open(fname, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "open '%s' failed: %s\n", fname, strerror(errno));
+        return -1;
+    }
+
+    if (fstat(fd, &st) < 0) {
+        fprintf(stderr, "stat '%s' failed: %s\n", fname, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    if ((size_t)st.st_size < sizeof(*header)) {
+        fprintf(stderr, "'%s' is not an access log segment\n", fname);
+        close(fd);
+        return -1;
+    }
+
+    p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        fprintf(stderr, "mmap '%s' failed: %s\n", fname, strerror(errno));
+        return -1;
+    }
+
+    header = (struct accesslog_header *)p;
+
+    if (memcmp(header->magic, ACCESSLOG_MAGIC, sizeof(ACCESSLOG_MAGIC)) != 0 ||
+            header->version != ACCESSLOG_VERSION ||
+            header->record_size != sizeof(struct accesslog_record)) {
+        fprintf(stderr, "'%s' is not an access log segment of version %d\n",
+                fname, ACCESSLOG_VERSION);
+        munmap(p, st.st_size);
+        return -1;
+    }
+
+    /* Segment may still be written or truncated, trust the file size */
+    count = MIN(header->count,
+            (st.st_size - sizeof(*header)) / sizeof(struct accesslog_record));
+
+    rec = (struct accesslog_record *)(header + 1);
+    for (i = 0; i < count; i++) {
+        alog_print(&rec[i], format);
+    }
+
+    munmap(p, st.st_size);
+
+    return 0;
+}
+
+int
+main(int argc, char **argv) {
+    int c, i, rc;
+    enum alog_format format;
+
+    static struct option long_options[] = {
+        { "help",   no_argument,        NULL,   'h' },
+        { "format", required_argument,  NULL,   'f' },
+        {  NULL,    0,                  NULL,    0  }
+    };
+
+    format = alog_csv;
+
+    for (;;) {
+        c = getopt_long(argc, argv, "hf:", long_options, NULL);
+        if (c == -1) {
+            break;
+        }
+
+        switch (c) {
+        case 'f':
+            if (strcmp(optarg, "csv") == 0) {
+                format = alog_csv;
+            } else if (strcmp(optarg, "json") == 0) {
+                format = alog_json;
+            } else {
+                alog_show_usage();
+            }
+            break;
+        case 'h':
+        default:
+            alog_show_usage();
+        }
+    }
+
+    if (optind >= argc) {
+        alog_show_usage();
+    }
+
+    if (format == alog_csv) {
+        alog_csv_header();
+    }
+
+    rc = 0;
+    for (i = optind; i < argc; i++) {
+        if (alog_decode(argv[i], format) != 0) {
+            rc = 1;
+        }
+    }
+
+    return rc;
+}
@@ -0,0 +1,894 @@
+/*
+ * rps-check: verify upstream proxies of the pool api concurrently.
+ *
+ * Every upstream is connected, handshaked with the same client state
+ * machines rps uses toward upstreams (proto/ *_client.c), then a request is
+ * sent to the target through it. Connect, handshake and payload round trip
+ * latencies are committed back to the pool api in bulk.
+ *
+ * The proto clients drive a context through server_write and server_do_next,
+ * rps-check provides both instead of server.c, on a single libuv loop.
+ *
+ * Usage: rps-check -c conf/rps.yml [-t host:port] [-u path] [-n concurrency]
+ */
+#include "core.h"
+#include "log.h"
+#include "config.h"
+#include "util.h"
+#include "server.h"
+#include "upstream.h"
+#include "proto/s5.h"
+#include "proto/http.h"
+#include "proto/http_proxy.h"
+#include "proto/http_tunnel.h"
+
+#include <uv.h>
+#include <jansson.h>
+#include <curl/curl.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <arpa/inet.h>
+#include <sys/resource.h>
+
+#define CHECK_DEFAULT_CONFIG_FILE   "conf/rps.yml"
+#define CHECK_DEFAULT_TARGET        "www.baidu.com:80"
+#define CHECK_DEFAULT_PATH          "/"
+#define CHECK_DEFAULT_CONCURRENCY   5000
+#define CHECK_DEFAULT_TIMEOUT       10000   /* ms */
+#define CHECK_COMMIT_BATCH          1000    /* results per api request */
+#define CHECK_PAYLOAD_MAX_LENGTH    1024
+
+struct check_result {
+    struct upstream     *upstream;
+    const char          *error;     /* NULL if passed */
+    uint32_t            connect;    /* us */
+    uint32_t            handshake;
+    uint32_t            rtt;
+};
+
+struct check {
+    struct context      ctx;        /* forward context, driven by proto client */
+    struct session      sess;
+    struct http_request req;        /* request of http and http_tunnel client */
+    char                rbuf[READ_BUF_SIZE];
+    struct check_result *result;
+    uint64_t            start;      /* ns */
+    uint64_t            connected;
+    uint64_t            sent;       /* payload sent */
+    unsigned            status:1;   /* payload response status line verified */
+    unsigned            done:1;
+};
+
+struct checker {
+    struct server       server;     /* loop, wheel and upstreams of contexts */
+    struct context      request;    /* req points to request of running check */
+    struct upstreams    upstreams;
+    struct config       cfg;
+
+    char                *config_filename;
+    char                *target;
+    char                *path;
+    char                *expect;    /* required in response, may be NULL */
+    uint32_t            concurrency;
+    uint32_t            timeout;
+    unsigned            dry_run:1;
+    unsigned            verbose:1;
+
+    rps_addr_t          remote;
+    char                host[MAX_HOSTNAME_LEN];
+    uint16_t            port;
+    char                payload[CHECK_PAYLOAD_MAX_LENGTH];
+    int                 payload_len;
+
+    rps_array_t         pools;      /* rps_hashmap_t of checked upstreams */
+    rps_array_t         results;
+    uint32_t            next;
+    uint32_t            inflight;
+    uint64_t            start;
+};
+
+static struct checker checker;
+
+static void check_finish(struct check *c, const char *error);
+
+static void
+check_show_usage() {
+    fprintf(stderr,
+        "Usage: rps-check -c conf/rps.yml [-t host:port] [-u path] [-e string]\n"
+        "                 [-n concurrency] [-T ms] [-D] [-v]\n"
+        "Options:\n"
+        "   -h, --help           :this help\n"
+        "   -c, --config=S       :rps configuration, api and pools (default: %s)\n"
+        "   -t, --target=S       :remote requested through upstreams (default: %s)\n"
+        "   -u, --path=S         :path of http request to target (default: %s)\n"
+        "   -e, --expect=S       :string required in response (default: none)\n"
+        "   -n, --concurrency=N  :upstreams checked at the same time (default: %d)\n"
+        "   -T, --timeout=N      :max time of a check in ms (default: %d)\n"
+        "   -D, --dry-run        :don't commit results to api\n"
+        "   -v, --verbose        :print every result\n",
+        CHECK_DEFAULT_CONFIG_FILE, CHECK_DEFAULT_TARGET, CHECK_DEFAULT_PATH,
+        CHECK_DEFAULT_CONCURRENCY, CHECK_DEFAULT_TIMEOUT);
+    exit(1);
+}
+
+static rps_status_t
+check_parse_target(struct checker *ck) {
+    char *sep;
+    int port;
+    struct in6_addr in6;
+
+    sep = strrchr(ck->target, ':');
+    if (sep == NULL || (size_t)(sep - ck->target) >= sizeof(ck->host)) {
+        return RPS_ERROR;
+    }
+
+    port = atoi(sep + 1);
+    if (port <= 0 || !rps_valid_port(port)) {
+        return RPS_ERROR;
+    }
+
+    memcpy(ck->host, ck->target, sep - ck->target);
+    ck->host[sep - ck->target] = '\0';
+    ck->port = (uint16_t)port;
+
+    /* domain is resolved by upstreams */
+    if (inet_pton(AF_INET, ck->host, &in6) == 1 || inet_pton(AF_INET6, ck->host, &in6) == 1) {
+        return rps_resolve_inet(ck->host, ck->port, &ck->remote) == 0 ? RPS_OK : RPS_ERROR;
+    }
+
+    rps_addr_name(&ck->remote, (uint8_t *)ck->host, strlen(ck->host), ck->port);
+
+    return RPS_OK;
+}
+
+static uint32_t
+check_elapsed(uint64_t from) {
+    return (uint32_t)((uv_hrtime() - from) / 1000);
+}
+
+static struct check *
+check_of(struct context *ctx) {
+    return (struct check *)((char *)ctx - offsetof(struct check, ctx));
+}
+
+static void
+check_request_init(struct checker *ck, struct check *c) {
+    char uri[HTTP_HEADER_MAX_VALUE_LENGTH];
+    int len;
+
+    http_request_init(&c->req);
+    c->req.method = http_get;
+    c->req.port = ck->port;
+    string_duplicate(&c->req.host, ck->host, strlen(ck->host));
+    string_duplicate(&c->req.version, "HTTP/1.1", sizeof("HTTP/1.1") - 1);
+    len = snprintf(uri, sizeof(uri), "http://%s:%d%s", ck->host, ck->port, ck->path);
+    string_duplicate(&c->req.full_uri, uri, len);
+    len = snprintf(uri, sizeof(uri), "%s:%d", ck->host, ck->port);
+    hashmap_set(&c->req.headers, (void *)"Host", 4, (void *)uri, len);
+}
+
+/* enter the proto client, http clients take the request from sess->request */
+static void
+check_do_next(struct context *ctx) {
+    checker.request.req = &check_of(ctx)->req;
+    ctx->do_next(ctx);
+    checker.request.req = NULL;
+}
+
+static void
+check_on_write_done(uv_write_t *req, int status) {
+    struct context *ctx;
+
+    ctx = (struct context *)req->data;
+    rps_free(req);
+
+    if (status < 0 && status != UV_ECANCELED) {
+        check_finish(check_of(ctx), "write");
+    }
+}
+
+rps_status_t
+server_writev(struct context *ctx, const uv_buf_t *bufs, unsigned int nbufs, 
+        uint32_t inplace) {
+    uv_write_t *req;
+    uv_buf_t buf;
+    unsigned int i;
+    size_t len;
+
+    len = 0;
+    for (i = 0; i < nbufs; i++) {
+        len += bufs[i].len;
+    }
+
+    ASSERT(len > 0);
+
+    /* the message follows the request, freed together */
+    req = (uv_write_t *)rps_alloc(sizeof(uv_write_t) + len);
+    if (req == NULL) {
+        return RPS_ENOMEM;
+    }
+    req->data = ctx;
+
+    buf.base = (char *)(req + 1);
+    buf.len = 0;
+    for (i = 0; i < nbufs; i++) {
+        if (bufs[i].len > 0) {
+            memcpy(buf.base + buf.len, bufs[i].base, bufs[i].len);
+            buf.len += bufs[i].len;
+        }
+    }
+
+    if (uv_write(req, &ctx->handle.stream, &buf, 1, check_on_write_done) != 0) {
+        rps_free(req);
+        return RPS_ERROR;
+    }
+
+    return RPS_OK;
+}
+
+rps_status_t
+server_write(struct context *ctx, const void *data, size_t len) {
+    uv_buf_t buf;
+
+    buf = uv_buf_init((char *)data, len);
+
+    return server_writev(ctx, &buf, 1, 0);
+}
+
+/* status line of the first chunk, then the expected string anywhere */
+static void
+check_payload_verify(struct check *c, const char *data, size_t size) {
+    char line[32];
+    int code;
+
+    if (!c->status) {
+        memcpy(line, data, MIN(size, sizeof(line) - 1));
+        line[MIN(size, sizeof(line) - 1)] = '\0';
+        if (sscanf(line, "HTTP/1.%*d %d", &code) != 1 || code < 200 || code >= 400) {
+            check_finish(c, "payload");
+            return;
+        }
+        c->status = 1;
+        c->result->rtt = check_elapsed(c->sent);
+    }
+
+    if (checker.expect != NULL && memmem(data, size, checker.expect,
+                strlen(checker.expect)) == NULL) {
+        /* wait for more */
+        return;
+    }
+
+    check_finish(c, NULL);
+}
+
+static void
+check_establish(struct check *c) {
+    struct context *ctx;
+
+    ctx = &c->ctx;
+    ctx->state = c_established;
+    c->result->handshake = check_elapsed(c->connected);
+    c->sent = uv_hrtime();
+
+    if (ctx->proto == HTTP) {
+        /* request has been relayed and response verified by the client */
+        c->status = 1;
+        c->result->rtt = c->result->handshake;
+        check_payload_verify(c, ctx->rbuf, ctx->nread);
+        return;
+    }
+
+    if (server_write(ctx, checker.payload, checker.payload_len) != RPS_OK) {
+        check_finish(c, "write");
+    }
+}
+
+void
+server_do_next(struct context *ctx) {
+    struct check *c;
+
+    c = check_of(ctx);
+
+    if (c->done) {
+        return;
+    }
+
+    switch (ctx->state) {
+    case c_establish:
+        check_establish(c);
+        break;
+    case c_retry:
+    case c_failed:
+    case c_kill:
+        check_finish(c, "handshake");
+        break;
+    default:
+        check_do_next(ctx);
+        break;
+    }
+}
+
+/* proto servers are linked in but never run by the checker */
+bool
+server_auth_required(struct server *s) {
+    UNUSED(s);
+    return false;
+}
+
+bool
+server_auth(rps_sess_t *sess, const char *uname, size_t ulen, 
+        const char *passwd, size_t plen) {
+    UNUSED(sess);
+    UNUSED(uname);
+    UNUSED(ulen);
+    UNUSED(passwd);
+    UNUSED(plen);
+    return false;
+}
+
+bool
+server_auth_cached(rps_sess_t *sess, const uint8_t *key, size_t len) {
+    UNUSED(sess);
+    UNUSED(key);
+    UNUSED(len);
+    return false;
+}
+
+void
+server_auth_cache(rps_sess_t *sess, uint32_t gen, const uint8_t *key, size_t len) {
+    UNUSED(sess);
+    UNUSED(gen);
+    UNUSED(key);
+    UNUSED(len);
+}
+
+void
+server_account(rps_sess_t *sess, size_t nup, size_t ndown) {
+    sess->nup += nup;
+    sess->ndown += ndown;
+}
+
+static void
+check_on_alloc(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
+    struct context *ctx;
+
+    UNUSED(suggested_size);
+
+    ctx = (struct context *)handle->data;
+    buf->base = ctx->rbuf;
+    buf->len = ctx->rsize;
+}
+
+static void
+check_on_read(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf) {
+    struct context *ctx;
+    struct check *c;
+
+    UNUSED(buf);
+
+    ctx = (struct context *)stream->data;
+    c = check_of(ctx);
+
+    if (nread == 0) {
+        return;
+    }
+
+    if (nread < 0) {
+        check_finish(c, ctx->state == c_established ? "payload" : "handshake");
+        return;
+    }
+
+    ctx->nread = nread;
+
+    if (ctx->state == c_established) {
+        check_payload_verify(c, ctx->rbuf, nread);
+    } else {
+        check_do_next(ctx);
+    }
+}
+
+static void
+check_on_connect(uv_connect_t *req, int status) {
+    struct context *ctx;
+    struct check *c;
+
+    ctx = (struct context *)req->data;
+    c = check_of(ctx);
+
+    if (status < 0) {
+        if (status != UV_ECANCELED) {
+            check_finish(c, "connect");
+        }
+        return;
+    }
+
+    c->connected = uv_hrtime();
+    c->result->connect = check_elapsed(c->start);
+
+    if (uv_read_start(&ctx->handle.stream, check_on_alloc, check_on_read) != 0) {
+        check_finish(c, "connect");
+        return;
+    }
+
+    ctx->connected = 1;
+    ctx->state = c_handshake_req;
+    check_do_next(ctx);
+}
+
+static void
+check_on_timer_expire(struct wheel_node *node) {
+    struct context *ctx;
+
+    ctx = (struct context *)((char *)node - offsetof(struct context, timer));
+
+    check_finish(check_of(ctx), "timeout");
+}
+
+static void check_next(struct checker *ck);
+
+static void
+check_on_close(uv_handle_t *handle) {
+    struct check *c;
+
+    c = check_of((struct context *)handle->data);
+
+    if (c->ctx.req != NULL) {
+        rps_free(c->ctx.req);
+    }
+    http_request_deinit(&c->req);
+    rps_free(c);
+
+    checker.inflight--;
+    check_next(&checker);
+}
+
+static void
+check_finish(struct check *c, const char *error) {
+    if (c->done) {
+        return;
+    }
+
+    c->done = 1;
+    c->result->error = error;
+    c->ctx.state = c_closing;
+
+    wheel_del(&checker.server.wheel, &c->ctx.timer);
+    uv_close(&c->ctx.handle.handle, check_on_close);
+}
+
+static rps_status_t
+check_start(struct checker *ck, struct check_result *r) {
+    struct check *c;
+    struct context *ctx;
+    struct upstream *u;
+
+    u = r->upstream;
+
+    c = (struct check *)rps_alloc(sizeof(struct check));
+    if (c == NULL) {
+        return RPS_ENOMEM;
+    }
+    memset(c, 0, sizeof(struct check));
+
+    c->result = r;
+    c->start = uv_hrtime();
+    check_request_init(ck, c);
+
+    c->sess.server = &ck->server;
+    c->sess.request = &ck->request;
+    c->sess.forward = &c->ctx;
+    c->sess.upstream = u;
+    memcpy(&c->sess.remote, &ck->remote, sizeof(ck->remote));
+
+    ctx = &c->ctx;
+    ctx->sess = &c->sess;
+    ctx->flag = c_forward;
+    ctx->state = c_conn;
+    ctx->proto = u->proto;
+    ctx->req = NULL;
+    ctx->reply_code = UNDEFINED_REPLY_CODE;
+    ctx->rbuf = c->rbuf;
+    ctx->rsize = sizeof(c->rbuf);
+    wheel_node_init(&ctx->timer);
+    rps_inaddr_unpack(&u->server, &ctx->peer);
+    rps_unresolve_addr(&ctx->peer, ctx->peername);
+
+    switch (u->proto) {
+    case SOCKS5:
+        ctx->do_next = s5_client_do_next;
+        break;
+    case HTTP:
+        ctx->do_next = http_proxy_client_do_next;
+        break;
+    case HTTP_TUNNEL:
+        ctx->do_next = http_tunnel_client_do_next;
+        break;
+    default:
+        NOT_REACHED();
+    }
+
+    uv_tcp_init(&ck->server.loop, &ctx->handle.tcp);
+    ctx->handle.handle.data = ctx;
+    ctx->connect_req.data = ctx;
+    ck->inflight++;
+
+    wheel_reset(&ck->server.wheel, &ctx->timer, ck->timeout);
+
+    if (uv_tcp_connect(&ctx->connect_req, &ctx->handle.tcp,
+                (const struct sockaddr *)&ctx->peer.addr, check_on_connect) != 0) {
+        check_finish(c, "connect");
+    }
+
+    return RPS_OK;
+}
+
+static void
+check_next(struct checker *ck) {
+    struct check_result *r;
+
+    while (ck->inflight < ck->concurrency && ck->next < array_n(&ck->results)) {
+        r = (struct check_result *)array_get(&ck->results, ck->next++);
+        if (check_start(ck, r) != RPS_OK) {
+            r->error = "memory";
+        }
+    }
+
+    if (ck->inflight == 0 && ck->next == array_n(&ck->results)) {
+        /* the loop returns once the wheel timer closed */
+        wheel_deinit(&ck->server.wheel);
+    }
+}
+
+static rps_status_t
+check_load(struct checker *ck) {
+    struct upstream_pool *up;
+    rps_hashmap_t *pool;
+    struct hashmap_entry *e;
+    struct check_result *r;
+    rps_str_t api;
+    char url[MAX_API_LENGTH + 8];
+    uint32_t i, j;
+    int len;
+
+    if (array_init(&ck->pools, array_n(&ck->upstreams.pools), sizeof(rps_hashmap_t)) != RPS_OK) {
+        return RPS_ENOMEM;
+    }
+
+    if (array_init(&ck->results, UPSTREAM_DEFAULT_POOL_LENGTH, sizeof(struct check_result)) != RPS_OK) {
+        return RPS_ENOMEM;
+    }
+
+    for (i = 0; i < array_n(&ck->upstreams.pools); i++) {
+        up = (struct upstream_pool *)array_get(&ck->upstreams.pools, i);
+        pool = (rps_hashmap_t *)array_push(&ck->pools);
+        if (hashmap_init(pool, UPSTREAM_DEFAULT_POOL_LENGTH, HASHMAP_DEFAULT_COLLISIONS) != RPS_OK) {
+            return RPS_ENOMEM;
+        }
+
+        /* disabled upstreams are checked too, they may come back */
+        len = snprintf(url, sizeof(url), "%s%call=1", up->api.data,
+                strchr((char *)up->api.data, '?') == NULL ? '?' : '&');
+        api.data = (uint8_t *)url;
+        api.len = len;
+
+        if (upstream_pool_load(pool, &api, up->timeout) != RPS_OK) {
+            log_error("load %s upstreams from '%s' failed", rps_proto_str(up->proto), url);
+            return RPS_ERROR;
+        }
+
+        for (j = 0; j < pool->size; j++) {
+            for (e = pool->buckets[j]; e != NULL; e = e->next) {
+                r = (struct check_result *)array_push(&ck->results);
+                if (r == NULL) {
+                    return RPS_ENOMEM;
+                }
+                memset(r, 0, sizeof(*r));
+                r->upstream = (struct upstream *)*(void **)e->value;
+                /* pool is keyed by address, proto comes from the pool */
+                r->upstream->proto = up->proto;
+                upstream_auth_build(r->upstream);
+            }
+        }
+
+        log_info("load %d %s upstreams", hashmap_n(pool), rps_proto_str(up->proto));
+    }
+
+    return RPS_OK;
+}
+
+static size_t
+check_commit_callback(void *contents, size_t size, size_t nmemb, void *userp) {
+    UNUSED(contents);
+    UNUSED(userp);
+    return size * nmemb;
+}
+
+static rps_status_t
+check_commit_post(struct upstream_pool *up, json_t *body) {
+    CURL *curl_handle;
+    CURLcode res;
+    struct curl_slist *headers;
+    char url[MAX_API_LENGTH];
+    char *data;
+    long code;
+    rps_status_t status;
+
+    snprintf(url, sizeof(url), "%s/check/%s/", checker.cfg.api.url.data,
+            rps_proto_str(up->proto));
+
+    data = json_dumps(body, JSON_COMPACT);
+    if (data == NULL) {
+        return RPS_ENOMEM;
+    }
+
+    headers = curl_slist_append(NULL, "Content-Type: application/json");
+
+    curl_handle = curl_easy_init();
+    curl_easy_setopt(curl_handle, CURLOPT_URL, url);
+    curl_easy_setopt(curl_handle, CURLOPT_POSTFIELDS, data);
+    curl_easy_setopt(curl_handle, CURLOPT_HTTPHEADER, headers);
+    curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, check_commit_callback);
+    curl_easy_setopt(curl_handle, CURLOPT_USERAGENT, RPS_CURL_UA);
+    curl_easy_setopt(curl_handle, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(curl_handle, CURLOPT_TIMEOUT, up->timeout);
+    res = curl_easy_perform(curl_handle);
+
+    code = 0;
+    curl_easy_getinfo(curl_handle, CURLINFO_RESPONSE_CODE, &code);
+
+    if (res != CURLE_OK || code != 200) {
+        log_error("commit check results to '%s' failed: %s (%ld)", url,
+                res != CURLE_OK ? curl_easy_strerror(res) : "bad status", code);
+        status = RPS_ERROR;
+    } else {
+        status = RPS_OK;
+    }
+
+    curl_easy_cleanup(curl_handle);
+    curl_slist_free_all(headers);
+    free(data);
+
+    return status;
+}
+
+static json_t *
+check_result_json(struct check_result *r) {
+    json_t *obj;
+    char name[MAX_HOSTNAME_LEN];
+
+    rps_inaddr_name(&r->upstream->server, name);
+
+    obj = json_object();
+    json_object_set_new(obj, "host", json_string(name));
+    json_object_set_new(obj, "port", json_integer(rps_inaddr_port(&r->upstream->server)));
+    json_object_set_new(obj, "enable", json_integer(r->error == NULL));
+    json_object_set_new(obj, "connect", json_real(r->connect / 1000.0));
+    json_object_set_new(obj, "handshake", json_real(r->handshake / 1000.0));
+    json_object_set_new(obj, "rtt", json_real(r->rtt / 1000.0));
+    json_object_set_new(obj, "error", r->error == NULL ? json_null() : json_string(r->error));
+
+    return obj;
+}
+
+/* results are posted per proto in batches of CHECK_COMMIT_BATCH */
+static rps_status_t
+check_commit(struct checker *ck) {
+    struct upstream_pool *up;
+    struct check_result *r;
+    json_t *body;
+    uint32_t i, j;
+    rps_status_t status;
+
+    status = RPS_OK;
+
+    for (i = 0; i < array_n(&ck->upstreams.pools); i++) {
+        up = (struct upstream_pool *)array_get(&ck->upstreams.pools, i);
+        body = json_array();
+
+        for (j = 0; j < array_n(&ck->results); j++) {
+            r = (struct check_result *)array_get(&ck->results, j);
+            if (r->upstream->proto != up->proto) {
+                continue;
+            }
+
+            json_array_append_new(body, check_result_json(r));
+            if (json_array_size(body) == CHECK_COMMIT_BATCH) {
+                if (check_commit_post(up, body) != RPS_OK) {
+                    status = RPS_ERROR;
+                }
+                json_array_clear(body);
+            }
+        }
+
+        if (json_array_size(body) > 0 && check_commit_post(up, body) != RPS_OK) {
+            status = RPS_ERROR;
+        }
+        json_decref(body);
+    }
+
+    return status;
+}
+
+static void
+check_report(struct checker *ck) {
+    struct check_result *r;
+    uint32_t i, ok;
+    uint32_t nconnect, nhandshake, npayload, ntimeout, nother;
+    double elapsed;
+    char name[MAX_HOSTNAME_LEN];
+
+    ok = nconnect = nhandshake = npayload = ntimeout = nother = 0;
+
+    for (i = 0; i < array_n(&ck->results); i++) {
+        r = (struct check_result *)array_get(&ck->results, i);
+
+        if (r->error == NULL) {
+            ok++;
+        } else if (strcmp(r->error, "connect") == 0) {
+            nconnect++;
+        } else if (strcmp(r->error, "handshake") == 0) {
+            nhandshake++;
+        } else if (strcmp(r->error, "payload") == 0) {
+            npayload++;
+        } else if (strcmp(r->error, "timeout") == 0) {
+            ntimeout++;
+        } else {
+            nother++;
+        }
+
+        if (ck->verbose) {
+            rps_inaddr_name(&r->upstream->server, name);
+            printf("%s://%s:%d %s connect %.3f ms, handshake %.3f ms, rtt %.3f ms\n",
+                    rps_proto_str(r->upstream->proto), name,
+                    rps_inaddr_port(&r->upstream->server),
+                    r->error == NULL ? "ok" : r->error,
+                    r->connect / 1000.0, r->handshake / 1000.0, r->rtt / 1000.0);
+        }
+    }
+
+    elapsed = (uv_hrtime() - ck->start) / 1e9;
+
+    printf("checked:   %d upstreams in %.3f s, %.1f checks/s\n", array_n(&ck->results),
+            elapsed, elapsed > 0 ? array_n(&ck->results) / elapsed : 0.0);
+    printf("ok:        %d\n", ok);
+    printf("failed:    connect %d, handshake %d, payload %d, timeout %d, other %d\n",
+            nconnect, nhandshake, npayload, ntimeout, nother);
+}
+
+static void
+check_raise_nofile(uint32_t concurrency) {
+    struct rlimit rl;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < concurrency + 64) {
+        log_warn("open files limit %d is lower than concurrency %d",
+                (int)rl.rlim_cur, concurrency);
+    }
+}
+
+static rps_status_t
+check_get_options(int argc, char **argv, struct checker *ck) {
+    int c;
+
+    static struct option long_options[] = {
+        { "help",        no_argument,        NULL,   'h' },
+        { "config",      required_argument,  NULL,   'c' },
+        { "target",      required_argument,  NULL,   't' },
+        { "path",        required_argument,  NULL,   'u' },
+        { "expect",      required_argument,  NULL,   'e' },
+        { "concurrency", required_argument,  NULL,   'n' },
+        { "timeout",     required_argument,  NULL,   'T' },
+        { "dry-run",     no_argument,        NULL,   'D' },
+        { "verbose",     no_argument,        NULL,   'v' },
+        {  NULL,         0,                  NULL,    0  }
+    };
+
+    for (;;) {
+        c = getopt_long(argc, argv, "hc:t:u:e:n:T:Dv", long_options, NULL);
+        if (c == -1) {
+            break;
+        }
+
+        switch (c) {
+        case 'c':
+            ck->config_filename = optarg;
+            break;
+        case 't':
+            ck->target = optarg;
+            break;
+        case 'u':
+            ck->path = optarg;
+            break;
+        case 'e':
+            ck->expect = optarg;
+            break;
+        case 'n':
+            ck->concurrency = (uint32_t)atoi(optarg);
+            break;
+        case 'T':
+            ck->timeout = (uint32_t)atoi(optarg);
+            break;
+        case 'D':
+            ck->dry_run = 1;
+            break;
+        case 'v':
+            ck->verbose = 1;
+            break;
+        case 'h':
+        default:
+            return RPS_ERROR;
+        }
+    }
+
+    if (ck->concurrency == 0 || ck->timeout == 0 || ck->path[0] != '/') {
+        return RPS_ERROR;
+    }
+
+    return RPS_OK;
+}
+
+int
+main(int argc, char **argv) {
+    struct checker *ck;
+
+    ck = &checker;
+    memset(ck, 0, sizeof(*ck));
+    ck->config_filename = CHECK_DEFAULT_CONFIG_FILE;
+    ck->target = CHECK_DEFAULT_TARGET;
+    ck->path = CHECK_DEFAULT_PATH;
+    ck->concurrency = CHECK_DEFAULT_CONCURRENCY;
+    ck->timeout = CHECK_DEFAULT_TIMEOUT;
+
+    log_init(LOG_INFO, NULL);
+
+    if (check_get_options(argc, argv, ck) != RPS_OK) {
+        check_show_usage();
+    }
+
+    if (check_parse_target(ck) != RPS_OK) {
+        log_stderr("invalid target '%s'", ck->target);
+        exit(1);
+    }
+
+    ck->payload_len = snprintf(ck->payload, sizeof(ck->payload),
+            "GET %s HTTP/1.1\r\nHost: %s:%d\r\nConnection: close\r\n\r\n",
+            ck->path, ck->host, ck->port);
+
+    if (config_init(ck->config_filename, &ck->cfg) != RPS_OK) {
+        exit(1);
+    }
+
+    if (upstreams_init(&ck->upstreams, &ck->cfg.api, &ck->cfg.upstreams, 0) != RPS_OK) {
+        exit(1);
+    }
+
+    if (check_load(ck) != RPS_OK) {
+        exit(1);
+    }
+
+    check_raise_nofile(ck->concurrency);
+
+    ck->server.upstreams = &ck->upstreams;
+    ck->request.req = NULL;
+    ck->request.state = c_init;
+    uv_loop_init(&ck->server.loop);
+    wheel_init(&ck->server.wheel, &ck->server.loop, check_on_timer_expire);
+
+    ck->start = uv_hrtime();
+    check_next(ck);
+    uv_run(&ck->server.loop, UV_RUN_DEFAULT);
+
+    check_report(ck);
+
+    if (!ck->dry_run && check_commit(ck) != RPS_OK) {
+        exit(1);
+    }
+
+    exit(0);
+}
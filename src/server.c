@@ -7,12 +7,22 @@
 #include "proto/http_proxy.h"
 #include "proto/http_tunnel.h"
 
+#include <stddef.h>
+
+static void server_on_timer_expire(struct wheel_node *node);
+static void server_on_throttle_expire(struct wheel_node *node);
+static void server_on_reconcile(uv_timer_t *handle);
+static void server_on_drain(uv_async_t *handle);
+static void server_unblock(rps_ctx_t *ctx);
+static void server_uring_start(rps_sess_t *sess);
 
 rps_status_t
-server_init(struct server *s, struct config_server *cfg, 
-        struct upstreams *us, uint32_t rtimeout, uint32_t ftimeout) {
+server_init(struct server *s, uint32_t id, struct config_server *cfg, 
+        struct upstreams *us, struct users *users, struct config_accesslog *ca,
+        struct config_servers *css) {
     int err;
     int status;
+    int i;
 
     err = uv_loop_init(&s->loop);
     if (err != 0) {
@@ -27,6 +37,8 @@ server_init(struct server *s, struct config_server *cfg,
     }
 
     s->us.data = s;
+    s->id = id;
+    traffic_slot_init(&s->traffic);
 
     s->proto = rps_proto_int((const char *)cfg->proto.data);
 
@@ -41,10 +53,72 @@ server_init(struct server *s, struct config_server *cfg,
         return RPS_ERROR;
     }
 
+    status = accesslog_init(&s->alog, ca, s->proto, cfg->port);
+    if (status != RPS_OK) {
+        return RPS_ERROR;
+    }
+
+    wheel_init(&s->wheel, &s->loop, server_on_timer_expire);
+    bufpool_init(&s->rpool);
+
+    s->uring.fd = -1;
+    if (cfg->io_uring && uring_init(&s->uring, &s->loop) == RPS_OK) {
+        log_notice("%s proxy on %s:%d relay tunnels with io_uring", 
+                cfg->proto.data, cfg->listen.data, cfg->port);
+    }
+
+    status = admission_init(&s->admission, &s->loop, cfg);
+    if (status != RPS_OK) {
+        return RPS_ERROR;
+    }
+
+    s->users = users;
+    s->buckets = NULL;
+    s->nbuckets = 0;
+    s->authcache = NULL;
+    wheel_init(&s->throttle, &s->loop, server_on_throttle_expire);
+    uv_timer_init(&s->loop, &s->reconcile);
+    s->reconcile.data = s;
+
+    if (users_enabled(users)) {
+        uv_timer_start(&s->reconcile, server_on_reconcile, 
+                USERS_RECONCILE_INTERVAL, USERS_RECONCILE_INTERVAL);
+        uv_unref((uv_handle_t *)&s->reconcile);
+    }
+
+    if ((s->proto == HTTP || s->proto == HTTP_TUNNEL) && 
+            (users_enabled(users) || !string_empty(&cfg->username))) {
+        s->authcache = user_cache_create();
+        if (s->authcache == NULL) {
+            return RPS_ENOMEM;
+        }
+    }
+
+    uv_async_init(&s->loop, &s->drain, server_on_drain);
+    s->drain.data = s;
+    uv_timer_init(&s->loop, &s->drain_timer);
+    s->drain_timer.data = s;
+
+    s->fd = -1;
+    s->listening = NULL;
+    s->nsess = 0;
+    s->drain_timeout = 0;
+    s->drain_deadline = 0;
+
     s->cfg = cfg;
     s->upstreams = us;
-    s->rtimeout = rtimeout;
-    s->ftimeout = ftimeout;
+
+    s->timeouts[p_request_idle] = css->rtimeout;
+    s->timeouts[p_forward_idle] = css->ftimeout;
+    s->timeouts[p_handshake] = css->handshake_timeout ? css->handshake_timeout : css->rtimeout;
+    s->timeouts[p_establish] = css->establish_timeout ? css->establish_timeout : css->rtimeout;
+    s->timeouts[p_connect] = css->connect_timeout ? css->connect_timeout : css->ftimeout;
+    s->timeouts[p_upstream] = css->upstream_timeout ? css->upstream_timeout : css->ftimeout;
+    s->timeouts[p_lifetime] = css->lifetime;
+
+    for (i = 0; i < p_max; i++) {
+        s->expired[i] = 0;
+    }
 
     return RPS_OK;
 }
@@ -52,6 +126,15 @@ server_init(struct server *s, struct config_server *cfg,
 
 void
 server_deinit(struct server *s) {
+    accesslog_deinit(&s->alog);
+    wheel_deinit(&s->wheel);
+    wheel_deinit(&s->throttle);
+    bufpool_deinit(&s->rpool);
+    uring_deinit(&s->uring);
+    admission_deinit(&s->admission);
+    user_buckets_destroy(s->buckets);
+    user_cache_destroy(s->authcache);
+
     uv_loop_close(&s->loop);
 
     /* Make valgrind happy */
@@ -64,8 +147,32 @@ server_sess_init(rps_sess_t *sess, struct server *s) {
     sess->request = NULL;
     sess->forward = NULL;
     sess->upstream = NULL;
+    sess->user = NULL;
     rps_addr_init(&sess->remote);
     gettimeofday(&sess->start, NULL);
+    sess->hrstart = uv_hrtime();
+    sess->t_request = 0;
+    sess->t_connect = 0;
+    sess->t_establish = 0;
+    sess->deadline = 0;
+    sess->nup = 0;
+    sess->ndown = 0;
+    sess->success = 0;
+    sess->admitted = 0;
+    sess->rejected = 0;
+    sess->accounted = 0;
+    sess->uring = NULL;
+    sess->source[0] = '\0';
+}
+
+/* microseconds elapsed since session accepted */
+static uint32_t
+server_sess_elapsed(rps_sess_t *sess) {
+    uint64_t elapsed;
+
+    elapsed = (uv_hrtime() - sess->hrstart) / 1000;
+
+    return elapsed > UINT32_MAX ? UINT32_MAX : (uint32_t)elapsed;
 }
 
 static void
@@ -79,7 +186,7 @@ server_sess_upstream_mark_fail(rps_sess_t *sess) {
         return;
     }
 
-    sess->upstream->failure += 1;
+    upstreams_failure(sess->server->upstreams, sess->upstream);
 
     request = sess->request;
     forward = sess->forward;
@@ -100,8 +207,13 @@ server_sess_mark_fail(rps_sess_t *sess) {
     char remoteip[MAX_INET_ADDRSTRLEN];
 
     request = sess->request;
-    /* request may has been free */
-    if (request == NULL) {
+    /* request may has been closed */
+    if (request == NULL || (request->state & c_closed)) {
+        return;
+    }
+
+    /* rejected by admission control, logged on accept */
+    if (sess->rejected) {
         return;
     }
 
@@ -134,7 +246,8 @@ server_sess_mark_success(rps_sess_t *sess) {
     request = sess->request;
     forward = sess->forward;
 
-    sess->upstream->success += 1;
+    upstreams_success(sess->server->upstreams, sess->upstream);
+    sess->success = 1;
 
     gettimeofday (&sess->end, NULL);
     elapsed = (sess->end.tv_sec - sess->start.tv_sec) + 
@@ -149,65 +262,178 @@ server_sess_mark_success(rps_sess_t *sess) {
             remoteip, rps_unresolve_port(&sess->remote), elapsed);
 }
 
+static void
+server_sess_log(rps_sess_t *sess) {
+    struct accesslog *alog;
+    struct accesslog_record rec;
+    rps_ctx_t *request, *forward;
+
+    alog = &sess->server->alog;
+
+    if (!accesslog_enabled(alog)) {
+        return;
+    }
+
+    request = sess->request;
+    forward = sess->forward;
+
+    memset(&rec, 0, sizeof(rec));
+
+    rec.start = (uint64_t)sess->start.tv_sec * 1000000 + sess->start.tv_usec;
+    rec.duration = (uv_hrtime() - sess->hrstart) / 1000;
+    rec.request = sess->t_request;
+    rec.connect = sess->t_connect;
+    rec.establish = sess->t_establish;
+    rec.nup = sess->nup;
+    rec.ndown = sess->ndown;
+    rec.proto = sess->server->proto;
+    rec.reply_code = rps_rep_undefined;
+
+    if (request != NULL) {
+        accesslog_addr(&request->peer, &rec.client_family, rec.client, &rec.client_port);
+        rec.reply_code = request->reply_code;
+    }
+
+    if (forward != NULL) {
+        accesslog_addr(&forward->peer, &rec.upstream_family, rec.upstream, &rec.upstream_port);
+        rec.upstream_proto = forward->proto;
+        rec.retry = forward->retry;
+        rec.reconn = forward->reconn;
+        if (rec.reply_code == rps_rep_undefined) {
+            rec.reply_code = forward->reply_code;
+        }
+    }
+
+    if (!rps_addr_uninit(&sess->remote)) {
+        rec.remote_hash = rps_addr_hash(&sess->remote);
+        rec.remote_port = rps_unresolve_port(&sess->remote);
+    }
+
+    if (sess->t_establish) {
+        rec.flags |= ACCESSLOG_F_ESTABLISHED;
+    }
+
+    if (sess->success) {
+        rec.flags |= ACCESSLOG_F_SUCCESS;
+    }
+
+    accesslog_write(alog, &rec);
+}
+
+/* Count bytes relayed by a session at listener, user and upstream. */
+void
+server_account(rps_sess_t *sess, size_t nup, size_t ndown) {
+    struct server *s;
+
+    s = sess->server;
+
+    sess->nup += nup;
+    sess->ndown += ndown;
+
+    s->traffic.nup += nup;
+    s->traffic.ndown += ndown;
+
+    if (sess->user != NULL) {
+        traffic_add(sess->user->traffic, s->id, nup, ndown);
+    }
+
+    if (sess->upstream != NULL && sess->t_establish) {
+        traffic_add(sess->upstream->traffic, s->id, nup, ndown);
+    }
+}
+
+static void
+server_sess_unaccount(rps_sess_t *sess) {
+    struct server *s;
+    uint64_t elapsed;
+
+    s = sess->server;
+    elapsed = (uv_hrtime() - sess->hrstart) / 1000;
+
+    s->traffic.active--;
+    s->traffic.elapsed += elapsed;
+
+    if (sess->accounted) {
+        traffic_leave(sess->user->traffic, s->id, elapsed);
+    }
+
+    /* upstream is released right after, while it is still held */
+    if (sess->upstream != NULL && sess->t_establish) {
+        traffic_leave(sess->upstream->traffic, s->id, elapsed - sess->t_establish);
+    }
+}
 
 static void
 server_sess_free(rps_sess_t *sess) {
-    if (((sess->request != NULL)) && (sess->request->state & c_closed)) {
+    /* Closed context is kept until the other side closed too, 
+     * the access log record is collected from both of them. 
+     */
+    if ((sess->request != NULL) && !(sess->request->state & c_closed)) {
+        return;
+    }
+
+    if ((sess->forward != NULL) && !(sess->forward->state & c_closed)) {
+        return;
+    }
+
+    server_sess_log(sess);
+    server_sess_unaccount(sess);
+
+    if (sess->admitted || sess->rejected) {
+        admission_leave(&sess->server->admission, &sess->request->peer, sess->admitted);
+    }
+
+    if (sess->request != NULL) {
         rps_free(sess->request);
         sess->request = NULL;
     }
 
-    if ((sess->forward != NULL) && (sess->forward->state & c_closed)) {
+    if (sess->forward != NULL) {
         rps_free(sess->forward);
         sess->forward = NULL;
     }
 
-    if (sess->request != NULL || sess->forward != NULL) {
-        return;
+    if (sess->upstream != NULL) {
+        upstreams_put(sess->server->upstreams, sess->upstream);
+        sess->upstream = NULL;
     }
-
-    sess->upstream = NULL;
+    sess->server->nsess--;
     rps_free(sess);
 }
 
 static rps_status_t
-server_ctx_init(rps_ctx_t *ctx, rps_sess_t *sess, uint8_t flag, uint32_t timeout) {
+server_ctx_init(rps_ctx_t *ctx, rps_sess_t *sess, uint8_t flag) {
     ctx->sess = sess;
     ctx->flag = flag;
     ctx->state = c_init;
     ctx->stream = -1;
+    ctx->rbuf = NULL;
+    ctx->rsize = 0;
     ctx->nread = 0;
-    ctx->nwrite = 0;
-    ctx->nwrite2 = 0;
+    ctx->rchunk = NULL;
+    ctx->rclass = 0;
+    ctx->rfull = 0;
+    ctx->rsmall = 0;
+    ctx->wqueued = 0;
     ctx->reconn = 0;
     ctx->retry = 0;
     ctx->connecting = 0;
     ctx->connected = 0;
     ctx->established = 0;
-    ctx->c_count = 0;
+    ctx->pipelined = 0;
+    ctx->blocked = 0;
     ctx->proto = UNSET;
     ctx->reply_code = rps_rep_undefined;
     ctx->rstat = c_stop;
     ctx->wstat = c_stop;
-    ctx->timeout = timeout;
+    ctx->phase = flag == c_request ? p_handshake : p_connect;
+    rps_addr_init(&ctx->peer);
     ctx->handle.handle.data  = ctx;
-    ctx->write_req.data = ctx;
-    ctx->timer.data = ctx;
+    wheel_node_init(&ctx->timer);
+    wheel_node_init(&ctx->throttle);
     ctx->connect_req.data = ctx;
     ctx->shutdown_req.data = ctx;
 
-    ctx->wbuf = (char *)rps_alloc(WRITE_BUF_SIZE);
-    if (ctx->wbuf == NULL) {
-        return RPS_ENOMEM;
-    }
-    
-    ctx->wbuf2 = (char *)rps_alloc(WRITE_BUF_SIZE);
-    if (ctx->wbuf2 == NULL) {
-        rps_free(ctx->wbuf);
-        ctx->wbuf = NULL;
-        return RPS_ENOMEM;
-    }
-
     ctx->req = NULL;
     ctx->do_next = NULL;
 
@@ -261,6 +487,18 @@ server_ctx_set_proto(rps_ctx_t *ctx, rps_proto_t proto) {
 }
 
 
+/* Drop the read chunk if it wasn't passed on, the next read borrows another. */
+static void
+server_rbuf_put(rps_ctx_t *ctx) {
+    if (ctx->rchunk != NULL) {
+        bufchunk_unref(ctx->rchunk);
+        ctx->rchunk = NULL;
+    }
+
+    ctx->rbuf = NULL;
+    ctx->rsize = 0;
+}
+
 static void
 server_ctx_deinit(rps_ctx_t *ctx) {
 
@@ -270,19 +508,16 @@ server_ctx_deinit(rps_ctx_t *ctx) {
     ctx->connecting = 0;
     ctx->connected = 0;
     ctx->established = 0;
-    ctx->c_count = 0;
 
     ctx->handle.handle.data  = NULL;
-    ctx->write_req.data = NULL;
-    ctx->timer.data = NULL;
     ctx->connect_req.data = NULL;
     ctx->shutdown_req.data = NULL;
 
-    rps_free(ctx->wbuf);
-    rps_free(ctx->wbuf2);
+    server_rbuf_put(ctx);
 
     if (ctx->req != NULL) {
         rps_free(ctx->req);
+        ctx->req = NULL;
     }
 
     ctx->do_next = NULL;
@@ -311,13 +546,6 @@ server_on_ctx_close(uv_handle_t* handle) {
 
     ctx = handle->data;
 
-    ctx->c_count += 1;
-
-    if (ctx->c_count < 2) {
-        //waitting for both timer and handler closed.
-        return; 
-    }
-    
     switch (ctx->flag) {
         case c_request:
             log_debug("Request from %s:%d be closed", 
@@ -347,18 +575,26 @@ server_ctx_close(rps_ctx_t *ctx) {
         return;
     }
 
-    uv_timer_stop(&ctx->timer);
-    uv_close((uv_handle_t *)&ctx->timer, (uv_close_cb)server_on_ctx_close);
+    /* closed again once io_uring handed the tunnel back */
+    if (ctx->sess->uring != NULL) {
+        uring_tunnel_stop(ctx->sess->uring);
+        return;
+    }
+
+    wheel_del(&ctx->sess->server->wheel, &ctx->timer);
+    wheel_del(&ctx->sess->server->throttle, &ctx->throttle);
+
+    ctx->state = c_closing;
 
     if (!ctx->connecting && !ctx->connected) {
         // we still need guarantee free the memory of context and session 
-        // even if connect didn't established 
-        ctx->c_count += 1;
+        // even if connect didn't established.
+        // Close a fresh handle, so the context is freed in close callback as usual.
+        uv_tcp_init(&ctx->sess->server->loop, &ctx->handle.tcp);
+        uv_close(&ctx->handle.handle, (uv_close_cb)server_on_ctx_close);
         return;
     }
 
-    ctx->state = c_closing;
-
     // Recycle the allocated resources.
     // Only context that has been connected need close action
     if (ctx->connected) {
@@ -371,6 +607,11 @@ server_ctx_close(rps_ctx_t *ctx) {
 
 static void
 server_close(rps_sess_t *sess) {
+    if (sess->uring != NULL) {
+        uring_tunnel_stop(sess->uring);
+        return;
+    }
+
     server_ctx_close(sess->request);
     server_ctx_close(sess->forward);
     server_sess_mark_fail(sess);
@@ -415,26 +656,56 @@ server_alloc(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
 
     ctx = handle->data;
 
+    /* 
+     * Handshake chunk is kept across reads until the session is established, 
+     * a chunk left by an empty read is reused. Without one libuv fails the 
+     * read with UV_ENOBUFS.
+     */
+    if (ctx->rchunk == NULL) {
+        if (ctx->state & c_established) {
+            ctx->rchunk = bufchunk_get(&ctx->sess->server->rpool, ctx->rclass);
+        } else {
+            ctx->rchunk = bufchunk_get_size(&ctx->sess->server->rpool, READ_BUF_SIZE);
+        }
+
+        if (ctx->rchunk != NULL) {
+            ctx->rbuf = ctx->rchunk->data;
+            ctx->rsize = ctx->rchunk->size;
+        }
+    }
+
     buf->base = ctx->rbuf;
-    buf->len = sizeof(ctx->rbuf);
+    buf->len = ctx->rsize;
 
     return buf;
 }
 
 static void 
-server_on_timer_expire(uv_timer_t *handle) {
+server_on_timer_expire(struct wheel_node *node) {
     rps_ctx_t *ctx;
+    struct server *s;
+    ctx_phase_t phase;
 
-    ctx = handle->data;
+    ctx = (rps_ctx_t *)((char *)node - offsetof(rps_ctx_t, timer));
 
     if (server_ctx_dead(ctx)) {
         return;
     }
-    
+
+    s = ctx->sess->server;
+    phase = (ctx_phase_t)ctx->phase;
+
+    /* idle deadline was cut short by the session lifetime, wheel rounds to ticks */
+    if (ctx->sess->deadline != 0 && 
+            uv_now(&s->loop) + WHEEL_TICK > ctx->sess->deadline) {
+        phase = p_lifetime;
+    }
+
+    s->expired[phase]++;
 
     if (ctx->flag == c_request) {
         ctx->state = c_kill;
-        log_debug("Request from %s timeout", ctx->peername);
+        log_debug("Request from %s %s timeout", ctx->peername, ctx_phase_str(phase));
     } else {
         /* tunnel or pipeline has been established retry dosen’t make sense */
         if (ctx->state & c_established) {
@@ -442,23 +713,49 @@ server_on_timer_expire(uv_timer_t *handle) {
         } else {
             ctx->state = c_retry;
         }
-        log_debug("Forward to %s timeout", ctx->peername);
+        log_debug("Forward to %s %s timeout", ctx->peername, ctx_phase_str(phase));
     }
 
     server_do_next(ctx);
 }
 
-static void 
+/* Enter phase, its deadline is armed from now on. */
+static void
+server_phase(rps_ctx_t *ctx, ctx_phase_t phase, uint32_t timeout) {
+    if (server_ctx_dead(ctx)) {
+        return;
+    }
+
+    ctx->phase = phase;
+    wheel_reset(&ctx->sess->server->wheel, &ctx->timer, timeout);
+}
+
+/* Push the idle deadline on I/O, deadlines of other phases stay put. */
+void 
 server_timer_reset(rps_ctx_t *ctx) {
-    int err;
+    struct server *s;
+    uint32_t timeout;
+    uint64_t now;
 
-    err = uv_timer_start(&ctx->timer, 
-            (uv_timer_cb)server_on_timer_expire, ctx->timeout, 0);
-    if (err) {
-        char why[256];
-        snprintf(why, 256, "reset timer %s", ctx->peername);
-        UV_SHOW_ERROR(err, why);
+    if (ctx->phase != p_request_idle && ctx->phase != p_forward_idle) {
+        return;
+    }
+
+    /* node of closing context must stay off the wheel, context memory be freed soon */
+    if (server_ctx_dead(ctx)) {
+        return;
+    }
+
+    s = ctx->sess->server;
+    timeout = s->timeouts[ctx->phase];
+
+    if (ctx->sess->deadline != 0) {
+        now = uv_now(&s->loop);
+        timeout = now < ctx->sess->deadline ? 
+            MIN(timeout, ctx->sess->deadline - now) : 0;
     }
+
+    wheel_reset(&s->wheel, &ctx->timer, timeout);
 }
 
 
@@ -533,29 +830,37 @@ server_read_start(rps_ctx_t *ctx) {
     return RPS_OK;
 }
 
-/*
 static void
 server_read_stop(rps_ctx_t *ctx) {
     uv_read_stop(&ctx->handle.stream);
     ctx->rstat = c_stop;
 }
-*/
 
 static void
 server_on_write_done(uv_write_t *req, int err) {
     rps_ctx_t *ctx;
+    struct bufchunk *chunk;
+    size_t len;
+
+    chunk = (struct bufchunk *)((char *)req - offsetof(struct bufchunk, req));
+    ctx = req->data;
+    len = chunk->wlen;
+
+    /* chunk goes back to pool whatever happened to the write */
+    bufchunk_unref(chunk);
 
     if (err == UV_ECANCELED) {
         return;  /* Handle has been closed. */
     }
 
-    ctx = req->data;
-
     if (server_ctx_dead(ctx)) {
         return;
     }
 
-    ctx->wstat = c_done;
+    ctx->wqueued -= len;
+    if (ctx->wqueued == 0) {
+        ctx->wstat = c_done;
+    }
 
     if (err) {
         char why[256];
@@ -566,69 +871,192 @@ server_on_write_done(uv_write_t *req, int err) {
         return;
     }
 
-    if (ctx->nwrite2 > 0) {
-        server_write(ctx, ctx->wbuf2, ctx->nwrite2);
-        ctx->nwrite2 = 0;
+    /* backlog drained, the peer may read again */
+    if (ctx->wqueued <= WRITE_BACKLOG_LOW) {
+        if (ctx->sess->request == ctx) {
+            server_unblock(ctx->sess->forward);
+        } else {
+            server_unblock(ctx->sess->request);
+        }
     }
 
+    if (ctx->wqueued == 0) {
+        server_uring_start(ctx->sess);
+    }
 }
 
-rps_status_t
-server_write(rps_ctx_t *ctx, const void *data, size_t len) {
-    int err;
-    uv_buf_t buf;
-    size_t slot;
+/* 
+ * Hand an established tunnel over to io_uring once nothing is left in the 
+ * libuv write queues, writes of both would otherwise reorder.
+ */
+static void
+server_uring_start(rps_sess_t *sess) {
+    rps_ctx_t *request, *forward;
 
-    ASSERT(len > 0);
+    request = sess->request;
+    forward = sess->forward;
 
-    if (ctx->wstat == c_busy) {
-        slot = WRITE_BUF_SIZE - ctx->nwrite2;
-        if (slot == 0) {
-            log_debug("write buffer to %s has been full, drop %d bytes.", ctx->peername, len);
-            return RPS_OK; 
-        }
+    if (!uring_enabled(&sess->server->uring) || sess->uring != NULL) {
+        return;
+    }
+
+    if (server_ctx_dead(request) || server_ctx_dead(forward)) {
+        return;
+    }
+
+    if (request->state != c_established || forward->state != c_established ||
+            request->stream != c_tunnel || forward->stream != c_tunnel) {
+        return;
+    }
+
+    if (request->wqueued > 0 || forward->wqueued > 0) {
+        return;
+    }
 
-        len = MIN(slot, len);
+    /* bandwidth limit is enforced on libuv reads */
+    if (sess->user != NULL && sess->user->bandwidth > 0) {
+        return;
+    }
 
-        memcpy(&ctx->wbuf2[ctx->nwrite2], data, len);
-        ctx->nwrite2 += len;
-        return RPS_OK;
+    if (uring_tunnel_start(&sess->server->uring, sess) != RPS_OK) {
+        return;
     }
 
+    uv_read_stop(&request->handle.stream);
+    request->rstat = c_stop;
+    request->blocked = 0;
+    server_rbuf_put(request);
+
+    uv_read_stop(&forward->handle.stream);
+    forward->rstat = c_stop;
+    forward->blocked = 0;
+    server_rbuf_put(forward);
+}
+
+/* 
+ * Queue bufs for write along with the chunk they are taken from, the 
+ * reference of caller is taken over. wlen of chunk counts every buf.
+ */
+static rps_status_t
+server_write_bufs(rps_ctx_t *ctx, struct bufchunk *chunk, const uv_buf_t *bufs, 
+        unsigned int nbufs) {
+    int err;
 
-    memcpy(ctx->wbuf, data, len);
-    ctx->nwrite = len;
+    ASSERT(chunk->wlen > 0);
 
-    buf.base = (char *)ctx->wbuf;
-    buf.len = len;
+    chunk->req.data = ctx;
 
-    
-    err = uv_write(&ctx->write_req, 
+    err = uv_write(&chunk->req, 
              &ctx->handle.stream, 
-             &buf, 
-             1, 
+             bufs, 
+             nbufs, 
              server_on_write_done);
 
     if (err) {
         char why[256];
         snprintf(why, 256, "write to %s", ctx->peername);
         UV_SHOW_ERROR(err, why);
+        bufchunk_unref(chunk);
         return RPS_ERROR;
     }
+
+    ctx->wqueued += chunk->wlen;
+    ctx->wstat = c_busy;
+
+    server_timer_reset(ctx);
     
+    return RPS_OK;
+}
+
+/* Queue a chunk for write, the reference of caller is taken over. */
+static rps_status_t
+server_write_chunk(rps_ctx_t *ctx, struct bufchunk *chunk) {
+    uv_buf_t buf;
+
+    ASSERT(chunk->len > 0);
+
+    buf.base = chunk->data;
+    buf.len = chunk->len;
+    chunk->wlen = chunk->len;
+
+    return server_write_bufs(ctx, chunk, &buf, 1);
+}
+
+/* 
+ * Send bufs in a single write. Bufs flagged in inplace (bit i for bufs[i])
+ * must stay untouched until the session ends, static messages or interned
+ * strings of the upstream, they are sent where they are. The rest belongs
+ * to the caller and is copied into one pooled chunk which carries the write.
+ */
+rps_status_t
+server_writev(rps_ctx_t *ctx, const uv_buf_t *bufs, unsigned int nbufs, uint32_t inplace) {
+    struct bufchunk *chunk;
+    uv_buf_t wbufs[SERVER_WRITEV_MAX];
+    unsigned int i, n;
+    size_t len, ncopy;
+    char *p;
+
+    ASSERT(nbufs <= SERVER_WRITEV_MAX);
+
+    len = 0;
+    ncopy = 0;
+    for (i = 0; i < nbufs; i++) {
+        len += bufs[i].len;
+        if (!(inplace & (1u << i))) {
+            ncopy += bufs[i].len;
+        }
+    }
+
+    ASSERT(len > 0);
+
+    chunk = bufchunk_get_size(&ctx->sess->server->rpool, ncopy);
+    if (chunk == NULL) {
+        return RPS_ENOMEM;
+    }
+
+    n = 0;
+    for (i = 0; i < nbufs; i++) {
+        if (bufs[i].len == 0) {
+            continue;
+        }
+
+        if (inplace & (1u << i)) {
+            wbufs[n++] = bufs[i];
+            continue;
+        }
+
+        p = chunk->data + chunk->len;
+        memcpy(p, bufs[i].base, bufs[i].len);
+        chunk->len += bufs[i].len;
+
+        /* adjacent copies go out as one buf */
+        if (n > 0 && wbufs[n - 1].base + wbufs[n - 1].len == p) {
+            wbufs[n - 1].len += bufs[i].len;
+        } else {
+            wbufs[n++] = uv_buf_init(p, bufs[i].len);
+        }
+    }
+    chunk->wlen = len;
 
 #if RPS_DEBUG_OPEN
     if (ctx->proto == SOCKS5 && ctx->state < c_established) {
-        log_verb("write %zd bytes", len);
-        log_hex(LOG_VERBOSE, (char *)data, len);
+        for (i = 0; i < n; i++) {
+            log_verb("write %zd bytes", wbufs[i].len);
+            log_hex(LOG_VERBOSE, wbufs[i].base, wbufs[i].len);
+        }
     }
 #endif
 
-    ctx->wstat = c_busy;
+    return server_write_bufs(ctx, chunk, wbufs, n);
+}
 
-    server_timer_reset(ctx);
-    
-    return RPS_OK;
+rps_status_t
+server_write(rps_ctx_t *ctx, const void *data, size_t len) {
+    uv_buf_t buf;
+
+    buf = uv_buf_init((char *)data, len);
+
+    return server_writev(ctx, &buf, 1, 0);
 }
 
 static void
@@ -689,7 +1117,7 @@ server_connect(rps_ctx_t *ctx) {
 
     ctx->connecting = 1;
 
-    server_timer_reset(ctx);
+    server_phase(ctx, p_connect, ctx->sess->server->timeouts[p_connect]);
 
     return RPS_OK;
 }
@@ -710,6 +1138,7 @@ server_on_request_connect(uv_stream_t *us, int err) {
     rps_ctx_t *request; /* client -> rps */
     int len;
     rps_status_t status;
+    admission_verdict_t verdict;
 
     if (err) {
         UV_SHOW_ERROR(err, "on new connect");
@@ -718,28 +1147,31 @@ server_on_request_connect(uv_stream_t *us, int err) {
 
     s = (struct server*)us->data;
     
-    sess = (struct session*)rps_alloc(sizeof(struct session));
+    sess = (struct session*)rps_alloc_tag(sizeof(struct session), mem_session);
     if (sess == NULL) {
         return;
     }
     server_sess_init(sess, s);
 
-    request = (struct context *)rps_alloc(sizeof(struct context));
+    request = (struct context *)rps_alloc_tag(sizeof(struct context), mem_context);
     if (request == NULL) {
         rps_free(sess);
         return;
     }
     sess->request = request;
-    status = server_ctx_init(request, sess, c_request, s->rtimeout);
+    status = server_ctx_init(request, sess, c_request);
     if (status != RPS_OK) {
         rps_free(sess);
         return;
     }
 
     server_ctx_set_proto(request, s->proto);
+
+    s->nsess++;
+    s->traffic.sessions++;
+    s->traffic.active++;
     
     uv_tcp_init(&s->loop, &request->handle.tcp);
-    uv_timer_init(&s->loop, &request->timer);
 
     err = uv_accept(us, &request->handle.stream);
     if (err) {
@@ -780,8 +1212,28 @@ server_on_request_connect(uv_stream_t *us, int err) {
 
     log_debug("Accept request from %s:%d", request->peername, rps_unresolve_port(&request->peer));
 
+    verdict = admission_enter(&s->admission, &request->peer);
+    switch (verdict) {
+    case admit_ok:
+        sess->admitted = 1;
+        break;
+    case admit_drop:
+        log_debug("Drop request from %s:%d, %s", request->peername, 
+                rps_unresolve_port(&request->peer), admission_verdict_str(verdict));
+        goto error;
+    default:
+        /* answered once the handshake is done, short handshake timeout */
+        sess->rejected = 1;
+        log_debug("Reject request from %s:%d, %s", request->peername, 
+                rps_unresolve_port(&request->peer), admission_verdict_str(verdict));
+    }
+
     request->state = c_handshake_req;
 
+    /* armed before the first byte, a silent client is closed as well */
+    server_phase(request, p_handshake, sess->rejected ? 
+            MIN(s->timeouts[p_handshake], ADMISSION_REJECT_TIMEOUT) : s->timeouts[p_handshake]);
+
     /*
      * Beigin receive data
      */
@@ -797,6 +1249,24 @@ error:
     return;
 }
 
+/* Answer a session rejected by admission control, no upstream is involved. */
+static void
+server_reject(rps_sess_t *sess) {
+    rps_ctx_t *request;
+
+    request = sess->request;
+
+    request->reply_code = rps_rep_overload;
+    request->state = c_reply;
+    server_do_next(request);
+
+    /* flush the reply before close */
+    if (!server_ctx_dead(request)) {
+        request->state = c_will_kill;
+        server_do_next(request);
+    }
+}
+
 static void
 server_switch(rps_sess_t *sess) {
     struct server *s;
@@ -812,24 +1282,47 @@ server_switch(rps_sess_t *sess) {
 
     s = sess->server;
     request = sess->request;
-    /* request stop read, wait for upstream establishment finished */
-    // server_read_stop(request);
+    sess->t_request = server_sess_elapsed(sess);
+
+    if (sess->rejected) {
+        server_reject(sess);
+        return;
+    }
+
+    if (sess->user != NULL && 
+            !user_bucket_session(&s->buckets[sess->user->id])) {
+        log_debug("user %s exceeds session rate", sess->user->uname.data);
+        server_reject(sess);
+        return;
+    }
+
+    if (sess->user != NULL) {
+        traffic_enter(sess->user->traffic, s->id);
+        sess->accounted = 1;
+    }
+
+    /* 
+     * Request stops reading until the upstream is established, bytes sent
+     * on meanwhile wait in the socket instead of overwriting the read buffer.
+     */
+    server_read_stop(request);
 
-    forward = (struct context *)rps_alloc(sizeof(struct context));
+    forward = (struct context *)rps_alloc_tag(sizeof(struct context), mem_context);
     if (forward == NULL) {
         request->state = c_kill;
         server_do_next(request);
         return;
     }
 
-    if (server_ctx_init(forward, sess, c_forward,  s->ftimeout) != RPS_OK) {
+    if (server_ctx_init(forward, sess, c_forward) != RPS_OK) {
         request->state = c_kill;
         server_do_next(request);
         return;
     }
     sess->forward = forward;
-    
-    uv_timer_init(&s->loop, &forward->timer);
+
+    /* one budget for every upstream attempt */
+    server_phase(request, p_establish, s->timeouts[p_establish]);
 
     /*
      *  conext switch from reuqest to forward 
@@ -850,8 +1343,9 @@ server_on_forward_close(uv_handle_t* handle) {
     forward->connected = 0;
     forward->established = 0;
 
-    /* request context may have been free during server_forward_reconn called */
-    if (request == NULL) {
+    /* request context may have been closed during server_forward_reconn called */
+    if (request == NULL || (request->state & c_closed)) {
+        forward->state = c_conn;
         server_ctx_close(forward);
         return;
     }
@@ -885,7 +1379,7 @@ server_forward_reconn(rps_ctx_t *forward) {
     forward->state = c_closing;
 
     uv_read_stop(&forward->handle.stream);
-    uv_timer_stop(&forward->timer);
+    wheel_del(&s->wheel, &forward->timer);
     uv_close(&forward->handle.handle, server_on_forward_close);
     return;
 
@@ -911,6 +1405,7 @@ server_forward_connect(rps_ctx_t *forward) {
 
         if (forward->connected) {
             server_ctx_set_proto(forward, sess->upstream->proto);
+            sess->t_connect = server_sess_elapsed(sess);
 
             /* Connect success */
             log_debug("Connect upstream %s://%s:%d success", rps_proto_str(forward->proto), forward->peername, 
@@ -923,6 +1418,7 @@ server_forward_connect(rps_ctx_t *forward) {
             /* Set forward protocol after upstream has connected */
             forward->reconn = 0;
             forward->state = c_handshake_req;
+            server_phase(forward, p_upstream, s->timeouts[p_upstream]);
             server_do_next(forward);
             return;
         }
@@ -930,16 +1426,22 @@ server_forward_connect(rps_ctx_t *forward) {
         goto reconn;
     }
 
-    sess->upstream = upstreams_get(s->upstreams, sess->request->proto);
+    if (sess->upstream != NULL) {
+        upstreams_put(s->upstreams, sess->upstream);
+    }
+
+    sess->upstream = upstreams_get(s->upstreams, sess->request->proto, &sess->remote, 
+            sess->source);
     if (sess->upstream == NULL) {
-        log_debug("no available %s upstream proxy.", rps_proto_str(sess->request->proto));
+        log_debug("no available %s upstream proxy%s%s.", rps_proto_str(sess->request->proto), 
+                sess->source[0] != '\0' ? " of source " : "", sess->source);
         forward->state = c_failed;
         forward->reply_code = rps_rep_proxy_unavailable;
         server_do_next(forward);
         return;
     }
 
-    memcpy(&forward->peer, &sess->upstream->server, sizeof(sess->upstream->server));
+    rps_inaddr_unpack(&sess->upstream->server, &forward->peer);
 
     if (rps_unresolve_addr(&forward->peer, forward->peername) != RPS_OK) {
         goto reconn;
@@ -1085,6 +1587,30 @@ server_establish_pipeline_tunnel(rps_sess_t *sess) {
 
 static void
 server_establish(rps_sess_t *sess) {
+    struct server *s;
+
+    s = sess->server;
+
+    sess->t_establish = server_sess_elapsed(sess);
+    traffic_enter(sess->upstream->traffic, s->id);
+
+    if (s->timeouts[p_lifetime] > 0) {
+        sess->deadline = uv_now(&s->loop) + s->timeouts[p_lifetime];
+    }
+
+    /* stopped by server_switch, reads after the reply are relayed */
+    if (sess->request->rstat == c_stop && server_read_start(sess->request) != RPS_OK) {
+        sess->request->state = c_kill;
+        server_do_next(sess->request);
+        return;
+    }
+
+    /* from now on reads and writes push the deadlines */
+    sess->request->phase = p_request_idle;
+    server_timer_reset(sess->request);
+    sess->forward->phase = p_forward_idle;
+    server_timer_reset(sess->forward);
+
     switch (sess->request->stream) {
     case c_tunnel:
         server_establish_tunnel(sess);
@@ -1101,16 +1627,119 @@ server_establish(rps_sess_t *sess) {
     default:
         NOT_REACHED();
     }    
+
+    /* handshake data left in the chunks has been consumed */
+    server_rbuf_put(sess->request);
+    server_rbuf_put(sess->forward);
+}
+
+/* 
+ * Pause reading until the user bucket is refilled, the data already read 
+ * has been relayed, nothing is dropped.
+ */
+static void
+server_throttle(rps_ctx_t *ctx) {
+    struct server *s;
+    struct user_bucket *b;
+
+    s = ctx->sess->server;
+    b = &s->buckets[ctx->sess->user->id];
+
+    uv_read_stop(&ctx->handle.stream);
+    ctx->rstat = c_stop;
+
+    wheel_reset(&s->throttle, &ctx->throttle, user_bucket_delay(b));
+}
+
+static void
+server_on_throttle_expire(struct wheel_node *node) {
+    rps_ctx_t *ctx;
+    struct server *s;
+    struct user_bucket *b;
+
+    ctx = (rps_ctx_t *)((char *)node - offsetof(rps_ctx_t, throttle));
+
+    if (server_ctx_dead(ctx)) {
+        return;
+    }
+
+    s = ctx->sess->server;
+    b = &s->buckets[ctx->sess->user->id];
+
+    if (!user_bucket_consume(b, 0)) {
+        wheel_reset(&s->throttle, &ctx->throttle, user_bucket_delay(b));
+        return;
+    }
+
+    /* endpoint backlog resumes it */
+    if (ctx->blocked) {
+        return;
+    }
+
+    if (server_read_start(ctx) != RPS_OK) {
+        ctx->state = c_kill;
+        server_do_next(ctx);
+    }
+}
+
+static void
+server_on_reconcile(uv_timer_t *handle) {
+    struct server *s;
+
+    s = (struct server *)handle->data;
+
+    user_buckets_reconcile(s->buckets, s->nbuckets);
+}
+
+/* Step the read size class up on full reads and down on small ones. */
+static void
+server_rbuf_adapt(rps_ctx_t *ctx, size_t size) {
+    if (size >= ctx->rsize) {
+        ctx->rsmall = 0;
+        if (++ctx->rfull >= BUFPOOL_GROW_READS && ctx->rclass < BUFPOOL_CLASSES - 1) {
+            ctx->rclass++;
+            ctx->rfull = 0;
+        }
+    } else if (size <= ctx->rsize / 4) {
+        ctx->rfull = 0;
+        if (++ctx->rsmall >= BUFPOOL_SHRINK_READS && ctx->rclass > 0) {
+            ctx->rclass--;
+            ctx->rsmall = 0;
+        }
+    } else {
+        ctx->rfull = 0;
+        ctx->rsmall = 0;
+    }
+}
+
+/* Resume a read paused for the backlog of its endpoint. */
+static void
+server_unblock(rps_ctx_t *ctx) {
+    if (server_ctx_dead(ctx) || !ctx->blocked) {
+        return;
+    }
+
+    ctx->blocked = 0;
+
+    /* bandwidth limit resumes it */
+    if (wheel_node_pending(&ctx->throttle)) {
+        return;
+    }
+
+    if (server_read_start(ctx) != RPS_OK) {
+        ctx->state = c_kill;
+        server_do_next(ctx);
+    }
 }
 
 static void
 server_cycle(rps_ctx_t *ctx) {
-    uint8_t    *data;
     size_t     size;
     rps_sess_t  *sess;
     rps_ctx_t   *endpoint;
+    struct bufchunk *chunk;
+    rps_status_t status;
 
-    data = (uint8_t *)ctx->rbuf;
     size = (size_t)ctx->nread;
 
     sess = ctx->sess;
@@ -1141,12 +1770,41 @@ server_cycle(rps_ctx_t *ctx) {
         return;
     }
     
-    if (server_write(endpoint, data, size) != RPS_OK) {
+    server_rbuf_adapt(ctx, size);
+
+    /* hand the chunk read into over to endpoint, no copy */
+    ASSERT(ctx->rchunk != NULL);
+    chunk = ctx->rchunk;
+    chunk->len = size;
+    ctx->rchunk = NULL;
+    ctx->rbuf = NULL;
+    ctx->rsize = 0;
+    status = server_write_chunk(endpoint, chunk);
+
+    if (status != RPS_OK) {
         ctx->state = c_kill;
         server_do_next(ctx);
         return;
     }
 
+    if (ctx->flag == c_request) {
+        server_account(sess, size, 0);
+    } else {
+        server_account(sess, 0, size);
+    }
+
+    if (sess->user != NULL && 
+            !user_bucket_consume(&sess->server->buckets[sess->user->id], size)) {
+        server_throttle(ctx);
+    }
+
+    /* pause until endpoint drained its backlog */
+    if (endpoint->wqueued >= WRITE_BACKLOG_HIGH) {
+        uv_read_stop(&ctx->handle.stream);
+        ctx->rstat = c_stop;
+        ctx->blocked = 1;
+    }
+
 #ifdef RPS_DEBUG_OPEN
     log_verb("redirect %d bytes to %s:%d", 
             size, endpoint->peername, rps_unresolve_port(&endpoint->peer));
@@ -1202,6 +1860,8 @@ server_do_next(rps_ctx_t *ctx) {
             break;
         case c_established:
             server_cycle(ctx);
+            /* chunk not passed on holds dropped data */
+            server_rbuf_put(ctx);
             break;
         case c_will_kill:
             server_ctx_shutdown(ctx);
@@ -1224,19 +1884,207 @@ server_do_next(rps_ctx_t *ctx) {
 }
 
 
+bool
+server_auth_required(struct server *s) {
+    if (!string_empty(&s->cfg->username) && !string_empty(&s->cfg->password)) {
+        return true;
+    }
+
+    return users_enabled(s->users);
+}
+
+/* 
+ * Verify client credentials against the listener account, then user accounts.
+ * A username of account-source-name authenticates account and routes the
+ * session to upstreams of source name, else to the source of the user if any.
+ * Credentials are compared in constant time, never copied.
+ */
+bool
+server_auth(rps_sess_t *sess, const char *uname, size_t ulen, 
+        const char *passwd, size_t plen) {
+    struct server *s;
+    struct user *user;
+    const char *route;
+    size_t rlen;
+    char source[UPSTREAM_SOURCE_MAX_LENGTH];
+
+    s = sess->server;
+
+    /* the session takes the source only once credentials are verified */
+    source[0] = '\0';
+
+    route = memmem(uname, ulen, UPSTREAM_ROUTE_SOURCE, strlen(UPSTREAM_ROUTE_SOURCE));
+    if (route != NULL) {
+        rlen = ulen - (size_t)(route - uname) - strlen(UPSTREAM_ROUTE_SOURCE);
+        if (route == uname || rlen == 0 || rlen >= sizeof(source)) {
+            return false;
+        }
+        memcpy(source, route + strlen(UPSTREAM_ROUTE_SOURCE), rlen);
+        source[rlen] = '\0';
+        ulen = (size_t)(route - uname);
+    }
+
+    if (!string_empty(&s->cfg->username) && 
+            rps_memeq_ct(uname, ulen, s->cfg->username.data, s->cfg->username.len) &&
+            rps_memeq_ct(passwd, plen, s->cfg->password.data, s->cfg->password.len)) {
+        strcpy(sess->source, source);
+        return true;
+    }
+
+    user = users_auth(s->users, uname, ulen, passwd, plen, source);
+    if (user == NULL) {
+        return false;
+    }
+
+    if (user_buckets_get(&s->buckets, &s->nbuckets, user) == NULL) {
+        return false;
+    }
+
+    sess->user = user;
+    strcpy(sess->source, source);
+
+    return true;
+}
+
+/* credentials verified before by this server, see server_auth_cache */
+bool
+server_auth_cached(rps_sess_t *sess, const uint8_t *key, size_t len) {
+    struct user_cache_entry *e;
+
+    e = user_cache_get(sess->server->authcache, sess->server->users, key, len);
+    if (e == NULL) {
+        return false;
+    }
+
+    sess->user = e->user;
+    strcpy(sess->source, e->source);
+
+    return true;
+}
+
+/* remember credentials key which server_auth accepted, gen read before it */
+void
+server_auth_cache(rps_sess_t *sess, uint32_t gen, const uint8_t *key, size_t len) {
+    user_cache_put(sess->server->authcache, gen, key, len, sess->user, sess->source);
+}
+
+/* 
+ * Take over a listening socket inherited from the previous process 
+ * if it is bound to our listen address.
+ */
+rps_status_t
+server_inherit(struct server *s, int fd) {
+    struct sockaddr_storage addr;
+    struct sockaddr_in *in, *lin;
+    struct sockaddr_in6 *in6, *lin6;
+    socklen_t len;
+
+    len = sizeof(addr);
+    if (getsockname(fd, (struct sockaddr *)&addr, &len) < 0) {
+        return RPS_ERROR;
+    }
+
+    if (addr.ss_family != s->listen.family) {
+        return RPS_ERROR;
+    }
+
+    switch (addr.ss_family) {
+    case AF_INET:
+        in = (struct sockaddr_in *)&addr;
+        lin = &s->listen.addr.in;
+        if (in->sin_port != lin->sin_port || 
+                in->sin_addr.s_addr != lin->sin_addr.s_addr) {
+            return RPS_ERROR;
+        }
+        break;
+    case AF_INET6:
+        in6 = (struct sockaddr_in6 *)&addr;
+        lin6 = &s->listen.addr.in6;
+        if (in6->sin6_port != lin6->sin6_port || 
+                memcmp(&in6->sin6_addr, &lin6->sin6_addr, sizeof(in6->sin6_addr)) != 0) {
+            return RPS_ERROR;
+        }
+        break;
+    default:
+        return RPS_ERROR;
+    }
+
+    s->fd = fd;
+
+    return RPS_OK;
+}
+
+static void
+server_on_drain_timer(uv_timer_t *handle) {
+    struct server *s;
+
+    s = (struct server *)handle->data;
+
+    if (s->nsess > 0 && uv_now(&s->loop) < s->drain_deadline) {
+        return;
+    }
+
+    if (s->nsess > 0) {
+        log_warn("%s proxy on %s:%d drain timeout, drop %d sessions", 
+                s->cfg->proto.data, s->cfg->listen.data, s->cfg->port, s->nsess);
+    } else {
+        log_notice("%s proxy on %s:%d drained", 
+                s->cfg->proto.data, s->cfg->listen.data, s->cfg->port);
+    }
+
+    uv_stop(&s->loop);
+}
+
+static void
+server_on_drain(uv_async_t *handle) {
+    struct server *s;
+
+    s = (struct server *)handle->data;
+
+    if (s->drain_deadline != 0) {
+        return;
+    }
+
+    /* stop accepting, the listening socket lives on in the new process */
+    uv_close((uv_handle_t *)&s->us, NULL);
+
+    s->drain_deadline = uv_now(&s->loop) + s->drain_timeout;
+
+    log_notice("%s proxy on %s:%d stop accepting, draining %d sessions", 
+            s->cfg->proto.data, s->cfg->listen.data, s->cfg->port, s->nsess);
+
+    uv_timer_start(&s->drain_timer, server_on_drain_timer, 0, SERVER_DRAIN_INTERVAL);
+}
+
+/* 
+ * Stop accepting and leave server_run once all sessions finished or 
+ * timeout expired. Called from other threads.
+ */
+void
+server_drain(struct server *s, uint32_t timeout) {
+    s->drain_timeout = timeout;
+    uv_async_send(&s->drain);
+}
+
 void 
 server_run(struct server *s) {
     int err;
 
     /* wait for upstreams load success */
-    uv_mutex_lock(&s->upstreams->mutex);
-    uv_cond_wait(&s->upstreams->ready, &s->upstreams->mutex);
-    uv_mutex_unlock(&s->upstreams->mutex);
+    upstreams_wait(s->upstreams);
 
-    err = uv_tcp_bind(&s->us, (struct sockaddr *)&s->listen.addr, 0);
-    if (err) {
-        UV_SHOW_ERROR(err, "bind");
-        exit(1);
+    if (s->fd >= 0) {
+        err = uv_tcp_open(&s->us, s->fd);
+        if (err) {
+            UV_SHOW_ERROR(err, "open inherited listener");
+            exit(1);
+        }
+    } else {
+        err = uv_tcp_bind(&s->us, (struct sockaddr *)&s->listen.addr, 0);
+        if (err) {
+            UV_SHOW_ERROR(err, "bind");
+            exit(1);
+        }
     }
     
     err = uv_listen((uv_stream_t*)&s->us, TCP_BACKLOG, server_on_request_connect);
@@ -1245,7 +2093,12 @@ server_run(struct server *s) {
         exit(1);
     }
 
-    log_notice("%s proxy run on %s:%d", s->cfg->proto.data, s->cfg->listen.data, s->cfg->port);
+    log_notice("%s proxy run on %s:%d%s", s->cfg->proto.data, s->cfg->listen.data, s->cfg->port,
+            s->fd >= 0 ? " (inherited)" : "");
+
+    if (s->listening != NULL) {
+        uv_sem_post(s->listening);
+    }
 
     uv_run(&s->loop, UV_RUN_DEFAULT);
 }
@@ -6,6 +6,12 @@
 #include "util.h"
 #include "_string.h"
 #include "upstream.h"
+#include "accesslog.h"
+#include "wheel.h"
+#include "admission.h"
+#include "users.h"
+#include "bufpool.h"
+#include "uring.h"
 
 #include <uv.h>
 
@@ -13,9 +19,12 @@
 
 #define TCP_BACKLOG  65536
 #define TCP_KEEPALIVE_DELAY 120
+#define SERVER_DRAIN_INTERVAL   1000    /* ms */
+#define SERVER_WRITEV_MAX       8       /* bufs of one server_writev */
 
 
 struct server {
+    uint32_t                id;     /* traffic slot of this thread */
     uv_loop_t               loop;   
     uv_tcp_t                us; /* libuv tcp server */
 
@@ -23,22 +32,66 @@ struct server {
     
     rps_addr_t              listen;
     
-    uint32_t                rtimeout; /* request context timeout */
-    uint32_t                ftimeout; /* forward context timeout */
+    /* ms by phase, see CTX_PHASE_MAP, and expiries of each */
+    uint32_t                timeouts[p_max];
+    uint64_t                expired[p_max];
 
     struct config_server    *cfg;
 
     struct upstreams        *upstreams;
+
+    struct accesslog        alog;
+
+    struct wheel            wheel;  /* context timeouts */
+
+    struct bufpool          rpool;  /* read buffers of established tunnels */
+
+    struct uring            uring;  /* io_uring data plane, unused unless enabled */
+
+    struct admission        admission;
+
+    /* user accounts shared by servers, tokens leased by this thread */
+    struct users            *users;
+    struct user_bucket      *buckets;   /* by user id */
+    uint32_t                nbuckets;
+    struct user_cache       *authcache; /* verified Proxy-Authorization values */
+    struct wheel            throttle;   /* reads paused by bandwidth limit */
+    uv_timer_t              reconcile;
+
+    int                     fd;     /* inherited listening socket, -1 if none */
+    uv_sem_t                *listening; /* posted once listening, may be NULL */
+
+    uint32_t                nsess;  /* live sessions */
+
+    struct traffic_slot     traffic;    /* listener totals, written by this thread only */
+
+    /* graceful shutdown on restart */
+    uv_async_t              drain;
+    uv_timer_t              drain_timer;
+    uint32_t                drain_timeout;
+    uint64_t                drain_deadline;
 };
 
-rps_status_t server_init(struct server *s, struct config_server *cs, 
-        struct upstreams *us, uint32_t rtimeout, uint32_t ftimeout);
+rps_status_t server_init(struct server *s, uint32_t id, struct config_server *cs, 
+        struct upstreams *us, struct users *users, struct config_accesslog *ca,
+        struct config_servers *css);
 void server_deinit(struct server *s);
 void server_run(struct server *s);
-// void server_stop(struct server *);
+rps_status_t server_inherit(struct server *s, int fd);
+void server_drain(struct server *s, uint32_t timeout);
 
 void server_do_next(rps_ctx_t *ctx);
 
+bool server_auth_required(struct server *s);
+bool server_auth(rps_sess_t *sess, const char *uname, size_t ulen, 
+        const char *passwd, size_t plen);
+bool server_auth_cached(rps_sess_t *sess, const uint8_t *key, size_t len);
+void server_auth_cache(rps_sess_t *sess, uint32_t gen, const uint8_t *key, size_t len);
+
 rps_status_t server_write(struct context *ctx, const void *data, size_t len);
+rps_status_t server_writev(struct context *ctx, const uv_buf_t *bufs, unsigned int nbufs,
+        uint32_t inplace);
+void server_account(rps_sess_t *sess, size_t nup, size_t ndown);
+void server_timer_reset(rps_ctx_t *ctx);
 
 #endif
@@ -0,0 +1,439 @@
+#define RPS_MEM_TAG mem_upstream
+
+#include "core.h"
+#include "snapshot.h"
+#include "upstream.h"
+#include "_string.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define SNAPSHOT_ALIGN(_n)  (((_n) + 7) & ~((size_t)7))
+
+struct snapshot_writer {
+    int         fd;
+    uint8_t     *buf;
+    size_t      len;
+    size_t      offset;     /* bytes flushed into file */
+};
+
+static rps_status_t
+snapshot_flush(struct snapshot_writer *w) {
+    ssize_t n;
+    size_t done;
+
+    done = 0;
+
+    while (done < w->len) {
+        n = pwrite(w->fd, w->buf + done, w->len - done, w->offset + done);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_error("write snapshot failed: %s", strerror(errno));
+            return RPS_ERROR;
+        }
+        done += n;
+    }
+
+    w->offset += w->len;
+    w->len = 0;
+
+    return RPS_OK;
+}
+
+static rps_status_t
+snapshot_put(struct snapshot_writer *w, const void *data, size_t len) {
+    const uint8_t *p;
+    size_t n;
+
+    p = data;
+
+    while (len > 0) {
+        if (w->len == SNAPSHOT_BUFFER_SIZE) {
+            if (snapshot_flush(w) != RPS_OK) {
+                return RPS_ERROR;
+            }
+        }
+
+        n = MIN(len, SNAPSHOT_BUFFER_SIZE - w->len);
+        memcpy(w->buf + w->len, p, n);
+        w->len += n;
+        p += n;
+        len -= n;
+    }
+
+    return RPS_OK;
+}
+
+static rps_status_t
+snapshot_put_upstream(struct snapshot_writer *w, struct upstream *u) {
+    struct snapshot_record rec;
+    rps_addr_t addr;
+    rps_queue_t *timewheel;
+    uint32_t i, n;
+    int64_t ts;
+    size_t tail;
+    static const uint8_t pad[8];
+
+    memset(&rec, 0, sizeof(rec));
+
+    timewheel = &u->timewheel;
+    n = queue_is_null(timewheel) ? 0 : queue_n(timewheel);
+
+    tail = n * sizeof(int64_t) + u->uname.len + u->passwd.len + u->source.len;
+
+    rec.size = (uint32_t)SNAPSHOT_ALIGN(sizeof(rec) + tail);
+    rec.proto = (uint8_t)u->proto;
+    rec.enable = u->enable;
+    rec.weight = u->weight;
+    rec.success = u->success;
+    rec.failure = u->failure;
+    rec.insert_date = u->insert_date;
+    rec.expire_date = u->expire_date;
+    rec.uname_len = (uint16_t)u->uname.len;
+    rec.passwd_len = (uint16_t)u->passwd.len;
+    rec.source_len = (uint16_t)u->source.len;
+    rps_inaddr_unpack(&u->server, &addr);
+    rec.addrlen = (uint16_t)MIN(addr.addrlen, sizeof(rec.addr));
+    rec.ntimestamp = n;
+    rec.flags = 0;
+    memcpy(rec.addr, &addr.addr, rec.addrlen);
+
+    if (snapshot_put(w, &rec, sizeof(rec)) != RPS_OK) {
+        return RPS_ERROR;
+    }
+
+    for (i = 0; i < n; i++) {
+        ts = (int64_t)(rps_ts_t)timewheel->elts[(timewheel->head + i) % timewheel->nelts];
+        if (snapshot_put(w, &ts, sizeof(ts)) != RPS_OK) {
+            return RPS_ERROR;
+        }
+    }
+
+    if (snapshot_put(w, u->uname.data, u->uname.len) != RPS_OK ||
+            snapshot_put(w, u->passwd.data, u->passwd.len) != RPS_OK ||
+            snapshot_put(w, u->source.data, u->source.len) != RPS_OK) {
+        return RPS_ERROR;
+    }
+
+    return snapshot_put(w, pad, rec.size - sizeof(rec) - tail);
+}
+
+/*
+ * Dump all upstream pools into fd from offset 0.
+ * Pools are locked one by one, counters still being updated by servers
+ * are copied as is.
+ */
+rps_status_t
+snapshot_write(struct upstreams *us, int fd) {
+    struct snapshot_writer w;
+    struct snapshot_header hdr;
+    struct upstream_pool *up;
+    struct upstream_slab *slab;
+    struct upstream *u;
+    rps_status_t status;
+    uint32_t i, n;
+    size_t size;
+
+    w.fd = fd;
+    w.len = 0;
+    w.offset = sizeof(hdr);
+    w.buf = rps_alloc(SNAPSHOT_BUFFER_SIZE);
+    if (w.buf == NULL) {
+        return RPS_ENOMEM;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    hdr.version = SNAPSHOT_VERSION;
+    hdr.record_size = sizeof(struct snapshot_record);
+    hdr.created = rps_now();
+
+    status = RPS_OK;
+
+    n = array_n(&us->pools);
+    for (i = 0; i < n && status == RPS_OK; i++) {
+        up = (struct upstream_pool *)array_get(&us->pools, i);
+
+        uv_rwlock_rdlock(&up->rwlock);
+        upstream_pool_foreach(up, slab, u) {
+            if (status != RPS_OK) {
+                break;
+            }
+            status = snapshot_put_upstream(&w, u);
+            if (status == RPS_OK) {
+                hdr.count++;
+            }
+        }
+        uv_rwlock_rdunlock(&up->rwlock);
+    }
+
+    if (status == RPS_OK) {
+        status = snapshot_flush(&w);
+    }
+    size = w.offset;
+
+    /* header goes last, a truncated snapshot never looks complete */
+    if (status == RPS_OK) {
+        w.offset = 0;
+        w.len = sizeof(hdr);
+        memcpy(w.buf, &hdr, sizeof(hdr));
+        status = snapshot_flush(&w);
+    }
+
+    rps_free(w.buf);
+
+    if (status == RPS_OK) {
+        log_debug("snapshot %d upstreams, %zu bytes", hdr.count, size);
+    }
+
+    return status;
+}
+
+static struct upstream *
+snapshot_get_upstream(struct upstreams *us, struct snapshot_record *rec) {
+    struct upstream *u;
+    struct sockaddr *sa;
+    rps_addr_t addr;
+    int64_t *ts;
+    uint8_t *p;
+    uint32_t i, n;
+
+    u = rps_alloc(sizeof(struct upstream));
+    if (u == NULL) {
+        return NULL;
+    }
+    upstream_init(u);
+
+    u->proto = (rps_proto_t)rec->proto;
+    u->enable = rec->enable;
+    u->weight = rec->weight;
+    u->success = rec->success;
+    u->failure = rec->failure;
+    /* sessions in flight are accounted by the old process */
+    u->count = rec->success + rec->failure;
+    u->insert_date = (rps_ts_t)rec->insert_date;
+    u->expire_date = (rps_ts_t)rec->expire_date;
+    u->stale = 1;
+
+    sa = (struct sockaddr *)rec->addr;
+    rps_addrinfo(sa, &addr, rec->addrlen);
+    if (rps_inaddr_pack(&u->server, &addr) != RPS_OK) {
+        goto error;
+    }
+
+    ts = (int64_t *)(rec + 1);
+    p = (uint8_t *)(ts + rec->ntimestamp);
+
+    if (strtab_intern(&u->uname, (char *)p, rec->uname_len) != RPS_OK ||
+            strtab_intern(&u->passwd, (char *)p + rec->uname_len, rec->passwd_len) != RPS_OK ||
+            strtab_intern(&u->source, (char *)p + rec->uname_len + rec->passwd_len, 
+                rec->source_len) != RPS_OK) {
+        goto error;
+    }
+
+    if (rec->ntimestamp > 0) {
+        if (upstream_init_timewheel(u, us->mr1m, us->mr1h, us->mr1d) != RPS_OK) {
+            goto error;
+        }
+        /* keep the newest timestamps if the wheel shrank */
+        n = rec->ntimestamp;
+        i = n > u->timewheel.nelts ? n - u->timewheel.nelts : 0;
+        for (; i < n; i++) {
+            queue_en(&u->timewheel, (void *)(rps_ts_t)ts[i]);
+        }
+    }
+
+    return u;
+
+error:
+    upstream_deinit(u);
+    rps_free(u);
+    return NULL;
+}
+
+/*
+ * Load upstreams from a snapshot into the pools, upstreams already in a
+ * pool are kept and expired ones are skipped. Pools become ready if 
+ * anything is loaded. Loaded upstreams are stale until the api confirms.
+ */
+rps_status_t
+snapshot_read(struct upstreams *us, int fd) {
+    struct stat st;
+    struct snapshot_header *hdr;
+    struct snapshot_record *rec;
+    struct upstream *u;
+    uint8_t *base;
+    size_t size, offset, tail;
+    uint32_t i, loaded;
+    int64_t created, now;
+    rps_status_t status;
+
+    if (fstat(fd, &st) < 0) {
+        log_error("stat snapshot failed: %s", strerror(errno));
+        return RPS_ERROR;
+    }
+
+    size = (size_t)st.st_size;
+    if (size < sizeof(*hdr)) {
+        log_error("snapshot too short: %zu bytes", size);
+        return RPS_ERROR;
+    }
+
+    base = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (base == MAP_FAILED) {
+        log_error("mmap snapshot failed: %s", strerror(errno));
+        return RPS_ERROR;
+    }
+
+    hdr = (struct snapshot_header *)base;
+    if (memcmp(hdr->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0 ||
+            hdr->version != SNAPSHOT_VERSION ||
+            hdr->record_size != sizeof(struct snapshot_record)) {
+        log_error("invalid snapshot header");
+        munmap(base, size);
+        return RPS_ERROR;
+    }
+
+    status = RPS_OK;
+    loaded = 0;
+    created = hdr->created;
+    offset = sizeof(*hdr);
+    now = rps_now();
+
+    for (i = 0; i < hdr->count; i++) {
+        rec = (struct snapshot_record *)(base + offset);
+        if (offset + sizeof(*rec) > size) {
+            status = RPS_ERROR;
+            break;
+        }
+
+        tail = (size_t)rec->ntimestamp * sizeof(int64_t) +
+            rec->uname_len + rec->passwd_len + rec->source_len;
+        if (rec->size < sizeof(*rec) + tail || offset + rec->size > size ||
+                rec->addrlen > sizeof(rec->addr)) {
+            status = RPS_ERROR;
+            break;
+        }
+        offset += rec->size;
+
+        if (rec->expire_date != 0 && rec->expire_date <= now) {
+            continue;
+        }
+
+        u = snapshot_get_upstream(us, rec);
+        if (u == NULL) {
+            status = RPS_ENOMEM;
+            break;
+        }
+
+        if (upstreams_add(us, u) != RPS_OK) {
+            upstream_deinit(u);
+            rps_free(u);
+            continue;
+        }
+        rps_free(u);
+        loaded++;
+    }
+
+    munmap(base, size);
+
+    if (status != RPS_OK) {
+        log_error("snapshot corrupted at record %d", i);
+    }
+
+    log_notice("load %d upstreams from snapshot created at %ld", loaded, (long)created);
+
+    if (loaded > 0) {
+        upstreams_rehash(us);
+        upstreams_ready(us);
+    }
+
+    return status;
+}
+
+/* write to a temporary file and rename, readers never see a partial file */
+rps_status_t
+snapshot_save(struct upstreams *us, const char *path) {
+    char tmp[SNAPSHOT_PATH_MAX_LENGTH];
+    int fd;
+    rps_status_t status;
+
+    /* 
+     * Old and new process of a hot restart may save at once, each writes a
+     * temp file of its own so neither renames a file the other truncated.
+     */
+    if (snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path) >= (int)sizeof(tmp)) {
+        log_error("snapshot path '%s' too long", path);
+        return RPS_ERROR;
+    }
+
+    fd = mkstemp(tmp);
+    if (fd < 0) {
+        log_error("create snapshot '%s' failed: %s", tmp, strerror(errno));
+        return RPS_ERROR;
+    }
+
+    status = snapshot_write(us, fd);
+    if (status == RPS_OK && fchmod(fd, 0644) < 0) {
+        log_error("chmod snapshot '%s' failed: %s", tmp, strerror(errno));
+        status = RPS_ERROR;
+    }
+    if (status == RPS_OK && fsync(fd) < 0) {
+        log_error("fsync snapshot '%s' failed: %s", tmp, strerror(errno));
+        status = RPS_ERROR;
+    }
+
+    close(fd);
+
+    if (status == RPS_OK && rename(tmp, path) < 0) {
+        log_error("rename snapshot '%s' failed: %s", tmp, strerror(errno));
+        status = RPS_ERROR;
+    }
+
+    if (status != RPS_OK) {
+        unlink(tmp);
+    }
+
+    return status;
+}
+
+rps_status_t
+snapshot_load(struct upstreams *us, const char *path) {
+    int fd;
+    rps_status_t status;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        log_notice("no snapshot loaded from '%s': %s", path, strerror(errno));
+        return RPS_ERROR;
+    }
+
+    status = snapshot_read(us, fd);
+
+    close(fd);
+
+    return status;
+}
+
+/* crontab, persist pools once they are loaded */
+void
+snapshot_persist(uv_timer_t *handle) {
+    struct upstreams *us;
+
+    us = (struct upstreams *)handle->data;
+
+    /* never overwrite a good snapshot with empty pools */
+    if (!us->once) {
+        return;
+    }
+
+    if (snapshot_save(us, (char *)us->snapshot.data) == RPS_OK) {
+        log_info("save upstream pools snapshot to '%s'", us->snapshot.data);
+    }
+}
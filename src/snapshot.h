@@ -0,0 +1,62 @@
+#ifndef _RPS_SNAPSHOT_H
+#define _RPS_SNAPSHOT_H
+
+#include "core.h"
+#include "upstream.h"
+
+#include <stdint.h>
+
+/*
+ * Upstream pool snapshot, a flat image of every upstream pool with its
+ * counters and rate-limit timewheel, so that a new process starts with the
+ * state of the old one instead of a cold pool.
+ *
+ *  +--------+--------------------------------------------+-----+
+ *  | header | record | timestamps | uname passwd source | ... |
+ *  +--------+--------------------------------------------+-----+
+ *
+ * Records are variable-size and 8 bytes aligned. Integers are stored in host
+ * byte order, a snapshot is only loaded on the host which wrote it.
+ */
+
+#define SNAPSHOT_MAGIC              "RPSSNAP"
+#define SNAPSHOT_VERSION            1
+#define SNAPSHOT_BUFFER_SIZE        (64 * 1024)
+#define SNAPSHOT_PATH_MAX_LENGTH    1024
+
+/* Record flags, none defined, bit 0 was a lock-step flag of upstreams */
+
+struct snapshot_header {
+    char        magic[8];
+    uint32_t    version;
+    uint32_t    record_size;    /* fixed part of record */
+    uint32_t    count;          /* records */
+    uint32_t    reserved;
+    int64_t     created;        /* seconds since epoch */
+};
+
+struct snapshot_record {
+    uint32_t    size;           /* whole record including the tail */
+    uint8_t     proto;
+    uint8_t     enable;
+    uint16_t    weight;
+    uint32_t    success;
+    uint32_t    failure;
+    int64_t     insert_date;
+    int64_t     expire_date;
+    uint16_t    uname_len;
+    uint16_t    passwd_len;
+    uint16_t    source_len;
+    uint16_t    addrlen;
+    uint32_t    ntimestamp;     /* timewheel entries, oldest first */
+    uint32_t    flags;
+    uint8_t     addr[32];       /* struct sockaddr_in or sockaddr_in6 */
+};
+
+rps_status_t snapshot_write(struct upstreams *us, int fd);
+rps_status_t snapshot_read(struct upstreams *us, int fd);
+rps_status_t snapshot_save(struct upstreams *us, const char *path);
+rps_status_t snapshot_load(struct upstreams *us, const char *path);
+void snapshot_persist(uv_timer_t *handle);
+
+#endif
@@ -0,0 +1,121 @@
+#define RPS_MEM_TAG mem_upstream
+
+#include "strtab.h"
+#include "hashmap.h"
+#include "util.h"
+
+#include <uv.h>
+
+struct strtab_entry {
+    uint32_t    refs;
+    uint32_t    len;
+    uint8_t     data[1];
+};
+
+static rps_hashmap_t strtab;
+static uv_mutex_t strtab_mutex;
+static uv_once_t strtab_once = UV_ONCE_INIT;
+static size_t strtab_bytes;
+
+#define strtab_entry(_data) \
+    ((struct strtab_entry *)((uint8_t *)(_data) - offsetof(struct strtab_entry, data)))
+
+static void
+strtab_init(void) {
+    uv_mutex_init(&strtab_mutex);
+    if (hashmap_init(&strtab, STRTAB_BUCKETS, HASHMAP_DEFAULT_COLLISIONS) != RPS_OK) {
+        log_error("init string table failed");
+        abort();
+    }
+}
+
+/* dst shares the entry of s, empty s leaves dst empty */
+rps_status_t
+strtab_intern(rps_str_t *dst, const char *s, size_t len) {
+    struct strtab_entry *e;
+    void *v;
+    size_t size;
+
+    ASSERT(dst->data == NULL && dst->len == 0);
+
+    if (len == 0) {
+        return RPS_OK;
+    }
+
+    uv_once(&strtab_once, strtab_init);
+    uv_mutex_lock(&strtab_mutex);
+
+    v = hashmap_get(&strtab, (void *)s, len, &size);
+    if (v != NULL) {
+        e = (struct strtab_entry *)*(void **)v;
+        e->refs++;
+    } else {
+        e = rps_alloc(offsetof(struct strtab_entry, data) + len + 1);
+        if (e == NULL) {
+            uv_mutex_unlock(&strtab_mutex);
+            return RPS_ENOMEM;
+        }
+        e->refs = 1;
+        e->len = (uint32_t)len;
+        memcpy(e->data, s, len);
+        e->data[len] = '\0';
+        hashmap_set(&strtab, e->data, len, &e, sizeof(e));
+        strtab_bytes += offsetof(struct strtab_entry, data) + len + 1;
+    }
+
+    uv_mutex_unlock(&strtab_mutex);
+
+    dst->data = e->data;
+    dst->len = len;
+
+    return RPS_OK;
+}
+
+/* src must be interned or empty */
+void
+strtab_ref(rps_str_t *dst, const rps_str_t *src) {
+    ASSERT(dst->data == NULL && dst->len == 0);
+
+    if (src->len == 0) {
+        return;
+    }
+
+    uv_mutex_lock(&strtab_mutex);
+    strtab_entry(src->data)->refs++;
+    uv_mutex_unlock(&strtab_mutex);
+
+    dst->data = src->data;
+    dst->len = src->len;
+}
+
+void
+strtab_release(rps_str_t *str) {
+    struct strtab_entry *e;
+
+    if (str->len == 0) {
+        string_init(str);
+        return;
+    }
+
+    e = strtab_entry(str->data);
+
+    uv_mutex_lock(&strtab_mutex);
+    ASSERT(e->refs > 0);
+    if (--e->refs == 0) {
+        hashmap_remove(&strtab, e->data, e->len);
+        strtab_bytes -= offsetof(struct strtab_entry, data) + e->len + 1;
+        rps_free(e);
+    }
+    uv_mutex_unlock(&strtab_mutex);
+
+    string_init(str);
+}
+
+void
+strtab_stats(uint32_t *n, size_t *bytes) {
+    uv_once(&strtab_once, strtab_init);
+    uv_mutex_lock(&strtab_mutex);
+    *n = hashmap_n(&strtab);
+    *bytes = strtab_bytes;
+    uv_mutex_unlock(&strtab_mutex);
+}
@@ -0,0 +1,30 @@
+#ifndef _RPS_STRTAB_H
+#define _RPS_STRTAB_H
+
+#include "core.h"
+#include "_string.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Interned strings of upstream records.
+ *
+ * Credentials and sources repeat over thousands of upstreams and over the
+ * pools of every proto, the table keeps a single refcounted copy of each.
+ * An interned string is a read-only rps_str_t pointing into its entry, so
+ * readers use it like any other string, but it is taken with strtab_intern
+ * or strtab_ref and given back with strtab_release, never string_deinit.
+ *
+ * The table is process wide behind a mutex, it is touched only when
+ * upstreams are loaded, copied or recycled, never on the session path.
+ */
+
+#define STRTAB_BUCKETS  1024
+
+rps_status_t strtab_intern(rps_str_t *dst, const char *s, size_t len);
+void strtab_ref(rps_str_t *dst, const rps_str_t *src);
+void strtab_release(rps_str_t *str);
+void strtab_stats(uint32_t *n, size_t *bytes);
+
+#endif
@@ -0,0 +1,86 @@
+#include "core.h"
+#include "traffic.h"
+#include "util.h"
+
+void
+traffic_slot_init(struct traffic_slot *slot) {
+    slot->nup = 0;
+    slot->ndown = 0;
+    slot->sessions = 0;
+    slot->active = 0;
+    slot->elapsed = 0;
+}
+
+struct traffic *
+traffic_create(uint32_t n) {
+    struct traffic *t;
+    uintptr_t p;
+    uint32_t i;
+
+    if (n == 0) {
+        return NULL;
+    }
+
+    t = (struct traffic *)rps_alloc(sizeof(struct traffic));
+    if (t == NULL) {
+        return NULL;
+    }
+
+    /* one more slot to align the first to a cache line */
+    t->base = rps_alloc((n + 1) * sizeof(struct traffic_slot));
+    if (t->base == NULL) {
+        rps_free(t);
+        return NULL;
+    }
+
+    p = ((uintptr_t)t->base + TRAFFIC_CACHE_LINE - 1) & ~(uintptr_t)(TRAFFIC_CACHE_LINE - 1);
+    t->slots = (struct traffic_slot *)p;
+    t->n = n;
+
+    for (i = 0; i < n; i++) {
+        traffic_slot_init(&t->slots[i]);
+    }
+
+    return t;
+}
+
+void
+traffic_destroy(struct traffic *t) {
+    if (t == NULL) {
+        return;
+    }
+
+    rps_free(t->base);
+    rps_free(t);
+}
+
+/* bytes allocated for t */
+size_t
+traffic_size(struct traffic *t) {
+    if (t == NULL) {
+        return 0;
+    }
+
+    return sizeof(struct traffic) + (t->n + 1) * sizeof(struct traffic_slot);
+}
+
+void
+traffic_sum(struct traffic *t, struct traffic_slot *total) {
+    uint32_t i;
+    struct traffic_slot *slot;
+
+    traffic_slot_init(total);
+
+    if (t == NULL) {
+        return;
+    }
+
+    for (i = 0; i < t->n; i++) {
+        slot = &t->slots[i];
+        total->nup += slot->nup;
+        total->ndown += slot->ndown;
+        total->sessions += slot->sessions;
+        total->active += slot->active;
+        total->elapsed += slot->elapsed;
+    }
+}
@@ -0,0 +1,64 @@
+#ifndef _RPS_TRAFFIC_H
+#define _RPS_TRAFFIC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Traffic counters of an upstream or a user, shared by server threads.
+ *
+ * Each server thread owns one slot and is its only writer, so counting is
+ * a plain add without atomics. Slots are padded to a cache line to keep
+ * threads off each other's lines, readers sum the slots without locking
+ * and may see a slightly stale total.
+ */
+
+#define TRAFFIC_CACHE_LINE  64
+
+struct traffic_slot {
+    uint64_t    nup;        /* bytes client -> remote */
+    uint64_t    ndown;      /* bytes remote -> client */
+    uint64_t    sessions;   /* sessions started */
+    int64_t     active;     /* live sessions */
+    uint64_t    elapsed;    /* microseconds of finished sessions */
+} __attribute__((aligned(TRAFFIC_CACHE_LINE)));
+
+struct traffic {
+    uint32_t            n;
+    struct traffic_slot *slots;     /* aligned inside base */
+    void                *base;
+};
+
+struct traffic *traffic_create(uint32_t n);
+void traffic_destroy(struct traffic *t);
+size_t traffic_size(struct traffic *t);
+void traffic_sum(struct traffic *t, struct traffic_slot *total);
+void traffic_slot_init(struct traffic_slot *slot);
+
+/* NULL traffic is allowed, counting is skipped then */
+
+static inline void
+traffic_add(struct traffic *t, uint32_t slot, uint64_t nup, uint64_t ndown) {
+    if (t != NULL) {
+        t->slots[slot].nup += nup;
+        t->slots[slot].ndown += ndown;
+    }
+}
+
+static inline void
+traffic_enter(struct traffic *t, uint32_t slot) {
+    if (t != NULL) {
+        t->slots[slot].sessions++;
+        t->slots[slot].active++;
+    }
+}
+
+static inline void
+traffic_leave(struct traffic *t, uint32_t slot, uint64_t elapsed) {
+    if (t != NULL) {
+        t->slots[slot].active--;
+        t->slots[slot].elapsed += elapsed;
+    }
+}
+
+#endif
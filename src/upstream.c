@@ -1,14 +1,22 @@
+#define RPS_MEM_TAG mem_upstream
+
 #include "core.h"
 #include "upstream.h"
 #include "util.h"
 #include "config.h"
 #include "_string.h"
+#include "strtab.h"
+#include "traffic.h"
+#include "murmur3/murmur3.h"
+#include "b64/cencode.h"
+#include "s5.h"
 
+#include <math.h>
 #include <uv.h>
 #include <jansson.h>
 #include <curl/curl.h>
 
-typedef struct upstream * (*upstream_pool_get_algorithm)(struct upstream_pool *);
+typedef struct upstream * (*upstream_pool_get_algorithm)(struct upstream_pool *, uint32_t, int);
 
 struct curl_buf {
     uint8_t *buf;
@@ -20,23 +28,40 @@ upstream_init(struct upstream *u) {
     string_init(&u->uname);   
     string_init(&u->passwd);   
     string_init(&u->source);
+    string_init(&u->auth);
+    u->src = NULL;
+    u->sidx = 0;
+    u->hidx = UPSTREAM_HEAP_NONE;
     u->weight = UPSTREAM_DEFAULT_WEIGHT;
     u->proto = UNSUPPORT;
     u->success = 0;
     u->failure = 0;
     u->count = 0;
+    u->active = 0;
+    u->breaker = br_closed;
+    u->ntrip = 0;
+    u->nfail = 0;
+    u->nprobe = 0;
+    u->retry_date = 0;
+    u->traffic = NULL;
     u->insert_date = 0;
     u->expire_date = 0;
     u->enable = 0;
+    u->stale = 0;
+    u->nopipeline_until = 0;
+    u->used = 0;
+    u->retired = 0;
+    u->next = NULL;
 
     queue_null(&u->timewheel);
 }
 
 void
 upstream_deinit(struct upstream *u) {
-    string_deinit(&u->uname);
-    string_deinit(&u->passwd);
-    string_deinit(&u->source);
+    strtab_release(&u->uname);
+    strtab_release(&u->passwd);
+    strtab_release(&u->source);
+    strtab_release(&u->auth);
     u->success = 0;
     u->failure = 0;
     u->count = 0;
@@ -46,9 +71,12 @@ upstream_deinit(struct upstream *u) {
     if (!queue_is_null(&u->timewheel)) {
         queue_deinit(&u->timewheel);
     }
+
+    traffic_destroy(u->traffic);
+    u->traffic = NULL;
 }
 
-static rps_status_t
+rps_status_t
 upstream_init_timewheel(struct upstream *u, uint32_t mr1m, uint32_t mr1h, uint32_t mr1d) {
     uint32_t n;
 
@@ -60,21 +88,80 @@ upstream_init_timewheel(struct upstream *u, uint32_t mr1m, uint32_t mr1h, uint32
 }
 
 
+/* 
+ * Serialize credentials the way the handshake of the proto sends them, the
+ * username/password request of RFC 1929 for socks5, a Proxy-Authorization
+ * header line for http and http_tunnel. Left empty without username.
+ */
+rps_status_t
+upstream_auth_build(struct upstream *u) {
+    base64_encodestate bstate;
+    char plain[UPSTREAM_AUTH_MAX_LENGTH];
+    char code[UPSTREAM_AUTH_MAX_LENGTH * 2];
+    char auth[UPSTREAM_AUTH_MAX_LENGTH * 2];
+    size_t ulen, plen;
+    int i, n, len;
+
+    strtab_release(&u->auth);
+
+    if (string_empty(&u->uname)) {
+        return RPS_OK;
+    }
+
+    len = 0;
+
+    switch (u->proto) {
+    case SOCKS5:
+        ulen = MIN(u->uname.len, UINT8_MAX);
+        plen = MIN(u->passwd.len, UINT8_MAX);
+        auth[len++] = SOCKS5_AUTH_PASSWD_VERSION;
+        auth[len++] = (uint8_t)ulen;
+        memcpy(&auth[len], u->uname.data, ulen);
+        len += ulen;
+        auth[len++] = (uint8_t)plen;
+        if (plen > 0) {
+            memcpy(&auth[len], u->passwd.data, plen);
+            len += plen;
+        }
+        break;
+    case HTTP:
+    case HTTP_TUNNEL:
+        n = snprintf(plain, sizeof(plain), "%s:%s", u->uname.data, 
+                string_empty(&u->passwd) ? "" : (const char *)u->passwd.data);
+        if (n < 0 || n >= (int)sizeof(plain)) {
+            return RPS_ERROR;
+        }
+
+        base64_init_encodestate(&bstate);
+        n = base64_encode_block(plain, n, code, &bstate);
+        n += base64_encode_blockend(&code[n], &bstate);
+
+        len = snprintf(auth, sizeof(auth), "%s", UPSTREAM_AUTH_HEADER);
+        /* the encoder wraps lines, a header value must not */
+        for (i = 0; i < n; i++) {
+            if (code[i] != '\n') {
+                auth[len++] = code[i];
+            }
+        }
+        auth[len++] = '\r';
+        auth[len++] = '\n';
+        break;
+    default:
+        return RPS_OK;
+    }
+
+    return strtab_intern(&u->auth, auth, len);
+}
+
 static void
 upstream_copy(struct upstream *dst, struct upstream *src) {
     dst->proto = src->proto;
     dst->weight = src->weight;
 
     memcpy(&dst->server, &src->server, sizeof(src->server));
-    if (!string_empty(&src->uname)) {
-        string_copy(&dst->uname, &src->uname);
-    }
-    if (!string_empty(&src->passwd)) {
-        string_copy(&dst->passwd, &src->passwd);
-    }
-    if (!string_empty(&src->source)) {
-        string_copy(&dst->source, &src->source);
-    }
+    strtab_ref(&dst->uname, &src->uname);
+    strtab_ref(&dst->passwd, &src->passwd);
+    strtab_ref(&dst->source, &src->source);
     
     dst->success = src->success;
     dst->failure = src->failure;
@@ -84,14 +171,15 @@ upstream_copy(struct upstream *dst, struct upstream *src) {
     dst->enable = src->enable;
 }
 
-static int 
-upstream_key(struct upstream *u, char *key, size_t max_size) {
-    char name[MAX_HOSTNAME_LEN];
-
-    rps_unresolve_addr(&u->server, name);   
-
-    return snprintf(key, max_size, "%s://%s:%d", rps_proto_str(u->proto), name, 
-            rps_unresolve_port(&u->server));
+static size_t
+upstream_key(struct upstream *u, struct upstream_key *key) {
+    memset(key, 0, sizeof(*key));
+    key->proto = (uint8_t)u->proto;
+    key->family = (uint8_t)u->server.family;
+    key->port = u->server.port;
+    memcpy(key->addr, &u->server.addr, u->server.family == AF_INET6 ? 16 : 4);
+
+    return sizeof(*key);
 }
 
 #ifdef RPS_DEBUG_OPEN
@@ -102,13 +190,20 @@ upstream_str(void *data) {
 
     u = (struct upstream *)data;
 
-    rps_unresolve_addr(&u->server, name);
+    rps_inaddr_name(&u->server, name);
     log_verb("\t%s://%s:%s@%s:%d (s:%d, f:%d, c:%d, d:%d) expire_date:%d", rps_proto_str(u->proto), 
-            u->uname.data, u->passwd.data, name, rps_unresolve_port(&u->server), 
+            u->uname.data, u->passwd.data, name, rps_inaddr_port(&u->server), 
             u->success, u->failure, u->count, queue_n(&u->timewheel), u->expire_date);
 }
 #endif
 
+static const char *
+upstream_breaker_str(uint8_t breaker) {
+    static const char *breakers[] = { "closed", "open", "half-open", "open" };
+
+    return breaker <= br_tripping ? breakers[breaker] : "unknown";
+}
+
 static bool
 upstream_freshly(struct upstream *u) {
     return queue_is_null(&u->timewheel);
@@ -199,6 +294,97 @@ upstream_request_too_often(struct upstream *u, uint32_t mr1m, uint32_t mr1h, uin
             (mr1d != 0 && d >= mr1d));
 }
 
+/* end a transition won by compare-and-swap, fields written before are published first */
+static void
+upstream_breaker_set(struct upstream *u, uint8_t breaker) {
+    __sync_synchronize();
+    u->breaker = breaker;
+}
+
+/* take a probe slot, never past breaker_probes */
+static bool
+upstream_breaker_probe(struct upstreams *us, struct upstream *u) {
+    uint16_t n;
+
+    do {
+        n = __sync_add_and_fetch(&u->nprobe, 0);
+        if (n >= us->breaker_probes) {
+            return false;
+        }
+    } while (!__sync_bool_compare_and_swap(&u->nprobe, n, n + 1));
+
+    return true;
+}
+
+/* 
+ * Breaker admission, open upstream turns half-open once its backoff passed.
+ * Probes which never report back are replaced after a probe window.
+ */
+static bool
+upstream_breaker_allow(struct upstreams *us, struct upstream *u) {
+    rps_ts_t now, retry_date;
+    uint8_t breaker;
+
+    /* a stale state is fine here, transitions are decided by compare-and-swap */
+    breaker = *(volatile uint8_t *)&u->breaker;
+
+    if (us->breaker_failures == 0 || breaker == br_closed) {
+        return true;
+    }
+
+    if (breaker == br_tripping) {
+        return false;
+    }
+
+    now = rps_now();
+    retry_date = __sync_add_and_fetch(&u->retry_date, 0);
+
+    if (breaker == br_open) {
+        if (now < retry_date) {
+            return false;
+        }
+        if (!__sync_bool_compare_and_swap(&u->breaker, br_open, br_tripping)) {
+            return false;
+        }
+        u->nprobe = 0;
+        u->retry_date = now + us->breaker_backoff;
+        upstream_breaker_set(u, br_half_open);
+        return upstream_breaker_probe(us, u);
+    }
+
+    if (upstream_breaker_probe(us, u)) {
+        return true;
+    }
+
+    /* probes of the window are lost, one thread opens the next window */
+    if (now < retry_date || 
+            !__sync_bool_compare_and_swap(&u->retry_date, retry_date, now + us->breaker_backoff)) {
+        return false;
+    }
+
+    __sync_lock_test_and_set(&u->nprobe, 0);
+
+    return upstream_breaker_probe(us, u);
+}
+
+/* caller won the transition to br_tripping */
+static void
+upstream_breaker_open(struct upstreams *us, struct upstream *u) {
+    uint32_t backoff;
+    char name[MAX_HOSTNAME_LEN];
+
+    backoff = MIN((uint64_t)us->breaker_backoff << u->ntrip, us->breaker_max_backoff);
+
+    u->nprobe = 0;
+    u->retry_date = rps_now() + backoff;
+    upstream_breaker_set(u, br_open);
+
+    rps_inaddr_name(&u->server, name);
+    log_info("%s upstream %s:%d breaker open for %d s, %d consecutive failures", 
+            rps_proto_str(u->proto), name, rps_inaddr_port(&u->server), 
+            backoff, u->nfail);
+}
+
 static void
 upstream_timewheel_add(struct upstream *u) {
     rps_ts_t now;
@@ -215,6 +401,21 @@ upstream_pool_init(struct upstream_pool *up, struct config_upstream *cu,
     char stats_api[MAX_API_LENGTH];
 
     up->timeout = capi->timeout;
+    up->active = 0;
+    up->chash = false;
+    up->ring.vnodes = NULL;
+    up->ring.n = 0;
+    up->ring.members = 0;
+    up->slabs = NULL;
+    up->free = NULL;
+    up->nslabs = 0;
+    up->heap = NULL;
+    up->nheap = 0;
+    up->heap_alloc = 0;
+    up->retired = NULL;
+    up->nretired = 0;
+    up->retired_alloc = 0;
+    up->nstale = 0;
     uv_rwlock_init(&up->rwlock);
 
     up->proto = rps_proto_int((const char *)cu->proto.data);
@@ -268,6 +469,10 @@ upstream_pool_init(struct upstream_pool *up, struct config_upstream *cu,
         return RPS_ERROR;       
     }
 
+    if (hashmap_init(&up->sources, UPSTREAM_SOURCE_BUCKETS, HASHMAP_DEFAULT_COLLISIONS) != RPS_OK) {
+        return RPS_ERROR;
+    }
+
     hashmap_iterator_init(&up->iter, &up->pool);
 
     return RPS_OK;
@@ -286,17 +491,424 @@ upstream_pool_deinit_foreach(void *data) {
     
 }
 
+/* take a free record of the pool, caller holds the write lock */
+static struct upstream *
+upstream_record_get(struct upstream_pool *up) {
+    struct upstream_slab *slab;
+    struct upstream *u;
+    uint32_t i;
+
+    if (up->free == NULL) {
+        slab = rps_alloc(sizeof(struct upstream_slab));
+        if (slab == NULL) {
+            return NULL;
+        }
+        slab->next = up->slabs;
+        up->slabs = slab;
+        up->nslabs++;
+
+        for (i = UPSTREAM_SLAB_RECORDS; i > 0; i--) {
+            u = &slab->records[i - 1];
+            u->used = 0;
+            u->next = up->free;
+            up->free = u;
+        }
+    }
+
+    u = up->free;
+    up->free = u->next;
+
+    upstream_init(u);
+    u->used = 1;
+
+    return u;
+}
+
+static void
+upstream_record_put(struct upstream_pool *up, struct upstream *u) {
+    ASSERT(u->used && u->src == NULL && u->hidx == UPSTREAM_HEAP_NONE);
+
+    upstream_deinit(u);
+    u->used = 0;
+    u->next = up->free;
+    up->free = u;
+}
+
+static void
+upstream_source_free(struct upstream_source *s) {
+    strtab_release(&s->name);
+    if (s->members != NULL) {
+        rps_free(s->members);
+    }
+    rps_free(s);
+}
+
+static struct upstream_source *
+upstream_source_get(struct upstream_pool *up, const char *name, size_t len) {
+    void *v;
+    size_t size;
+
+    v = hashmap_get(&up->sources, (void *)name, len, &size);
+    if (v == NULL) {
+        return NULL;
+    }
+
+    return (struct upstream_source *)*(void **)v;
+}
+
+/* index upstream under its source, caller holds the write lock */
+static rps_status_t
+upstream_source_add(struct upstream_pool *up, struct upstream *u) {
+    struct upstream_source *s;
+    struct upstream **members;
+    uint32_t nalloc;
+
+    ASSERT(u->src == NULL);
+
+    if (string_empty(&u->source)) {
+        return RPS_OK;
+    }
+
+    s = upstream_source_get(up, (const char *)u->source.data, u->source.len);
+    if (s == NULL) {
+        s = rps_alloc(sizeof(struct upstream_source));
+        if (s == NULL) {
+            return RPS_ENOMEM;
+        }
+        string_init(&s->name);
+        s->members = NULL;
+        s->n = 0;
+        s->nalloc = 0;
+        s->next = 0;
+        strtab_ref(&s->name, &u->source);
+        hashmap_set(&up->sources, s->name.data, s->name.len, &s, sizeof(s));
+    }
+
+    if (s->n == s->nalloc) {
+        nalloc = MAX(s->nalloc * 2, UPSTREAM_SOURCE_MIN_MEMBERS);
+        members = rps_realloc(s->members, nalloc * sizeof(struct upstream *));
+        if (members == NULL) {
+            return RPS_ENOMEM;
+        }
+        s->members = members;
+        s->nalloc = nalloc;
+    }
+
+    u->src = s;
+    u->sidx = s->n;
+    s->members[s->n++] = u;
+
+    return RPS_OK;
+}
+
+/* unindex upstream, the last member takes its slot */
+static void
+upstream_source_del(struct upstream_pool *up, struct upstream *u) {
+    struct upstream_source *s;
+    struct upstream *last;
+
+    s = u->src;
+    if (s == NULL) {
+        return;
+    }
+
+    ASSERT(s->members[u->sidx] == u);
+
+    last = s->members[--s->n];
+    s->members[u->sidx] = last;
+    last->sidx = u->sidx;
+
+    u->src = NULL;
+    u->sidx = 0;
+
+    if (s->n == 0) {
+        hashmap_remove(&up->sources, s->name.data, s->name.len);
+        upstream_source_free(s);
+    }
+}
+
+static void
+upstream_heap_swap(struct upstream_pool *up, uint32_t i, uint32_t j) {
+    struct upstream *t;
+
+    t = up->heap[i];
+    up->heap[i] = up->heap[j];
+    up->heap[j] = t;
+    up->heap[i]->hidx = i;
+    up->heap[j]->hidx = j;
+}
+
+static void
+upstream_heap_up(struct upstream_pool *up, uint32_t i) {
+    uint32_t parent;
+
+    while (i > 0) {
+        parent = (i - 1) / 2;
+        if (up->heap[parent]->expire_date <= up->heap[i]->expire_date) {
+            break;
+        }
+        upstream_heap_swap(up, i, parent);
+        i = parent;
+    }
+}
+
+static void
+upstream_heap_down(struct upstream_pool *up, uint32_t i) {
+    uint32_t min, child;
+
+    for (;;) {
+        min = i;
+        child = 2 * i + 1;
+        if (child < up->nheap 
+                && up->heap[child]->expire_date < up->heap[min]->expire_date) {
+            min = child;
+        }
+        child++;
+        if (child < up->nheap 
+                && up->heap[child]->expire_date < up->heap[min]->expire_date) {
+            min = child;
+        }
+        if (min == i) {
+            break;
+        }
+        upstream_heap_swap(up, i, min);
+        i = min;
+    }
+}
+
+static void
+upstream_heap_del(struct upstream_pool *up, struct upstream *u) {
+    uint32_t i;
+
+    i = u->hidx;
+    if (i == UPSTREAM_HEAP_NONE) {
+        return;
+    }
+
+    ASSERT(up->heap[i] == u);
+
+    u->hidx = UPSTREAM_HEAP_NONE;
+    up->nheap--;
+    if (i == up->nheap) {
+        return;
+    }
+
+    up->heap[i] = up->heap[up->nheap];
+    up->heap[i]->hidx = i;
+    upstream_heap_up(up, i);
+    upstream_heap_down(up, up->heap[i]->hidx);
+}
+
+/* 
+ * (Re)place upstream in the expiry heap after expire_date was set, 
+ * records without one leave it. Caller holds the write lock.
+ */
+static rps_status_t
+upstream_heap_set(struct upstream_pool *up, struct upstream *u) {
+    struct upstream **heap;
+    uint32_t nalloc;
+
+    if (u->expire_date == 0) {
+        upstream_heap_del(up, u);
+        return RPS_OK;
+    }
+
+    if (u->hidx != UPSTREAM_HEAP_NONE) {
+        upstream_heap_up(up, u->hidx);
+        upstream_heap_down(up, u->hidx);
+        return RPS_OK;
+    }
+
+    if (up->nheap == up->heap_alloc) {
+        nalloc = MAX(up->heap_alloc * 2, UPSTREAM_HEAP_MIN);
+        heap = rps_realloc(up->heap, nalloc * sizeof(struct upstream *));
+        if (heap == NULL) {
+            return RPS_ENOMEM;
+        }
+        up->heap = heap;
+        up->heap_alloc = nalloc;
+    }
+
+    u->hidx = up->nheap;
+    up->heap[up->nheap++] = u;
+    upstream_heap_up(up, u->hidx);
+
+    return RPS_OK;
+}
+
+/* drop upstream from the pool and its indexes, no session holds it */
+static void
+upstream_pool_recycle(struct upstream_pool *up, struct upstream *u, rps_ts_t now) {
+    struct upstream_key u_key;
+    size_t key_size;
+    char name[MAX_HOSTNAME_LEN];
+
+    ASSERT(u->active == 0);
+
+    rps_inaddr_name(&u->server, name);
+    log_verb("%s:%d be cleanup, expire_date:%ld, now:%ld (s:%d, f:%d, c:%d)", 
+            name, rps_inaddr_port(&u->server), u->expire_date, now, 
+            u->success, u->failure, u->count);
+
+    if (u->stale) {
+        up->nstale--;
+    }
+
+    key_size = upstream_key(u, &u_key);
+    hashmap_remove(&up->pool, &u_key, key_size);
+    upstream_heap_del(up, u);
+    upstream_source_del(up, u);
+    upstream_record_put(up, u);
+}
+
+/* 
+ * Drop an upstream which left the pool, at once if idle, else disable it
+ * and leave it to the expiry crontab. Caller holds the write lock.
+ */
+static rps_status_t
+upstream_pool_retire(struct upstream_pool *up, struct upstream *u, rps_ts_t now) {
+    struct upstream **retired;
+    uint32_t nalloc;
+
+    if (u->retired) {
+        return RPS_OK;
+    }
+
+    if (__sync_add_and_fetch(&u->active, 0) == 0) {
+        upstream_pool_recycle(up, u, now);
+        return RPS_OK;
+    }
+
+    if (up->nretired == up->retired_alloc) {
+        nalloc = MAX(up->retired_alloc * 2, UPSTREAM_HEAP_MIN);
+        retired = rps_realloc(up->retired, nalloc * sizeof(struct upstream *));
+        if (retired == NULL) {
+            return RPS_ENOMEM;
+        }
+        up->retired = retired;
+        up->retired_alloc = nalloc;
+    }
+
+    u->enable = 0;
+    u->retired = 1;
+    upstream_heap_del(up, u);
+    up->retired[up->nretired++] = u;
+
+    return RPS_OK;
+}
+
 static void
 upstream_pool_deinit(struct upstream_pool *up) {
-    hashmap_foreach2(&up->pool, (hashmap_foreach2_t)upstream_pool_deinit_foreach);
+    struct upstream_slab *slab;
+    struct upstream *u;
+
+    hashmap_foreach2(&up->sources, (hashmap_foreach2_t)upstream_source_free);
+    hashmap_deinit(&up->sources);
+    upstream_pool_foreach(up, slab, u) {
+        upstream_deinit(u);
+    }
+    while (up->slabs != NULL) {
+        slab = up->slabs;
+        up->slabs = slab->next;
+        rps_free(slab);
+    }
+    up->free = NULL;
+    up->nslabs = 0;
+    if (up->heap != NULL) {
+        rps_free(up->heap);
+        up->heap = NULL;
+    }
+    up->nheap = 0;
+    if (up->retired != NULL) {
+        rps_free(up->retired);
+        up->retired = NULL;
+    }
+    up->nretired = 0;
     hashmap_deinit(&up->pool);
     hashmap_iterator_deinit(&up->iter);
+    if (up->ring.vnodes != NULL) {
+        rps_free(up->ring.vnodes);
+        up->ring.vnodes = NULL;
+    }
     string_deinit(&up->api);
     string_deinit(&up->stats_api);
     up->timeout = 0;
     uv_rwlock_destroy(&up->rwlock);
 } 
 
+static int
+upstream_vnode_cmp(const void *a, const void *b) {
+    uint32_t x, y;
+
+    x = ((const struct upstream_vnode *)a)->hash;
+    y = ((const struct upstream_vnode *)b)->hash;
+
+    return (x > y) - (x < y);
+}
+
+/* 
+ * Rebuild the hash ring from enabled upstreams, caller holds the write lock.
+ * Every upstream owns UPSTREAM_RING_VNODES points hashed from its key, so 
+ * its points do not depend on the rest of the pool.
+ */
+static rps_status_t
+upstream_ring_build(struct upstream_pool *up) {
+    struct upstream_ring ring;
+    struct upstream_slab *slab;
+    struct upstream *u;
+    struct upstream_key u_key;
+    size_t key_size;
+    uint32_t j;
+
+    if (!up->chash) {
+        return RPS_OK;
+    }
+
+    ring.vnodes = NULL;
+    ring.n = 0;
+    ring.members = 0;
+
+    if (hashmap_n(&up->pool) > 0) {
+        ring.vnodes = rps_alloc(hashmap_n(&up->pool) * UPSTREAM_RING_VNODES * 
+                sizeof(struct upstream_vnode));
+        if (ring.vnodes == NULL) {
+            /* old ring may refer to recycled upstreams */
+            if (up->ring.vnodes != NULL) {
+                rps_free(up->ring.vnodes);
+            }
+            up->ring = ring;
+            log_error("build %s upstream hash ring failed", rps_proto_str(up->proto));
+            return RPS_ENOMEM;
+        }
+    }
+
+    upstream_pool_foreach(up, slab, u) {
+        if (!u->enable) {
+            continue;
+        }
+
+        key_size = upstream_key(u, &u_key);
+        for (j = 0; j < UPSTREAM_RING_VNODES; j++) {
+            MurmurHash3_x86_32(&u_key, key_size, j, &ring.vnodes[ring.n].hash);
+            ring.vnodes[ring.n].upstream = u;
+            ring.n++;
+        }
+        ring.members++;
+    }
+
+    qsort(ring.vnodes, ring.n, sizeof(struct upstream_vnode), upstream_vnode_cmp);
+
+    if (up->ring.vnodes != NULL) {
+        rps_free(up->ring.vnodes);
+    }
+    up->ring = ring;
+
+    log_debug("%s upstream hash ring: %d members, %d vnodes", 
+            rps_proto_str(up->proto), ring.members, ring.n);
+
+    return RPS_OK;
+}
+
 #ifdef  RPS_MORE_VERBOSE
 static void
 upstream_pool_dump(struct upstream_pool *up) {
@@ -307,7 +919,7 @@ upstream_pool_dump(struct upstream_pool *up) {
 
 rps_status_t 
 upstreams_init(struct upstreams *us, struct config_api *capi, 
-        struct config_upstreams *cus) {
+        struct config_upstreams *cus, uint32_t nslots) {
 
     rps_status_t status;
     rps_str_t   *schedule;
@@ -316,18 +928,33 @@ upstreams_init(struct upstreams *us, struct config_api *capi,
     struct config_upstream *cu;
 
     us->hybrid = cus->hybrid;   
+    us->pipeline = cus->pipeline;
     us->maxreconn = cus->maxreconn;
     us->maxretry = cus->maxretry;
     us->mr1m = cus->mr1m;
     us->mr1h = cus->mr1h;
     us->mr1d = cus->mr1d;
     us->max_fail_rate = cus->max_fail_rate;
+    us->breaker_failures = cus->breaker_failures;
+    us->breaker_backoff = cus->breaker_backoff;
+    us->breaker_max_backoff = cus->breaker_max_backoff;
+    us->breaker_probes = cus->breaker_probes > 0 ? cus->breaker_probes : 1;
+    us->nslots = nslots;
+
+    string_init(&us->snapshot);
+    if (!string_empty(&cus->snapshot)) {
+        if (string_copy(&us->snapshot, &cus->snapshot) != RPS_OK) {
+            return RPS_ENOMEM;
+        }
+    }
 
     schedule = &cus->schedule;
     if (rps_strcmp(schedule, "rr") == 0) {
         us->schedule = up_rr;
     } else if (rps_strcmp(schedule, "random") == 0) {
         us->schedule = up_random;
+    } else if (rps_strcmp(schedule, "chash") == 0) {
+        us->schedule = up_chash;
     } else if (rps_strcmp(schedule, "wrr") == 0) {
         log_error("wrr algorithm have not implemented");
         abort();
@@ -349,6 +976,8 @@ upstreams_init(struct upstreams *us, struct config_api *capi,
         if (upstream_pool_init(up, cu, capi) != RPS_OK) {
             goto error;
         }
+        up->chash = (us->schedule == up_chash);
+        up->nslots = nslots;
     }
 
     if (uv_mutex_init(&us->mutex) < 0) {
@@ -381,6 +1010,7 @@ upstreams_deinit(struct upstreams *us) {
     }
 
     array_deinit(&us->pools);
+    string_deinit(&us->snapshot);
 
     uv_mutex_destroy(&us->mutex);
     uv_cond_destroy(&us->ready);
@@ -390,6 +1020,7 @@ upstreams_deinit(struct upstreams *us) {
 static rps_status_t
 upstream_json_parse(struct upstream *u, json_t *element) {
     rps_str_t host;
+    rps_addr_t addr;
     uint16_t port;
     void *kv;
     rps_status_t status;
@@ -419,17 +1050,17 @@ upstream_json_parse(struct upstream *u, json_t *element) {
         } else if (strcmp(json_object_iter_key(kv), "username") == 0) {
             /* Ignore username is null */
             if (json_typeof(tmp) == JSON_STRING) {
-                status = string_duplicate(&u->uname, json_string_value(tmp), json_string_length(tmp));
+                status = strtab_intern(&u->uname, json_string_value(tmp), json_string_length(tmp));
             }
         } else if (strcmp(json_object_iter_key(kv), "password") == 0) {
             /* Ignore password is null */
             if (json_typeof(tmp) == JSON_STRING) {
-                status = string_duplicate(&u->passwd, json_string_value(tmp), json_string_length(tmp));
+                status = strtab_intern(&u->passwd, json_string_value(tmp), json_string_length(tmp));
             }
         } else if (strcmp(json_object_iter_key(kv), "source") == 0) {
             /* Ignore source is null */
             if (json_typeof(tmp) == JSON_STRING) {
-                status = string_duplicate(&u->source, json_string_value(tmp), json_string_length(tmp));
+                status = strtab_intern(&u->source, json_string_value(tmp), json_string_length(tmp));
             }
         } else if (strcmp(json_object_iter_key(kv), "weight") == 0) {
             u->weight = (uint16_t)json_integer_value(tmp);
@@ -454,7 +1085,10 @@ upstream_json_parse(struct upstream *u, json_t *element) {
         }
     }
 
-    status = rps_resolve_inet((const char *)host.data, port, &u->server);
+    status = rps_resolve_inet((const char *)host.data, port, &addr);
+    if (status == RPS_OK) {
+        status = rps_inaddr_pack(&u->server, &addr);
+    }
     if (status != RPS_OK) {
         log_error("jason parse error, invalid upstream address, %s:%d", host.data, port);
     }
@@ -469,7 +1103,7 @@ upstream_pool_json_parse(rps_hashmap_t *pool, struct curl_buf *resp) {
     json_t *root;
     json_t *element;
     json_error_t error;
-    char u_key[UPSTREAM_KEY_MAX_LENGTH];
+    struct upstream_key u_key;
     size_t key_size;
     struct upstream *u;
     size_t  len;
@@ -502,8 +1136,8 @@ upstream_pool_json_parse(rps_hashmap_t *pool, struct curl_buf *resp) {
             rps_free(u);
             continue;
         }
-        key_size = upstream_key(u, u_key, UPSTREAM_KEY_MAX_LENGTH);
-        hashmap_set(pool, u_key, key_size, &u, sizeof(u));
+        key_size = upstream_key(u, &u_key);
+        hashmap_set(pool, &u_key, key_size, &u, sizeof(u));
     }
 
     json_decref(root);
@@ -532,7 +1166,7 @@ upstream_pool_load_callback(void *contents, size_t size, size_t nmemb, void *use
     return realsize;
 }
 
-static rps_status_t
+rps_status_t
 upstream_pool_load(rps_hashmap_t *pool, rps_str_t *api, uint32_t timeout) {
     CURL *curl_handle;
     CURLcode res;
@@ -570,9 +1204,9 @@ upstream_pool_load(rps_hashmap_t *pool, rps_str_t *api, uint32_t timeout) {
     return status;
 }
 static rps_status_t
-upstream_pool_merge(rps_hashmap_t *o_pool, rps_hashmap_t *n_pool) {
+upstream_pool_merge(struct upstream_pool *up, rps_hashmap_t *n_pool) {
     struct upstream *u, *nu, *ou;
-    char u_key[UPSTREAM_KEY_MAX_LENGTH];
+    struct upstream_key u_key;
     uint32_t i;
     size_t key_size;
     size_t val_size;
@@ -591,19 +1225,41 @@ upstream_pool_merge(rps_hashmap_t *o_pool, rps_hashmap_t *n_pool) {
         e = n_pool->buckets[i];
         while (e != NULL) {
             u = (struct upstream *)*(void **)e->value;
-            key_size = upstream_key(u, u_key, UPSTREAM_KEY_MAX_LENGTH);
-            ov = hashmap_get(o_pool, u_key, key_size, &val_size);
+            key_size = upstream_key(u, &u_key);
+            ov = hashmap_get(&up->pool, &u_key, key_size, &val_size);
             if (ov == NULL) {
                 /* insert new upstream proxy */
-                if ((nu = rps_alloc(sizeof(struct upstream))) == NULL) {
+                if ((nu = upstream_record_get(up)) == NULL) {
                     return RPS_ENOMEM;
                 }   
-                upstream_init(nu);
                 upstream_copy(nu, u);
-                hashmap_set(o_pool, u_key, key_size, &nu, sizeof(nu));
+                upstream_auth_build(nu);
+                nu->traffic = traffic_create(up->nslots);
+                hashmap_set(&up->pool, &u_key, key_size, &nu, sizeof(nu));
+                upstream_source_add(up, nu);
+                upstream_heap_set(up, nu);
             } else {
                 /* update existence proxy */
                 ou = (struct upstream *)*(void **)ov;
+                if (ou->retired) {
+                    /* on its way out, added afresh once recycled */
+                    e = e->next;
+                    continue;
+                }
+                if (ou->stale) {
+                    ou->stale = 0;
+                    up->nstale--;
+                }
+                if (ou->expire_date != u->expire_date) {
+                    ou->expire_date = u->expire_date;
+                    upstream_heap_set(up, ou);
+                }
+                if (!string_equal(&ou->source, &u->source)) {
+                    upstream_source_del(up, ou);
+                    strtab_release(&ou->source);
+                    strtab_ref(&ou->source, &u->source);
+                    upstream_source_add(up, ou);
+                }
                 if (!u->enable && ou->enable) {
                     ou->enable = 0;
                 } else if (u->enable && !ou->enable) {
@@ -619,58 +1275,95 @@ upstream_pool_merge(rps_hashmap_t *o_pool, rps_hashmap_t *n_pool) {
     return RPS_OK;
 }
 
-/* cleanup expired upstream proxy, recycle memory resource */
-static rps_status_t
-upstream_pool_cleanup(rps_hashmap_t *pool) {
-    uint32_t i;
+/* 
+ * Drop records restored from snapshot which the api does not provide any 
+ * more, scans the pool once after the first merges only.
+ */
+static void
+upstream_pool_drop_stale(struct upstream_pool *up) {
     rps_ts_t now;
-    struct hashmap_entry *e, *n;
+    struct upstream_slab *slab;
     struct upstream *u;
-    char name[MAX_HOSTNAME_LEN];
+
+    if (up->nstale == 0) {
+        return;
+    }
 
     now = rps_now();
 
-    for (i = 0; i < pool->size; i++) {
-        e = pool->buckets[i];
-        while (e != NULL) {
-            u = (struct upstream *)*(void **)e->value;
-            rps_unresolve_addr(&u->server, name);
-            /* unset expire date parameter */
-            if (u->expire_date == 0) {
-                e = e->next;
-                continue;
-            }
+    upstream_pool_foreach(up, slab, u) {
+        if (!u->stale || u->retired) {
+            continue;
+        }
+        u->enable = 0;
+        if (upstream_pool_retire(up, u, now) != RPS_OK) {
+            return;
+        }
+    }
+}
 
-            if (u->expire_date > now) {
-                e = e->next;
-                continue;
-            }
+/* 
+ * Recycle retired records no session holds any more and expire records due
+ * by the heap, at most UPSTREAM_EXPIRE_BATCH of each per tick.
+ */
+static void
+upstream_pool_expire(struct upstream_pool *up) {
+    rps_ts_t now;
+    struct upstream *u;
+    uint32_t i, n, expired, recycled;
 
-#ifdef RPS_UPSTREAM_DELAY_CLEANUP
-            if (u->enable) {
-                e = e->next;
-                continue
-            }
-#endif
-            /* still be using */
-            if ((u->success + u->failure) != u->count) {
-                e = e->next;
-                continue;
-            }
-            
-            log_verb("%s:%d be cleanup, expire_date:%ld, now:%ld (s:%d, f:%d, c:%d)", 
-                    name, rps_unresolve_port(&u->server), u->expire_date, now, 
-                    u->success, u->failure, u->count);
+    now = rps_now();
 
-            upstream_deinit(u);
-            rps_free(u);
-            n = e->next;
-            hashmap_remove(pool, e->key, e->key_size);
-            e = n;
+    /* nothing due, leave the pool to readers */
+    uv_rwlock_rdlock(&up->rwlock);
+    n = up->nretired;
+    if (up->nheap > 0 && up->heap[0]->expire_date <= now) {
+        n++;
+    }
+    uv_rwlock_rdunlock(&up->rwlock);
+
+    if (n == 0) {
+        return;
+    }
+
+    expired = 0;
+    recycled = 0;
+
+    uv_rwlock_wrlock(&up->rwlock);
+
+    for (i = up->nretired; i > 0 && recycled < UPSTREAM_EXPIRE_BATCH; i--) {
+        u = up->retired[i - 1];
+        if (__sync_add_and_fetch(&u->active, 0) != 0) {
+            continue;
         }
+        up->retired[i - 1] = up->retired[--up->nretired];
+        upstream_pool_recycle(up, u, now);
+        recycled++;
     }
 
-    return RPS_OK;
+    while (up->nheap > 0 && expired < UPSTREAM_EXPIRE_BATCH) {
+        u = up->heap[0];
+        if (u->expire_date > now) {
+            break;
+        }
+        if (upstream_pool_retire(up, u, now) != RPS_OK) {
+            break;
+        }
+        expired++;
+    }
+
+    if (expired > 0) {
+        upstream_ring_build(up);
+    }
+
+    n = up->nretired;
+
+    uv_rwlock_wrunlock(&up->rwlock);
+
+    if (expired > 0 || recycled > 0) {
+        log_debug("expire %s upstreams: %d expired, %d recycled, %d retired", 
+                rps_proto_str(up->proto), expired, recycled, n);
+    }
 }
 
 static rps_status_t
@@ -680,16 +1373,21 @@ upstream_stats_commit(struct upstream *u, rps_str_t *api, uint32_t timeout) {
     char name[MAX_HOSTNAME_LEN];
     char payload[UPSTREAM_PAYLOAD_MAX_LENGTH];
     rps_status_t status;
+    struct traffic_slot t;
 
-    rps_unresolve_addr(&u->server, name);   
+    rps_inaddr_name(&u->server, name);   
+    traffic_sum(u->traffic, &t);
     //avoid flush the output to stdout
     FILE *devnull = fopen("/dev/null", "w+");
 
     snprintf(payload, UPSTREAM_PAYLOAD_MAX_LENGTH, 
-        "ip=%s&port=%d&uname=%s&passwd=%s&source=%s&success=%d&failure=%d&count=%d&insert_date=%ld \
-        &expire_date=%ld&enable=%d&timewheel=%d",
-        name, rps_unresolve_port(&u->server), u->uname.data, u->passwd.data, u->source.data, u->success,
-        u->failure, u->count,(long int)u->insert_date, (long int)u->expire_date, u->enable, queue_n(&u->timewheel));
+        "ip=%s&port=%d&uname=%s&passwd=%s&source=%s&success=%d&failure=%d&count=%d&insert_date=%ld"
+        "&expire_date=%ld&enable=%d&timewheel=%d&breaker=%s&sessions=%llu&active=%lld"
+        "&bytes_up=%llu&bytes_down=%llu&elapsed=%llu",
+        name, rps_inaddr_port(&u->server), u->uname.data, u->passwd.data, u->source.data, u->success,
+        u->failure, u->count,(long int)u->insert_date, (long int)u->expire_date, u->enable, queue_n(&u->timewheel),
+        upstream_breaker_str(u->breaker), (unsigned long long)t.sessions, (long long)t.active,
+        (unsigned long long)t.nup, (unsigned long long)t.ndown, (unsigned long long)t.elapsed);
 
     curl_handle = curl_easy_init();
     curl_easy_setopt(curl_handle, CURLOPT_URL, api->data);
@@ -702,11 +1400,11 @@ upstream_stats_commit(struct upstream *u, rps_str_t *api, uint32_t timeout) {
 
     if(res != CURLE_OK) {
         log_error("post upstream (%s:%d) statistic to '%s' trigger error. %s", 
-                name, rps_unresolve_port(&u->server), api->data,  curl_easy_strerror(res));
+                name, rps_inaddr_port(&u->server), api->data,  curl_easy_strerror(res));
         status = RPS_ERROR;
     } else {
 #ifdef RPS_MORE_VERBOSE
-        log_verb("post upstream (%s:%d) statistic success", name, rps_unresolve_port(&u->server));
+        log_verb("post upstream (%s:%d) statistic success", name, rps_inaddr_port(&u->server));
 #endif
         status = RPS_OK;
     }
@@ -718,10 +1416,9 @@ upstream_stats_commit(struct upstream *u, rps_str_t *api, uint32_t timeout) {
 
 static void
 upstream_pool_stats(struct upstream_pool *up) {
-    struct hashmap_entry *entry;
+    struct upstream_slab *slab;
     struct upstream *upstream;
     struct upstream *t_upstream;
-    uint32_t i;
     rps_array_t t_pool;
 
     if (hashmap_n(&up->pool) == 0) {
@@ -733,14 +1430,14 @@ upstream_pool_stats(struct upstream_pool *up) {
      */
     uv_rwlock_rdlock(&up->rwlock);
     array_init(&t_pool, hashmap_n(&up->pool), sizeof(struct upstream));
-    for (i = 0; i < up->pool.size; i++) {
-        entry = up->pool.buckets[i];
-        while (entry != NULL) {
-            upstream = (struct upstream *)*(void **)entry->value;
-            t_upstream = (struct upstream *)array_push(&t_pool);
-            upstream_init(t_upstream);
-            upstream_copy(t_upstream, upstream);
-            entry = entry->next;
+    upstream_pool_foreach(up, slab, upstream) {
+        t_upstream = (struct upstream *)array_push(&t_pool);
+        upstream_init(t_upstream);
+        upstream_copy(t_upstream, upstream);
+        /* fold the slots, the copy keeps totals in its only slot */
+        t_upstream->traffic = traffic_create(1);
+        if (t_upstream->traffic != NULL) {
+            traffic_sum(upstream->traffic, &t_upstream->traffic->slots[0]);
         }
     }
     uv_rwlock_rdunlock(&up->rwlock);
@@ -757,6 +1454,7 @@ upstream_pool_stats(struct upstream_pool *up) {
 static rps_status_t
 upstream_pool_refresh(struct upstream_pool *up) {
     rps_hashmap_t new_pool;
+    rps_mem_tag_t scope;
 
     /* Free current upstream pool only when new pool load successful */
 
@@ -764,7 +1462,11 @@ upstream_pool_refresh(struct upstream_pool *up) {
         return RPS_ERROR;
     }
 
+    /* strings of loaded upstreams are charged to upstream */
+    scope = memstat_scope(mem_upstream);
+
     if (upstream_pool_load(&new_pool, &up->api, up->timeout) != RPS_OK) {
+        memstat_scope(scope);
         hashmap_foreach2(&new_pool, (hashmap_foreach2_t)upstream_pool_deinit_foreach);
         hashmap_deinit(&new_pool);
         log_error("load %s upstreams from webapi failed.", rps_proto_str(up->proto));
@@ -772,9 +1474,11 @@ upstream_pool_refresh(struct upstream_pool *up) {
     }
 
     uv_rwlock_wrlock(&up->rwlock);
-    upstream_pool_merge(&up->pool, &new_pool);
-    upstream_pool_cleanup(&up->pool);
+    upstream_pool_merge(up, &new_pool);
+    upstream_pool_drop_stale(up);
+    upstream_ring_build(up);
     uv_rwlock_wrunlock(&up->rwlock);
+    memstat_scope(scope);
     
     hashmap_foreach2(&new_pool, (hashmap_foreach2_t)upstream_pool_deinit_foreach);
     hashmap_deinit(&new_pool);
@@ -811,13 +1515,120 @@ upstreams_refresh(uv_timer_t *handle) {
         }
     }
     
-    //run only once
+    upstreams_ready(us);
+}
+
+/* mark upstreams loaded, wake up servers waiting for the first load */
+void
+upstreams_ready(struct upstreams *us) {
+    uv_mutex_lock(&us->mutex);
     if (us->once == 0) {
-        uv_mutex_lock(&us->mutex);
+        us->once = 1;
         uv_cond_broadcast(&us->ready);
-        uv_mutex_unlock(&us->mutex);
     }
-    us->once = 1;
+    uv_mutex_unlock(&us->mutex);
+}
+
+void
+upstreams_wait(struct upstreams *us) {
+    uv_mutex_lock(&us->mutex);
+    while (us->once == 0) {
+        uv_cond_wait(&us->ready, &us->mutex);
+    }
+    uv_mutex_unlock(&us->mutex);
+}
+
+static struct upstream_pool *
+upstreams_pool(struct upstreams *us, rps_proto_t proto) {
+    struct upstream_pool *up;
+    int i, len;
+
+    len = array_n(&us->pools);
+    for (i = 0; i < len; i++) {
+        up = (struct upstream_pool *)array_get(&us->pools, i);
+        if (up->proto == proto) {
+            return up;
+        }
+    }
+
+    return NULL;
+}
+
+/* 
+ * Insert an upstream into the pool of its proto. On success a record of the
+ * pool takes over its strings, timewheel and traffic, the caller frees u 
+ * without upstream_deinit. Existing upstream with the same key is kept.
+ */
+rps_status_t
+upstreams_add(struct upstreams *us, struct upstream *u) {
+    struct upstream_pool *up;
+    struct upstream *nu;
+    struct upstream_key u_key;
+    size_t key_size, val_size;
+    rps_status_t status;
+
+    up = upstreams_pool(us, u->proto);
+    if (up == NULL) {
+        return RPS_ERROR;
+    }
+
+    key_size = upstream_key(u, &u_key);
+
+    uv_rwlock_wrlock(&up->rwlock);
+    if (hashmap_get(&up->pool, &u_key, key_size, &val_size) != NULL) {
+        status = RPS_ERROR;
+    } else if ((nu = upstream_record_get(up)) == NULL) {
+        status = RPS_ENOMEM;
+    } else {
+        *nu = *u;
+        nu->used = 1;
+        nu->next = NULL;
+        nu->src = NULL;
+        if (nu->traffic == NULL) {
+            nu->traffic = traffic_create(up->nslots);
+        }
+        nu->hidx = UPSTREAM_HEAP_NONE;
+        nu->retired = 0;
+        upstream_auth_build(nu);
+        hashmap_set(&up->pool, &u_key, key_size, &nu, sizeof(nu));
+        upstream_source_add(up, nu);
+        upstream_heap_set(up, nu);
+        if (nu->stale) {
+            up->nstale++;
+        }
+        status = RPS_OK;
+    }
+    uv_rwlock_wrunlock(&up->rwlock);
+
+    return status;
+}
+
+void
+upstreams_expire(uv_timer_t *handle) {
+    struct upstreams *us;
+    int i, len;
+
+    us = (struct upstreams *)handle->data;
+
+    len = array_n(&us->pools);
+    for (i = 0; i < len; i++) {
+        upstream_pool_expire((struct upstream_pool *)array_get(&us->pools, i));
+    }
+}
+
+/* rebuild hash rings after upstreams_add */
+void
+upstreams_rehash(struct upstreams *us) {
+    struct upstream_pool *up;
+    int i, len;
+
+    len = array_n(&us->pools);
+    for (i = 0; i < len; i++) {
+        up = (struct upstream_pool *)array_get(&us->pools, i);
+        uv_rwlock_wrlock(&up->rwlock);
+        upstream_ring_build(up);
+        uv_rwlock_wrunlock(&up->rwlock);
+    }
 }
 
 void
@@ -840,10 +1651,13 @@ upstreams_stats(uv_timer_t *handle) {
 }
 
 static struct upstream *
-upstream_pool_get_rr(struct upstream_pool *up) {
+upstream_pool_get_rr(struct upstream_pool *up, uint32_t hash, int n) {
     struct hashmap_entry *entry;
     struct upstream *upstream;
 
+    UNUSED(hash);
+    UNUSED(n);
+
     entry = hashmap_next(&up->iter);
     if (entry == NULL) {
         return NULL;
@@ -854,10 +1668,13 @@ upstream_pool_get_rr(struct upstream_pool *up) {
 }
 
 static struct upstream *
-upstream_pool_get_random(struct upstream_pool *up) {
+upstream_pool_get_random(struct upstream_pool *up, uint32_t hash, int n) {
     struct hashmap_entry *entry;
     struct upstream *upstream;
 
+    UNUSED(hash);
+    UNUSED(n);
+
     entry = hashmap_get_random_entry(&up->pool);
     if (entry == NULL) {
         return NULL;
@@ -867,18 +1684,71 @@ upstream_pool_get_random(struct upstream_pool *up) {
     return upstream;
 }
 
+/* n-th vnode clockwise from hash */
+static struct upstream *
+upstream_pool_get_chash(struct upstream_pool *up, uint32_t hash, int n) {
+    struct upstream_ring *ring;
+    uint32_t lo, hi, mid;
+
+    ring = &up->ring;
+    if (ring->n == 0) {
+        return NULL;
+    }
+
+    lo = 0;
+    hi = ring->n;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (ring->vnodes[mid].hash < hash) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return ring->vnodes[(lo + n) % ring->n].upstream;
+}
+
+/* 
+ * Consistent hashing with bounded loads, an upstream takes no more than 
+ * ceil(c * (active + 1) / members) sessions, the overflow of hot remotes 
+ * goes on to the next upstreams of the ring.
+ */
+static bool
+upstream_overloaded(struct upstream_pool *up, struct upstream *u) {
+    uint32_t capacity;
+
+    capacity = (uint32_t)ceil(UPSTREAM_CHASH_LOAD_FACTOR * (up->active + 1) / 
+            up->ring.members);
+
+    return u->active >= capacity;
+}
+
+/*
+ * Pick an upstream of the pool serving proto. With source set, candidates
+ * come from the source index only, each member is tried at most once from
+ * a start given by the schedule: the round-robin cursor of the source, a
+ * random member or the remote hash (plain modulo, no ring per source).
+ */
 struct upstream *
-upstreams_get(struct upstreams *us, rps_proto_t proto) {
+upstreams_get(struct upstreams *us, rps_proto_t proto, rps_addr_t *remote, 
+        const char *source) {
     struct upstream *upstream;
     struct upstream_pool *up;
+    struct upstream_source *src;
     int i, len;
-    int count;
+    int count, limit;
+    uint32_t hash, start;
     upstream_pool_get_algorithm get_func;
 
     upstream = NULL;
     up = NULL;
+    src = NULL;
     get_func = NULL;
     count = 0;
+    limit = UPSTREAM_MAX_LOOP;
+    hash = 0;
+    start = 0;
 
     if (us->hybrid) {
         if (proto == HTTP_TUNNEL || proto == SOCKS5) {
@@ -909,6 +1779,10 @@ upstreams_get(struct upstreams *us, rps_proto_t proto) {
         case up_random:
             get_func = upstream_pool_get_random;
             break;
+        case up_chash:
+            get_func = upstream_pool_get_chash;
+            hash = rps_addr_hash(remote);
+            break;
         case up_wrr:
         default:
             NOT_REACHED();
@@ -916,13 +1790,37 @@ upstreams_get(struct upstreams *us, rps_proto_t proto) {
 
     uv_rwlock_rdlock(&up->rwlock);
 
+    if (source != NULL && source[0] != '\0') {
+        src = upstream_source_get(up, source, strlen(source));
+        if (src == NULL) {
+            limit = 0;
+        } else {
+            limit = MIN(src->n, UPSTREAM_MAX_LOOP);
+            switch (us->schedule) {
+                case up_rr:
+                    start = __sync_fetch_and_add(&src->next, 1);
+                    break;
+                case up_random:
+                    start = (uint32_t)rps_random(src->n);
+                    break;
+                default:
+                    start = hash;
+                    break;
+            }
+        }
+    }
+
     for ( ; ; ) {
-        if (count >= UPSTREAM_MAX_LOOP) {
+        if (count >= limit) {
             upstream = NULL;
             break;
         }
 
-        upstream = get_func(up);
+        if (src != NULL) {
+            upstream = src->members[(start + count) % src->n];
+        } else {
+            upstream = get_func(up, hash, count);
+        }
 
         count += 1;
 
@@ -939,6 +1837,15 @@ upstreams_get(struct upstreams *us, rps_proto_t proto) {
             continue;
         }
 
+        /* loads are bounded against the whole ring */
+        if (up->chash && src == NULL && upstream_overloaded(up, upstream)) {
+            continue;
+        }
+
+        if (!upstream_breaker_allow(us, upstream)) {
+            continue;
+        }
+
         if (upstream_freshly(upstream)) {
             upstream_init_timewheel(upstream, us->mr1m, us->mr1h, us->mr1d);
             break;
@@ -960,6 +1867,9 @@ upstreams_get(struct upstreams *us, rps_proto_t proto) {
     
     if (upstream != NULL) {
         upstream->count += 1;    
+        /* servers share the pool under read lock */
+        __sync_add_and_fetch(&upstream->active, 1);
+        __sync_add_and_fetch(&up->active, 1);
         if (us->mr1m > 0 || us->mr1h > 0 || us->mr1d >0) {
             upstream_timewheel_add(upstream);
         }
@@ -968,3 +1878,200 @@ upstreams_get(struct upstreams *us, rps_proto_t proto) {
     uv_rwlock_rdunlock(&up->rwlock);
     return upstream;
 }
+
+/* release the upstream got from upstreams_get */
+void
+upstreams_put(struct upstreams *us, struct upstream *u) {
+    struct upstream_pool *up;
+
+    up = upstreams_pool(us, u->proto);
+    ASSERT(up != NULL);
+
+    __sync_sub_and_fetch(&u->active, 1);
+    __sync_sub_and_fetch(&up->active, 1);
+}
+
+void
+upstreams_success(struct upstreams *us, struct upstream *u) {
+    char name[MAX_HOSTNAME_LEN];
+
+    UNUSED(us);
+
+    __sync_add_and_fetch(&u->success, 1);
+
+    /* shared line is written only if there is something to reset */
+    if (u->nfail != 0) {
+        __sync_lock_test_and_set(&u->nfail, 0);
+    }
+
+    if (u->breaker != br_half_open || 
+            !__sync_bool_compare_and_swap(&u->breaker, br_half_open, br_tripping)) {
+        return;
+    }
+
+    u->ntrip = 0;
+    u->nprobe = 0;
+    upstream_breaker_set(u, br_closed);
+
+    rps_inaddr_name(&u->server, name);
+    log_info("%s upstream %s:%d breaker closed", 
+            rps_proto_str(u->proto), name, rps_inaddr_port(&u->server));
+}
+
+void
+upstreams_failure(struct upstreams *us, struct upstream *u) {
+    uint16_t nfail;
+
+    __sync_add_and_fetch(&u->failure, 1);
+
+    if (us->breaker_failures == 0) {
+        return;
+    }
+
+    /* saturated, a counter wrapping to zero would never trip */
+    do {
+        nfail = __sync_add_and_fetch(&u->nfail, 0);
+        if (nfail == UINT16_MAX) {
+            break;
+        }
+    } while (!__sync_bool_compare_and_swap(&u->nfail, nfail, nfail + 1));
+
+    if (nfail < UINT16_MAX) {
+        nfail++;
+    }
+
+    switch (__sync_add_and_fetch(&u->breaker, 0)) {
+    case br_closed:
+        if (nfail < us->breaker_failures || 
+                !__sync_bool_compare_and_swap(&u->breaker, br_closed, br_tripping)) {
+            return;
+        }
+        u->ntrip = 0;
+        break;
+    case br_half_open:
+        /* probe failed, back off longer */
+        if (!__sync_bool_compare_and_swap(&u->breaker, br_half_open, br_tripping)) {
+            return;
+        }
+        if (u->ntrip < UPSTREAM_BREAKER_MAX_TRIP) {
+            u->ntrip++;
+        }
+        break;
+    case br_open:
+    case br_tripping:
+    default:
+        /* sessions started before the breaker opened */
+        return;
+    }
+
+    upstream_breaker_open(us, u);
+}
+
+/* pipelined handshakes are tried again once the backoff passed */
+bool
+upstream_pipeline_allowed(struct upstream *u) {
+    return rps_now() >= *(volatile rps_ts_t *)&u->nopipeline_until;
+}
+
+void
+upstream_pipeline_failed(struct upstream *u) {
+    __sync_lock_test_and_set(&u->nopipeline_until, rps_now() + UPSTREAM_NOPIPELINE_BACKOFF);
+}
+
+/* 
+ * Memory held by a pool, caller holds the lock. Records and keys have a
+ * fixed size, traffic slots, timewheels and index arrays are counted as 
+ * allocated. Interned strings are shared by all pools, see strtab_stats.
+ */
+static size_t
+upstream_pool_memory(struct upstream_pool *up, size_t *records, size_t *keys, 
+        size_t *counters, size_t *indexes) {
+    struct upstream_slab *slab;
+    struct upstream *u;
+    struct hashmap_entry *e;
+    struct upstream_source *src;
+    uint32_t i;
+
+    *records = up->nslabs * sizeof(struct upstream_slab);
+    *keys = up->pool.size * sizeof(struct hashmap_entry *) + hashmap_n(&up->pool) * 
+        (sizeof(struct hashmap_entry) + sizeof(struct upstream_key) + sizeof(struct upstream *));
+    *counters = 0;
+    *indexes = up->ring.n * sizeof(struct upstream_vnode);
+
+    upstream_pool_foreach(up, slab, u) {
+        *counters += traffic_size(u->traffic);
+        if (u->timewheel.elts != NULL) {
+            *counters += u->timewheel.nelts * sizeof(void *);
+        }
+    }
+
+    for (i = 0; i < up->sources.size; i++) {
+        for (e = up->sources.buckets[i]; e != NULL; e = e->next) {
+            src = (struct upstream_source *)*(void **)e->value;
+            *indexes += sizeof(*src) + src->nalloc * sizeof(struct upstream *);
+        }
+    }
+
+    return *records + *keys + *counters + *indexes;
+}
+
+/* log breaker states and memory of all pools, upstreams not closed are listed */
+void
+upstreams_dump(struct upstreams *us) {
+    struct upstream_pool *up;
+    struct upstream_slab *slab;
+    struct upstream *u;
+    uint32_t n[br_tripping + 1], nstr, nup;
+    int j, len;
+    rps_ts_t now;
+    char name[MAX_HOSTNAME_LEN];
+    struct traffic_slot t, total;
+    size_t size, records, keys, counters, indexes, strbytes;
+
+    now = rps_now();
+    len = array_n(&us->pools);
+
+    for (j = 0; j < len; j++) {
+        up = (struct upstream_pool *)array_get(&us->pools, j);
+        memset(n, 0, sizeof(n));
+        traffic_slot_init(&total);
+
+        uv_rwlock_rdlock(&up->rwlock);
+        upstream_pool_foreach(up, slab, u) {
+            n[u->breaker]++;
+
+            traffic_sum(u->traffic, &t);
+            total.nup += t.nup;
+            total.ndown += t.ndown;
+            total.sessions += t.sessions;
+            total.active += t.active;
+
+            if (u->breaker == br_closed) {
+                continue;
+            }
+
+            rps_inaddr_name(&u->server, name);
+            log_notice("\t%s://%s:%d %s, failures: %d, trips: %d, probes: %d, retry in %ld s", 
+                    rps_proto_str(u->proto), name, rps_inaddr_port(&u->server), 
+                    upstream_breaker_str(u->breaker), u->nfail, u->ntrip, u->nprobe, 
+                    (long)MAX(u->retry_date - now, 0));
+        }
+        nup = hashmap_n(&up->pool);
+        size = upstream_pool_memory(up, &records, &keys, &counters, &indexes);
+        uv_rwlock_rdunlock(&up->rwlock);
+
+        log_notice("%s upstream pool <%d> proxys, breaker closed: %d, open: %d, half-open: %d", 
+                rps_proto_str(up->proto), nup, 
+                n[br_closed], n[br_open] + n[br_tripping], n[br_half_open]);
+        log_notice("%s upstream pool sessions: %llu, active: %lld, up: %llu bytes, down: %llu bytes", 
+                rps_proto_str(up->proto), (unsigned long long)total.sessions, 
+                (long long)total.active, (unsigned long long)total.nup, 
+                (unsigned long long)total.ndown);
+        log_notice("%s upstream pool memory: %zu bytes, %zu per upstream (records %zu, keys %zu, "
+                "counters %zu, indexes %zu)", rps_proto_str(up->proto), size, 
+                nup > 0 ? size / nup : 0, records, keys, counters, indexes);
+    }
+
+    strtab_stats(&nstr, &strbytes);
+    log_notice("upstream strings: %d interned, %zu bytes", nstr, strbytes);
+}
@@ -8,6 +8,8 @@
 #include "hashmap.h"
 #include "_string.h"
 #include "config.h"
+#include "traffic.h"
+#include "strtab.h"
 
 #include <uv.h>
 
@@ -19,30 +21,107 @@
 #define UPSTREAM_MIN_FAILURE   10
 #define UPSTREAM_MAX_LOOP      200
 
-#define UPSTREAM_KEY_MAX_LENGTH 128
-#define UPSTREAM_PAYLOAD_MAX_LENGTH 512
+#define UPSTREAM_RING_VNODES    40      /* ring points per upstream */
+#define UPSTREAM_CHASH_LOAD_FACTOR  1.25    /* max active of an upstream relative to mean */
+
+#define UPSTREAM_SLAB_RECORDS   256     /* records per slab of a pool */
+#define UPSTREAM_SOURCE_MAX_LENGTH  32
+#define UPSTREAM_SOURCE_BUCKETS     64
+#define UPSTREAM_SOURCE_MIN_MEMBERS 16
+
+#define UPSTREAM_EXPIRE_INTERVAL    1000    /* ms between expiry ticks */
+#define UPSTREAM_EXPIRE_BATCH       256     /* records recycled per pool and tick */
+#define UPSTREAM_HEAP_MIN           64
+#define UPSTREAM_HEAP_NONE          UINT32_MAX
+
+/* username suffix routing a session to upstreams of a source, e.g. rps-source-zhima */
+#define UPSTREAM_ROUTE_SOURCE   "-source-"
+#define UPSTREAM_PAYLOAD_MAX_LENGTH 1024
+
+#define UPSTREAM_AUTH_MAX_LENGTH    1024    /* serialized credentials */
+#define UPSTREAM_AUTH_HEADER        "Proxy-Authorization: Basic "
 
 enum upstream_schedule {
     up_rr,         /* round-robin */
     up_wrr,        /* weighted round-robin*/
     up_random,     /* raondom schedule */
+    up_chash,      /* consistent hashing of remote host with bounded loads */
+};
+
+/*
+ * Server threads move the breaker with compare-and-swap. The thread winning
+ * a transition holds br_tripping while it sets retry_date, ntrip and nprobe,
+ * others see the breaker as open meanwhile.
+ */
+enum upstream_breaker {
+    br_closed,      /* serving */
+    br_open,        /* skipped until retry_date */
+    br_half_open,   /* let a few probe sessions through */
+    br_tripping,    /* transition in progress, skipped */
 };
 
+#define UPSTREAM_BREAKER_MAX_TRIP   16
+#define UPSTREAM_NOPIPELINE_BACKOFF 600     /* s of lock-step after a misparsed pipelined reply */
+
 /*
  * upstreams.pools -> {2-3}upstream_pool.pool -> {n}upstream
+ *                            upstream_pool.sources -> {n}upstream_source -> {n}upstream
+ *                            upstream_pool.slabs -> {n}upstream_slab -> {256}upstream
+ *
+ * Records of a pool live in slabs and never move while in use, the pool
+ * hashmap and the indexes point to them. Strings of a record are interned,
+ * see strtab.h, records outside a pool (api responses, snapshots, stats
+ * copies) intern theirs too.
+ *
+ * Records with an expire_date sit in a min-heap of the pool ordered by it.
+ * The expiry crontab pops what is due, a bounded batch per tick, and
+ * recycles records no session holds. Held ones are disabled and retired,
+ * they go back to the slab on a later tick once active dropped to 0.
  */
 
+struct upstream_source;
+
+/* binary key of the pool hashmap */
+struct upstream_key {
+    uint8_t     proto;
+    uint8_t     family;
+    uint16_t    port;
+    uint8_t     addr[16];
+};
+
 struct upstream  {
-    rps_addr_t  server;
+    rps_inaddr_t    server;
     rps_proto_t proto;
     rps_str_t   uname;
     rps_str_t   passwd;
     rps_str_t   source;
 
+    /* credentials serialized once, see upstream_auth_build */
+    rps_str_t   auth;
+
+    /* slot in members of the source index, NULL if source is empty */
+    struct upstream_source  *src;
+    uint32_t    sidx;
+
+    uint32_t    hidx;       /* slot in the expiry heap, UPSTREAM_HEAP_NONE if out */
+
     uint16_t    weight;
     uint32_t    success;
     uint32_t    failure;
     uint32_t    count;
+    uint32_t    active;     /* sessions holding the upstream, from get to put */
+
+    /* circuit breaker */
+    uint8_t     breaker;
+    uint8_t     ntrip;      /* consecutive opens, exponent of backoff */
+    uint16_t    nfail;      /* consecutive failures */
+    uint16_t    nprobe;     /* probes in flight */
+    rps_ts_t    retry_date; /* end of open backoff or of probe window */
+
+    /* lock-step handshakes until then, written by server threads without the pool lock */
+    rps_ts_t    nopipeline_until;
+
+    struct traffic  *traffic;   /* established sessions, slot per server */
 
     rps_ts_t    insert_date;
     rps_ts_t    expire_date;
@@ -54,28 +133,95 @@ struct upstream  {
     rps_queue_t timewheel;
     
     uint8_t     enable:1;
+    uint8_t     stale:1;    /* restored from snapshot, not confirmed by api yet */
+    uint8_t     used:1;     /* record of a slab in use */
+    uint8_t     retired:1;  /* expired while held, recycled once idle */
+
+    struct upstream *next;  /* free records of the pool */
+};
+
+struct upstream_slab {
+    struct upstream_slab    *next;
+    struct upstream         records[UPSTREAM_SLAB_RECORDS];
+};
+
+/* records in use of a pool, caller holds the lock; break leaves the slab only */
+#define upstream_pool_foreach(_up, _slab, _u)                                   \
+    for ((_slab) = (_up)->slabs; (_slab) != NULL; (_slab) = (_slab)->next)      \
+        for ((_u) = (_slab)->records;                                           \
+                (_u) < (_slab)->records + UPSTREAM_SLAB_RECORDS; (_u)++)        \
+            if ((_u)->used)
+
+struct upstream_vnode {
+    uint32_t                hash;
+    struct upstream         *upstream;
+};
+
+/* 
+ * Consistent hash ring of enabled upstreams, rebuilt when pool membership 
+ * changes so that only keys of the added or removed upstreams move.
+ */
+struct upstream_ring {
+    struct upstream_vnode   *vnodes;    /* sorted by hash */
+    uint32_t                n;
+    uint32_t                members;
+};
+
+/*
+ * Secondary index of a pool, upstreams of one source packed in a dense array.
+ * Kept in step with the pool on merge, expiry and add, an upstream leaves it
+ * by moving the last member into its slot.
+ */
+struct upstream_source {
+    rps_str_t               name;
+    struct upstream         **members;
+    uint32_t                n;
+    uint32_t                nalloc;
+    uint32_t                next;       /* round-robin cursor */
 };
 
 struct upstream_pool {
-    rps_hashmap_t           pool;
+    rps_hashmap_t           pool;       /* upstream_key -> record */
+    rps_hashmap_t           sources;    /* source -> upstream_source */
+    struct upstream_slab    *slabs;
+    struct upstream         *free;
+    uint32_t                nslabs;
+    struct upstream         **heap;     /* min-heap on expire_date */
+    uint32_t                nheap;
+    uint32_t                heap_alloc;
+    struct upstream         **retired;  /* expired, waiting for active to drop */
+    uint32_t                nretired;
+    uint32_t                retired_alloc;
+    uint32_t                nstale;     /* stale records, dropped after merge */
+    struct upstream_ring    ring;
+    uint32_t                active;     /* sum of upstream active */
+    bool                    chash;
     rps_hashmap_iterator_t  iter;
     rps_proto_t             proto;
     rps_str_t               api;
     rps_str_t               stats_api;
     uint32_t                timeout; //api request max timeout
+    uint32_t                nslots;     /* traffic slots of new upstreams */
     uv_rwlock_t             rwlock;
 };
 
 struct upstreams {
     uint8_t                 schedule;
     bool                    hybrid;
+    bool                    pipeline;
     uint16_t                maxreconn;
     uint16_t                maxretry;
     uint32_t                mr1m;
     uint32_t                mr1h;
     uint32_t                mr1d;
     float                   max_fail_rate;
+    uint32_t                breaker_failures;
+    uint32_t                breaker_backoff;
+    uint32_t                breaker_max_backoff;
+    uint32_t                breaker_probes;
+    rps_str_t               snapshot;
     rps_array_t             pools;
+    uint32_t                nslots;     /* server threads counting traffic */
     uv_cond_t               ready;
     uv_mutex_t              mutex;
     uint8_t                 once:1;
@@ -83,12 +229,29 @@ struct upstreams {
 
 void upstream_init(struct upstream *u);
 void upstream_deinit(struct upstream *u);
+rps_status_t upstream_init_timewheel(struct upstream *u, 
+        uint32_t mr1m, uint32_t mr1h, uint32_t mr1d);
+rps_status_t upstream_auth_build(struct upstream *u);
+
+rps_status_t upstream_pool_load(rps_hashmap_t *pool, rps_str_t *api, uint32_t timeout);
 
 rps_status_t upstreams_init(struct upstreams *us, 
-        struct config_api *api, struct config_upstreams *cu);
-struct upstream  *upstreams_get(struct upstreams *us, rps_proto_t proto);
+        struct config_api *api, struct config_upstreams *cu, uint32_t nslots);
+struct upstream  *upstreams_get(struct upstreams *us, rps_proto_t proto, 
+        rps_addr_t *remote, const char *source);
+void upstreams_put(struct upstreams *us, struct upstream *u);
+void upstreams_success(struct upstreams *us, struct upstream *u);
+void upstreams_failure(struct upstreams *us, struct upstream *u);
+bool upstream_pipeline_allowed(struct upstream *u);
+void upstream_pipeline_failed(struct upstream *u);
+void upstreams_dump(struct upstreams *us);
 void upstreams_deinit(struct upstreams *us);
 void upstreams_refresh(uv_timer_t *handle);
 void upstreams_stats(uv_timer_t *handler);
+void upstreams_expire(uv_timer_t *handle);
+void upstreams_ready(struct upstreams *us);
+void upstreams_wait(struct upstreams *us);
+rps_status_t upstreams_add(struct upstreams *us, struct upstream *u);
+void upstreams_rehash(struct upstreams *us);
 
 #endif
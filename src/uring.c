@@ -0,0 +1,982 @@
+#include "core.h"
+#include "uring.h"
+#include "server.h"
+#include "util.h"
+#include "log.h"
+
+#ifdef RPS_HAVE_URING
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define URING_OP_RECV       0
+#define URING_OP_SEND       1
+#define URING_OP_CANCEL     2
+
+#define URING_NIL           0xffff  /* end of buffer queue */
+
+#define URING_HOW_KILL      0
+#define URING_HOW_EOF       1
+
+/* user_data of operations, tunnels are 8 byte aligned */
+#define URING_DATA(t, op, d)    ((uint64_t)(uintptr_t)(t) | ((op) << 1) | (d))
+#define URING_DATA_TUNNEL(v)    ((struct uring_tunnel *)(uintptr_t)((v) & ~(uint64_t)7))
+#define URING_DATA_OP(v)        (((v) >> 1) & 3)
+#define URING_DATA_DIR(v)       ((v) & 1)
+
+/*
+ * Direction 0 relays request to forward (up), direction 1 forward to
+ * request (down). Received buffers wait in a queue linked through
+ * bnext of the ring, the first nsending of them are being sent.
+ */
+struct uring_dir {
+    uint16_t    head;
+    uint16_t    tail;
+    uint32_t    nqueued;
+    uint32_t    nsending;
+
+    unsigned    armed:1;    /* multishot recv in flight */
+    unsigned    eof:1;
+    unsigned    paused:1;   /* recv cancelled until the queue drained */
+    unsigned    starved:1;  /* recv ended for lack of buffers */
+};
+
+struct uring_tunnel {
+    struct uring        *u;
+    rps_sess_t          *sess;
+
+    int                 fd[2];  /* request, forward */
+    struct uring_dir    dir[2];
+
+    uint32_t            inflight;   /* operations waiting for completion */
+
+    struct uring_tunnel *snext;
+    struct uring_tunnel **sprev;
+
+    unsigned            stopping:1;
+    unsigned            how:1;
+    unsigned            eofdir:1;
+};
+
+static int
+uring_setup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int
+uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int
+uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/* Multishot recv and cancel of all requests on a fd came with 6.0. */
+static bool
+uring_kernel_supported(void) {
+    struct utsname un;
+    int major;
+
+    if (uname(&un) < 0) {
+        return false;
+    }
+
+    if (sscanf(un.release, "%d", &major) != 1) {
+        return false;
+    }
+
+    return major >= URING_KERNEL_MAJOR;
+}
+
+static bool
+uring_probe(int fd) {
+    struct io_uring_probe *probe;
+    size_t len;
+    bool ok;
+
+    len = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+
+    probe = (struct io_uring_probe *)rps_alloc(len);
+    if (probe == NULL) {
+        return false;
+    }
+    memset(probe, 0, len);
+
+    ok = false;
+
+    if (uring_register(fd, IORING_REGISTER_PROBE, probe, 256) == 0 &&
+            probe->last_op >= IORING_OP_SEND && probe->last_op >= IORING_OP_ASYNC_CANCEL) {
+        ok = (probe->ops[IORING_OP_RECV].flags & IO_URING_OP_SUPPORTED) &&
+            (probe->ops[IORING_OP_SEND].flags & IO_URING_OP_SUPPORTED) &&
+            (probe->ops[IORING_OP_ASYNC_CANCEL].flags & IO_URING_OP_SUPPORTED);
+    }
+
+    rps_free(probe);
+
+    return ok;
+}
+
+static rps_status_t
+uring_map(struct uring *u, struct io_uring_params *p) {
+    char *sq, *cq;
+    unsigned i;
+
+    u->sq_ring_size = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+    u->cq_ring_size = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+
+    if (p->features & IORING_FEAT_SINGLE_MMAP) {
+        u->sq_ring_size = MAX(u->sq_ring_size, u->cq_ring_size);
+        u->cq_ring_size = u->sq_ring_size;
+    }
+
+    u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if (u->sq_ring == MAP_FAILED) {
+        u->sq_ring = NULL;
+        return RPS_ERROR;
+    }
+
+    if (p->features & IORING_FEAT_SINGLE_MMAP) {
+        u->cq_ring = u->sq_ring;
+    } else {
+        u->cq_ring = mmap(NULL, u->cq_ring_size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+        if (u->cq_ring == MAP_FAILED) {
+            u->cq_ring = NULL;
+            return RPS_ERROR;
+        }
+    }
+
+    u->sqes_size = p->sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) {
+        u->sqes = NULL;
+        return RPS_ERROR;
+    }
+
+    sq = (char *)u->sq_ring;
+    cq = (char *)u->cq_ring;
+
+    u->sq_head = (unsigned *)(sq + p->sq_off.head);
+    u->sq_tail = (unsigned *)(sq + p->sq_off.tail);
+    u->sq_flags = (unsigned *)(sq + p->sq_off.flags);
+    u->sq_mask = *(unsigned *)(sq + p->sq_off.ring_mask);
+    u->sq_array = (unsigned *)(sq + p->sq_off.array);
+
+    u->cq_head = (unsigned *)(cq + p->cq_off.head);
+    u->cq_tail = (unsigned *)(cq + p->cq_off.tail);
+    u->cq_mask = *(unsigned *)(cq + p->cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(cq + p->cq_off.cqes);
+
+    /* sqes are used in ring order */
+    for (i = 0; i < p->sq_entries; i++) {
+        u->sq_array[i] = i;
+    }
+
+    u->sq_local = *u->sq_tail;
+    u->sq_pending = 0;
+
+    return RPS_OK;
+}
+
+static void
+uring_buf_add(struct uring *u, uint16_t bid) {
+    struct io_uring_buf *buf;
+
+    buf = &u->br->bufs[u->br_tail & (URING_BUFS - 1)];
+    buf->addr = (uint64_t)(uintptr_t)(u->bufs + (size_t)bid * URING_BUF_SIZE);
+    buf->len = URING_BUF_SIZE;
+    buf->bid = bid;
+
+    u->br_tail++;
+}
+
+static void
+uring_buf_publish(struct uring *u) {
+    __atomic_store_n(&u->br->tail, u->br_tail, __ATOMIC_RELEASE);
+}
+
+static rps_status_t
+uring_bufs_init(struct uring *u) {
+    struct io_uring_buf_reg reg;
+    uint16_t bid;
+
+    u->br_size = URING_BUFS * sizeof(struct io_uring_buf);
+    u->br = mmap(NULL, u->br_size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (u->br == MAP_FAILED) {
+        u->br = NULL;
+        return RPS_ERROR;
+    }
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)u->br;
+    reg.ring_entries = URING_BUFS;
+    reg.bgid = URING_BGID;
+
+    if (uring_register(u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        return RPS_ERROR;
+    }
+
+    u->bufs = rps_alloc_tag((size_t)URING_BUFS * URING_BUF_SIZE, mem_buffer);
+    if (u->bufs == NULL) {
+        return RPS_ENOMEM;
+    }
+
+    u->br_tail = 0;
+    for (bid = 0; bid < URING_BUFS; bid++) {
+        uring_buf_add(u, bid);
+        u->bnext[bid] = URING_NIL;
+        u->blen[bid] = 0;
+    }
+    uring_buf_publish(u);
+
+    u->nreturned = 0;
+
+    return RPS_OK;
+}
+
+/* Publish queued sqes and submit them. */
+static void
+uring_flush(struct uring *u) {
+    int n;
+
+    if (u->sq_pending == 0) {
+        return;
+    }
+
+    __atomic_store_n(u->sq_tail, u->sq_local, __ATOMIC_RELEASE);
+
+    n = uring_enter(u->fd, u->sq_pending, 0, 0);
+    if (n < 0) {
+        /* EAGAIN or EBUSY, retried before the loop blocks again */
+        if (errno != EAGAIN && errno != EBUSY && errno != EINTR) {
+            log_error("io_uring submit failed: %s", strerror(errno));
+        }
+        return;
+    }
+
+    u->sq_pending -= (unsigned)n;
+}
+
+/* 
+ * Make room for n sqes, a linked chain taken after it is never split by
+ * the flush of a full ring.
+ */
+static bool
+uring_sq_reserve(struct uring *u, unsigned n) {
+    unsigned head;
+
+    head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+    if (u->sq_local - head + n <= u->sq_mask + 1) {
+        return true;
+    }
+
+    uring_flush(u);
+
+    head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+    return u->sq_local - head + n <= u->sq_mask + 1;
+}
+
+static struct io_uring_sqe *
+uring_sqe(struct uring *u) {
+    struct io_uring_sqe *sqe;
+    unsigned head;
+
+    head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+    if (u->sq_local - head >= u->sq_mask + 1) {
+        uring_flush(u);
+        head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+        if (u->sq_local - head >= u->sq_mask + 1) {
+            return NULL;
+        }
+    }
+
+    sqe = &u->sqes[u->sq_local & u->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+
+    u->sq_local++;
+    u->sq_pending++;
+
+    return sqe;
+}
+
+static void uring_tunnel_fail(struct uring_tunnel *t);
+
+static void
+uring_recv_arm(struct uring_tunnel *t, int d) {
+    struct uring_dir *dir;
+    struct io_uring_sqe *sqe;
+
+    dir = &t->dir[d];
+
+    ASSERT(!dir->armed);
+
+    sqe = uring_sqe(t->u);
+    if (sqe == NULL) {
+        uring_tunnel_fail(t);
+        return;
+    }
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = t->fd[d];
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    sqe->user_data = URING_DATA(t, URING_OP_RECV, d);
+
+    dir->armed = 1;
+    dir->starved = 0;
+    t->inflight++;
+}
+
+static void
+uring_cancel(struct uring_tunnel *t, int d, bool all) {
+    struct io_uring_sqe *sqe;
+
+    sqe = uring_sqe(t->u);
+    if (sqe == NULL) {
+        return;
+    }
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    if (all) {
+        sqe->fd = t->fd[d];
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    } else {
+        sqe->fd = -1;
+        sqe->addr = URING_DATA(t, URING_OP_RECV, d);
+    }
+    sqe->user_data = URING_DATA(t, URING_OP_CANCEL, d);
+
+    t->inflight++;
+}
+
+/*
+ * Send the queued buffers of direction d not being sent yet as one linked
+ * chain, the next chain waits for this one so writes never reorder.
+ */
+static void
+uring_send_kick(struct uring_tunnel *t, int d) {
+    struct uring *u;
+    struct uring_dir *dir;
+    struct io_uring_sqe *sqe, *prev;
+    uint16_t bid;
+
+    u = t->u;
+    dir = &t->dir[d];
+
+    if (dir->nsending > 0 || dir->nqueued == 0) {
+        return;
+    }
+
+    if (!uring_sq_reserve(u, dir->nqueued)) {
+        uring_tunnel_fail(t);
+        return;
+    }
+
+    prev = NULL;
+
+    for (bid = dir->head; bid != URING_NIL; bid = u->bnext[bid]) {
+        sqe = uring_sqe(u);
+        ASSERT(sqe != NULL);
+
+        /* linked only once the next one is taken, a chain never dangles */
+        if (prev != NULL) {
+            prev->flags |= IOSQE_IO_LINK;
+        }
+
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = t->fd[1 - d];
+        sqe->addr = (uint64_t)(uintptr_t)(u->bufs + (size_t)bid * URING_BUF_SIZE);
+        sqe->len = u->blen[bid];
+        sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+        sqe->user_data = URING_DATA(t, URING_OP_SEND, d);
+
+        dir->nsending++;
+        t->inflight++;
+
+        prev = sqe;
+    }
+}
+
+static void
+uring_queue_push(struct uring_tunnel *t, int d, uint16_t bid, uint32_t len) {
+    struct uring *u;
+    struct uring_dir *dir;
+
+    u = t->u;
+    dir = &t->dir[d];
+
+    u->bnext[bid] = URING_NIL;
+    u->blen[bid] = len;
+
+    if (dir->head == URING_NIL) {
+        dir->head = bid;
+    } else {
+        u->bnext[dir->tail] = bid;
+    }
+    dir->tail = bid;
+    dir->nqueued++;
+}
+
+static void
+uring_buf_return(struct uring *u, uint16_t bid) {
+    uring_buf_add(u, bid);
+    u->nreturned++;
+}
+
+static uint16_t
+uring_queue_pop(struct uring_tunnel *t, int d) {
+    struct uring *u;
+    struct uring_dir *dir;
+    uint16_t bid;
+
+    u = t->u;
+    dir = &t->dir[d];
+
+    ASSERT(dir->head != URING_NIL);
+
+    bid = dir->head;
+    dir->head = u->bnext[bid];
+    if (dir->head == URING_NIL) {
+        dir->tail = URING_NIL;
+    }
+    dir->nqueued--;
+
+    return bid;
+}
+
+static void
+uring_starved_add(struct uring_tunnel *t, int d) {
+    struct uring *u;
+
+    u = t->u;
+
+    t->dir[d].starved = 1;
+
+    if (t->sprev != NULL) {
+        return;
+    }
+
+    t->snext = u->starved;
+    if (t->snext != NULL) {
+        t->snext->sprev = &t->snext;
+    }
+    t->sprev = &u->starved;
+    u->starved = t;
+}
+
+static void
+uring_starved_del(struct uring_tunnel *t) {
+    if (t->sprev == NULL) {
+        return;
+    }
+
+    *t->sprev = t->snext;
+    if (t->snext != NULL) {
+        t->snext->sprev = t->sprev;
+    }
+    t->snext = NULL;
+    t->sprev = NULL;
+}
+
+/* Cancel everything on both sockets, the tunnel is handed back once it all completed. */
+static void
+uring_tunnel_halt(struct uring_tunnel *t, int how, int d) {
+    if (t->stopping) {
+        return;
+    }
+
+    t->stopping = 1;
+    t->how = how;
+    t->eofdir = d;
+
+    uring_starved_del(t);
+
+    uring_cancel(t, 0, true);
+    uring_cancel(t, 1, true);
+}
+
+static void
+uring_tunnel_fail(struct uring_tunnel *t) {
+    uring_tunnel_halt(t, URING_HOW_KILL, 0);
+}
+
+/*
+ * Last completion arrived, give the contexts back to server.c. EOF goes
+ * down the usual path of a read returning UV_EOF, anything else kills
+ * the session.
+ */
+static void
+uring_tunnel_finish(struct uring_tunnel *t) {
+    struct uring *u;
+    rps_sess_t *sess;
+    rps_ctx_t *ctx;
+    int d;
+
+    u = t->u;
+    sess = t->sess;
+
+    for (d = 0; d < 2; d++) {
+        while (t->dir[d].head != URING_NIL) {
+            uring_buf_return(u, uring_queue_pop(t, d));
+        }
+    }
+
+    sess->uring = NULL;
+    u->ntunnels--;
+
+    if (t->how == URING_HOW_EOF) {
+        ctx = t->eofdir == 0 ? sess->request : sess->forward;
+        ctx->nread = UV_EOF;
+    } else {
+        ctx = sess->request;
+        ctx->state = c_kill;
+    }
+
+    rps_free(t);
+
+    server_do_next(ctx);
+}
+
+/* EOF of direction d is passed on after the data received before it. */
+static void
+uring_eof_check(struct uring_tunnel *t, int d) {
+    struct uring_dir *dir;
+
+    dir = &t->dir[d];
+
+    if (dir->eof && dir->nqueued == 0) {
+        uring_tunnel_halt(t, URING_HOW_EOF, d);
+    }
+}
+
+static void
+uring_on_recv(struct uring_tunnel *t, int d, struct io_uring_cqe *cqe) {
+    struct uring_dir *dir;
+    rps_sess_t *sess;
+    rps_ctx_t *src, *dst;
+    uint16_t bid;
+
+    dir = &t->dir[d];
+    sess = t->sess;
+
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        dir->armed = 0;
+        t->inflight--;
+    }
+
+    if (cqe->res > 0) {
+        ASSERT(cqe->flags & IORING_CQE_F_BUFFER);
+        bid = (uint16_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+
+        if (t->stopping) {
+            uring_buf_return(t->u, bid);
+            return;
+        }
+
+        src = d == 0 ? sess->request : sess->forward;
+        dst = d == 0 ? sess->forward : sess->request;
+
+        uring_queue_push(t, d, bid, (uint32_t)cqe->res);
+
+        if (d == 0) {
+            server_account(sess, (size_t)cqe->res, 0);
+        } else {
+            server_account(sess, 0, (size_t)cqe->res);
+        }
+
+        server_timer_reset(src);
+        server_timer_reset(dst);
+
+        uring_send_kick(t, d);
+
+        /* stop reading until the other side took its backlog */
+        if (dir->nqueued >= URING_MAX_QUEUED && dir->armed && !dir->paused) {
+            dir->paused = 1;
+            uring_cancel(t, d, false);
+        }
+    } else if (cqe->res == 0) {
+        dir->eof = 1;
+    } else if (cqe->res == -ENOBUFS) {
+        if (!t->stopping) {
+            uring_starved_add(t, d);
+        }
+        return;
+    } else if (cqe->res != -ECANCELED) {
+        uring_tunnel_fail(t);
+        return;
+    }
+
+    if (t->stopping) {
+        return;
+    }
+
+    if (dir->eof) {
+        uring_eof_check(t, d);
+        return;
+    }
+
+    /* multishot ended on its own */
+    if (!dir->armed && !dir->paused) {
+        uring_recv_arm(t, d);
+    }
+}
+
+static void
+uring_on_send(struct uring_tunnel *t, int d, struct io_uring_cqe *cqe) {
+    struct uring_dir *dir;
+    uint16_t bid;
+    uint32_t len;
+
+    dir = &t->dir[d];
+
+    bid = uring_queue_pop(t, d);
+    len = t->u->blen[bid];
+    uring_buf_return(t->u, bid);
+
+    dir->nsending--;
+    t->inflight--;
+
+    if (t->stopping) {
+        return;
+    }
+
+    if (cqe->res < 0 || (uint32_t)cqe->res != len) {
+        uring_tunnel_fail(t);
+        return;
+    }
+
+    uring_send_kick(t, d);
+
+    if (dir->paused && dir->nqueued <= URING_MAX_QUEUED / 2) {
+        dir->paused = 0;
+        if (!dir->armed && !dir->eof) {
+            uring_recv_arm(t, d);
+        }
+    }
+
+    uring_eof_check(t, d);
+}
+
+static void
+uring_complete(struct uring *u, struct io_uring_cqe *cqe) {
+    struct uring_tunnel *t;
+    int d;
+
+    t = URING_DATA_TUNNEL(cqe->user_data);
+    d = (int)URING_DATA_DIR(cqe->user_data);
+
+    switch (URING_DATA_OP(cqe->user_data)) {
+    case URING_OP_RECV:
+        uring_on_recv(t, d, cqe);
+        break;
+    case URING_OP_SEND:
+        uring_on_send(t, d, cqe);
+        break;
+    case URING_OP_CANCEL:
+        t->inflight--;
+        break;
+    default:
+        NOT_REACHED();
+    }
+
+    if (t->stopping && t->inflight == 0) {
+        uring_tunnel_finish(t);
+    }
+
+    UNUSED(u);
+}
+
+/* Buffers came back, recv of starved tunnels again. */
+static void
+uring_rearm_starved(struct uring *u) {
+    struct uring_tunnel *t;
+    int d;
+
+    while (u->starved != NULL && u->nreturned > 0) {
+        t = u->starved;
+        uring_starved_del(t);
+
+        for (d = 0; d < 2; d++) {
+            if (t->dir[d].starved && !t->dir[d].armed && !t->dir[d].paused) {
+                uring_recv_arm(t, d);
+            }
+            t->dir[d].starved = 0;
+        }
+    }
+
+    u->nreturned = 0;
+}
+
+static void
+uring_reap(struct uring *u) {
+    struct io_uring_cqe *cqe;
+    unsigned head, tail;
+
+    for (;;) {
+        head = *u->cq_head;
+        tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+
+        if (head == tail) {
+            /* completions the kernel kept aside while the ring was full */
+            if (__atomic_load_n(u->sq_flags, __ATOMIC_RELAXED) & IORING_SQ_CQ_OVERFLOW) {
+                uring_enter(u->fd, 0, 0, IORING_ENTER_GETEVENTS);
+                continue;
+            }
+            break;
+        }
+
+        while (head != tail) {
+            cqe = &u->cqes[head & u->cq_mask];
+            uring_complete(u, cqe);
+            head++;
+            /* completion handlers may not look at the cqe later */
+            __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+        }
+
+        if (u->nreturned > 0) {
+            uring_buf_publish(u);
+            uring_rearm_starved(u);
+        }
+    }
+}
+
+static void
+uring_on_poll(uv_poll_t *handle, int status, int events) {
+    struct uring *u;
+
+    UNUSED(events);
+
+    u = (struct uring *)handle->data;
+
+    if (status < 0) {
+        UV_SHOW_ERROR(status, "io_uring poll");
+        return;
+    }
+
+    uring_reap(u);
+}
+
+/* Submissions of the whole loop iteration go to the kernel at once. */
+static void
+uring_on_prepare(uv_prepare_t *handle) {
+    struct uring *u;
+
+    u = (struct uring *)handle->data;
+
+    uring_flush(u);
+}
+
+static void
+uring_release(struct uring *u) {
+    if (u->br != NULL) {
+        munmap(u->br, u->br_size);
+        u->br = NULL;
+    }
+
+    if (u->bufs != NULL) {
+        rps_free(u->bufs);
+        u->bufs = NULL;
+    }
+
+    if (u->sqes != NULL) {
+        munmap(u->sqes, u->sqes_size);
+        u->sqes = NULL;
+    }
+
+    if (u->cq_ring != NULL && u->cq_ring != u->sq_ring) {
+        munmap(u->cq_ring, u->cq_ring_size);
+    }
+    u->cq_ring = NULL;
+
+    if (u->sq_ring != NULL) {
+        munmap(u->sq_ring, u->sq_ring_size);
+        u->sq_ring = NULL;
+    }
+
+    if (u->fd >= 0) {
+        close(u->fd);
+        u->fd = -1;
+    }
+}
+
+/* Set up the ring of a server loop, on failure relaying stays on libuv. */
+rps_status_t
+uring_init(struct uring *u, uv_loop_t *loop) {
+    struct io_uring_params p;
+    rps_status_t status;
+
+    memset(u, 0, sizeof(*u));
+    u->loop = loop;
+    u->fd = -1;
+
+    if (!uring_kernel_supported()) {
+        log_warn("io_uring needs linux %d.0 or later, fallback to epoll", URING_KERNEL_MAJOR);
+        return RPS_ERROR;
+    }
+
+    memset(&p, 0, sizeof(p));
+
+    u->fd = uring_setup(URING_ENTRIES, &p);
+    if (u->fd < 0) {
+        log_warn("io_uring setup failed: %s, fallback to epoll", strerror(errno));
+        u->fd = -1;
+        return RPS_ERROR;
+    }
+
+    if (!uring_probe(u->fd)) {
+        log_warn("io_uring lacks recv, send or cancel, fallback to epoll");
+        uring_release(u);
+        return RPS_ERROR;
+    }
+
+    if (uring_map(u, &p) != RPS_OK) {
+        log_warn("io_uring mmap failed: %s, fallback to epoll", strerror(errno));
+        uring_release(u);
+        return RPS_ERROR;
+    }
+
+    status = uring_bufs_init(u);
+    if (status != RPS_OK) {
+        log_warn("io_uring provided buffers failed: %s, fallback to epoll", strerror(errno));
+        uring_release(u);
+        return status;
+    }
+
+    uv_poll_init(loop, &u->poll, u->fd);
+    u->poll.data = u;
+    uv_poll_start(&u->poll, UV_READABLE, uring_on_poll);
+    uv_unref((uv_handle_t *)&u->poll);
+
+    uv_prepare_init(loop, &u->prepare);
+    u->prepare.data = u;
+    uv_prepare_start(&u->prepare, uring_on_prepare);
+    uv_unref((uv_handle_t *)&u->prepare);
+
+    return RPS_OK;
+}
+
+void
+uring_deinit(struct uring *u) {
+    if (u->fd < 0) {
+        return;
+    }
+
+    uv_poll_stop(&u->poll);
+    uv_close((uv_handle_t *)&u->poll, NULL);
+    uv_prepare_stop(&u->prepare);
+    uv_close((uv_handle_t *)&u->prepare, NULL);
+
+    uring_release(u);
+}
+
+bool
+uring_enabled(struct uring *u) {
+    return u->fd >= 0;
+}
+
+/*
+ * Take over relaying of an established session, libuv reads of both
+ * contexts must be stopped by the caller and no write queued.
+ */
+rps_status_t
+uring_tunnel_start(struct uring *u, rps_sess_t *sess) {
+    struct uring_tunnel *t;
+    uv_os_fd_t fd0, fd1;
+    int d;
+
+    if (uv_fileno(&sess->request->handle.handle, &fd0) != 0 ||
+            uv_fileno(&sess->forward->handle.handle, &fd1) != 0) {
+        return RPS_ERROR;
+    }
+
+    t = (struct uring_tunnel *)rps_alloc_tag(sizeof(*t), mem_session);
+    if (t == NULL) {
+        return RPS_ENOMEM;
+    }
+
+    t->u = u;
+    t->sess = sess;
+    t->fd[0] = fd0;
+    t->fd[1] = fd1;
+    t->inflight = 0;
+    t->snext = NULL;
+    t->sprev = NULL;
+    t->stopping = 0;
+    t->how = URING_HOW_KILL;
+    t->eofdir = 0;
+
+    for (d = 0; d < 2; d++) {
+        t->dir[d].head = URING_NIL;
+        t->dir[d].tail = URING_NIL;
+        t->dir[d].nqueued = 0;
+        t->dir[d].nsending = 0;
+        t->dir[d].armed = 0;
+        t->dir[d].eof = 0;
+        t->dir[d].paused = 0;
+        t->dir[d].starved = 0;
+    }
+
+    sess->uring = t;
+    u->ntunnels++;
+
+    uring_recv_arm(t, 0);
+    uring_recv_arm(t, 1);
+
+    return RPS_OK;
+}
+
+/* Session is closed from outside (timeout, error of the other side). */
+void
+uring_tunnel_stop(struct uring_tunnel *t) {
+    uring_tunnel_fail(t);
+}
+
+#else
+
+rps_status_t
+uring_init(struct uring *u, uv_loop_t *loop) {
+    UNUSED(loop);
+
+    u->fd = -1;
+
+    log_warn("io_uring not supported by this build, fallback to epoll");
+
+    return RPS_ERROR;
+}
+
+void
+uring_deinit(struct uring *u) {
+    UNUSED(u);
+}
+
+bool
+uring_enabled(struct uring *u) {
+    UNUSED(u);
+    return false;
+}
+
+rps_status_t
+uring_tunnel_start(struct uring *u, rps_sess_t *sess) {
+    UNUSED(u);
+    UNUSED(sess);
+    return RPS_ERROR;
+}
+
+void
+uring_tunnel_stop(struct uring_tunnel *t) {
+    UNUSED(t);
+}
+
+#endif
@@ -0,0 +1,109 @@
+/*
+ * Optional io_uring data plane of established tunnels (Linux only).
+ *
+ * Handshakes run on the libuv state machines as ever. Once a session is
+ * established and has no libuv write pending, its sockets leave libuv:
+ * each side gets a multishot recv picking buffers from a ring provided to
+ * the kernel, every received buffer is queued as a send to the other side
+ * and given back to the ring when the send completed. Sends queued at once
+ * are linked so the kernel runs them in order.
+ *
+ * One ring per server loop. The ring fd is watched by a uv_poll to reap
+ * completions, submissions are batched and flushed once per loop iteration
+ * before libuv blocks.
+ *
+ * On EOF, errors or any close of the session (timeouts, drain) the tunnel
+ * cancels its operations and hands the contexts back to server.c once the
+ * last completion arrived, which closes them the usual way.
+ *
+ * Sessions of users with a bandwidth limit stay on libuv.
+ */
+
+#ifndef _RPS_URING_H
+#define _RPS_URING_H
+
+#include "core.h"
+
+#include <uv.h>
+
+#include <stdint.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#if defined(IORING_RECV_MULTISHOT) && defined(IORING_ASYNC_CANCEL_FD)
+#define RPS_HAVE_URING 1
+#endif
+#endif
+#endif
+
+#define URING_ENTRIES       1024    /* submission queue */
+#define URING_BUFS          256     /* provided buffers, power of 2 */
+#define URING_BUF_SIZE      65536
+#define URING_BGID          1
+#define URING_MAX_QUEUED    32      /* buffers pending per direction before recv pauses */
+#define URING_KERNEL_MAJOR  6       /* multishot recv and cancel by fd */
+
+struct uring_tunnel;
+
+#ifdef RPS_HAVE_URING
+
+struct uring {
+    uv_loop_t               *loop;
+
+    int                     fd;
+
+    /* submission queue */
+    unsigned                *sq_head;
+    unsigned                *sq_flags;
+    unsigned                *sq_tail;
+    unsigned                sq_mask;
+    unsigned                *sq_array;
+    struct io_uring_sqe     *sqes;
+    unsigned                sq_local;   /* tail not yet published */
+    unsigned                sq_pending;
+
+    /* completion queue */
+    unsigned                *cq_head;
+    unsigned                *cq_tail;
+    unsigned                cq_mask;
+    struct io_uring_cqe     *cqes;
+
+    void                    *sq_ring;
+    size_t                  sq_ring_size;
+    void                    *cq_ring;
+    size_t                  cq_ring_size;
+    size_t                  sqes_size;
+
+    /* provided buffers */
+    struct io_uring_buf_ring *br;
+    size_t                  br_size;
+    char                    *bufs;
+    uint16_t                br_tail;
+    uint16_t                bnext[URING_BUFS];  /* queue links of received buffers */
+    uint32_t                blen[URING_BUFS];
+    uint32_t                nreturned;  /* buffers given back since last reap */
+
+    uv_poll_t               poll;
+    uv_prepare_t            prepare;
+
+    struct uring_tunnel     *starved;   /* recv ended for lack of buffers */
+    uint32_t                ntunnels;
+};
+
+#else
+
+struct uring {
+    int                     fd;
+};
+
+#endif
+
+rps_status_t uring_init(struct uring *u, uv_loop_t *loop);
+void uring_deinit(struct uring *u);
+bool uring_enabled(struct uring *u);
+
+rps_status_t uring_tunnel_start(struct uring *u, rps_sess_t *sess);
+void uring_tunnel_stop(struct uring_tunnel *t);
+
+#endif
@@ -0,0 +1,681 @@
+#define RPS_MEM_TAG mem_user
+
+#include "core.h"
+#include "users.h"
+#include "util.h"
+#include "log.h"
+#include "murmur3/murmur3.h"
+
+#include <stdio.h>
+#include <errno.h>
+
+static void
+users_file_free(rps_array_t *entries) {
+    while (array_n(entries)) {
+        config_user_deinit((struct config_user *)array_pop(entries));
+    }
+    array_destroy(entries);
+}
+
+static void
+user_destroy(struct user *u) {
+    string_deinit(&u->uname);
+    string_deinit(&u->passwd);
+    uv_mutex_destroy(&u->lock);
+    traffic_destroy(u->traffic);
+    rps_free(u);
+}
+
+static rps_status_t
+user_check(struct config_user *cu) {
+    if (string_empty(&cu->username) || string_empty(&cu->password)) {
+        log_error("user %s: username and password are required", 
+                string_empty(&cu->username) ? "" : (char *)cu->username.data);
+        return RPS_ERROR;
+    }
+
+    if (strstr((char *)cu->username.data, UPSTREAM_ROUTE_SOURCE) != NULL) {
+        log_error("user %s: username must not contain '%s'", 
+                cu->username.data, UPSTREAM_ROUTE_SOURCE);
+        return RPS_ERROR;
+    }
+
+    if (cu->source.len >= UPSTREAM_SOURCE_MAX_LENGTH) {
+        log_error("user %s: source %s too long", cu->username.data, cu->source.data);
+        return RPS_ERROR;
+    }
+
+    return RPS_OK;
+}
+
+static void
+user_set(struct user *u, struct config_user *cu) {
+    u->bandwidth = cu->bandwidth;
+    u->rate = cu->rate;
+    if (string_empty(&cu->source)) {
+        u->source[0] = '\0';
+    } else {
+        memcpy(u->source, cu->source.data, cu->source.len + 1);
+    }
+    u->disabled = 0;
+    u->seen = 1;
+}
+
+/* append an account, caller holds the write lock or owns the table */
+static rps_status_t
+user_create(struct users *us, struct config_user *cu, bool file) {
+    struct user *u, **users;
+    uint32_t nalloc;
+
+    if (us->n == us->nalloc) {
+        nalloc = MAX(us->nalloc * 2, USERS_DEFAULT_COUNT);
+        users = rps_realloc(us->users, nalloc * sizeof(struct user *));
+        if (users == NULL) {
+            return RPS_ENOMEM;
+        }
+        us->users = users;
+        us->nalloc = nalloc;
+    }
+
+    u = (struct user *)rps_alloc(sizeof(struct user));
+    if (u == NULL) {
+        return RPS_ENOMEM;
+    }
+
+    u->id = us->n;
+    string_init(&u->uname);
+    string_init(&u->passwd);
+    uv_mutex_init(&u->lock);
+    u->traffic = NULL;
+
+    if (string_copy(&u->uname, &cu->username) != RPS_OK ||
+            string_copy(&u->passwd, &cu->password) != RPS_OK) {
+        user_destroy(u);
+        return RPS_ENOMEM;
+    }
+
+    if (us->nslots > 0) {
+        u->traffic = traffic_create(us->nslots);
+        if (u->traffic == NULL) {
+            user_destroy(u);
+            return RPS_ENOMEM;
+        }
+    }
+
+    user_set(u, cu);
+    u->file = file;
+
+    /* start with a full burst */
+    u->bytes = u->bandwidth;
+    u->sessions = u->rate;
+    u->refill = uv_hrtime() / 1000000;
+
+    hashmap_set(&us->index, u->uname.data, u->uname.len, &u->id, sizeof(u->id));
+    us->users[us->n++] = u;
+
+    return RPS_OK;
+}
+
+static struct user *
+users_find(struct users *us, const char *uname, size_t len) {
+    uint32_t *id;
+    size_t size;
+
+    id = (uint32_t *)hashmap_get(&us->index, (void *)uname, len, &size);
+    if (id == NULL) {
+        return NULL;
+    }
+
+    return us->users[*id];
+}
+
+/* 
+ * Lines of username password [bandwidth=N] [rate=N] [source=S], blank 
+ * lines and lines starting with # are skipped.
+ */
+static rps_array_t *
+users_file_load(const char *path) {
+    FILE *fp;
+    char line[USERS_FILE_LINE_LENGTH];
+    char *tok, *save, *val;
+    rps_array_t *entries;
+    struct config_user *cu;
+    uint32_t lineno;
+    rps_status_t status;
+
+    fp = fopen(path, "r");
+    if (fp == NULL) {
+        log_error("open users file '%s' failed: %s", path, strerror(errno));
+        return NULL;
+    }
+
+    entries = array_create(USERS_DEFAULT_COUNT, sizeof(struct config_user));
+    if (entries == NULL) {
+        fclose(fp);
+        return NULL;
+    }
+
+    lineno = 0;
+    status = RPS_OK;
+
+    while (status == RPS_OK && fgets(line, sizeof(line), fp) != NULL) {
+        lineno++;
+
+        tok = strtok_r(line, " \t\r\n", &save);
+        if (tok == NULL || tok[0] == '#') {
+            continue;
+        }
+
+        cu = (struct config_user *)array_push(entries);
+        if (cu == NULL) {
+            status = RPS_ENOMEM;
+            break;
+        }
+        config_user_init(cu);
+
+        status = string_duplicate(&cu->username, tok, strlen(tok));
+        
+        tok = strtok_r(NULL, " \t\r\n", &save);
+        if (status == RPS_OK && tok != NULL) {
+            status = string_duplicate(&cu->password, tok, strlen(tok));
+        }
+
+        while (status == RPS_OK && (tok = strtok_r(NULL, " \t\r\n", &save)) != NULL) {
+            val = strchr(tok, '=');
+            if (val == NULL) {
+                status = RPS_ERROR;
+                break;
+            }
+            *val++ = '\0';
+
+            if (strcmp(tok, "bandwidth") == 0) {
+                cu->bandwidth = atoi(val);
+            } else if (strcmp(tok, "rate") == 0) {
+                cu->rate = atoi(val);
+            } else if (strcmp(tok, "source") == 0) {
+                if (val[0] != '\0') {
+                    status = string_duplicate(&cu->source, val, strlen(val));
+                }
+            } else {
+                status = RPS_ERROR;
+            }
+        }
+
+        if (status == RPS_OK) {
+            status = user_check(cu);
+        }
+
+        if (status != RPS_OK) {
+            log_error("users file '%s' line %d is invalid", path, lineno);
+        }
+    }
+
+    fclose(fp);
+
+    if (status != RPS_OK) {
+        users_file_free(entries);
+        return NULL;
+    }
+
+    return entries;
+}
+
+/* 
+ * Merge accounts of the users file, accounts gone from it are disabled. 
+ * Caller holds the write lock or owns the table.
+ */
+static rps_status_t
+users_file_apply(struct users *us, rps_array_t *entries, 
+        uint32_t *added, uint32_t *updated, uint32_t *removed) {
+    struct config_user *cu;
+    struct user *u;
+    uint32_t i;
+    rps_status_t status;
+
+    *added = 0;
+    *updated = 0;
+    *removed = 0;
+
+    for (i = 0; i < us->n; i++) {
+        us->users[i]->seen = 0;
+    }
+
+    for (i = 0; i < array_n(entries); i++) {
+        cu = (struct config_user *)array_get(entries, i);
+
+        u = users_find(us, (char *)cu->username.data, cu->username.len);
+        if (u == NULL) {
+            status = user_create(us, cu, true);
+            if (status != RPS_OK) {
+                return status;
+            }
+            (*added)++;
+            continue;
+        }
+
+        if (!u->file) {
+            log_warn("user %s: defined in configuration, skipped in users file", u->uname.data);
+            continue;
+        }
+
+        if (u->seen) {
+            log_warn("user %s: duplicated in users file", u->uname.data);
+            continue;
+        }
+
+        if (!string_equal(&u->passwd, &cu->password)) {
+            string_deinit(&u->passwd);
+            if (string_copy(&u->passwd, &cu->password) != RPS_OK) {
+                u->disabled = 1;
+                return RPS_ENOMEM;
+            }
+        }
+        user_set(u, cu);
+        (*updated)++;
+    }
+
+    for (i = 0; i < us->n; i++) {
+        u = us->users[i];
+        if (u->file && !u->seen && !u->disabled) {
+            u->disabled = 1;
+            (*removed)++;
+        }
+    }
+
+    return RPS_OK;
+}
+
+rps_status_t
+users_init(struct users *us, rps_array_t *cfg, rps_str_t *file, uint32_t nslots) {
+    uint32_t i, added, updated, removed;
+    struct config_user *cu;
+    rps_array_t *entries;
+    rps_status_t status;
+
+    us->users = NULL;
+    us->n = 0;
+    us->nalloc = 0;
+    us->gen = 1;
+    us->nslots = nslots;
+    string_init(&us->file);
+    uv_rwlock_init(&us->lock);
+
+    status = hashmap_init(&us->index, MAX(array_n(cfg), USERS_DEFAULT_COUNT), 
+            HASHMAP_DEFAULT_COLLISIONS);
+    if (status != RPS_OK) {
+        uv_rwlock_destroy(&us->lock);
+        return status;
+    }
+
+    for (i = 0; i < array_n(cfg); i++) {
+        cu = (struct config_user *)array_get(cfg, i);
+
+        if (user_check(cu) != RPS_OK) {
+            goto error;
+        }
+
+        if (hashmap_has(&us->index, cu->username.data, cu->username.len)) {
+            log_error("user %s: duplicated", cu->username.data);
+            goto error;
+        }
+
+        if (user_create(us, cu, false) != RPS_OK) {
+            goto error;
+        }
+    }
+
+    if (!string_empty(file)) {
+        if (string_copy(&us->file, file) != RPS_OK) {
+            goto error;
+        }
+
+        entries = users_file_load((char *)us->file.data);
+        if (entries == NULL) {
+            goto error;
+        }
+
+        status = users_file_apply(us, entries, &added, &updated, &removed);
+        users_file_free(entries);
+        if (status != RPS_OK) {
+            goto error;
+        }
+    }
+
+    log_notice("load %d users", us->n);
+
+    return RPS_OK;
+
+error:
+    users_deinit(us);
+    return RPS_ERROR;
+}
+
+void
+users_deinit(struct users *us) {
+    uint32_t i;
+
+    for (i = 0; i < us->n; i++) {
+        user_destroy(us->users[i]);
+    }
+
+    if (us->users != NULL) {
+        rps_free(us->users);
+        us->users = NULL;
+    }
+    us->n = 0;
+    us->nalloc = 0;
+
+    string_deinit(&us->file);
+    hashmap_deinit(&us->index);
+    uv_rwlock_destroy(&us->lock);
+}
+
+/* read the users file again, the table is kept as is if it is invalid */
+rps_status_t
+users_reload(struct users *us) {
+    rps_array_t *entries;
+    uint32_t added, updated, removed;
+    rps_status_t status;
+
+    if (string_empty(&us->file)) {
+        log_warn("reload users: no users file configured");
+        return RPS_OK;
+    }
+
+    entries = users_file_load((char *)us->file.data);
+    if (entries == NULL) {
+        log_error("reload users from '%s' failed, keep current users", us->file.data);
+        return RPS_ERROR;
+    }
+
+    uv_rwlock_wrlock(&us->lock);
+    status = users_file_apply(us, entries, &added, &updated, &removed);
+    __sync_add_and_fetch(&us->gen, 1);
+    uv_rwlock_wrunlock(&us->lock);
+
+    users_file_free(entries);
+
+    if (status != RPS_OK) {
+        log_error("reload users from '%s' failed", us->file.data);
+        return status;
+    }
+
+    log_notice("reload users from '%s': %d added, %d updated, %d removed", 
+            us->file.data, added, updated, removed);
+
+    return RPS_OK;
+}
+
+/* a listener without an account of its own requires one of these */
+bool
+users_enabled(struct users *us) {
+    return us->n > 0 || !string_empty(&us->file);
+}
+
+uint32_t
+users_gen(struct users *us) {
+    return __sync_add_and_fetch(&us->gen, 0);
+}
+
+/* 
+ * Account of uname if passwd matches. Its source is copied to source unless
+ * the session asked for one already.
+ */
+struct user *
+users_auth(struct users *us, const char *uname, size_t ulen, 
+        const char *passwd, size_t plen, char *source) {
+    struct user *u;
+
+    if (!users_enabled(us)) {
+        return NULL;
+    }
+
+    uv_rwlock_rdlock(&us->lock);
+
+    u = users_find(us, uname, ulen);
+    if (u == NULL) {
+        /* unknown users cost a compare as well */
+        rps_memeq_ct(passwd, plen, passwd, plen);
+    } else if (!rps_memeq_ct(passwd, plen, u->passwd.data, u->passwd.len) || u->disabled) {
+        u = NULL;
+    } else if (source[0] == '\0' && u->source[0] != '\0') {
+        strcpy(source, u->source);
+    }
+
+    uv_rwlock_rdunlock(&us->lock);
+
+    return u;
+}
+
+struct user_cache *
+user_cache_create(void) {
+    struct user_cache *c;
+    uint32_t i;
+
+    c = (struct user_cache *)rps_alloc(sizeof(struct user_cache));
+    if (c == NULL) {
+        return NULL;
+    }
+
+    for (i = 0; i < USERS_CACHE_ENTRIES; i++) {
+        c->entries[i].gen = 0;
+    }
+
+    return c;
+}
+
+void
+user_cache_destroy(struct user_cache *c) {
+    if (c != NULL) {
+        rps_free(c);
+    }
+}
+
+struct user_cache_entry *
+user_cache_get(struct user_cache *c, struct users *us, const uint8_t *key, size_t len) {
+    struct user_cache_entry *e;
+    uint32_t hash;
+
+    if (c == NULL || len > USERS_CACHE_KEY_LENGTH) {
+        return NULL;
+    }
+
+    MurmurHash3_x86_32(key, (int)len, 0, &hash);
+
+    e = &c->entries[hash & (USERS_CACHE_ENTRIES - 1)];
+    if (e->gen != users_gen(us) || e->hash != hash || 
+            !rps_memeq_ct(key, len, e->key, e->len)) {
+        return NULL;
+    }
+
+    return e;
+}
+
+/* remember key verified as u, gen is read before verifying it */
+void
+user_cache_put(struct user_cache *c, uint32_t gen, const uint8_t *key, size_t len,
+        struct user *u, const char *source) {
+    struct user_cache_entry *e;
+    uint32_t hash;
+
+    if (c == NULL || len > USERS_CACHE_KEY_LENGTH) {
+        return;
+    }
+
+    MurmurHash3_x86_32(key, (int)len, 0, &hash);
+
+    e = &c->entries[hash & (USERS_CACHE_ENTRIES - 1)];
+    e->gen = gen;
+    e->hash = hash;
+    e->user = u;
+    e->len = (uint16_t)len;
+    memcpy(e->key, key, len);
+    strcpy(e->source, source);
+}
+
+/* bucket of u leased by a server thread, grown as accounts are added */
+struct user_bucket *
+user_buckets_get(struct user_bucket **buckets, uint32_t *n, struct user *u) {
+    struct user_bucket *b;
+    uint32_t i, nalloc;
+
+    if (u->id >= *n) {
+        nalloc = MAX(u->id + 1, *n * 2);
+        b = (struct user_bucket *)rps_realloc(*buckets, nalloc * sizeof(struct user_bucket));
+        if (b == NULL) {
+            return NULL;
+        }
+
+        for (i = *n; i < nalloc; i++) {
+            b[i].user = NULL;
+            b[i].bytes = 0;
+            b[i].sessions = 0;
+            b[i].used = 0;
+        }
+
+        *buckets = b;
+        *n = nalloc;
+    }
+
+    b = &(*buckets)[u->id];
+    b->user = u;
+
+    return b;
+}
+
+void
+user_buckets_destroy(struct user_bucket *buckets) {
+    if (buckets != NULL) {
+        rps_free(buckets);
+    }
+}
+
+/* Called with user locked, burst is up to one second of rate. */
+static void
+user_refill(struct user *u) {
+    uint64_t now;
+    double elapsed;
+
+    now = uv_hrtime() / 1000000;
+    if (now <= u->refill) {
+        return;
+    }
+
+    elapsed = (double)(now - u->refill) / 1000;
+    u->bytes = MIN(u->bytes + elapsed * u->bandwidth, (double)u->bandwidth);
+    u->sessions = MIN(u->sessions + elapsed * u->rate, (double)u->rate);
+    u->refill = now;
+}
+
+/* Called with user locked, covers the local deficit plus a slice. */
+static void
+user_lease(double *global, double *local, uint32_t rate) {
+    double want, grant;
+
+    want = MAX((double)rate / USERS_LEASE_SLICE, 1);
+    if (*local < 0) {
+        want -= *local;
+    }
+
+    grant = MIN(*global, want);
+    if (grant <= 0) {
+        return;
+    }
+
+    *global -= grant;
+    *local += grant;
+}
+
+bool
+user_bucket_session(struct user_bucket *b) {
+    struct user *u;
+
+    u = b->user;
+    b->used++;
+
+    if (u->rate == 0) {
+        return true;
+    }
+
+    if (b->sessions < 1) {
+        uv_mutex_lock(&u->lock);
+        user_refill(u);
+        user_lease(&u->sessions, &b->sessions, u->rate);
+        uv_mutex_unlock(&u->lock);
+    }
+
+    if (b->sessions < 1) {
+        return false;
+    }
+
+    b->sessions -= 1;
+    return true;
+}
+
+/* Charge relayed bytes, false means the reader should pause. */
+bool
+user_bucket_consume(struct user_bucket *b, size_t size) {
+    struct user *u;
+
+    u = b->user;
+    b->used += size;
+
+    if (u->bandwidth == 0) {
+        return true;
+    }
+
+    b->bytes -= size;
+
+    if (b->bytes < 0) {
+        uv_mutex_lock(&u->lock);
+        user_refill(u);
+        user_lease(&u->bytes, &b->bytes, u->bandwidth);
+        uv_mutex_unlock(&u->lock);
+    }
+
+    return b->bytes >= 0;
+}
+
+/* ms until the deficit of bucket is refilled */
+uint32_t
+user_bucket_delay(struct user_bucket *b) {
+    double delay;
+
+    if (b->bytes >= 0 || b->user->bandwidth == 0) {
+        return USERS_THROTTLE_MIN_DELAY;
+    }
+
+    delay = -b->bytes * 1000 / b->user->bandwidth;
+
+    return MAX((uint32_t)delay, USERS_THROTTLE_MIN_DELAY);
+}
+
+/* Hand leases of idle buckets back to the accounts. */
+void
+user_buckets_reconcile(struct user_bucket *buckets, uint32_t n) {
+    uint32_t i;
+    struct user_bucket *b;
+    struct user *u;
+
+    for (i = 0; i < n; i++) {
+        b = &buckets[i];
+        u = b->user;
+
+        if (u == NULL) {
+            continue;
+        }
+
+        if (b->used == 0 && (b->bytes > 0 || b->sessions > 0)) {
+            uv_mutex_lock(&u->lock);
+            user_refill(u);
+            u->bytes = MIN(u->bytes + MAX(b->bytes, 0), (double)u->bandwidth);
+            u->sessions = MIN(u->sessions + MAX(b->sessions, 0), (double)u->rate);
+            uv_mutex_unlock(&u->lock);
+
+            b->bytes = MIN(b->bytes, 0);
+            b->sessions = MIN(b->sessions, 0);
+        }
+
+        b->used = 0;
+    }
+}
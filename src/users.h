@@ -0,0 +1,121 @@
+#ifndef _RPS_USERS_H
+#define _RPS_USERS_H
+
+#include "core.h"
+#include "config.h"
+#include "hashmap.h"
+#include "_string.h"
+#include "traffic.h"
+#include "upstream.h"
+
+#include <uv.h>
+
+#include <stdint.h>
+
+/*
+ * User accounts of listeners with bandwidth and session rate limits.
+ *
+ * Each account has one global token bucket per limit. Server threads don't
+ * consume from them directly, they lease a slice of tokens into a bucket of
+ * their own and go back to the global one only when it runs dry, so worker
+ * loops contend on the account lock a few times per second at most.
+ * Leases left unused for a reconcile interval are handed back.
+ *
+ * Accounts come from the users section of the configuration and from the
+ * users file, which users_reload reads again on SIGUSR2. Accounts are never
+ * freed before exit, a reload updates them in place and disables the ones
+ * gone from the file, so sessions and buckets may keep their pointers. The
+ * index, passwords and sources are guarded by the table lock, every reload
+ * bumps a generation which invalidates the auth caches of servers.
+ *
+ * An auth cache maps Proxy-Authorization values verified by a server thread
+ * to their account, repeated requests skip decoding and the table lock.
+ */
+
+#define USERS_LEASE_SLICE           10      /* a lease is 1/10 s of rate */
+#define USERS_RECONCILE_INTERVAL    1000    /* ms */
+#define USERS_THROTTLE_MIN_DELAY    WHEEL_TICK  /* ms */
+#define USERS_DEFAULT_COUNT         64
+#define USERS_FILE_LINE_LENGTH      1024
+#define USERS_CACHE_ENTRIES         256     /* per server, power of 2 */
+#define USERS_CACHE_KEY_LENGTH      128     /* longer values are not cached */
+
+struct user {
+    uint32_t        id;
+    rps_str_t       uname;
+    rps_str_t       passwd;
+    uint32_t        bandwidth;  /* bytes per second, 0 is unlimited */
+    uint32_t        rate;       /* new sessions per second, 0 is unlimited */
+
+    /* upstream source of sessions not asking for one, empty for any */
+    char            source[UPSTREAM_SOURCE_MAX_LENGTH];
+
+    unsigned        file:1;     /* from the users file */
+    unsigned        disabled:1; /* dropped from the users file */
+    unsigned        seen:1;     /* found by the reload in progress */
+
+    /* global buckets, refilled lazily on lease */
+    uv_mutex_t      lock;
+    double          bytes;
+    double          sessions;
+    uint64_t        refill;     /* ms */
+
+    struct traffic  *traffic;   /* slot per server */
+};
+
+struct users {
+    struct user     **users;    /* by id */
+    uint32_t        n;
+    uint32_t        nalloc;
+    rps_hashmap_t   index;      /* username -> id */
+    uint32_t        gen;        /* bumped by reload */
+    uint32_t        nslots;
+    rps_str_t       file;
+    uv_rwlock_t     lock;
+};
+
+/* tokens leased by a server thread */
+struct user_bucket {
+    struct user     *user;
+    double          bytes;      /* may go negative by one read */
+    double          sessions;
+    uint64_t        used;       /* bytes consumed since last reconcile */
+};
+
+struct user_cache_entry {
+    uint32_t        gen;        /* of the table when verified, 0 is empty */
+    uint32_t        hash;
+    struct user     *user;      /* NULL for the listener account */
+    uint16_t        len;
+    uint8_t         key[USERS_CACHE_KEY_LENGTH];
+    char            source[UPSTREAM_SOURCE_MAX_LENGTH];
+};
+
+struct user_cache {
+    struct user_cache_entry entries[USERS_CACHE_ENTRIES];
+};
+
+rps_status_t users_init(struct users *us, rps_array_t *cfg, rps_str_t *file, uint32_t nslots);
+void users_deinit(struct users *us);
+rps_status_t users_reload(struct users *us);
+bool users_enabled(struct users *us);
+uint32_t users_gen(struct users *us);
+struct user *users_auth(struct users *us, const char *uname, size_t ulen, 
+        const char *passwd, size_t plen, char *source);
+
+struct user_cache *user_cache_create(void);
+void user_cache_destroy(struct user_cache *c);
+struct user_cache_entry *user_cache_get(struct user_cache *c, struct users *us, 
+        const uint8_t *key, size_t len);
+void user_cache_put(struct user_cache *c, uint32_t gen, const uint8_t *key, size_t len,
+        struct user *u, const char *source);
+
+struct user_bucket *user_buckets_get(struct user_bucket **buckets, uint32_t *n, struct user *u);
+void user_buckets_destroy(struct user_bucket *buckets);
+void user_buckets_reconcile(struct user_bucket *buckets, uint32_t n);
+
+bool user_bucket_session(struct user_bucket *b);
+bool user_bucket_consume(struct user_bucket *b, size_t size);
+uint32_t user_bucket_delay(struct user_bucket *b);
+
+#endif
@@ -1,6 +1,7 @@
 #include <stdlib.h>
 #include <sys/socket.h>
 #include <netdb.h>
+#include <arpa/inet.h>
 #include <string.h>
 #include <time.h>
 #include <stdarg.h>
@@ -9,14 +10,20 @@
 
 #include "util.h"
 #include "log.h"
+#include "murmur3/murmur3.h"
 
 void *
-_rps_alloc(size_t size, const char *name, int line) {
+_rps_alloc(size_t size, rps_mem_tag_t tag, const char *name, int line) {
     void *p;
     
     ASSERT(size != 0);
 
+#ifdef RPS_MEMSTAT
+    p = memstat_alloc(size, tag);
+#else
+    UNUSED(tag);
     p = malloc(size);
+#endif
     
     if (p == NULL) {
         log_error("malloc(%zu) failed @ %s:%d", size, name, line);
@@ -31,10 +38,10 @@ _rps_alloc(size_t size, const char *name, int line) {
 }
 
 void *
-_rps_zalloc(size_t size, const char *name, int line) {
+_rps_zalloc(size_t size, rps_mem_tag_t tag, const char *name, int line) {
     void *p;
 
-    p = _rps_alloc(size, name, line);\
+    p = _rps_alloc(size, tag, name, line);
     if (p != NULL) {
         memset(p, 0, size);
     }
@@ -43,17 +50,22 @@ _rps_zalloc(size_t size, const char *name, int line) {
 }
 
 void *
-_rps_calloc(size_t nmemb, size_t size, const char *name, int line) {
-    return _rps_alloc(nmemb * size, name, line);
+_rps_calloc(size_t nmemb, size_t size, rps_mem_tag_t tag, const char *name, int line) {
+    return _rps_alloc(nmemb * size, tag, name, line);
 }
 
 void *
-_rps_realloc(void *ptr, size_t size, const char *name, int line) {
+_rps_realloc(void *ptr, size_t size, rps_mem_tag_t tag, const char *name, int line) {
     void *p;
     
     ASSERT(size != 0);
 
+#ifdef RPS_MEMSTAT
+    p = memstat_realloc(ptr, size, tag);
+#else
+    UNUSED(tag);
     p = realloc(ptr, size);
+#endif
     
     if (p == NULL) {
         log_error("realloc(%zu) failed @ %s:%d", size, name, line);
@@ -77,7 +89,11 @@ _rps_free(void *ptr) {
 #endif
 
     ASSERT(ptr != NULL);
+#ifdef RPS_MEMSTAT
+    memstat_free(ptr);
+#else
     free(ptr);
+#endif
 }
 
 void
@@ -202,6 +218,75 @@ rps_addr_name(rps_addr_t *addr, uint8_t *_addr, uint8_t len, uint16_t port) {
     addr->addrlen = sizeof(addr->addr.name);
 }
 
+/* murmur3 of the host part, port is not included */
+uint32_t
+rps_addr_hash(rps_addr_t *addr) {
+    uint32_t hash;
+
+    switch (addr->family) {
+    case AF_INET:
+        MurmurHash3_x86_32(&addr->addr.in.sin_addr, 4, 0, &hash);
+        break;
+    case AF_INET6:
+        MurmurHash3_x86_32(&addr->addr.in6.sin6_addr, 16, 0, &hash);
+        break;
+    case AF_DOMAIN:
+        MurmurHash3_x86_32(addr->addr.name.host,
+                strnlen(addr->addr.name.host, sizeof(addr->addr.name.host)), 0, &hash);
+        break;
+    default:
+        hash = 0;
+        break;
+    }
+
+    return hash;
+}
+
+/* inet addresses only, domain names do not fit */
+int
+rps_inaddr_pack(rps_inaddr_t *dst, rps_addr_t *src) {
+    memset(dst, 0, sizeof(*dst));
+
+    switch (src->family) {
+    case AF_INET:
+        dst->port = src->addr.in.sin_port;
+        memcpy(&dst->addr.in, &src->addr.in.sin_addr, sizeof(dst->addr.in));
+        break;
+    case AF_INET6:
+        dst->port = src->addr.in6.sin6_port;
+        memcpy(&dst->addr.in6, &src->addr.in6.sin6_addr, sizeof(dst->addr.in6));
+        break;
+    default:
+        return -1;
+    }
+
+    dst->family = src->family;
+
+    return 0;
+}
+
+void
+rps_inaddr_unpack(rps_inaddr_t *src, rps_addr_t *dst) {
+    rps_addr_init(dst);
+
+    if (src->family == AF_INET) {
+        rps_addr_in4(dst, (uint8_t *)&src->addr.in, sizeof(src->addr.in), (uint8_t *)&src->port);
+    } else if (src->family == AF_INET6) {
+        rps_addr_in6(dst, (uint8_t *)&src->addr.in6, sizeof(src->addr.in6), (uint8_t *)&src->port);
+    }
+}
+
+int
+rps_inaddr_name(rps_inaddr_t *addr, char *name) {
+    if ((addr->family != AF_INET && addr->family != AF_INET6) ||
+            inet_ntop(addr->family, &addr->addr, name, INET6_ADDRSTRLEN) == NULL) {
+        log_error("Unknow inet family:%d", addr->family);
+        return -1;
+    }
+
+    return 0;
+}
+
 void
 rps_init_random() {
     srand(time(NULL));
@@ -214,6 +299,27 @@ rps_random(int max) {
     return rand() %max;
 }
 
+/* 
+ * Compare secrets in time depending on alen only, not on where a and b 
+ * differ. Pass the presented value as a.
+ */
+bool
+rps_memeq_ct(const void *a, size_t alen, const void *b, size_t blen) {
+    const volatile uint8_t *pa, *pb;
+    size_t i;
+    uint8_t diff;
+
+    pa = (const volatile uint8_t *)a;
+    pb = (const volatile uint8_t *)(blen > 0 ? b : a);
+    diff = alen != blen;
+
+    for (i = 0; i < alen; i++) {
+        diff |= pa[i] ^ pb[i < blen ? i : 0];
+    }
+
+    return diff == 0;
+}
+
 
 static char *
 _rps_safe_utoa(int _base, uint64_t val, char *buf)
@@ -2,12 +2,15 @@
 #define _RPS_UTIL_H
 
 #include "log.h"
+#include "memstat.h"
 
 #include "uv.h"
 
 #include <stdlib.h>
 #include <sys/un.h>
 #include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 
 #define CRLF        "\x0d\x0a"
 #define CR          (uint8_t)13
@@ -21,6 +24,9 @@
 
 #define UNUSED(_x) (void)(_x)
 
+/* compile time check, c99 has no _Static_assert */
+#define STATIC_ASSERT(_cond, _name) typedef char static_assert_##_name[(_cond) ? 1 : -1]
+
 #define rps_str4_cmp(p, c0, c1, c2, c3)                             \
     ((p[0] == c0) && (p[1] == c1) && (p[2] == c2) && (p[3] == c3))  \
 
@@ -34,17 +40,25 @@
      && (p[4] == c4) && (p[5] == c5) && (p[6] == c6))               \
 
 
+/* memory tag of the including file, see memstat.h */
+#ifndef RPS_MEM_TAG
+#define RPS_MEM_TAG mem_scope
+#endif
+
 #define rps_alloc(_s)                                               \
-    _rps_alloc((size_t)(_s), __FILE__, __LINE__)                    \
+    rps_alloc_tag(_s, RPS_MEM_TAG)                                  \
 
 #define rps_zalloc(_s)                                              \
-    _rps_zalloc((size_t)(_s), __FILE__, __LINE__)                   \
+    _rps_zalloc((size_t)(_s), RPS_MEM_TAG, __FILE__, __LINE__)      \
 
 #define rps_calloc(_n, _s)                                          \
-    _rps_calloc((size_t)(_n), (size_t)(_s), __FILE__, __LINE__)     \
+    _rps_calloc((size_t)(_n), (size_t)(_s), RPS_MEM_TAG, __FILE__, __LINE__) \
 
 #define rps_realloc(_p, _s)                                         \
-    _rps_realloc(_p, (size_t)(_s), __FILE__, __LINE__)              \
+    _rps_realloc(_p, (size_t)(_s), RPS_MEM_TAG, __FILE__, __LINE__) \
+
+#define rps_alloc_tag(_s, _t)                                       \
+    _rps_alloc((size_t)(_s), _t, __FILE__, __LINE__)                \
 
 #ifdef RPS_MORE_VERBOSE
 #define rps_free(_p)                                                \
@@ -61,10 +75,10 @@ void _rps_free(void *ptr);
 #endif
 
 
-void  *_rps_alloc(size_t size, const char *name, int line);
-void * _rps_zalloc(size_t size, const char *name, int line);
-void *_rps_calloc(size_t nmemb, size_t size, const char *name, int line);
-void *_rps_realloc(void *ptr, size_t size, const char *name, int line);
+void  *_rps_alloc(size_t size, rps_mem_tag_t tag, const char *name, int line);
+void * _rps_zalloc(size_t size, rps_mem_tag_t tag, const char *name, int line);
+void *_rps_calloc(size_t nmemb, size_t size, rps_mem_tag_t tag, const char *name, int line);
+void *_rps_realloc(void *ptr, size_t size, rps_mem_tag_t tag, const char *name, int line);
 
 typedef enum { false, true } bool;
 
@@ -86,6 +100,7 @@ void _rps_assert(const char *cond, const char *file, int line);
 
 #define MAX_HOSTNAME_LEN 255
 #define MAX_INET_ADDRSTRLEN MAX_HOSTNAME_LEN
+#define PEER_ADDRSTRLEN INET6_ADDRSTRLEN   /* numeric address with terminator */
 #define AF_DOMAIN 60 /* AF_INET is 2, AF_INET6 is 30, so we get 60 */
 #define AF_UNKNOWN 0
 
@@ -106,6 +121,21 @@ typedef struct sockinfo {
     } addr;
 } rps_addr_t;
 
+/* compact inet address for tables of many addresses */
+typedef struct inaddr {
+    uint16_t        family;     /* AF_INET or AF_INET6 */
+    uint16_t        port;       /* network byte order */
+    union {
+        struct in_addr  in;
+        struct in6_addr in6;
+    } addr;
+} rps_inaddr_t;
+
+static inline uint16_t
+rps_inaddr_port(rps_inaddr_t *addr) {
+    return ntohs(addr->port);
+}
+
 static inline void
 rps_addr_init(rps_addr_t *addr) {
     addr->family = AF_UNKNOWN;
@@ -137,10 +167,16 @@ uint16_t rps_unresolve_port(rps_addr_t *addr);
 void rps_addr_in4(rps_addr_t *addr, uint8_t *_addr, uint8_t len, uint8_t *port);
 void rps_addr_in6(rps_addr_t *addr, uint8_t *_addr, uint8_t len, uint8_t *port);
 void rps_addr_name(rps_addr_t *addr, uint8_t *_addr, uint8_t len, uint16_t port);
+uint32_t rps_addr_hash(rps_addr_t *addr);
+int rps_inaddr_pack(rps_inaddr_t *dst, rps_addr_t *src);
+void rps_inaddr_unpack(rps_inaddr_t *src, rps_addr_t *dst);
+int rps_inaddr_name(rps_inaddr_t *addr, char *name);
 
 void rps_init_random();
 int rps_random(int max);
 
+bool rps_memeq_ct(const void *a, size_t alen, const void *b, size_t blen);
+
 
 /* Copy from twitter tweemproxy
  * A (very) limited version of snprintf
@@ -0,0 +1,219 @@
+#include "wheel.h"
+#include "util.h"
+#include "log.h"
+
+static uint64_t
+wheel_now(struct wheel *w) {
+    return uv_now(w->loop) / WHEEL_TICK;
+}
+
+static void
+wheel_link(struct wheel_node **head, struct wheel_node *node) {
+    node->next = *head;
+    if (node->next != NULL) {
+        node->next->pprev = &node->next;
+    }
+    *head = node;
+    node->pprev = head;
+}
+
+static void
+wheel_unlink(struct wheel_node *node) {
+    *node->pprev = node->next;
+    if (node->next != NULL) {
+        node->next->pprev = node->pprev;
+    }
+    node->next = NULL;
+    node->pprev = NULL;
+}
+
+/* Move the whole bucket to a local list head, so callbacks may delete any node of it. */
+static void
+wheel_detach(struct wheel_node **head, struct wheel_node **list) {
+    *list = *head;
+    *head = NULL;
+    if (*list != NULL) {
+        (*list)->pprev = list;
+    }
+}
+
+/* Bucket is picked by distance between the deadline and next tick */
+static void
+wheel_add(struct wheel *w, struct wheel_node *node) {
+    uint64_t due, delta;
+    uint32_t level, shift;
+    struct wheel_node **head;
+
+    due = MAX(node->expire, w->next);
+    delta = due - w->next;
+
+    if (delta >= WHEEL_MAX_TICKS) {
+        /* be rearmed when it comes due */
+        delta = WHEEL_MAX_TICKS - 1;
+        due = w->next + delta;
+    }
+
+    if (delta < WHEEL_ROOT_SIZE) {
+        head = &w->root[due & WHEEL_ROOT_MASK];
+    } else {
+        for (level = 0; level < WHEEL_LEVELS - 1; level++) {
+            if (delta < (1ULL << (WHEEL_ROOT_BITS + (level + 1) * WHEEL_LEVEL_BITS))) {
+                break;
+            }
+        }
+        shift = WHEEL_ROOT_BITS + level * WHEEL_LEVEL_BITS;
+        head = &w->levels[level][(due >> shift) & WHEEL_LEVEL_MASK];
+    }
+
+    node->due = due;
+    wheel_link(head, node);
+}
+
+/* Re-add nodes of an upper level bucket, return the bucket index */
+static uint32_t
+wheel_cascade(struct wheel *w, uint32_t level) {
+    uint32_t index;
+    struct wheel_node *list, *node;
+
+    index = (w->next >> (WHEEL_ROOT_BITS + level * WHEEL_LEVEL_BITS)) & WHEEL_LEVEL_MASK;
+
+    wheel_detach(&w->levels[level][index], &list);
+    while (list != NULL) {
+        node = list;
+        wheel_unlink(node);
+        wheel_add(w, node);
+    }
+
+    return index;
+}
+
+static void
+wheel_run_tick(struct wheel *w) {
+    uint32_t index, level;
+    uint64_t tick;
+    struct wheel_node *list, *node;
+
+    index = w->next & WHEEL_ROOT_MASK;
+
+    if (index == 0) {
+        for (level = 0; level < WHEEL_LEVELS; level++) {
+            if (wheel_cascade(w, level) != 0) {
+                break;
+            }
+        }
+    }
+
+    tick = w->next++;
+
+    wheel_detach(&w->root[index], &list);
+    while (list != NULL) {
+        node = list;
+        wheel_unlink(node);
+
+        /* deadline was pushed forward since the node was bucketed */
+        if (node->expire > tick) {
+            wheel_add(w, node);
+            continue;
+        }
+
+        w->n--;
+        w->expired++;
+        w->expire(node);
+    }
+}
+
+static void
+wheel_on_tick(uv_timer_t *handle) {
+    struct wheel *w;
+    uint64_t now;
+
+    w = handle->data;
+    now = wheel_now(w);
+    w->expired = 0;
+
+    while (w->next <= now) {
+        wheel_run_tick(w);
+    }
+
+    if (w->expired > 0) {
+        w->total_expired += w->expired;
+        w->max_expired = MAX(w->max_expired, w->expired);
+        log_verb("timing wheel: %u expired this tick, %u pending, %llu expired in total",
+                w->expired, w->n, (unsigned long long)w->total_expired);
+    }
+
+    /* no wakeup while nothing be scheduled */
+    if (w->n == 0) {
+        uv_timer_stop(&w->timer);
+    }
+}
+
+void
+wheel_init(struct wheel *w, uv_loop_t *loop, wheel_expire_t expire) {
+    uint32_t i, j;
+
+    w->loop = loop;
+    w->expire = expire;
+    w->next = 0;
+    w->n = 0;
+    w->expired = 0;
+    w->max_expired = 0;
+    w->total_expired = 0;
+
+    for (i = 0; i < WHEEL_ROOT_SIZE; i++) {
+        w->root[i] = NULL;
+    }
+
+    for (i = 0; i < WHEEL_LEVELS; i++) {
+        for (j = 0; j < WHEEL_LEVEL_SIZE; j++) {
+            w->levels[i][j] = NULL;
+        }
+    }
+
+    uv_timer_init(loop, &w->timer);
+    w->timer.data = w;
+}
+
+void
+wheel_deinit(struct wheel *w) {
+    uv_timer_stop(&w->timer);
+    uv_close((uv_handle_t *)&w->timer, NULL);
+}
+
+/* (Re)arm node to expire after timeout ms */
+void
+wheel_reset(struct wheel *w, struct wheel_node *node, uint32_t timeout) {
+    uint64_t expire;
+
+    expire = wheel_now(w) + (timeout + WHEEL_TICK - 1) / WHEEL_TICK;
+
+    if (wheel_node_pending(node)) {
+        node->expire = expire;
+        /* O(1) rearm, later deadline waits in the current bucket */
+        if (expire >= node->due) {
+            return;
+        }
+        wheel_unlink(node);
+        wheel_add(w, node);
+        return;
+    }
+
+    if (!uv_is_active((uv_handle_t *)&w->timer)) {
+        w->next = wheel_now(w);
+        uv_timer_start(&w->timer, wheel_on_tick, WHEEL_TICK, WHEEL_TICK);
+    }
+
+    node->expire = expire;
+    wheel_add(w, node);
+    w->n++;
+}
+
+void
+wheel_del(struct wheel *w, struct wheel_node *node) {
+    if (!wheel_node_pending(node)) {
+        return;
+    }
+
+    wheel_unlink(node);
+    w->n--;
+}
@@ -0,0 +1,72 @@
+/*
+ * Hierarchical timing wheel, one per event loop.
+ *
+ * Coarse idle/handshake timeouts of contexts share one libuv timer ticking
+ * every WHEEL_TICK ms, instead of each context owning a heap timer.
+ * Level 0 has 256 slots of one tick, upper levels 64 slots each and cascade
+ * down when level 0 wraps around.
+ *
+ * Rearm is lazy: wheel_reset only moves the deadline forward in the node,
+ * the node is moved to its new bucket when its old slot comes due.
+ */
+
+#ifndef _RPS_WHEEL_H
+#define _RPS_WHEEL_H
+
+#include <uv.h>
+
+#include <stdint.h>
+
+#define WHEEL_TICK          100     /* ms */
+
+#define WHEEL_ROOT_BITS     8
+#define WHEEL_LEVEL_BITS    6
+#define WHEEL_ROOT_SIZE     (1 << WHEEL_ROOT_BITS)
+#define WHEEL_LEVEL_SIZE    (1 << WHEEL_LEVEL_BITS)
+#define WHEEL_ROOT_MASK     (WHEEL_ROOT_SIZE - 1)
+#define WHEEL_LEVEL_MASK    (WHEEL_LEVEL_SIZE - 1)
+#define WHEEL_LEVELS        3   /* upper levels */
+#define WHEEL_MAX_TICKS     (1ULL << (WHEEL_ROOT_BITS + WHEEL_LEVELS * WHEEL_LEVEL_BITS))
+
+struct wheel_node {
+    struct wheel_node   *next;
+    struct wheel_node   **pprev;    /* NULL means not scheduled */
+    uint64_t            expire;     /* deadline in ticks */
+    uint64_t            due;        /* tick of the bucket holding the node */
+};
+
+typedef void (*wheel_expire_t)(struct wheel_node *);
+
+struct wheel {
+    uv_timer_t          timer;
+    uv_loop_t           *loop;
+    wheel_expire_t      expire;
+
+    uint64_t            next;       /* next tick to be processed */
+    uint32_t            n;          /* scheduled nodes */
+
+    /* expired nodes of last tick, all time total and the worst tick */
+    uint32_t            expired;
+    uint32_t            max_expired;
+    uint64_t            total_expired;
+
+    struct wheel_node   *root[WHEEL_ROOT_SIZE];
+    struct wheel_node   *levels[WHEEL_LEVELS][WHEEL_LEVEL_SIZE];
+};
+
+#define wheel_node_pending(_n)  ((_n)->pprev != NULL)
+
+static inline void
+wheel_node_init(struct wheel_node *node) {
+    node->next = NULL;
+    node->pprev = NULL;
+    node->expire = 0;
+    node->due = 0;
+}
+
+void wheel_init(struct wheel *w, uv_loop_t *loop, wheel_expire_t expire);
+void wheel_deinit(struct wheel *w);
+void wheel_reset(struct wheel *w, struct wheel_node *node, uint32_t timeout);
+void wheel_del(struct wheel *w, struct wheel_node *node);
+
+#endif
@@ -0,0 +1,1131 @@
+/*
+ * rps-bench: load generator for rps listeners.
+ *
+ * Every request open a new connection to rps, finish the proxy handshake,
+ * then exchange one HTTP request with the target through the tunnel.
+ *
+ *  closed loop: each of concurrency slots issue next request once previous done.
+ *  open loop:   requests be issued at fixed rate, latency counted from the
+ *               scheduled time, so stall of rps won't be hidden (no coordinated omission).
+ */
+#include "bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <arpa/inet.h>
+
+#define BENCH_DEFAULT_SERVER        "127.0.0.1:9890"
+#define BENCH_DEFAULT_TARGET        "127.0.0.1:19000"
+#define BENCH_DEFAULT_CONCURRENCY   16
+#define BENCH_DEFAULT_DURATION      10
+#define BENCH_DEFAULT_TIMEOUT       30000
+#define BENCH_CHURN_BYTES           1024
+#define BENCH_BULK_BYTES            (64 * 1024 * 1024)
+
+#define BENCH_NS    1000000000ULL
+
+enum bench_proto {
+    b_socks5,
+    b_http,
+    b_http_tunnel,
+    b_direct,
+};
+
+enum bench_state {
+    b_idle,
+    b_connect,
+    b_s5_method,
+    b_s5_auth,
+    b_s5_reply,
+    b_tunnel_reply,
+    b_response_header,
+    b_body,
+    b_closing,
+};
+
+struct bench_conf {
+    enum bench_proto    proto;
+    const char          *proto_name;
+    struct sockaddr_in  server;
+    struct sockaddr_in  target;
+    char                target_host[64];
+    uint16_t            target_port;
+    char                *auth;          /* user:password */
+    char                auth_b64[256];
+    int                 concurrency;
+    int                 threads;
+    uint64_t            requests;
+    double              duration;
+    double              rate;
+    uint64_t            download;
+    uint64_t            upload;
+    uint64_t            timeout;        /* ns */
+    int                 domain;
+    int                 sink;
+    int                 pid;
+    int                 json;
+    const char          *mode;
+};
+
+struct bench_stats {
+    uint64_t            ok;
+    uint64_t            errors;
+    uint64_t            timeouts;
+    uint64_t            skipped;
+    uint64_t            aborted;
+    uint64_t            nread;
+    uint64_t            nwrite;
+    struct histogram    connect;
+    struct histogram    handshake;
+    struct histogram    latency;
+};
+
+struct bench_worker;
+
+struct bench_conn {
+    uv_tcp_t            tcp;
+    uv_connect_t        connect_req;
+    uv_write_t          write_req;
+    struct bench_worker *w;
+    enum bench_state    state;
+    uint64_t            t_sched;
+    uint64_t            t_start;
+    uint64_t            t_last;
+    uint64_t            body_left;
+    uint64_t            upload_left;
+    int                 chunked_body;   /* body length unknown, read until EOF */
+    size_t              hlen;
+    char                hbuf[BENCH_HEADER_MAX_LENGTH];
+    char                wbuf[1024];
+};
+
+struct bench_worker {
+    uv_loop_t           loop;
+    uv_timer_t          tick;
+    uv_thread_t         tid;
+    struct bench_conf   *conf;
+    struct bench_conn   *conns;
+    struct bench_conn   **idle;
+    int                 nidle;
+    int                 nconn;
+    int                 active;
+    uint64_t            quota;      /* requests this worker should issue */
+    uint64_t            issued;
+    uint64_t            start;
+    uint64_t            end;
+    uint64_t            deadline;
+    uint64_t            last_sweep;
+    double              rate;
+    int                 stopping;
+    struct bench_stats  stats;
+    char                rbuf[BENCH_CHUNK_SIZE];
+};
+
+static char bench_payload[BENCH_CHUNK_SIZE];
+
+static void bench_conn_start(struct bench_worker *w, uint64_t t_sched);
+static void bench_write_upload(struct bench_conn *c);
+
+static void
+bench_show_usage() {
+    fprintf(stderr,
+        "Usage: rps-bench [options]\n"
+        "Options:\n"
+        "   -h, --help           :this help\n"
+        "   -p, --proto=S        :socks5, http, http_tunnel or direct (default: socks5)\n"
+        "   -s, --server=S       :rps listener host:port (default: %s)\n"
+        "   -t, --target=S       :target host:port (default: %s)\n"
+        "   -S, --sink           :run built-in sink target on target address\n"
+        "   -a, --auth=S         :proxy credential user:password\n"
+        "   -c, --concurrency=N  :max concurrent connections (default: %d)\n"
+        "   -T, --threads=N      :worker threads (default: 1)\n"
+        "   -n, --requests=N     :total requests, default run by duration\n"
+        "   -d, --duration=N     :seconds to run (default: %d)\n"
+        "   -r, --rate=N         :open loop requests per second, 0 means closed loop\n"
+        "   -m, --mode=S         :churn or bulk (default: churn)\n"
+        "   -b, --bytes=N        :response body bytes of each request\n"
+        "   -u, --upload=N       :request body bytes of each request\n"
+        "   -D, --domain         :socks5 request use domain address type\n"
+        "   -o, --timeout=N      :request timeout in ms (default: %d)\n"
+        "   -P, --pid=N          :rps pid, report rps cpu usage\n"
+        "   -j, --json           :print result as json\n",
+        BENCH_DEFAULT_SERVER, BENCH_DEFAULT_TARGET,
+        BENCH_DEFAULT_CONCURRENCY, BENCH_DEFAULT_DURATION, BENCH_DEFAULT_TIMEOUT);
+    exit(1);
+}
+
+static void
+bench_alloc(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
+    struct bench_conn *c;
+
+    UNUSED(suggested_size);
+
+    c = handle->data;
+    buf->base = c->w->rbuf;
+    buf->len = sizeof(c->w->rbuf);
+}
+
+static void
+bench_worker_check_done(struct bench_worker *w) {
+    if (!w->stopping || w->active > 0) {
+        return;
+    }
+
+    if (w->end == 0) {
+        w->end = uv_hrtime();
+    }
+
+    if (!uv_is_closing((uv_handle_t *)&w->tick)) {
+        uv_close((uv_handle_t *)&w->tick, NULL);
+    }
+}
+
+static int
+bench_worker_more(struct bench_worker *w) {
+    if (w->stopping) {
+        return 0;
+    }
+
+    if (w->quota && w->issued >= w->quota) {
+        w->stopping = 1;
+        return 0;
+    }
+
+    return 1;
+}
+
+static void
+bench_on_close(uv_handle_t *handle) {
+    struct bench_conn *c;
+    struct bench_worker *w;
+
+    c = handle->data;
+    w = c->w;
+
+    c->state = b_idle;
+    w->active--;
+    w->idle[w->nidle++] = c;
+
+    /* closed loop, the slot issue next request immediately */
+    if (w->rate == 0 && bench_worker_more(w)) {
+        bench_conn_start(w, 0);
+        return;
+    }
+
+    bench_worker_check_done(w);
+}
+
+static void
+bench_conn_close(struct bench_conn *c) {
+    if (c->state == b_closing || c->state == b_idle) {
+        return;
+    }
+
+    c->state = b_closing;
+    uv_close((uv_handle_t *)&c->tcp, bench_on_close);
+}
+
+static void
+bench_conn_fail(struct bench_conn *c) {
+    c->w->stats.errors++;
+    bench_conn_close(c);
+}
+
+static void
+bench_conn_done(struct bench_conn *c) {
+    struct bench_worker *w;
+    uint64_t now;
+
+    w = c->w;
+    now = uv_hrtime();
+
+    w->stats.ok++;
+    hist_add(&w->stats.latency, (now - (c->t_sched ? c->t_sched : c->t_start)) / 1000);
+
+    bench_conn_close(c);
+}
+
+static void
+bench_on_write(uv_write_t *req, int err) {
+    struct bench_conn *c;
+
+    c = req->data;
+
+    if (c->state == b_closing) {
+        return;
+    }
+
+    if (err) {
+        bench_conn_fail(c);
+        return;
+    }
+
+    if (c->upload_left > 0) {
+        bench_write_upload(c);
+    }
+}
+
+static void
+bench_write(struct bench_conn *c, const char *data, size_t len) {
+    uv_buf_t buf;
+
+    buf.base = (char *)data;
+    buf.len = len;
+
+    c->w->stats.nwrite += len;
+
+    if (uv_write(&c->write_req, (uv_stream_t *)&c->tcp, &buf, 1, bench_on_write)) {
+        bench_conn_fail(c);
+    }
+}
+
+static void
+bench_write_upload(struct bench_conn *c) {
+    size_t len;
+
+    len = (size_t)MIN(c->upload_left, sizeof(bench_payload));
+    c->upload_left -= len;
+
+    bench_write(c, bench_payload, len);
+}
+
+/* Send HTTP request to target, absolute uri for http proxy */
+static void
+bench_send_request(struct bench_conn *c) {
+    struct bench_conf *conf;
+    char uri[128];
+    char auth[320];
+    int n;
+
+    conf = c->w->conf;
+
+    uri[0] = '\0';
+    if (conf->proto == b_http) {
+        snprintf(uri, sizeof(uri), "http://%s:%d", conf->target_host, conf->target_port);
+    }
+
+    auth[0] = '\0';
+    if (conf->proto == b_http && conf->auth != NULL) {
+        snprintf(auth, sizeof(auth), "Proxy-Authorization: Basic %s\r\n", conf->auth_b64);
+    }
+
+    if (conf->upload > 0) {
+        n = snprintf(c->wbuf, sizeof(c->wbuf),
+                "POST %s/sink HTTP/1.1\r\nHost: %s:%d\r\n%sContent-Length: %llu\r\n\r\n",
+                uri, conf->target_host, conf->target_port, auth,
+                (unsigned long long)conf->upload);
+        c->upload_left = conf->upload;
+    } else {
+        n = snprintf(c->wbuf, sizeof(c->wbuf),
+                "GET %s/bytes/%llu HTTP/1.1\r\nHost: %s:%d\r\n%s\r\n",
+                uri, (unsigned long long)conf->download,
+                conf->target_host, conf->target_port, auth);
+    }
+
+    c->hlen = 0;
+    c->state = b_response_header;
+
+    bench_write(c, c->wbuf, (size_t)n);
+}
+
+static void
+bench_tunnel_ready(struct bench_conn *c) {
+    hist_add(&c->w->stats.handshake, (uv_hrtime() - c->t_start) / 1000);
+    bench_send_request(c);
+}
+
+static void
+bench_s5_send_request(struct bench_conn *c) {
+    struct bench_conf *conf;
+    size_t n, len;
+
+    conf = c->w->conf;
+
+    n = 0;
+    c->wbuf[n++] = 0x05;
+    c->wbuf[n++] = 0x01;    /* connect */
+    c->wbuf[n++] = 0x00;
+
+    if (conf->domain) {
+        len = strlen(conf->target_host);
+        c->wbuf[n++] = 0x03;
+        c->wbuf[n++] = (char)len;
+        memcpy(&c->wbuf[n], conf->target_host, len);
+        n += len;
+    } else {
+        c->wbuf[n++] = 0x01;
+        memcpy(&c->wbuf[n], &conf->target.sin_addr, 4);
+        n += 4;
+    }
+
+    memcpy(&c->wbuf[n], &conf->target.sin_port, 2);
+    n += 2;
+
+    c->hlen = 0;
+    c->state = b_s5_reply;
+
+    bench_write(c, c->wbuf, n);
+}
+
+static void
+bench_s5_send_auth(struct bench_conn *c) {
+    char *sep;
+    size_t n, ulen, plen;
+
+    sep = strchr(c->w->conf->auth, ':');
+    ulen = sep ? (size_t)(sep - c->w->conf->auth) : strlen(c->w->conf->auth);
+    plen = sep ? strlen(sep + 1) : 0;
+
+    n = 0;
+    c->wbuf[n++] = 0x01;
+    c->wbuf[n++] = (char)ulen;
+    memcpy(&c->wbuf[n], c->w->conf->auth, ulen);
+    n += ulen;
+    c->wbuf[n++] = (char)plen;
+    if (plen) {
+        memcpy(&c->wbuf[n], sep + 1, plen);
+        n += plen;
+    }
+
+    c->hlen = 0;
+    c->state = b_s5_auth;
+
+    bench_write(c, c->wbuf, n);
+}
+
+/* Expected socks5 reply length, 0 means need more data */
+static size_t
+bench_s5_reply_length(struct bench_conn *c) {
+    if (c->hlen < 5) {
+        return 0;
+    }
+
+    switch ((uint8_t)c->hbuf[3]) {
+    case 0x01:
+        return 10;
+    case 0x03:
+        return 7 + (uint8_t)c->hbuf[4];
+    case 0x04:
+        return 22;
+    default:
+        return SIZE_MAX;
+    }
+}
+
+static int
+bench_parse_status(struct bench_conn *c) {
+    int code;
+
+    if (sscanf(c->hbuf, "HTTP/1.%*d %d", &code) != 1) {
+        return -1;
+    }
+
+    return code;
+}
+
+/* leftover is the response body already read */
+static void
+bench_on_response_header(struct bench_conn *c, size_t end, size_t leftover) {
+    const char *p;
+
+    c->hbuf[end] = '\0';
+
+    if (c->w->conf->proto == b_http || c->w->conf->proto == b_direct) {
+        /* pipeline mode, first response byte be the handshake */
+        hist_add(&c->w->stats.handshake, (uv_hrtime() - c->t_start) / 1000);
+    }
+
+    if (bench_parse_status(c) != 200) {
+        bench_conn_fail(c);
+        return;
+    }
+
+    p = strcasestr(c->hbuf, "\r\nContent-Length:");
+    if (p == NULL) {
+        c->chunked_body = 1;
+        c->body_left = UINT64_MAX;
+        c->state = b_body;
+        return;
+    }
+
+    c->body_left = strtoull(p + sizeof("\r\nContent-Length:") - 1, NULL, 10);
+    c->body_left -= MIN(c->body_left, leftover);
+
+    if (c->body_left == 0) {
+        bench_conn_done(c);
+        return;
+    }
+
+    c->state = b_body;
+}
+
+/* append data into header buffer as much as possible, return bytes appended */
+static size_t
+bench_hbuf_append(struct bench_conn *c, const char *data, size_t len) {
+    len = MIN(len, sizeof(c->hbuf) - 1 - c->hlen);
+
+    memcpy(c->hbuf + c->hlen, data, len);
+    c->hlen += len;
+    c->hbuf[c->hlen] = '\0';
+
+    return len;
+}
+
+static void
+bench_on_read(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf) {
+    struct bench_conn *c;
+    size_t len, n;
+    char *end;
+
+    c = stream->data;
+
+    if (c->state == b_closing) {
+        return;
+    }
+
+    if (nread < 0) {
+        if (nread == UV_EOF && c->state == b_body && c->chunked_body) {
+            bench_conn_done(c);
+            return;
+        }
+        bench_conn_fail(c);
+        return;
+    }
+
+    if (nread == 0) {
+        return;
+    }
+
+    c->t_last = uv_hrtime();
+    c->w->stats.nread += (uint64_t)nread;
+
+    if (c->state == b_body) {
+        if (c->chunked_body) {
+            return;
+        }
+        c->body_left -= MIN(c->body_left, (uint64_t)nread);
+        if (c->body_left == 0) {
+            bench_conn_done(c);
+        }
+        return;
+    }
+
+    n = bench_hbuf_append(c, buf->base, (size_t)nread);
+
+    switch (c->state) {
+    case b_s5_method:
+        if (c->hlen < 2) {
+            return;
+        }
+        if (c->hbuf[0] != 0x05) {
+            bench_conn_fail(c);
+        } else if (c->hbuf[1] == 0x00) {
+            bench_s5_send_request(c);
+        } else if (c->hbuf[1] == 0x02 && c->w->conf->auth != NULL) {
+            bench_s5_send_auth(c);
+        } else {
+            bench_conn_fail(c);
+        }
+        break;
+
+    case b_s5_auth:
+        if (c->hlen < 2) {
+            return;
+        }
+        if (c->hbuf[1] != 0x00) {
+            bench_conn_fail(c);
+            return;
+        }
+        bench_s5_send_request(c);
+        break;
+
+    case b_s5_reply:
+        len = bench_s5_reply_length(c);
+        if (len == 0 || c->hlen < len) {
+            return;
+        }
+        if (len == SIZE_MAX || c->hbuf[1] != 0x00) {
+            bench_conn_fail(c);
+            return;
+        }
+        bench_tunnel_ready(c);
+        break;
+
+    case b_tunnel_reply:
+        end = strstr(c->hbuf, "\r\n\r\n");
+        if (end == NULL) {
+            if (n < (size_t)nread) {
+                bench_conn_fail(c);
+            }
+            return;
+        }
+        if (bench_parse_status(c) != 200) {
+            bench_conn_fail(c);
+            return;
+        }
+        bench_tunnel_ready(c);
+        break;
+
+    case b_response_header:
+        end = strstr(c->hbuf, "\r\n\r\n");
+        if (end == NULL) {
+            if (n < (size_t)nread) {
+                bench_conn_fail(c);
+            }
+            return;
+        }
+        bench_on_response_header(c, (size_t)(end - c->hbuf),
+                c->hlen - (size_t)(end - c->hbuf) - 4 + ((size_t)nread - n));
+        break;
+
+    default:
+        bench_conn_fail(c);
+        break;
+    }
+}
+
+static void
+bench_on_connect(uv_connect_t *req, int err) {
+    struct bench_conn *c;
+    struct bench_conf *conf;
+    char auth[320];
+    int n;
+
+    c = req->data;
+    conf = c->w->conf;
+
+    if (c->state == b_closing) {
+        return;
+    }
+
+    if (err) {
+        bench_conn_fail(c);
+        return;
+    }
+
+    c->t_last = uv_hrtime();
+    hist_add(&c->w->stats.connect, (c->t_last - c->t_start) / 1000);
+
+    uv_tcp_nodelay(&c->tcp, 1);
+
+    if (uv_read_start((uv_stream_t *)&c->tcp, bench_alloc, bench_on_read)) {
+        bench_conn_fail(c);
+        return;
+    }
+
+    c->hlen = 0;
+
+    switch (conf->proto) {
+    case b_socks5:
+        c->wbuf[0] = 0x05;
+        c->wbuf[1] = 0x01;
+        c->wbuf[2] = conf->auth != NULL ? 0x02 : 0x00;
+        c->state = b_s5_method;
+        bench_write(c, c->wbuf, 3);
+        break;
+
+    case b_http_tunnel:
+        auth[0] = '\0';
+        if (conf->auth != NULL) {
+            snprintf(auth, sizeof(auth), "Proxy-Authorization: Basic %s\r\n", conf->auth_b64);
+        }
+        n = snprintf(c->wbuf, sizeof(c->wbuf),
+                "CONNECT %s:%d HTTP/1.1\r\nHost: %s:%d\r\n%s\r\n",
+                conf->target_host, conf->target_port,
+                conf->target_host, conf->target_port, auth);
+        c->state = b_tunnel_reply;
+        bench_write(c, c->wbuf, (size_t)n);
+        break;
+
+    case b_http:
+    case b_direct:
+        bench_send_request(c);
+        break;
+    }
+}
+
+static void
+bench_conn_start(struct bench_worker *w, uint64_t t_sched) {
+    struct bench_conn *c;
+    struct bench_conf *conf;
+    const struct sockaddr *addr;
+
+    conf = w->conf;
+
+    /* all slots busy, open loop drop this request */
+    if (w->nidle == 0) {
+        w->stats.skipped++;
+        return;
+    }
+
+    c = w->idle[--w->nidle];
+
+    w->issued++;
+    w->active++;
+
+    c->state = b_connect;
+    c->t_sched = t_sched;
+    c->t_start = uv_hrtime();
+    c->t_last = c->t_start;
+    c->body_left = 0;
+    c->upload_left = 0;
+    c->chunked_body = 0;
+    c->hlen = 0;
+
+    uv_tcp_init(&w->loop, &c->tcp);
+    c->tcp.data = c;
+    c->connect_req.data = c;
+    c->write_req.data = c;
+
+    addr = (const struct sockaddr *)(conf->proto == b_direct ? &conf->target : &conf->server);
+
+    if (uv_tcp_connect(&c->connect_req, &c->tcp, addr, bench_on_connect)) {
+        bench_conn_fail(c);
+    }
+}
+
+static void
+bench_worker_sweep(struct bench_worker *w, uint64_t now) {
+    int i;
+    struct bench_conn *c;
+
+    for (i = 0; i < w->nconn; i++) {
+        c = &w->conns[i];
+        if (c->state == b_idle || c->state == b_closing) {
+            continue;
+        }
+
+        if (w->stopping && w->deadline && now >= w->deadline) {
+            w->stats.aborted++;
+            bench_conn_close(c);
+        } else if (now > c->t_last && now - c->t_last > w->conf->timeout) {
+            w->stats.timeouts++;
+            bench_conn_close(c);
+        }
+    }
+}
+
+static void
+bench_on_tick(uv_timer_t *handle) {
+    struct bench_worker *w;
+    uint64_t now, due;
+
+    w = handle->data;
+    now = uv_hrtime();
+
+    if (w->deadline && now >= w->deadline && !w->stopping) {
+        w->stopping = 1;
+        w->end = now;
+        bench_worker_sweep(w, now);
+    }
+
+    if (w->rate > 0 && !w->stopping) {
+        due = (uint64_t)((double)(now - w->start) * w->rate / BENCH_NS);
+        if (w->quota) {
+            due = MIN(due, w->quota);
+        }
+
+        while (w->issued + w->stats.skipped < due && bench_worker_more(w)) {
+            bench_conn_start(w, w->start +
+                    (uint64_t)((double)(w->issued + w->stats.skipped) * BENCH_NS / w->rate));
+        }
+
+        if (w->quota && w->issued + w->stats.skipped >= w->quota) {
+            w->stopping = 1;
+        }
+    }
+
+    if (now - w->last_sweep > BENCH_NS / 10) {
+        w->last_sweep = now;
+        bench_worker_sweep(w, now);
+    }
+
+    bench_worker_check_done(w);
+}
+
+static void
+bench_worker_run(void *arg) {
+    struct bench_worker *w;
+    int i, n;
+
+    w = arg;
+
+    w->start = uv_hrtime();
+    w->last_sweep = w->start;
+    if (w->conf->requests == 0) {
+        w->deadline = w->start + (uint64_t)(w->conf->duration * BENCH_NS);
+    }
+
+    uv_timer_init(&w->loop, &w->tick);
+    w->tick.data = w;
+    uv_timer_start(&w->tick, bench_on_tick, 1, w->rate > 0 ? 1 : 100);
+
+    if (w->rate == 0) {
+        n = w->quota ? (int)MIN((uint64_t)w->nconn, w->quota) : w->nconn;
+        for (i = 0; i < n; i++) {
+            bench_conn_start(w, 0);
+        }
+    }
+
+    uv_run(&w->loop, UV_RUN_DEFAULT);
+    uv_loop_close(&w->loop);
+}
+
+static int
+bench_worker_init(struct bench_worker *w, struct bench_conf *conf, int nconn,
+        uint64_t quota, double rate) {
+    int i;
+
+    memset(w, 0, sizeof(*w));
+
+    w->conf = conf;
+    w->nconn = nconn;
+    w->quota = quota;
+    w->rate = rate;
+
+    w->conns = calloc(nconn, sizeof(struct bench_conn));
+    w->idle = calloc(nconn, sizeof(struct bench_conn *));
+    if (w->conns == NULL || w->idle == NULL) {
+        return BENCH_ERROR;
+    }
+
+    for (i = nconn - 1; i >= 0; i--) {
+        w->conns[i].w = w;
+        w->conns[i].state = b_idle;
+        w->idle[w->nidle++] = &w->conns[i];
+    }
+
+    hist_init(&w->stats.connect);
+    hist_init(&w->stats.handshake);
+    hist_init(&w->stats.latency);
+
+    if (uv_loop_init(&w->loop)) {
+        return BENCH_ERROR;
+    }
+
+    return BENCH_OK;
+}
+
+static void
+bench_stats_merge(struct bench_stats *dst, struct bench_stats *src) {
+    dst->ok += src->ok;
+    dst->errors += src->errors;
+    dst->timeouts += src->timeouts;
+    dst->skipped += src->skipped;
+    dst->aborted += src->aborted;
+    dst->nread += src->nread;
+    dst->nwrite += src->nwrite;
+    hist_merge(&dst->connect, &src->connect);
+    hist_merge(&dst->handshake, &src->handshake);
+    hist_merge(&dst->latency, &src->latency);
+}
+
+static void
+bench_report_hist(const char *name, struct histogram *h, int json, int last) {
+    if (json) {
+        printf("\"%s\": {\"count\": %llu, \"mean\": %.1f, \"p50\": %llu, \"p90\": %llu, "
+                "\"p99\": %llu, \"p999\": %llu, \"max\": %llu}%s",
+                name, (unsigned long long)h->count, hist_mean(h),
+                (unsigned long long)hist_percentile(h, 0.50),
+                (unsigned long long)hist_percentile(h, 0.90),
+                (unsigned long long)hist_percentile(h, 0.99),
+                (unsigned long long)hist_percentile(h, 0.999),
+                (unsigned long long)(h->count ? h->max : 0), last ? "" : ", ");
+        return;
+    }
+
+    printf("%-10s mean %8.1f  p50 %8llu  p90 %8llu  p99 %8llu  p999 %8llu  max %8llu us\n",
+            name, hist_mean(h),
+            (unsigned long long)hist_percentile(h, 0.50),
+            (unsigned long long)hist_percentile(h, 0.90),
+            (unsigned long long)hist_percentile(h, 0.99),
+            (unsigned long long)hist_percentile(h, 0.999),
+            (unsigned long long)(h->count ? h->max : 0));
+}
+
+static void
+bench_report(struct bench_conf *conf, struct bench_stats *st, double elapsed,
+        double rps_cpu, double self_cpu) {
+    double gb, mbps, reqps, cpu_per_gb;
+
+    gb = (double)(st->nread + st->nwrite) / (1024.0 * 1024.0 * 1024.0);
+    mbps = elapsed > 0 ? (double)(st->nread + st->nwrite) / (1024.0 * 1024.0) / elapsed : 0;
+    reqps = elapsed > 0 ? (double)st->ok / elapsed : 0;
+    cpu_per_gb = (rps_cpu >= 0 && gb > 0) ? rps_cpu / gb : -1.0;
+
+    if (conf->json) {
+        printf("{\"proto\": \"%s\", \"mode\": \"%s\", \"loop\": \"%s\", "
+                "\"concurrency\": %d, \"threads\": %d, \"rate\": %.1f, "
+                "\"download\": %llu, \"upload\": %llu, "
+                "\"ok\": %llu, \"errors\": %llu, \"timeouts\": %llu, "
+                "\"skipped\": %llu, \"aborted\": %llu, "
+                "\"elapsed\": %.3f, \"req_per_sec\": %.1f, \"mb_per_sec\": %.2f, "
+                "\"bytes_read\": %llu, \"bytes_written\": %llu, "
+                "\"rps_cpu\": %.3f, \"rps_cpu_per_gb\": %.3f, \"bench_cpu\": %.3f, ",
+                conf->proto_name, conf->mode, conf->rate > 0 ? "open" : "closed",
+                conf->concurrency, conf->threads, conf->rate,
+                (unsigned long long)conf->download, (unsigned long long)conf->upload,
+                (unsigned long long)st->ok, (unsigned long long)st->errors,
+                (unsigned long long)st->timeouts, (unsigned long long)st->skipped,
+                (unsigned long long)st->aborted,
+                elapsed, reqps, mbps,
+                (unsigned long long)st->nread, (unsigned long long)st->nwrite,
+                rps_cpu, cpu_per_gb, self_cpu);
+        bench_report_hist("connect", &st->connect, 1, 0);
+        bench_report_hist("handshake", &st->handshake, 1, 0);
+        bench_report_hist("latency", &st->latency, 1, 1);
+        printf("}\n");
+        return;
+    }
+
+    printf("proto: %s, mode: %s, %s loop, concurrency: %d, threads: %d",
+            conf->proto_name, conf->mode, conf->rate > 0 ? "open" : "closed",
+            conf->concurrency, conf->threads);
+    if (conf->rate > 0) {
+        printf(", rate: %.0f/s", conf->rate);
+    }
+    printf("\n");
+
+    printf("requests:  %llu ok, %llu errors, %llu timeouts, %llu skipped, %llu aborted\n",
+            (unsigned long long)st->ok, (unsigned long long)st->errors,
+            (unsigned long long)st->timeouts, (unsigned long long)st->skipped,
+            (unsigned long long)st->aborted);
+    printf("elapsed:   %.3f s, %.1f req/s, %.2f MB/s relayed\n", elapsed, reqps, mbps);
+
+    bench_report_hist("connect", &st->connect, 0, 0);
+    bench_report_hist("handshake", &st->handshake, 0, 0);
+    bench_report_hist("latency", &st->latency, 0, 0);
+
+    if (rps_cpu >= 0) {
+        printf("cpu:       rps %.3f s, %.3f s/GB, bench %.3f s\n", rps_cpu, cpu_per_gb, self_cpu);
+    } else {
+        printf("cpu:       bench %.3f s\n", self_cpu);
+    }
+}
+
+static int
+bench_parse_proto(struct bench_conf *conf, const char *name) {
+    if (strcmp(name, "socks5") == 0) {
+        conf->proto = b_socks5;
+    } else if (strcmp(name, "http") == 0) {
+        conf->proto = b_http;
+    } else if (strcmp(name, "http_tunnel") == 0) {
+        conf->proto = b_http_tunnel;
+    } else if (strcmp(name, "direct") == 0) {
+        conf->proto = b_direct;
+    } else {
+        return BENCH_ERROR;
+    }
+
+    conf->proto_name = name;
+
+    return BENCH_OK;
+}
+
+int
+main(int argc, char **argv) {
+    int c, i, nconn, status;
+    struct bench_conf conf;
+    struct bench_worker *workers;
+    struct bench_stats total;
+    struct sink sink;
+    const char *server, *target;
+    char host[64];
+    uint16_t port;
+    int64_t download;
+    uint64_t quota, start, end;
+    double rps_cpu0, rps_cpu1, self_cpu0, elapsed;
+
+    static struct option long_options[] = {
+        { "help",        no_argument,        NULL,   'h' },
+        { "proto",       required_argument,  NULL,   'p' },
+        { "server",      required_argument,  NULL,   's' },
+        { "target",      required_argument,  NULL,   't' },
+        { "sink",        no_argument,        NULL,   'S' },
+        { "auth",        required_argument,  NULL,   'a' },
+        { "concurrency", required_argument,  NULL,   'c' },
+        { "threads",     required_argument,  NULL,   'T' },
+        { "requests",    required_argument,  NULL,   'n' },
+        { "duration",    required_argument,  NULL,   'd' },
+        { "rate",        required_argument,  NULL,   'r' },
+        { "mode",        required_argument,  NULL,   'm' },
+        { "bytes",       required_argument,  NULL,   'b' },
+        { "upload",      required_argument,  NULL,   'u' },
+        { "domain",      no_argument,        NULL,   'D' },
+        { "timeout",     required_argument,  NULL,   'o' },
+        { "pid",         required_argument,  NULL,   'P' },
+        { "json",        no_argument,        NULL,   'j' },
+        {  NULL,         0,                  NULL,    0  }
+    };
+
+    memset(&conf, 0, sizeof(conf));
+    bench_parse_proto(&conf, "socks5");
+    conf.concurrency = BENCH_DEFAULT_CONCURRENCY;
+    conf.threads = 1;
+    conf.duration = BENCH_DEFAULT_DURATION;
+    conf.timeout = (uint64_t)BENCH_DEFAULT_TIMEOUT * 1000000;
+    conf.mode = "churn";
+    conf.pid = -1;
+
+    server = BENCH_DEFAULT_SERVER;
+    target = BENCH_DEFAULT_TARGET;
+    download = -1;
+
+    for (;;) {
+        c = getopt_long(argc, argv, "hp:s:t:Sa:c:T:n:d:r:m:b:u:Do:P:j", long_options, NULL);
+        if (c == -1) {
+            break;
+        }
+
+        switch (c) {
+        case 'p':
+            if (bench_parse_proto(&conf, optarg) != BENCH_OK) {
+                bench_show_usage();
+            }
+            break;
+        case 's':
+            server = optarg;
+            break;
+        case 't':
+            target = optarg;
+            break;
+        case 'S':
+            conf.sink = 1;
+            break;
+        case 'a':
+            conf.auth = optarg;
+            break;
+        case 'c':
+            conf.concurrency = atoi(optarg);
+            break;
+        case 'T':
+            conf.threads = atoi(optarg);
+            break;
+        case 'n':
+            conf.requests = strtoull(optarg, NULL, 10);
+            break;
+        case 'd':
+            conf.duration = atof(optarg);
+            break;
+        case 'r':
+            conf.rate = atof(optarg);
+            break;
+        case 'm':
+            if (strcmp(optarg, "churn") != 0 && strcmp(optarg, "bulk") != 0) {
+                bench_show_usage();
+            }
+            conf.mode = optarg;
+            break;
+        case 'b':
+            download = strtoll(optarg, NULL, 10);
+            break;
+        case 'u':
+            conf.upload = strtoull(optarg, NULL, 10);
+            break;
+        case 'D':
+            conf.domain = 1;
+            break;
+        case 'o':
+            conf.timeout = strtoull(optarg, NULL, 10) * 1000000;
+            break;
+        case 'P':
+            conf.pid = atoi(optarg);
+            break;
+        case 'j':
+            conf.json = 1;
+            break;
+        case 'h':
+        default:
+            bench_show_usage();
+        }
+    }
+
+    if (conf.concurrency <= 0 || conf.threads <= 0 || conf.threads > conf.concurrency) {
+        bench_show_usage();
+    }
+
+    if (download >= 0) {
+        conf.download = (uint64_t)download;
+    } else {
+        conf.download = strcmp(conf.mode, "bulk") == 0 ? BENCH_BULK_BYTES : BENCH_CHURN_BYTES;
+    }
+
+    if (bench_parse_addr(server, &conf.server, host, sizeof(host), &port) != BENCH_OK) {
+        fprintf(stderr, "invalid server address '%s'\n", server);
+        return 1;
+    }
+
+    if (bench_parse_addr(target, &conf.target, conf.target_host,
+                sizeof(conf.target_host), &conf.target_port) != BENCH_OK) {
+        fprintf(stderr, "invalid target address '%s'\n", target);
+        return 1;
+    }
+
+    if (conf.auth != NULL) {
+        bench_base64(conf.auth, conf.auth_b64, sizeof(conf.auth_b64));
+    }
+
+    memset(bench_payload, 'x', sizeof(bench_payload));
+
+    if (conf.sink) {
+        if (sink_start(&sink, conf.target_host, conf.target_port) != BENCH_OK) {
+            return 1;
+        }
+    }
+
+    workers = calloc(conf.threads, sizeof(struct bench_worker));
+    if (workers == NULL) {
+        return 1;
+    }
+
+    for (i = 0; i < conf.threads; i++) {
+        nconn = conf.concurrency / conf.threads + (i < conf.concurrency % conf.threads ? 1 : 0);
+        quota = 0;
+        if (conf.requests) {
+            quota = conf.requests / conf.threads + ((uint64_t)i < conf.requests % conf.threads ? 1 : 0);
+        }
+
+        status = bench_worker_init(&workers[i], &conf, nconn, quota, conf.rate / conf.threads);
+        if (status != BENCH_OK) {
+            fprintf(stderr, "initial worker failed\n");
+            return 1;
+        }
+    }
+
+    rps_cpu0 = conf.pid > 0 ? bench_proc_cpu(conf.pid) : -1.0;
+    self_cpu0 = bench_self_cpu();
+    start = uv_hrtime();
+
+    for (i = 0; i < conf.threads; i++) {
+        uv_thread_create(&workers[i].tid, bench_worker_run, &workers[i]);
+    }
+
+    memset(&total, 0, sizeof(total));
+    hist_init(&total.connect);
+    hist_init(&total.handshake);
+    hist_init(&total.latency);
+
+    end = start;
+    for (i = 0; i < conf.threads; i++) {
+        uv_thread_join(&workers[i].tid);
+        bench_stats_merge(&total, &workers[i].stats);
+        end = MAX(end, workers[i].end);
+    }
+
+    rps_cpu1 = conf.pid > 0 ? bench_proc_cpu(conf.pid) : -1.0;
+    elapsed = (double)(end - start) / BENCH_NS;
+
+    bench_report(&conf, &total, elapsed,
+            (rps_cpu0 >= 0 && rps_cpu1 >= 0) ? rps_cpu1 - rps_cpu0 : -1.0,
+            bench_self_cpu() - self_cpu0);
+
+    if (conf.sink) {
+        sink_stop(&sink);
+    }
+
+    return total.ok > 0 ? 0 : 1;
+}
@@ -0,0 +1,73 @@
+#ifndef _RPS_BENCH_H
+#define _RPS_BENCH_H
+
+#include <uv.h>
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define BENCH_OK        0
+#define BENCH_ERROR     -1
+
+#define BENCH_CHUNK_SIZE        65536
+#define BENCH_HEADER_MAX_LENGTH 4096
+#define BENCH_BACKLOG           1024
+
+#define MAX(_a, _b)     ((_a) > (_b) ? (_a):(_b))
+#define MIN(_a, _b)     ((_a) < (_b) ? (_a):(_b))
+#define UNUSED(_x)      (void)(_x)
+
+/*
+ * Log-linear latency histogram in microseconds.
+ * Values below 64 are exact, above that each power of two is split
+ * into 32 linear sub buckets, about 3% relative error.
+ */
+#define HIST_EXACT      64
+#define HIST_SUB_BITS   5
+#define HIST_SUB        (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS    (HIST_EXACT + (64 - 6) * HIST_SUB)
+
+struct histogram {
+    uint64_t    count;
+    uint64_t    min;
+    uint64_t    max;
+    uint64_t    sum;
+    uint64_t    buckets[HIST_BUCKETS];
+};
+
+void hist_init(struct histogram *h);
+void hist_add(struct histogram *h, uint64_t v);
+void hist_merge(struct histogram *dst, struct histogram *src);
+uint64_t hist_percentile(struct histogram *h, double p);
+double hist_mean(struct histogram *h);
+
+/*
+ * HTTP sink target
+ *  GET  /bytes/<n>   response n bytes body
+ *  POST /<any>       discard the body, response empty 200
+ * Connection always be closed after response.
+ */
+struct sink {
+    uv_loop_t   loop;
+    uv_tcp_t    server;
+    uv_thread_t tid;
+    uv_async_t  stop;
+};
+
+int sink_listen(uv_loop_t *loop, uv_tcp_t *server, const char *host, uint16_t port,
+        int reuseport);
+int sink_start(struct sink *s, const char *host, uint16_t port);
+void sink_stop(struct sink *s);
+
+/* parse host:port, ipv4 only */
+int bench_parse_addr(const char *str, struct sockaddr_in *addr, char *host, size_t size,
+        uint16_t *port);
+void bench_base64(const char *src, char *dst, size_t size);
+int bench_listen(uv_loop_t *loop, uv_tcp_t *server, const char *host, uint16_t port,
+        int reuseport, uv_connection_cb cb);
+
+/* read user + system cpu seconds of a process from /proc, -1 means unknown */
+double bench_proc_cpu(int pid);
+double bench_self_cpu();
+
+#endif
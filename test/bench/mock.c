@@ -0,0 +1,1392 @@
+/*
+ * rps-mock: self-contained upstream environment for rps performance tests.
+ *
+ *  pool api:   GET  <any>/proxy/<proto>/  json array of N synthetic upstreams
+ *              POST <any>/stats/<proto>/  accept and count statistic commits
+ *              POST <any>/check/<proto>/  accept and count rps-check commits
+ *  upstreams:  socks5, http and http_tunnel proxies. Upstream i is addressed
+ *              as (base + 1 + i):<port of proto>, one wildcard listener per
+ *              proto accepts connections to every loopback address, so 10k
+ *              upstreams cost three sockets and no network.
+ *  sink:       target server of sink.c, proxies relay to whatever address the
+ *              client asked, the sink is only the default.
+ *
+ * Faults are rolled per connection, on the faulty fraction of upstreams only,
+ * so rps sees a stable set of bad upstreams:
+ *  fail:       close the connection right after accept
+ *  blackhole:  read everything, never reply
+ *  deny:       authentication failure, socks5 0x01 status or http 407
+ *  forbid:     socks5 reply 0x02 (not allowed) or http 403
+ */
+#include "bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <sys/resource.h>
+
+#define MOCK_DEFAULT_UPSTREAMS  100
+#define MOCK_DEFAULT_LISTEN     "0.0.0.0"
+#define MOCK_DEFAULT_PORT       10080       /* socks5, http +1, http_tunnel +2 */
+#define MOCK_DEFAULT_BASE       "127.1.0.0"
+#define MOCK_DEFAULT_API        "127.0.0.1:9897"
+#define MOCK_DEFAULT_TARGET     "127.0.0.1:19000"
+#define MOCK_EXPIRE             86400
+#define MOCK_MAX_PENDING        (1024 * 1024)
+#define MOCK_MAX_THREADS        64
+
+enum mock_proto {
+    m_socks5,
+    m_http,
+    m_http_tunnel,
+    m_proto_max,
+};
+
+static const char *mock_proto_names[] = {
+    "socks5",
+    "http",
+    "http_tunnel",
+};
+
+enum mock_fault {
+    f_none,
+    f_fail,
+    f_blackhole,
+    f_deny,
+    f_forbid,
+};
+
+enum mock_state {
+    m_greeting,
+    m_auth,
+    m_request,
+    m_header,
+    m_connect,
+    m_relay,
+    m_blackhole,
+    m_closing,
+};
+
+struct mock_conf {
+    const char          *listen;
+    uint16_t            port;
+    uint32_t            base;           /* host byte order */
+    uint32_t            upstreams;
+    char                api_host[64];
+    uint16_t            api_port;
+    char                target_host[64];
+    uint16_t            target_port;
+    int                 sink;
+    uint32_t            latency;        /* ms */
+    uint32_t            jitter;         /* ms */
+    double              fail;
+    double              blackhole;
+    double              deny;
+    double              forbid;
+    double              faulty;
+    int                 sources;        /* upstream i is of source mock<i % sources> */
+    char                *auth;          /* user:password */
+    char                auth_b64[256];
+    char                *uname;
+    char                *passwd;
+    int                 threads;
+};
+
+/* shared among workers, updated atomically */
+struct mock_stats {
+    uint64_t            accepted;
+    uint64_t            relayed;
+    uint64_t            fail;
+    uint64_t            blackhole;
+    uint64_t            deny;
+    uint64_t            forbid;
+    uint64_t            unauth;
+    uint64_t            unreachable;
+    uint64_t            fetch;
+    uint64_t            commit;
+    uint64_t            check;
+};
+
+struct mock_worker {
+    uv_loop_t           loop;
+    uv_tcp_t            proxy[m_proto_max];
+    uv_tcp_t            sink;
+    uv_tcp_t            api;
+    uv_signal_t         sigint;
+    uv_signal_t         sigterm;
+    uv_thread_t         tid;
+    unsigned int        seed;
+};
+
+struct mock_conn {
+    uv_tcp_t            client;
+    uv_tcp_t            target;
+    uv_timer_t          timer;
+    uv_connect_t        connect_req;
+    uv_shutdown_t       shutdown_client;
+    uv_shutdown_t       shutdown_target;
+    struct mock_worker  *w;
+    enum mock_proto     proto;
+    enum mock_state     state;
+    enum mock_fault     fault;
+    int                 handles;        /* handles not closed yet */
+    unsigned            target_open:1;
+    unsigned            timer_open:1;
+    unsigned            client_eof:1;
+    unsigned            target_eof:1;
+    unsigned            client_reading:1;
+    unsigned            target_reading:1;
+    char                *pending;       /* forward to target once connected */
+    size_t              npending;
+    size_t              len;
+    char                buf[BENCH_HEADER_MAX_LENGTH];
+};
+
+/* write request carries its own data, relay reads land in it directly */
+struct mock_write {
+    uv_write_t          req;
+    uv_buf_t            buf;
+    int                 close;          /* close connection once written */
+    char                data[1];
+};
+
+struct mock_api_conn {
+    uv_tcp_t            tcp;
+    uv_write_t          write_req;
+    int                 closing;
+    uint64_t            body_left;
+    size_t              hlen;
+    char                hbuf[BENCH_HEADER_MAX_LENGTH];
+    char                head[256];
+};
+
+static struct mock_conf mock_conf;
+static struct mock_stats mock_stats;
+static struct mock_worker mock_workers[MOCK_MAX_THREADS];
+
+static char *mock_pool_json[m_proto_max];
+static size_t mock_pool_json_len[m_proto_max];
+
+static char mock_api_rbuf[BENCH_CHUNK_SIZE];
+
+#define mock_count(_field)  __sync_fetch_and_add(&mock_stats._field, 1)
+
+static void mock_relay_read(struct mock_conn *c, int client);
+
+static void
+mock_show_usage() {
+    fprintf(stderr,
+        "Usage: rps-mock [-n upstreams] [-l listen] [-p port] [-B base] [-A api] [-t target]\n"
+        "                [-N] [-a user:pass] [-L ms] [-J ms] [-f rate] [-k rate] [-d rate]\n"
+        "                [-F rate] [-q fraction] [-T threads]\n"
+        "Options:\n"
+        "   -h, --help           :this help\n"
+        "   -n, --upstreams=N    :synthetic upstreams of each proto (default: %d)\n"
+        "   -l, --listen=S       :listen address of upstream proxies (default: %s)\n"
+        "   -p, --port=N         :socks5 port, http +1, http_tunnel +2 (default: %d)\n"
+        "   -B, --base=S         :upstream i is addressed as base + 1 + i (default: %s)\n"
+        "   -A, --api=S          :pool api address (default: %s)\n"
+        "   -t, --target=S       :sink target address (default: %s)\n"
+        "   -N, --no-sink        :don't run sink target\n"
+        "   -a, --auth=S         :upstream credential user:password (default: none)\n"
+        "   -L, --latency=N      :delay of handshake in ms (default: 0)\n"
+        "   -J, --jitter=N       :random extra delay up to N ms (default: 0)\n"
+        "   -f, --fail=R         :rate of connections closed after accept\n"
+        "   -k, --blackhole=R    :rate of connections never replied\n"
+        "   -d, --deny=R         :rate of authentication failures (socks5 0x01, http 407)\n"
+        "   -F, --forbid=R       :rate of forbidden requests (socks5 0x02, http 403)\n"
+        "   -q, --faulty=R       :fraction of upstreams faults apply to (default: 1)\n"
+        "   -s, --sources=N      :spread upstreams over sources mock0..mockN-1 (default: all mock)\n"
+        "   -T, --threads=N      :worker threads (default: 1)\n",
+        MOCK_DEFAULT_UPSTREAMS, MOCK_DEFAULT_LISTEN, MOCK_DEFAULT_PORT,
+        MOCK_DEFAULT_BASE, MOCK_DEFAULT_API, MOCK_DEFAULT_TARGET);
+    exit(1);
+}
+
+static void
+mock_addr_str(uint32_t addr, char *dst, size_t size) {
+    struct in_addr in;
+
+    in.s_addr = htonl(addr);
+    inet_ntop(AF_INET, &in, dst, size);
+}
+
+static int
+mock_pool_build(enum mock_proto proto) {
+    char *json, *p;
+    size_t size;
+    uint32_t i;
+    long now;
+    char host[INET_ADDRSTRLEN];
+    char uname[160], passwd[160];
+    char source[32];
+
+    now = (long)time(NULL);
+
+    if (mock_conf.auth != NULL) {
+        snprintf(uname, sizeof(uname), "\"%s\"", mock_conf.uname);
+        snprintf(passwd, sizeof(passwd), "\"%s\"", mock_conf.passwd);
+    } else {
+        strcpy(uname, "null");
+        strcpy(passwd, "null");
+    }
+
+    size = 2 + (size_t)mock_conf.upstreams * (512 + strlen(uname) + strlen(passwd));
+    json = malloc(size);
+    if (json == NULL) {
+        return BENCH_ERROR;
+    }
+
+    p = json;
+    *p++ = '[';
+
+    for (i = 0; i < mock_conf.upstreams; i++) {
+        mock_addr_str(mock_conf.base + 1 + i, host, sizeof(host));
+        if (mock_conf.sources > 0) {
+            snprintf(source, sizeof(source), "mock%u", i % (uint32_t)mock_conf.sources);
+        } else {
+            strcpy(source, "mock");
+        }
+        p += sprintf(p, "%s{\"host\": \"%s\", \"port\": %d, \"proto\": \"%s\", "
+                "\"username\": %s, \"password\": %s, \"source\": \"%s\", "
+                "\"weight\": 10, \"success\": 0, \"failure\": 0, "
+                "\"insert_date\": %ld, \"expire_date\": %ld, \"enable\": 1}",
+                i == 0 ? "" : ", ", host, mock_conf.port + proto, mock_proto_names[proto],
+                uname, passwd, source, now, now + MOCK_EXPIRE);
+    }
+
+    *p++ = ']';
+
+    mock_pool_json[proto] = json;
+    mock_pool_json_len[proto] = (size_t)(p - json);
+
+    return BENCH_OK;
+}
+
+/*
+ * Faults only hit a stable subset of upstreams, picked by a multiplicative
+ * hash of the upstream index.
+ */
+static enum mock_fault
+mock_fault_roll(struct mock_worker *w, uint32_t index) {
+    double r;
+
+    if ((double)((index * 2654435761u) % 10000) >= mock_conf.faulty * 10000) {
+        return f_none;
+    }
+
+    r = (double)rand_r(&w->seed) / ((double)RAND_MAX + 1);
+
+    if ((r -= mock_conf.fail) < 0) {
+        return f_fail;
+    }
+    if ((r -= mock_conf.blackhole) < 0) {
+        return f_blackhole;
+    }
+    if ((r -= mock_conf.deny) < 0) {
+        return f_deny;
+    }
+    if ((r -= mock_conf.forbid) < 0) {
+        return f_forbid;
+    }
+
+    return f_none;
+}
+
+static void
+mock_on_close(uv_handle_t *handle) {
+    struct mock_conn *c;
+
+    c = handle->data;
+
+    if (--c->handles == 0) {
+        free(c->pending);
+        free(c);
+    }
+}
+
+static void
+mock_close(struct mock_conn *c) {
+    if (c->state == m_closing) {
+        return;
+    }
+
+    c->state = m_closing;
+
+    uv_close((uv_handle_t *)&c->client, mock_on_close);
+    if (c->target_open) {
+        uv_close((uv_handle_t *)&c->target, mock_on_close);
+    }
+    if (c->timer_open) {
+        uv_close((uv_handle_t *)&c->timer, mock_on_close);
+    }
+}
+
+static struct mock_write *
+mock_write_alloc(size_t size) {
+    struct mock_write *mw;
+
+    mw = malloc(sizeof(*mw) + size);
+    if (mw == NULL) {
+        return NULL;
+    }
+
+    mw->buf.base = mw->data;
+    mw->buf.len = size;
+    mw->close = 0;
+
+    return mw;
+}
+
+static void
+mock_on_write(uv_write_t *req, int err) {
+    struct mock_write *mw;
+    struct mock_conn *c;
+    uv_stream_t *stream;
+    int close;
+
+    mw = (struct mock_write *)req;
+    stream = req->handle;
+    c = stream->data;
+    close = mw->close;
+    free(mw);
+
+    if (c->state == m_closing) {
+        return;
+    }
+
+    if (err || close) {
+        mock_close(c);
+        return;
+    }
+
+    /* resume the side paused by backpressure of this stream */
+    if (c->state == m_relay && stream->write_queue_size < MOCK_MAX_PENDING / 2) {
+        mock_relay_read(c, stream == (uv_stream_t *)&c->target);
+    }
+}
+
+static int
+mock_write(struct mock_conn *c, uv_stream_t *stream, struct mock_write *mw) {
+    if (uv_write(&mw->req, stream, &mw->buf, 1, mock_on_write)) {
+        free(mw);
+        mock_close(c);
+        return BENCH_ERROR;
+    }
+
+    return BENCH_OK;
+}
+
+static void
+mock_send(struct mock_conn *c, uv_stream_t *stream, const char *data, size_t len, int close) {
+    struct mock_write *mw;
+
+    mw = mock_write_alloc(len);
+    if (mw == NULL) {
+        mock_close(c);
+        return;
+    }
+
+    memcpy(mw->data, data, len);
+    mw->close = close;
+
+    mock_write(c, stream, mw);
+}
+
+static void
+mock_reply(struct mock_conn *c, const char *data, size_t len, int close) {
+    mock_send(c, (uv_stream_t *)&c->client, data, len, close);
+}
+
+static void
+mock_http_reply(struct mock_conn *c, int code, const char *reason) {
+    char head[256];
+    int n;
+
+    n = snprintf(head, sizeof(head), "HTTP/1.1 %d %s\r\n%sContent-Length: 0\r\n"
+            "Connection: close\r\n\r\n", code, reason,
+            code == 407 ? "Proxy-Authenticate: Basic realm=\"mock\"\r\n" : "");
+
+    mock_reply(c, head, (size_t)n, 1);
+}
+
+static void
+mock_alloc(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
+    struct mock_write *mw;
+
+    UNUSED(handle);
+    UNUSED(suggested_size);
+
+    mw = mock_write_alloc(BENCH_CHUNK_SIZE);
+    if (mw == NULL) {
+        buf->base = NULL;
+        buf->len = 0;
+        return;
+    }
+
+    *buf = mw->buf;
+}
+
+static struct mock_write *
+mock_write_of(const uv_buf_t *buf) {
+    return (struct mock_write *)(buf->base - offsetof(struct mock_write, data));
+}
+
+static void
+mock_relay_on_shutdown(uv_shutdown_t *req, int err) {
+    struct mock_conn *c;
+
+    c = req->data;
+
+    if (err && c->state != m_closing) {
+        mock_close(c);
+    }
+}
+
+static void
+mock_relay_on_read(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf) {
+    struct mock_conn *c;
+    struct mock_write *mw;
+    uv_stream_t *dst;
+    int from_client;
+
+    c = stream->data;
+    mw = buf->base == NULL ? NULL : mock_write_of(buf);
+
+    from_client = stream == (uv_stream_t *)&c->client;
+    dst = from_client ? (uv_stream_t *)&c->target : (uv_stream_t *)&c->client;
+
+    if (nread > 0) {
+        mw->buf.len = (size_t)nread;
+        if (mock_write(c, dst, mw) != BENCH_OK) {
+            return;
+        }
+
+        if (dst->write_queue_size > MOCK_MAX_PENDING) {
+            uv_read_stop(stream);
+            if (from_client) {
+                c->client_reading = 0;
+            } else {
+                c->target_reading = 0;
+            }
+        }
+        return;
+    }
+
+    free(mw);
+
+    if (nread == 0) {
+        return;
+    }
+
+    if (nread != UV_EOF) {
+        mock_close(c);
+        return;
+    }
+
+    uv_read_stop(stream);
+    if (from_client) {
+        c->client_eof = 1;
+        c->client_reading = 0;
+    } else {
+        c->target_eof = 1;
+        c->target_reading = 0;
+    }
+
+    if (c->client_eof && c->target_eof) {
+        mock_close(c);
+        return;
+    }
+
+    /* half close, the peer write side be shutdown after pending writes */
+    if (uv_shutdown(from_client ? &c->shutdown_target : &c->shutdown_client,
+                dst, mock_relay_on_shutdown)) {
+        mock_close(c);
+    }
+}
+
+static void
+mock_relay_read(struct mock_conn *c, int client) {
+    uv_stream_t *stream;
+
+    if (client ? (c->client_reading || c->client_eof) : (c->target_reading || c->target_eof)) {
+        return;
+    }
+
+    stream = client ? (uv_stream_t *)&c->client : (uv_stream_t *)&c->target;
+    if (uv_read_start(stream, mock_alloc, mock_relay_on_read)) {
+        mock_close(c);
+        return;
+    }
+
+    if (client) {
+        c->client_reading = 1;
+    } else {
+        c->target_reading = 1;
+    }
+}
+
+static void
+mock_relay_start(struct mock_conn *c) {
+    mock_relay_read(c, 1);
+    if (c->state != m_closing) {
+        mock_relay_read(c, 0);
+    }
+}
+
+static void
+mock_on_target_connect(uv_connect_t *req, int err) {
+    struct mock_conn *c;
+    char reply[10];
+
+    c = req->data;
+
+    if (c->state == m_closing) {
+        return;
+    }
+
+    if (err) {
+        mock_count(unreachable);
+        if (c->proto == m_socks5) {
+            memcpy(reply, "\x05\x05\x00\x01\x00\x00\x00\x00\x00\x00", 10);
+            mock_reply(c, reply, 10, 1);
+        } else {
+            mock_http_reply(c, 502, "Bad Gateway");
+        }
+        return;
+    }
+
+    uv_tcp_nodelay(&c->target, 1);
+
+    switch (c->proto) {
+    case m_socks5:
+        memcpy(reply, "\x05\x00\x00\x01\x7f\x00\x00\x01", 8);
+        reply[8] = (char)(mock_conf.port >> 8);
+        reply[9] = (char)(mock_conf.port & 0xff);
+        mock_reply(c, reply, 10, 0);
+        break;
+    case m_http_tunnel:
+        mock_reply(c, "HTTP/1.1 200 Connection established\r\n\r\n",
+                sizeof("HTTP/1.1 200 Connection established\r\n\r\n") - 1, 0);
+        break;
+    default:
+        break;
+    }
+
+    if (c->npending > 0) {
+        mock_send(c, (uv_stream_t *)&c->target, c->pending, c->npending, 0);
+        if (c->state == m_closing) {
+            return;
+        }
+    }
+    free(c->pending);
+    c->pending = NULL;
+    c->npending = 0;
+
+    mock_count(relayed);
+    c->state = m_relay;
+    mock_relay_start(c);
+}
+
+/* remaining bytes of client buffer be forwarded to the target */
+static void
+mock_connect_target(struct mock_conn *c, const char *host, uint16_t port,
+        const char *prefix, size_t nprefix, size_t offset) {
+    struct sockaddr_in addr;
+    struct addrinfo hints, *res;
+    size_t rest;
+
+    uv_read_stop((uv_stream_t *)&c->client);
+    c->state = m_connect;
+    c->connect_req.data = c;
+
+    rest = c->len - offset;
+    c->npending = nprefix + rest;
+    if (c->npending > 0) {
+        c->pending = malloc(c->npending);
+        if (c->pending == NULL) {
+            mock_close(c);
+            return;
+        }
+        memcpy(c->pending, prefix, nprefix);
+        memcpy(c->pending + nprefix, c->buf + offset, rest);
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+
+    if (inet_pton(AF_INET, host, &addr.sin_addr) != 1) {
+        /* names are rare in benchmarks, blocking resolution is acceptable */
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        if (getaddrinfo(host, NULL, &hints, &res) != 0) {
+            mock_on_target_connect(&c->connect_req, UV_EAI_NONAME);
+            return;
+        }
+        addr.sin_addr = ((struct sockaddr_in *)res->ai_addr)->sin_addr;
+        freeaddrinfo(res);
+    }
+
+    uv_tcp_init(c->client.loop, &c->target);
+    c->target.data = c;
+    c->target_open = 1;
+    c->handles++;
+
+    if (uv_tcp_connect(&c->connect_req, &c->target, (const struct sockaddr *)&addr,
+                mock_on_target_connect)) {
+        mock_on_target_connect(&c->connect_req, UV_ECONNREFUSED);
+    }
+}
+
+static void
+mock_consume(struct mock_conn *c, size_t n) {
+    memmove(c->buf, c->buf + n, c->len - n);
+    c->len -= n;
+}
+
+/* return 1 when more data needed */
+static int
+mock_s5_process(struct mock_conn *c) {
+    uint8_t *p;
+    uint8_t want;
+    size_t i, need, ulen, plen;
+    char host[256];
+    uint16_t port;
+
+    p = (uint8_t *)c->buf;
+
+    switch (c->state) {
+    case m_greeting:
+        if (c->len < 2 || c->len < 2 + (size_t)p[1]) {
+            return 1;
+        }
+        want = mock_conf.auth != NULL ? 0x02 : 0x00;
+        for (i = 0; i < p[1]; i++) {
+            if (p[2 + i] == want) {
+                break;
+            }
+        }
+        if (i == p[1] || (want == 0x00 && c->fault == f_deny)) {
+            if (want == 0x00 && c->fault == f_deny) {
+                mock_count(deny);
+            } else {
+                mock_count(unauth);
+            }
+            mock_reply(c, "\x05\xff", 2, 1);
+            return 1;
+        }
+        mock_consume(c, 2 + (size_t)p[1]);
+        mock_reply(c, want == 0x02 ? "\x05\x02" : "\x05\x00", 2, 0);
+        c->state = want == 0x02 ? m_auth : m_request;
+        return 0;
+
+    case m_auth:
+        if (c->len < 2) {
+            return 1;
+        }
+        ulen = p[1];
+        if (c->len < 3 + ulen) {
+            return 1;
+        }
+        plen = p[2 + ulen];
+        if (c->len < 3 + ulen + plen) {
+            return 1;
+        }
+        if (c->fault == f_deny) {
+            mock_count(deny);
+            mock_reply(c, "\x01\x01", 2, 1);
+            return 1;
+        }
+        if (ulen != strlen(mock_conf.uname) || plen != strlen(mock_conf.passwd) ||
+                memcmp(p + 2, mock_conf.uname, ulen) != 0 ||
+                memcmp(p + 3 + ulen, mock_conf.passwd, plen) != 0) {
+            mock_count(unauth);
+            mock_reply(c, "\x01\x01", 2, 1);
+            return 1;
+        }
+        mock_consume(c, 3 + ulen + plen);
+        mock_reply(c, "\x01\x00", 2, 0);
+        c->state = m_request;
+        return 0;
+
+    case m_request:
+        if (c->len < 5) {
+            return 1;
+        }
+        switch (p[3]) {
+        case 0x01:
+            need = 10;
+            break;
+        case 0x03:
+            need = 7 + (size_t)p[4];
+            break;
+        case 0x04:
+            need = 22;
+            break;
+        default:
+            mock_reply(c, "\x05\x08\x00\x01\x00\x00\x00\x00\x00\x00", 10, 1);
+            return 1;
+        }
+        if (c->len < need) {
+            return 1;
+        }
+        if (p[1] != 0x01) {
+            mock_reply(c, "\x05\x07\x00\x01\x00\x00\x00\x00\x00\x00", 10, 1);
+            return 1;
+        }
+        if (c->fault == f_forbid) {
+            mock_count(forbid);
+            mock_reply(c, "\x05\x02\x00\x01\x00\x00\x00\x00\x00\x00", 10, 1);
+            return 1;
+        }
+        switch (p[3]) {
+        case 0x01:
+            inet_ntop(AF_INET, p + 4, host, sizeof(host));
+            break;
+        case 0x03:
+            memcpy(host, p + 5, p[4]);
+            host[p[4]] = '\0';
+            break;
+        default:
+            /* target of benchmark is always ipv4 */
+            mock_count(unreachable);
+            mock_reply(c, "\x05\x08\x00\x01\x00\x00\x00\x00\x00\x00", 10, 1);
+            return 1;
+        }
+        port = (uint16_t)((p[need - 2] << 8) | p[need - 1]);
+        mock_connect_target(c, host, port, NULL, 0, need);
+        return 1;
+
+    default:
+        return 1;
+    }
+}
+
+static void
+mock_http_process(struct mock_conn *c) {
+    char *end, *line, *uri, *uri_end, *host, *path, *colon;
+    char prefix[BENCH_HEADER_MAX_LENGTH];
+    char expect[320];
+    size_t nprefix;
+    uint16_t port;
+
+    c->buf[c->len] = '\0';
+    end = strstr(c->buf, "\r\n\r\n");
+    if (end == NULL) {
+        if (c->len == sizeof(c->buf) - 1) {
+            mock_http_reply(c, 400, "Bad Request");
+        }
+        return;
+    }
+
+    if (mock_conf.auth != NULL) {
+        snprintf(expect, sizeof(expect), "\r\nProxy-Authorization: Basic %s\r\n",
+                mock_conf.auth_b64);
+        if (strcasestr(c->buf, expect) == NULL) {
+            mock_count(unauth);
+            mock_http_reply(c, 407, "Proxy Authentication Required");
+            return;
+        }
+    }
+
+    if (c->fault == f_deny) {
+        mock_count(deny);
+        mock_http_reply(c, 407, "Proxy Authentication Required");
+        return;
+    }
+
+    if (c->fault == f_forbid) {
+        mock_count(forbid);
+        mock_http_reply(c, 403, "Forbidden");
+        return;
+    }
+
+    line = c->buf;
+    uri = strchr(line, ' ');
+    if (uri == NULL || uri > end) {
+        mock_http_reply(c, 400, "Bad Request");
+        return;
+    }
+    uri++;
+    uri_end = strchr(uri, ' ');
+    if (uri_end == NULL || uri_end > end) {
+        mock_http_reply(c, 400, "Bad Request");
+        return;
+    }
+    *uri_end = '\0';
+
+    if (strncmp(line, "CONNECT ", sizeof("CONNECT ") - 1) == 0) {
+        host = uri;
+        colon = strrchr(host, ':');
+        if (colon == NULL) {
+            mock_http_reply(c, 400, "Bad Request");
+            return;
+        }
+        *colon = '\0';
+        port = (uint16_t)atoi(colon + 1);
+        mock_connect_target(c, host, port, NULL, 0, (size_t)(end + 4 - c->buf));
+        return;
+    }
+
+    /* absolute uri, forward with origin form request line */
+    if (strncasecmp(uri, "http://", sizeof("http://") - 1) != 0) {
+        mock_http_reply(c, 400, "Bad Request");
+        return;
+    }
+    host = uri + sizeof("http://") - 1;
+    path = strchr(host, '/');
+
+    nprefix = (size_t)(uri - line);
+    memcpy(prefix, line, nprefix);
+    if (path == NULL) {
+        prefix[nprefix++] = '/';
+    } else {
+        memcpy(prefix + nprefix, path, strlen(path));
+        nprefix += strlen(path);
+        *path = '\0';
+    }
+
+    colon = strrchr(host, ':');
+    if (colon != NULL) {
+        *colon = '\0';
+        port = (uint16_t)atoi(colon + 1);
+    } else {
+        port = 80;
+    }
+
+    /* request line remainder starts with the space after uri */
+    *uri_end = ' ';
+    mock_connect_target(c, host, port, prefix, nprefix, (size_t)(uri_end - c->buf));
+}
+
+static void
+mock_on_read(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf) {
+    struct mock_conn *c;
+    struct mock_write *mw;
+    size_t n;
+
+    c = stream->data;
+    mw = buf->base == NULL ? NULL : mock_write_of(buf);
+
+    if (nread < 0) {
+        free(mw);
+        mock_close(c);
+        return;
+    }
+
+    if (c->state == m_blackhole || c->state == m_closing) {
+        free(mw);
+        return;
+    }
+
+    n = MIN((size_t)nread, sizeof(c->buf) - 1 - c->len);
+    memcpy(c->buf + c->len, buf->base, n);
+    c->len += n;
+    free(mw);
+
+    if (c->proto == m_socks5) {
+        while (mock_s5_process(c) == 0);
+    } else {
+        mock_http_process(c);
+    }
+}
+
+static void
+mock_begin(struct mock_conn *c) {
+    if (c->fault == f_blackhole) {
+        mock_count(blackhole);
+        c->state = m_blackhole;
+    }
+
+    if (uv_read_start((uv_stream_t *)&c->client, mock_alloc, mock_on_read)) {
+        mock_close(c);
+    }
+}
+
+static void
+mock_on_latency(uv_timer_t *handle) {
+    mock_begin(handle->data);
+}
+
+static void
+mock_on_connection(uv_stream_t *server, int err) {
+    struct mock_worker *w;
+    struct mock_conn *c;
+    struct sockaddr_in local;
+    int len;
+    uint32_t delay;
+
+    if (err) {
+        return;
+    }
+
+    w = server->loop->data;
+
+    c = calloc(1, sizeof(*c));
+    if (c == NULL) {
+        return;
+    }
+
+    c->w = w;
+    c->proto = (enum mock_proto)(uintptr_t)server->data;
+    c->state = c->proto == m_socks5 ? m_greeting : m_header;
+    c->client.data = c;
+    c->timer.data = c;
+    c->shutdown_client.data = c;
+    c->shutdown_target.data = c;
+    c->handles = 1;
+
+    uv_tcp_init(server->loop, &c->client);
+
+    if (uv_accept(server, (uv_stream_t *)&c->client)) {
+        mock_close(c);
+        return;
+    }
+
+    mock_count(accepted);
+    uv_tcp_nodelay(&c->client, 1);
+
+    len = sizeof(local);
+    if (uv_tcp_getsockname(&c->client, (struct sockaddr *)&local, &len) == 0) {
+        c->fault = mock_fault_roll(w, ntohl(local.sin_addr.s_addr) - mock_conf.base - 1);
+    }
+
+    if (c->fault == f_fail) {
+        mock_count(fail);
+        mock_close(c);
+        return;
+    }
+
+    delay = mock_conf.latency;
+    if (mock_conf.jitter > 0) {
+        delay += (uint32_t)rand_r(&w->seed) % (mock_conf.jitter + 1);
+    }
+
+    if (delay == 0) {
+        mock_begin(c);
+        return;
+    }
+
+    /* client bytes wait in kernel, so every handshake reply be delayed */
+    uv_timer_init(server->loop, &c->timer);
+    c->timer_open = 1;
+    c->handles++;
+    uv_timer_start(&c->timer, mock_on_latency, delay, 0);
+}
+
+static void
+mock_api_on_close(uv_handle_t *handle) {
+    free(handle->data);
+}
+
+static void
+mock_api_close(struct mock_api_conn *c) {
+    if (c->closing) {
+        return;
+    }
+    c->closing = 1;
+    uv_close((uv_handle_t *)&c->tcp, mock_api_on_close);
+}
+
+static void
+mock_api_on_write(uv_write_t *req, int err) {
+    UNUSED(err);
+    mock_api_close(req->data);
+}
+
+static void
+mock_api_respond(struct mock_api_conn *c, int code, const char *body, size_t len) {
+    uv_buf_t bufs[2];
+
+    bufs[0].base = c->head;
+    bufs[0].len = snprintf(c->head, sizeof(c->head),
+            "HTTP/1.1 %d %s\r\nContent-Type: application/json\r\n"
+            "Content-Length: %zu\r\nConnection: close\r\n\r\n",
+            code, code == 200 ? "OK" : "Not Found", len);
+    bufs[1].base = (char *)body;
+    bufs[1].len = len;
+
+    uv_read_stop((uv_stream_t *)&c->tcp);
+
+    if (uv_write(&c->write_req, (uv_stream_t *)&c->tcp, bufs, len > 0 ? 2 : 1,
+                mock_api_on_write)) {
+        mock_api_close(c);
+    }
+}
+
+static void
+mock_api_on_header(struct mock_api_conn *c, size_t leftover) {
+    char *p;
+    int i;
+    uint64_t length;
+
+    p = strstr(c->hbuf, "/proxy/");
+    if (p != NULL && strncmp(c->hbuf, "GET ", 4) == 0) {
+        p += sizeof("/proxy/") - 1;
+        for (i = m_proto_max - 1; i >= 0; i--) {
+            if (strncmp(p, mock_proto_names[i], strlen(mock_proto_names[i])) == 0 &&
+                    p[strlen(mock_proto_names[i])] == '/') {
+                mock_count(fetch);
+                mock_api_respond(c, 200, mock_pool_json[i], mock_pool_json_len[i]);
+                return;
+            }
+        }
+    }
+
+    if ((strstr(c->hbuf, "/stats/") != NULL || strstr(c->hbuf, "/check/") != NULL) &&
+            strncmp(c->hbuf, "POST ", 5) == 0) {
+        if (strstr(c->hbuf, "/check/") != NULL) {
+            mock_count(check);
+        } else {
+            mock_count(commit);
+        }
+        p = strcasestr(c->hbuf, "\r\nContent-Length:");
+        length = p == NULL ? 0 : strtoull(p + sizeof("\r\nContent-Length:") - 1, NULL, 10);
+        if (leftover >= length) {
+            mock_api_respond(c, 200, "{}", 2);
+            return;
+        }
+        c->body_left = length - leftover;
+        return;
+    }
+
+    mock_api_respond(c, 404, "{}", 2);
+}
+
+static void
+mock_api_on_read(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf) {
+    struct mock_api_conn *c;
+    size_t n;
+    char *end;
+
+    c = stream->data;
+
+    if (nread < 0) {
+        mock_api_close(c);
+        return;
+    }
+
+    if (c->body_left > 0) {
+        c->body_left -= MIN((uint64_t)nread, c->body_left);
+        if (c->body_left == 0) {
+            mock_api_respond(c, 200, "{}", 2);
+        }
+        return;
+    }
+
+    n = MIN((size_t)nread, sizeof(c->hbuf) - 1 - c->hlen);
+    if (n == 0) {
+        mock_api_respond(c, 404, "{}", 2);
+        return;
+    }
+    memcpy(c->hbuf + c->hlen, buf->base, n);
+    c->hlen += n;
+    c->hbuf[c->hlen] = '\0';
+
+    end = strstr(c->hbuf, "\r\n\r\n");
+    if (end != NULL) {
+        *end = '\0';
+        mock_api_on_header(c, c->hlen - (size_t)(end - c->hbuf) - 4 + ((size_t)nread - n));
+    }
+}
+
+static void
+mock_api_alloc(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
+    UNUSED(handle);
+    UNUSED(suggested_size);
+
+    buf->base = mock_api_rbuf;
+    buf->len = sizeof(mock_api_rbuf);
+}
+
+static void
+mock_api_on_connection(uv_stream_t *server, int err) {
+    struct mock_api_conn *c;
+
+    if (err) {
+        return;
+    }
+
+    c = calloc(1, sizeof(*c));
+    if (c == NULL) {
+        return;
+    }
+
+    c->tcp.data = c;
+    c->write_req.data = c;
+
+    uv_tcp_init(server->loop, &c->tcp);
+
+    if (uv_accept(server, (uv_stream_t *)&c->tcp) ||
+            uv_read_start((uv_stream_t *)&c->tcp, mock_api_alloc, mock_api_on_read)) {
+        mock_api_close(c);
+    }
+}
+
+static void
+mock_report() {
+    fprintf(stderr,
+        "accepted: %llu, relayed: %llu, fail: %llu, blackhole: %llu, deny: %llu, "
+        "forbid: %llu, unauth: %llu, unreachable: %llu, fetch: %llu, commit: %llu, check: %llu\n",
+        (unsigned long long)mock_stats.accepted, (unsigned long long)mock_stats.relayed,
+        (unsigned long long)mock_stats.fail, (unsigned long long)mock_stats.blackhole,
+        (unsigned long long)mock_stats.deny, (unsigned long long)mock_stats.forbid,
+        (unsigned long long)mock_stats.unauth, (unsigned long long)mock_stats.unreachable,
+        (unsigned long long)mock_stats.fetch, (unsigned long long)mock_stats.commit,
+        (unsigned long long)mock_stats.check);
+}
+
+static void
+mock_on_signal(uv_signal_t *handle, int signum) {
+    UNUSED(handle);
+    UNUSED(signum);
+
+    mock_report();
+    exit(0);
+}
+
+static int
+mock_worker_init(struct mock_worker *w, int id) {
+    int i, reuseport;
+
+    if (uv_loop_init(&w->loop)) {
+        return BENCH_ERROR;
+    }
+
+    w->loop.data = w;
+    w->seed = (unsigned int)time(NULL) ^ (unsigned int)id;
+    reuseport = mock_conf.threads > 1;
+
+    for (i = 0; i < m_proto_max; i++) {
+        if (bench_listen(&w->loop, &w->proxy[i], mock_conf.listen, mock_conf.port + i,
+                    reuseport, mock_on_connection) != BENCH_OK) {
+            return BENCH_ERROR;
+        }
+        w->proxy[i].data = (void *)(uintptr_t)i;
+    }
+
+    if (mock_conf.sink) {
+        if (sink_listen(&w->loop, &w->sink, mock_conf.target_host, mock_conf.target_port,
+                    reuseport) != BENCH_OK) {
+            return BENCH_ERROR;
+        }
+    }
+
+    if (id != 0) {
+        return BENCH_OK;
+    }
+
+    /* api and signals are served by the main thread */
+    if (bench_listen(&w->loop, &w->api, mock_conf.api_host, mock_conf.api_port, 0,
+                mock_api_on_connection) != BENCH_OK) {
+        return BENCH_ERROR;
+    }
+
+    uv_signal_init(&w->loop, &w->sigint);
+    uv_signal_start(&w->sigint, mock_on_signal, SIGINT);
+    uv_signal_init(&w->loop, &w->sigterm);
+    uv_signal_start(&w->sigterm, mock_on_signal, SIGTERM);
+
+    return BENCH_OK;
+}
+
+static void
+mock_worker_run(void *arg) {
+    struct mock_worker *w;
+
+    w = arg;
+    uv_run(&w->loop, UV_RUN_DEFAULT);
+}
+
+/* wildcard listener keeps one fd per connection pair, lift the limit */
+static void
+mock_raise_nofile() {
+    struct rlimit rl;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+int
+main(int argc, char **argv) {
+    int c, i;
+    const char *api, *target, *base;
+    char *sep;
+    struct sockaddr_in addr;
+    struct in_addr in;
+
+    static struct option long_options[] = {
+        { "help",       no_argument,        NULL,   'h' },
+        { "upstreams",  required_argument,  NULL,   'n' },
+        { "listen",     required_argument,  NULL,   'l' },
+        { "port",       required_argument,  NULL,   'p' },
+        { "base",       required_argument,  NULL,   'B' },
+        { "api",        required_argument,  NULL,   'A' },
+        { "target",     required_argument,  NULL,   't' },
+        { "no-sink",    no_argument,        NULL,   'N' },
+        { "auth",       required_argument,  NULL,   'a' },
+        { "latency",    required_argument,  NULL,   'L' },
+        { "jitter",     required_argument,  NULL,   'J' },
+        { "fail",       required_argument,  NULL,   'f' },
+        { "blackhole",  required_argument,  NULL,   'k' },
+        { "deny",       required_argument,  NULL,   'd' },
+        { "forbid",     required_argument,  NULL,   'F' },
+        { "faulty",     required_argument,  NULL,   'q' },
+        { "threads",    required_argument,  NULL,   'T' },
+        { "sources",    required_argument,  NULL,   's' },
+        {  NULL,        0,                  NULL,    0  }
+    };
+
+    memset(&mock_conf, 0, sizeof(mock_conf));
+    mock_conf.listen = MOCK_DEFAULT_LISTEN;
+    mock_conf.port = MOCK_DEFAULT_PORT;
+    mock_conf.upstreams = MOCK_DEFAULT_UPSTREAMS;
+    mock_conf.sink = 1;
+    mock_conf.faulty = 1;
+    mock_conf.threads = 1;
+
+    api = MOCK_DEFAULT_API;
+    target = MOCK_DEFAULT_TARGET;
+    base = MOCK_DEFAULT_BASE;
+
+    for (;;) {
+        c = getopt_long(argc, argv, "hn:l:p:B:A:t:Na:L:J:f:k:d:F:q:T:s:", long_options, NULL);
+        if (c == -1) {
+            break;
+        }
+
+        switch (c) {
+        case 'n':
+            mock_conf.upstreams = (uint32_t)strtoul(optarg, NULL, 10);
+            break;
+        case 'l':
+            mock_conf.listen = optarg;
+            break;
+        case 'p':
+            mock_conf.port = (uint16_t)atoi(optarg);
+            break;
+        case 'B':
+            base = optarg;
+            break;
+        case 'A':
+            api = optarg;
+            break;
+        case 't':
+            target = optarg;
+            break;
+        case 'N':
+            mock_conf.sink = 0;
+            break;
+        case 'a':
+            mock_conf.auth = optarg;
+            break;
+        case 'L':
+            mock_conf.latency = (uint32_t)strtoul(optarg, NULL, 10);
+            break;
+        case 'J':
+            mock_conf.jitter = (uint32_t)strtoul(optarg, NULL, 10);
+            break;
+        case 'f':
+            mock_conf.fail = atof(optarg);
+            break;
+        case 'k':
+            mock_conf.blackhole = atof(optarg);
+            break;
+        case 'd':
+            mock_conf.deny = atof(optarg);
+            break;
+        case 'F':
+            mock_conf.forbid = atof(optarg);
+            break;
+        case 'q':
+            mock_conf.faulty = atof(optarg);
+            break;
+        case 'T':
+            mock_conf.threads = atoi(optarg);
+            break;
+        case 's':
+            mock_conf.sources = atoi(optarg);
+            break;
+        case 'h':
+        default:
+            mock_show_usage();
+        }
+    }
+
+    if (mock_conf.upstreams == 0 || mock_conf.threads <= 0 ||
+            mock_conf.threads > MOCK_MAX_THREADS || mock_conf.port > 65535 - 2) {
+        mock_show_usage();
+    }
+
+    if (inet_pton(AF_INET, base, &in) != 1) {
+        fprintf(stderr, "invalid base address '%s'\n", base);
+        return 1;
+    }
+    mock_conf.base = ntohl(in.s_addr);
+
+    if (bench_parse_addr(api, &addr, mock_conf.api_host,
+                sizeof(mock_conf.api_host), &mock_conf.api_port) != BENCH_OK) {
+        fprintf(stderr, "invalid api address '%s'\n", api);
+        return 1;
+    }
+
+    if (bench_parse_addr(target, &addr, mock_conf.target_host,
+                sizeof(mock_conf.target_host), &mock_conf.target_port) != BENCH_OK) {
+        fprintf(stderr, "invalid target address '%s'\n", target);
+        return 1;
+    }
+
+    if (mock_conf.auth != NULL) {
+        sep = strchr(mock_conf.auth, ':');
+        if (sep == NULL) {
+            fprintf(stderr, "invalid auth '%s', should be user:password\n", mock_conf.auth);
+            return 1;
+        }
+        bench_base64(mock_conf.auth, mock_conf.auth_b64, sizeof(mock_conf.auth_b64));
+        mock_conf.uname = strndup(mock_conf.auth, (size_t)(sep - mock_conf.auth));
+        mock_conf.passwd = sep + 1;
+    }
+
+    for (i = 0; i < m_proto_max; i++) {
+        if (mock_pool_build((enum mock_proto)i) != BENCH_OK) {
+            fprintf(stderr, "build upstream pool failed, out of memory\n");
+            return 1;
+        }
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    mock_raise_nofile();
+
+    for (i = 0; i < mock_conf.threads; i++) {
+        if (mock_worker_init(&mock_workers[i], i) != BENCH_OK) {
+            return 1;
+        }
+    }
+
+    fprintf(stderr, "rps-mock: %u upstreams per proto from %s, socks5:%d http:%d "
+            "http_tunnel:%d, api %s, sink %s\n", mock_conf.upstreams, base,
+            mock_conf.port, mock_conf.port + 1, mock_conf.port + 2, api,
+            mock_conf.sink ? target : "off");
+
+    for (i = 1; i < mock_conf.threads; i++) {
+        if (uv_thread_create(&mock_workers[i].tid, mock_worker_run, &mock_workers[i])) {
+            fprintf(stderr, "create worker thread failed\n");
+            return 1;
+        }
+    }
+
+    mock_worker_run(&mock_workers[0]);
+
+    return 0;
+}
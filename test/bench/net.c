@@ -0,0 +1,116 @@
+#include "bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+/*
+ * Bind and listen a tcp server on the loop.
+ * With reuseport, every loop binds its own socket on the same address,
+ * kernel balances the connections among them.
+ */
+int
+bench_listen(uv_loop_t *loop, uv_tcp_t *server, const char *host, uint16_t port,
+        int reuseport, uv_connection_cb cb) {
+    int err, fd, on;
+    struct sockaddr_in addr;
+
+    err = uv_ip4_addr(host, port, &addr);
+    if (err) {
+        fprintf(stderr, "invalid address %s:%d\n", host, port);
+        return BENCH_ERROR;
+    }
+
+    uv_tcp_init(loop, server);
+
+    if (reuseport) {
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0) {
+            fprintf(stderr, "socket failed: %s\n", strerror(errno));
+            return BENCH_ERROR;
+        }
+
+        on = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+            fprintf(stderr, "set SO_REUSEPORT failed: %s\n", strerror(errno));
+            close(fd);
+            return BENCH_ERROR;
+        }
+
+        if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+            fprintf(stderr, "bind %s:%d failed: %s\n", host, port, strerror(errno));
+            close(fd);
+            return BENCH_ERROR;
+        }
+
+        err = uv_tcp_open(server, fd);
+    } else {
+        err = uv_tcp_bind(server, (const struct sockaddr *)&addr, 0);
+    }
+
+    if (err == 0) {
+        err = uv_listen((uv_stream_t *)server, BENCH_BACKLOG, cb);
+    }
+
+    if (err) {
+        fprintf(stderr, "listen %s:%d failed: %s\n", host, port, uv_strerror(err));
+        return BENCH_ERROR;
+    }
+
+    return BENCH_OK;
+}
+
+int
+bench_parse_addr(const char *str, struct sockaddr_in *addr, char *host, size_t size, uint16_t *port) {
+    const char *p;
+    size_t len;
+
+    p = strrchr(str, ':');
+    if (p == NULL) {
+        return BENCH_ERROR;
+    }
+
+    len = (size_t)(p - str);
+    if (len == 0 || len >= size) {
+        return BENCH_ERROR;
+    }
+
+    memcpy(host, str, len);
+    host[len] = '\0';
+    *port = (uint16_t)atoi(p + 1);
+
+    if (uv_ip4_addr(host, *port, addr)) {
+        return BENCH_ERROR;
+    }
+
+    return BENCH_OK;
+}
+
+void
+bench_base64(const char *src, char *dst, size_t size) {
+    static const char table[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    size_t i, n, len;
+    uint32_t v;
+
+    len = strlen(src);
+    n = 0;
+
+    for (i = 0; i < len && n + 4 < size; i += 3) {
+        v = (uint8_t)src[i] << 16;
+        if (i + 1 < len) v |= (uint8_t)src[i + 1] << 8;
+        if (i + 2 < len) v |= (uint8_t)src[i + 2];
+
+        dst[n++] = table[(v >> 18) & 0x3f];
+        dst[n++] = table[(v >> 12) & 0x3f];
+        dst[n++] = i + 1 < len ? table[(v >> 6) & 0x3f] : '=';
+        dst[n++] = i + 2 < len ? table[v & 0x3f] : '=';
+    }
+
+    dst[n] = '\0';
+}
@@ -0,0 +1,56 @@
+#!/bin/sh
+#
+# Reproducible perf run: rps-mock serves the upstream pool, upstream proxies
+# and sink, rps runs with rps.yml, rps-bench drives every listener in turn.
+#
+# Usage: ./run.sh [rps-bench options]
+# Environment:
+#   RPS         rps binary (default: ../../src/rps)
+#   UPSTREAMS   synthetic upstreams per proto (default: 10000)
+#   MOCK_ARGS   extra rps-mock options, e.g. "-L 20 -J 10 -f 0.05 -q 0.2"
+#   PROTOS      listeners to bench (default: "socks5 http http_tunnel")
+#   WARMUP      seconds to wait for rps loading the pool (default: 3)
+
+cd `dirname $0`
+
+RPS=${RPS:-../../src/rps}
+UPSTREAMS=${UPSTREAMS:-10000}
+PROTOS=${PROTOS:-"socks5 http http_tunnel"}
+WARMUP=${WARMUP:-3}
+
+if [ ! -x ./rps-mock ] || [ ! -x ./rps-bench ] || [ ! -x $RPS ]; then
+    echo "build rps and bench tools first: make && make bench" >&2
+    exit 1
+fi
+
+cleanup() {
+    [ -n "$RPS_PID" ] && kill $RPS_PID 2>/dev/null
+    [ -n "$MOCK_PID" ] && kill $MOCK_PID 2>/dev/null
+    wait 2>/dev/null
+}
+trap cleanup EXIT INT TERM
+
+./rps-mock -n $UPSTREAMS $MOCK_ARGS &
+MOCK_PID=$!
+sleep 1
+
+$RPS -c rps.yml > /tmp/rps-perf.out 2>&1 &
+RPS_PID=$!
+sleep $WARMUP
+
+if ! kill -0 $RPS_PID 2>/dev/null; then
+    echo "rps exited, see /tmp/rps-perf.out" >&2
+    exit 1
+fi
+
+for proto in $PROTOS; do
+    case $proto in
+    socks5)      port=9890 ;;
+    http)        port=9891 ;;
+    http_tunnel) port=9892 ;;
+    *)           echo "unknown proto $proto" >&2; exit 1 ;;
+    esac
+
+    echo "== $proto"
+    ./rps-bench -p $proto -s 127.0.0.1:$port -P $RPS_PID "$@"
+done
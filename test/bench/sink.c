@@ -0,0 +1,304 @@
+#include "bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum sink_state {
+    s_header,
+    s_body,
+    s_response,
+    s_closing,
+};
+
+struct sink_conn {
+    uv_tcp_t        tcp;
+    uv_write_t      write_req;
+    uv_shutdown_t   shutdown_req;
+    enum sink_state state;
+    uint64_t        body_left;  /* request body not received yet */
+    uint64_t        send_left;  /* response body not sent yet */
+    size_t          hlen;
+    char            hbuf[BENCH_HEADER_MAX_LENGTH];
+    char            head[256];
+};
+
+static char sink_rbuf[BENCH_CHUNK_SIZE];
+static char sink_payload[BENCH_CHUNK_SIZE];
+
+static void sink_send(struct sink_conn *c);
+
+static void
+sink_on_close(uv_handle_t *handle) {
+    free(handle->data);
+}
+
+static void
+sink_close(struct sink_conn *c) {
+    if (c->state == s_closing) {
+        return;
+    }
+    c->state = s_closing;
+    uv_close((uv_handle_t *)&c->tcp, sink_on_close);
+}
+
+static void
+sink_on_shutdown(uv_shutdown_t *req, int err) {
+    UNUSED(err);
+    sink_close(req->data);
+}
+
+static void
+sink_on_write(uv_write_t *req, int err) {
+    struct sink_conn *c;
+
+    c = req->data;
+
+    if (err || c->state == s_closing) {
+        sink_close(c);
+        return;
+    }
+
+    if (c->send_left > 0) {
+        sink_send(c);
+        return;
+    }
+
+    if (uv_shutdown(&c->shutdown_req, (uv_stream_t *)&c->tcp, sink_on_shutdown)) {
+        sink_close(c);
+    }
+}
+
+static void
+sink_send(struct sink_conn *c) {
+    uv_buf_t buf;
+
+    buf.base = sink_payload;
+    buf.len = (size_t)MIN(c->send_left, sizeof(sink_payload));
+    c->send_left -= buf.len;
+
+    if (uv_write(&c->write_req, (uv_stream_t *)&c->tcp, &buf, 1, sink_on_write)) {
+        sink_close(c);
+    }
+}
+
+static void
+sink_respond(struct sink_conn *c, int code, uint64_t length) {
+    uv_buf_t bufs[2];
+    unsigned n;
+
+    c->state = s_response;
+
+    bufs[0].base = c->head;
+    bufs[0].len = snprintf(c->head, sizeof(c->head),
+            "HTTP/1.1 %d %s\r\nContent-Length: %llu\r\nConnection: close\r\n\r\n",
+            code, code == 200 ? "OK" : "Not Found", (unsigned long long)length);
+
+    n = 1;
+    c->send_left = length;
+    if (length > 0) {
+        bufs[1].base = sink_payload;
+        bufs[1].len = (size_t)MIN(length, sizeof(sink_payload));
+        c->send_left -= bufs[1].len;
+        n = 2;
+    }
+
+    if (uv_write(&c->write_req, (uv_stream_t *)&c->tcp, bufs, n, sink_on_write)) {
+        sink_close(c);
+    }
+}
+
+static uint64_t
+sink_content_length(const char *headers) {
+    const char *p;
+
+    p = strcasestr(headers, "\r\nContent-Length:");
+    if (p == NULL) {
+        return 0;
+    }
+
+    return strtoull(p + sizeof("\r\nContent-Length:") - 1, NULL, 10);
+}
+
+/* leftover is the request body already read */
+static void
+sink_on_header(struct sink_conn *c, size_t end, size_t leftover) {
+    uint64_t length;
+
+    c->hbuf[end] = '\0';
+
+    if (strncmp(c->hbuf, "GET /bytes/", sizeof("GET /bytes/") - 1) == 0) {
+        length = strtoull(c->hbuf + sizeof("GET /bytes/") - 1, NULL, 10);
+        sink_respond(c, 200, length);
+        return;
+    }
+
+    if (strncmp(c->hbuf, "POST ", sizeof("POST ") - 1) == 0) {
+        length = sink_content_length(c->hbuf);
+        if (leftover >= length) {
+            sink_respond(c, 200, 0);
+            return;
+        }
+        c->body_left = length - leftover;
+        c->state = s_body;
+        return;
+    }
+
+    sink_respond(c, 404, 0);
+}
+
+static void
+sink_on_read(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf) {
+    struct sink_conn *c;
+    size_t n;
+    char *end;
+
+    c = stream->data;
+
+    if (nread < 0) {
+        sink_close(c);
+        return;
+    }
+
+    switch (c->state) {
+    case s_header:
+        n = MIN((size_t)nread, sizeof(c->hbuf) - 1 - c->hlen);
+        if (n == 0) {
+            sink_respond(c, 404, 0);
+            return;
+        }
+        memcpy(c->hbuf + c->hlen, buf->base, n);
+        c->hlen += n;
+        c->hbuf[c->hlen] = '\0';
+        end = strstr(c->hbuf, "\r\n\r\n");
+        if (end != NULL) {
+            sink_on_header(c, (size_t)(end - c->hbuf),
+                    c->hlen - (size_t)(end - c->hbuf) - 4 + ((size_t)nread - n));
+        }
+        break;
+
+    case s_body:
+        c->body_left -= MIN((uint64_t)nread, c->body_left);
+        if (c->body_left == 0) {
+            sink_respond(c, 200, 0);
+        }
+        break;
+
+    default:
+        /* drop anything after request */
+        break;
+    }
+}
+
+static void
+sink_alloc(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
+    UNUSED(handle);
+    UNUSED(suggested_size);
+
+    buf->base = sink_rbuf;
+    buf->len = sizeof(sink_rbuf);
+}
+
+static void
+sink_on_connect(uv_stream_t *server, int err) {
+    struct sink_conn *c;
+
+    if (err) {
+        return;
+    }
+
+    c = calloc(1, sizeof(*c));
+    if (c == NULL) {
+        return;
+    }
+
+    c->state = s_header;
+    c->tcp.data = c;
+    c->write_req.data = c;
+    c->shutdown_req.data = c;
+
+    uv_tcp_init(server->loop, &c->tcp);
+
+    if (uv_accept(server, (uv_stream_t *)&c->tcp)) {
+        sink_close(c);
+        return;
+    }
+
+    uv_tcp_nodelay(&c->tcp, 1);
+
+    if (uv_read_start((uv_stream_t *)&c->tcp, sink_alloc, sink_on_read)) {
+        sink_close(c);
+    }
+}
+
+/* Listen on the loop, caller drive the loop */
+int
+sink_listen(uv_loop_t *loop, uv_tcp_t *server, const char *host, uint16_t port,
+        int reuseport) {
+    memset(sink_payload, 'x', sizeof(sink_payload));
+
+    if (bench_listen(loop, server, host, port, reuseport, sink_on_connect) != BENCH_OK) {
+        fprintf(stderr, "sink: listen %s:%d failed\n", host, port);
+        return BENCH_ERROR;
+    }
+
+    return BENCH_OK;
+}
+
+static void
+sink_walk_close(uv_handle_t *handle, void *arg) {
+    UNUSED(arg);
+
+    if (!uv_is_closing(handle)) {
+        uv_close(handle, handle->data == NULL ? NULL : sink_on_close);
+    }
+}
+
+static void
+sink_on_stop(uv_async_t *handle) {
+    struct sink *s;
+
+    s = handle->data;
+
+    /* listener and async carry no data, connections own theirs */
+    s->server.data = NULL;
+    s->stop.data = NULL;
+    uv_walk(&s->loop, sink_walk_close, NULL);
+}
+
+static void
+sink_run(void *arg) {
+    struct sink *s;
+
+    s = arg;
+
+    uv_run(&s->loop, UV_RUN_DEFAULT);
+    uv_loop_close(&s->loop);
+}
+
+/* Run sink in a dedicated thread */
+int
+sink_start(struct sink *s, const char *host, uint16_t port) {
+    if (uv_loop_init(&s->loop)) {
+        return BENCH_ERROR;
+    }
+
+    if (sink_listen(&s->loop, &s->server, host, port, 0) != BENCH_OK) {
+        return BENCH_ERROR;
+    }
+
+    uv_async_init(&s->loop, &s->stop, sink_on_stop);
+    s->stop.data = s;
+
+    if (uv_thread_create(&s->tid, sink_run, s)) {
+        return BENCH_ERROR;
+    }
+
+    return BENCH_OK;
+}
+
+void
+sink_stop(struct sink *s) {
+    uv_async_send(&s->stop);
+    uv_thread_join(&s->tid);
+}
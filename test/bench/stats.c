@@ -0,0 +1,149 @@
+#include "bench.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+static int
+hist_index(uint64_t v) {
+    int msb;
+
+    if (v < HIST_EXACT) {
+        return (int)v;
+    }
+
+    msb = 63 - __builtin_clzll(v);
+
+    return HIST_EXACT + (msb - 6) * HIST_SUB +
+        (int)((v >> (msb - HIST_SUB_BITS)) - HIST_SUB);
+}
+
+static uint64_t
+hist_value(int idx) {
+    int k, msb;
+    uint64_t sub;
+
+    if (idx < HIST_EXACT) {
+        return (uint64_t)idx;
+    }
+
+    k = idx - HIST_EXACT;
+    msb = k / HIST_SUB + 6;
+    sub = (uint64_t)(k % HIST_SUB + HIST_SUB);
+
+    /* middle of the bucket */
+    return (sub << (msb - HIST_SUB_BITS)) + ((1ULL << (msb - HIST_SUB_BITS)) >> 1);
+}
+
+void
+hist_init(struct histogram *h) {
+    memset(h, 0, sizeof(*h));
+    h->min = UINT64_MAX;
+}
+
+void
+hist_add(struct histogram *h, uint64_t v) {
+    h->buckets[hist_index(v)]++;
+    h->count++;
+    h->sum += v;
+    h->min = MIN(h->min, v);
+    h->max = MAX(h->max, v);
+}
+
+void
+hist_merge(struct histogram *dst, struct histogram *src) {
+    int i;
+
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        dst->buckets[i] += src->buckets[i];
+    }
+
+    dst->count += src->count;
+    dst->sum += src->sum;
+    dst->min = MIN(dst->min, src->min);
+    dst->max = MAX(dst->max, src->max);
+}
+
+uint64_t
+hist_percentile(struct histogram *h, double p) {
+    int i;
+    uint64_t rank, seen;
+
+    if (h->count == 0) {
+        return 0;
+    }
+
+    rank = (uint64_t)(p * (double)h->count);
+    if (rank >= h->count) {
+        rank = h->count - 1;
+    }
+
+    seen = 0;
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen > rank) {
+            return MIN(MAX(hist_value(i), h->min), h->max);
+        }
+    }
+
+    return h->max;
+}
+
+double
+hist_mean(struct histogram *h) {
+    if (h->count == 0) {
+        return 0.0;
+    }
+
+    return (double)h->sum / (double)h->count;
+}
+
+double
+bench_proc_cpu(int pid) {
+    FILE *fp;
+    char path[64];
+    char buf[1024];
+    char *p;
+    unsigned long utime, stime;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+
+    fp = fopen(path, "r");
+    if (fp == NULL) {
+        return -1.0;
+    }
+
+    if (fgets(buf, sizeof(buf), fp) == NULL) {
+        fclose(fp);
+        return -1.0;
+    }
+    fclose(fp);
+
+    /* comm may contain spaces, fields restart after the last ')' */
+    p = strrchr(buf, ')');
+    if (p == NULL) {
+        return -1.0;
+    }
+
+    /* state ppid pgrp session tty_nr tpgid flags minflt cminflt majflt cmajflt utime stime */
+    if (sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+                &utime, &stime) != 2) {
+        return -1.0;
+    }
+
+    return (double)(utime + stime) / (double)sysconf(_SC_CLK_TCK);
+}
+
+double
+bench_self_cpu() {
+    struct rusage ru;
+
+    if (getrusage(RUSAGE_SELF, &ru) < 0) {
+        return -1.0;
+    }
+
+    return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+        ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
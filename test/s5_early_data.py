@@ -0,0 +1,76 @@
+#! /usr/bin/env python3
+#
+# Optimistic socks5 client: greeting and request in one segment, the first
+# payload bytes with it and the rest in a later segment, both sent before
+# the upstream answered. rps must relay every byte once the tunnel is up.
+#
+# Run against rps-mock with handshake latency, see bench/README.md:
+#   ./bench/rps-mock -L 300 &
+#   ../src/rps -c bench/rps.yml &
+#   ./s5_early_data.py
+
+import socket
+import struct
+import sys
+import time
+import optparse
+
+
+def main():
+    parser = optparse.OptionParser()
+    parser.add_option("-s", "--server", default="127.0.0.1:9890", help="rps socks5 listener")
+    parser.add_option("-t", "--target", default="127.0.0.1:19000", help="sink target of rps-mock")
+    parser.add_option("-n", "--bytes", type="int", default=1000, help="response body bytes")
+    opts, _ = parser.parse_args()
+
+    host, port = opts.server.split(":")
+    thost, tport = opts.target.split(":")
+
+    request = ("GET /bytes/%d HTTP/1.1\r\nHost: %s\r\nConnection: close\r\n\r\n"
+            % (opts.bytes, thost)).encode()
+
+    s = socket.create_connection((host, int(port)))
+    s.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+    s.settimeout(10)
+
+    greeting = b"\x05\x01\x00"
+    connect = b"\x05\x01\x00\x01" + socket.inet_aton(thost) + struct.pack(">H", int(tport))
+
+    s.sendall(greeting + connect + request[:10])
+    time.sleep(0.1)
+    s.sendall(request[10:20])
+    time.sleep(0.1)
+    s.sendall(request[20:])
+
+    reply = b""
+    while len(reply) < 12:
+        chunk = s.recv(12 - len(reply))
+        if not chunk:
+            break
+        reply += chunk
+
+    if reply[:2] != b"\x05\x00" or reply[2:4] != b"\x05\x00":
+        print("handshake failed: %r" % reply)
+        return 1
+
+    response = b""
+    while True:
+        try:
+            chunk = s.recv(65536)
+        except socket.timeout:
+            break
+        if not chunk:
+            break
+        response += chunk
+
+    head, _, body = response.partition(b"\r\n\r\n")
+    if not head.startswith(b"HTTP/1.1 200") or len(body) != opts.bytes:
+        print("early data lost, response: %r" % response[:80])
+        return 1
+
+    print("ok, %d bytes body" % len(body))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())